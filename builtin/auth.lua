@@ -29,71 +29,23 @@ end
 assert(minetest.string_to_privs("a,b").b == true)
 assert(minetest.privs_to_string({a=true,b=true}) == "a,b")
 
-minetest.auth_file_path = minetest.get_worldpath().."/auth.txt"
-minetest.auth_table = {}
-
-local function read_auth_file()
-	local newtable = {}
-	local file, errmsg = io.open(minetest.auth_file_path, 'rb')
-	if not file then
-		minetest.log("info", minetest.auth_file_path.." could not be opened for reading ("..errmsg.."); assuming new world")
-		return
-	end
-	for line in file:lines() do
-		if line ~= "" then
-			local name, password, privilegestring = string.match(line, "([^:]*):([^:]*):([^:]*)")
-			if not name or not password or not privilegestring then
-				error("Invalid line in auth.txt: "..dump(line))
-			end
-			local privileges = minetest.string_to_privs(privilegestring)
-			newtable[name] = {password=password, privileges=privileges}
-		end
-	end
-	io.close(file)
-	minetest.auth_table = newtable
-	minetest.notify_authentication_modified()
-end
-
-local function save_auth_file()
-	local newtable = {}
-	-- Check table for validness before attempting to save
-	for name, stuff in pairs(minetest.auth_table) do
-		assert(type(name) == "string")
-		assert(name ~= "")
-		assert(type(stuff) == "table")
-		assert(type(stuff.password) == "string")
-		assert(type(stuff.privileges) == "table")
-	end
-	local file, errmsg = io.open(minetest.auth_file_path, 'w+b')
-	if not file then
-		error(minetest.auth_file_path.." could not be opened for writing: "..errmsg)
-	end
-	for name, stuff in pairs(minetest.auth_table) do
-		local privstring = minetest.privs_to_string(stuff.privileges)
-		file:write(name..":"..stuff.password..":"..privstring..'\n')
-	end
-	io.close(file)
-end
-
-read_auth_file()
+--
+-- The built-in handler keeps its data in the player database of the world
+-- (players.sqlite). Entries are looked up and written one at a time by
+-- minetest.get_auth_entry() and minetest.set_auth_entry(); auth.txt of
+-- old worlds is imported to it once.
+--
 
 minetest.builtin_auth_handler = {
 	get_auth = function(name)
 		assert(type(name) == "string")
-		-- Figure out what password to use for a new player (singleplayer
-		-- always has an empty password, otherwise use default, which is
-		-- usually empty too)
-		local new_password_hash = ""
 		-- If not in authentication table, return nil
-		if not minetest.auth_table[name] then
+		local auth = minetest.get_auth_entry(name)
+		if not auth then
 			return nil
 		end
 		-- Figure out what privileges the player should have.
-		-- Take a copy of the privilege table
-		local privileges = {}
-		for priv, _ in pairs(minetest.auth_table[name].privileges) do
-			privileges[priv] = true
-		end
+		local privileges = auth.privileges
 		-- If singleplayer, give all privileges except those marked as give_to_singleplayer = false
 		if minetest.is_singleplayer() then
 			for priv, def in pairs(minetest.registered_privileges) do
@@ -109,7 +61,7 @@ minetest.builtin_auth_handler = {
 		end
 		-- All done
 		return {
-			password = minetest.auth_table[name].password,
+			password = auth.password,
 			privileges = privileges,
 		}
 	end,
@@ -117,36 +69,35 @@ minetest.builtin_auth_handler = {
 		assert(type(name) == "string")
 		assert(type(password) == "string")
 		minetest.log('info', "Built-in authentication handler adding player '"..name.."'")
-		minetest.auth_table[name] = {
-			password = password,
-			privileges = minetest.string_to_privs(minetest.setting_get("default_privs")),
-		}
-		save_auth_file()
+		minetest.set_auth_entry(name, password,
+				minetest.string_to_privs(minetest.setting_get("default_privs")))
 	end,
 	set_password = function(name, password)
 		assert(type(name) == "string")
 		assert(type(password) == "string")
-		if not minetest.auth_table[name] then
+		local auth = minetest.get_auth_entry(name)
+		if not auth then
 			minetest.builtin_auth_handler.create_auth(name, password)
 		else
 			minetest.log('info', "Built-in authentication handler setting password of player '"..name.."'")
-			minetest.auth_table[name].password = password
-			save_auth_file()
+			minetest.set_auth_entry(name, password, auth.privileges)
 		end
 		return true
 	end,
 	set_privileges = function(name, privileges)
 		assert(type(name) == "string")
 		assert(type(privileges) == "table")
-		if not minetest.auth_table[name] then
+		local auth = minetest.get_auth_entry(name)
+		if not auth then
 			minetest.builtin_auth_handler.create_auth(name, minetest.get_password_hash(name, minetest.setting_get("default_password")))
+			auth = minetest.get_auth_entry(name)
 		end
-		minetest.auth_table[name].privileges = privileges
+		minetest.set_auth_entry(name, auth.password, privileges)
 		minetest.notify_authentication_modified(name)
-		save_auth_file()
 	end,
 	reload = function()
-		read_auth_file()
+		minetest.reload_auth_entries()
+		minetest.notify_authentication_modified()
 		return true
 	end,
 }
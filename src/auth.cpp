@@ -0,0 +1,99 @@
+/*
+Minetest-c55
+Copyright (C) 2010-2012 celeron55, Perttu Ahola <celeron55@gmail.com>
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation; either version 2.1 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include "auth.h"
+#include "playerdatabase.h"
+#include "strfnd.h"
+#include "log.h"
+
+AuthManager::AuthManager(PlayerDatabase *database):
+	m_database(database)
+{
+}
+
+AuthManager::Entry * AuthManager::getEntry(const std::string &name)
+{
+	std::map<std::string, Entry>::iterator i = m_entries.find(name);
+	if(i != m_entries.end())
+		return &i->second;
+
+	std::string password;
+	std::string privileges;
+	if(m_database->loadAuth(name, &password, &privileges) == false)
+		return NULL;
+
+	Entry &entry = m_entries[name];
+	entry.password = password;
+	entry.privileges = stringToPrivs(privileges);
+	return &entry;
+}
+
+bool AuthManager::get(const std::string &name, std::string *password,
+		std::set<std::string> *privileges)
+{
+	Entry *entry = getEntry(name);
+	if(entry == NULL)
+		return false;
+	if(password)
+		*password = entry->password;
+	if(privileges)
+		*privileges = entry->privileges;
+	return true;
+}
+
+void AuthManager::set(const std::string &name, const std::string &password,
+		const std::set<std::string> &privileges)
+{
+	Entry &entry = m_entries[name];
+	entry.password = password;
+	entry.privileges = privileges;
+	m_database->saveAuth(name, password, privsToString(privileges));
+}
+
+void AuthManager::reload()
+{
+	m_entries.clear();
+}
+
+std::set<std::string> AuthManager::stringToPrivs(const std::string &str)
+{
+	std::set<std::string> privs;
+	Strfnd sf(str);
+	while(sf.atend() == false)
+	{
+		std::string priv = trim(sf.next(","));
+		if(priv != "")
+			privs.insert(priv);
+	}
+	return privs;
+}
+
+std::string AuthManager::privsToString(const std::set<std::string> &privs)
+{
+	std::string str;
+	for(std::set<std::string>::const_iterator i = privs.begin();
+			i != privs.end(); i++)
+	{
+		if(i != privs.begin())
+			str += ",";
+		str += *i;
+	}
+	return str;
+}
+
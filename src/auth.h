@@ -0,0 +1,70 @@
+/*
+Minetest-c55
+Copyright (C) 2010-2012 celeron55, Perttu Ahola <celeron55@gmail.com>
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation; either version 2.1 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#ifndef AUTH_HEADER
+#define AUTH_HEADER
+
+#include <map>
+#include <set>
+#include <string>
+
+class PlayerDatabase;
+
+/*
+	Authentication data of players: a password hash and privileges.
+
+	Entries are read from the player database the first time they are
+	asked for and then kept in memory. A change writes only the one entry.
+
+	Not thread-safe; used with the environment locked.
+*/
+
+class AuthManager
+{
+public:
+	AuthManager(PlayerDatabase *database);
+
+	// Returns false if there is no entry
+	bool get(const std::string &name, std::string *password,
+			std::set<std::string> *privileges);
+	// Creates the entry if there is none
+	void set(const std::string &name, const std::string &password,
+			const std::set<std::string> &privileges);
+	// Drops what is in memory, so that entries are read again
+	void reload();
+
+	static std::set<std::string> stringToPrivs(const std::string &str);
+	static std::string privsToString(const std::set<std::string> &privs);
+
+private:
+	struct Entry
+	{
+		std::string password;
+		std::set<std::string> privileges;
+	};
+
+	// Returns NULL if there is no entry
+	Entry * getEntry(const std::string &name);
+
+	PlayerDatabase *m_database;
+	std::map<std::string, Entry> m_entries;
+};
+
+#endif
+
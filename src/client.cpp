@@ -529,6 +529,7 @@ void Client::step(float dtime)
 		m_env.getMap().timerUpdate(map_timer_and_unload_dtime,
 				g_settings->getFloat("client_unload_unused_data_timeout"),
 				&deleted_blocks);
+		MemoryPool::reportAll(g_profiler);
 				
 		/*if(deleted_blocks.size() > 0)
 			infostream<<"Client: Unloaded "<<deleted_blocks.size()
@@ -1688,6 +1689,19 @@ void Client::ProcessData(u8 *data, u32 datasize, u16 sender_peer_id)
 		}
 		infostream<<std::endl;
 	}
+	else if(command == TOCLIENT_COMPRESSION_DICTIONARY)
+	{
+		std::string datastring((char*)&data[2], datasize-2);
+		std::istringstream is(datastring, std::ios_base::binary);
+		std::istringstream tmp_is(deSerializeLongString(is), std::ios::binary);
+		std::ostringstream tmp_os(std::ios::binary);
+		decompressZlib(tmp_is, tmp_os);
+
+		// The blocks that follow find it by its id
+		registerCompressionDictionary(tmp_os.str());
+		infostream<<"Client: Received compression dictionary: "
+				<<tmp_os.str().size()<<" bytes"<<std::endl;
+	}
 	else
 	{
 		infostream<<"Client: Ignoring unknown command "
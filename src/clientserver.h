@@ -308,6 +308,16 @@ enum ToClientCommand
 			u16 len
 			u8[len] privilege
 	*/
+
+	TOCLIENT_COMPRESSION_DICTIONARY = 0x42,
+	/*
+		Sent to clients of block format 24 and later before the blocks,
+		if they are compressed with a dictionary.
+
+		u16 command
+		u32 length of the next item
+		zlib-compressed dictionary
+	*/
 };
 
 enum ToServerCommand
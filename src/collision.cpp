@@ -25,6 +25,7 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "log.h"
 #include <vector>
 #include "util/timetaker.h"
+#include "util/pointer.h"
 #include "main.h" // g_profiler
 #include "profiler.h"
 
@@ -224,36 +225,43 @@ collisionMoveResult collisionMoveSimple(Map *map, IGameDef *gamedef,
 	s16 max_y = MYMAX(oldpos_i.Y, newpos_i.Y) + (box_0.MaxEdge.Y / BS) + 1;
 	s16 max_z = MYMAX(oldpos_i.Z, newpos_i.Z) + (box_0.MaxEdge.Z / BS) + 1;
 
+	// Get all the nodes at once instead of one by one
+	VoxelArea area(v3s16(min_x, min_y, min_z), v3s16(max_x, max_y, max_z));
+	Buffer<MapNode> nodes(area.getVolume());
+	Buffer<bool> nodes_valid(area.getVolume());
+	map->getNodesInArea(area, *nodes, *nodes_valid);
+
 	for(s16 x = min_x; x <= max_x; x++)
 	for(s16 y = min_y; y <= max_y; y++)
 	for(s16 z = min_z; z <= max_z; z++)
 	{
-		try{
-			// Object collides into walkable nodes
-			MapNode n = map->getNode(v3s16(x,y,z));
-			if(gamedef->getNodeDefManager()->get(n).walkable == false)
-				continue;
-
-			std::vector<aabb3f> nodeboxes = n.getNodeBoxes(gamedef->ndef());
-			for(std::vector<aabb3f>::iterator
-					i = nodeboxes.begin();
-					i != nodeboxes.end(); i++)
-			{
-				aabb3f box = *i;
-				box.MinEdge += v3f(x, y, z)*BS;
-				box.MaxEdge += v3f(x, y, z)*BS;
-				cboxes.push_back(box);
-				is_unloaded.push_back(false);
-				is_step_up.push_back(false);
-			}
-		}
-		catch(InvalidPositionException &e)
+		u32 index = area.index(x, y, z);
+		if(!nodes_valid[index])
 		{
 			// Collide with unloaded nodes
 			aabb3f box = getNodeBox(v3s16(x,y,z), BS);
 			cboxes.push_back(box);
 			is_unloaded.push_back(true);
 			is_step_up.push_back(false);
+			continue;
+		}
+
+		// Object collides into walkable nodes
+		MapNode n = nodes[index];
+		if(gamedef->getNodeDefManager()->get(n).walkable == false)
+			continue;
+
+		std::vector<aabb3f> nodeboxes = n.getNodeBoxes(gamedef->ndef());
+		for(std::vector<aabb3f>::iterator
+				i = nodeboxes.begin();
+				i != nodeboxes.end(); i++)
+		{
+			aabb3f box = *i;
+			box.MinEdge += v3f(x, y, z)*BS;
+			box.MaxEdge += v3f(x, y, z)*BS;
+			cboxes.push_back(box);
+			is_unloaded.push_back(false);
+			is_step_up.push_back(false);
 		}
 	}
 	} // tt2
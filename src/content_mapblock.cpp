@@ -141,7 +141,7 @@ void mapblock_mesh_generate_special(MeshMakeData *data,
 	{
 		v3s16 p(x,y,z);
 
-		MapNode n = data->m_vmanip.getNodeNoEx(blockpos_nodes+p);
+		MapNode n = data->m_vmanip.getNodeNoExNoEmerge(blockpos_nodes+p);
 		const ContentFeatures &f = nodedef->get(n);
 
 		// Only solidness=0 stuff is drawn here
@@ -164,7 +164,7 @@ void mapblock_mesh_generate_special(MeshMakeData *data,
 			AtlasPointer &pa_liquid = tile_liquid.texture;
 
 			bool top_is_air = false;
-			MapNode n = data->m_vmanip.getNodeNoEx(blockpos_nodes + v3s16(x,y+1,z));
+			MapNode n = data->m_vmanip.getNodeNoExNoEmerge(blockpos_nodes + v3s16(x,y+1,z));
 			if(n.getContent() == CONTENT_AIR)
 				top_is_air = true;
 			
@@ -206,7 +206,7 @@ void mapblock_mesh_generate_special(MeshMakeData *data,
 			AtlasPointer &pa_liquid = tile_liquid.texture;
 
 			bool top_is_same_liquid = false;
-			MapNode ntop = data->m_vmanip.getNodeNoEx(blockpos_nodes + v3s16(x,y+1,z));
+			MapNode ntop = data->m_vmanip.getNodeNoExNoEmerge(blockpos_nodes + v3s16(x,y+1,z));
 			content_t c_flowing = nodedef->getId(f.liquid_alternative_flowing);
 			content_t c_source = nodedef->getId(f.liquid_alternative_source);
 			if(ntop.getContent() == c_flowing || ntop.getContent() == c_source)
@@ -253,7 +253,7 @@ void mapblock_mesh_generate_special(MeshMakeData *data,
 				u8 flags = 0;
 				// Check neighbor
 				v3s16 p2 = p + neighbor_dirs[i];
-				MapNode n2 = data->m_vmanip.getNodeNoEx(blockpos_nodes + p2);
+				MapNode n2 = data->m_vmanip.getNodeNoExNoEmerge(blockpos_nodes + p2);
 				if(n2.getContent() != CONTENT_IGNORE)
 				{
 					content = n2.getContent();
@@ -268,7 +268,7 @@ void mapblock_mesh_generate_special(MeshMakeData *data,
 					// NOTE: This doesn't get executed if neighbor
 					//       doesn't exist
 					p2.Y += 1;
-					n2 = data->m_vmanip.getNodeNoEx(blockpos_nodes + p2);
+					n2 = data->m_vmanip.getNodeNoExNoEmerge(blockpos_nodes + p2);
 					if(n2.getContent() == c_source ||
 							n2.getContent() == c_flowing)
 						flags |= neighborflag_top_is_same_liquid;
@@ -551,7 +551,7 @@ void mapblock_mesh_generate_special(MeshMakeData *data,
 			{
 				// Check this neighbor
 				v3s16 n2p = blockpos_nodes + p + g_6dirs[j];
-				MapNode n2 = data->m_vmanip.getNodeNoEx(n2p);
+				MapNode n2 = data->m_vmanip.getNodeNoExNoEmerge(n2p);
 				// Don't make face if neighbor is of same type
 				if(n2.getContent() == n.getContent())
 					continue;
@@ -818,7 +818,7 @@ void mapblock_mesh_generate_special(MeshMakeData *data,
 			// Now a section of fence, +X, if there's a post there
 			v3s16 p2 = p;
 			p2.X++;
-			MapNode n2 = data->m_vmanip.getNodeNoEx(blockpos_nodes + p2);
+			MapNode n2 = data->m_vmanip.getNodeNoExNoEmerge(blockpos_nodes + p2);
 			const ContentFeatures *f2 = &nodedef->get(n2);
 			if(f2->drawtype == NDT_FENCELIKE)
 			{
@@ -844,7 +844,7 @@ void mapblock_mesh_generate_special(MeshMakeData *data,
 			// Now a section of fence, +Z, if there's a post there
 			p2 = p;
 			p2.Z++;
-			n2 = data->m_vmanip.getNodeNoEx(blockpos_nodes + p2);
+			n2 = data->m_vmanip.getNodeNoExNoEmerge(blockpos_nodes + p2);
 			f2 = &nodedef->get(n2);
 			if(f2->drawtype == NDT_FENCELIKE)
 			{
@@ -877,18 +877,18 @@ void mapblock_mesh_generate_special(MeshMakeData *data,
 			bool is_rail_z_plus_y [] = { false, false };  /* z-1, z+1; y+1 */
 			bool is_rail_x_plus_y [] = { false, false };  /* x-1, x+1; y+1 */
 
-			MapNode n_minus_x = data->m_vmanip.getNodeNoEx(blockpos_nodes + v3s16(x-1,y,z));
-			MapNode n_plus_x = data->m_vmanip.getNodeNoEx(blockpos_nodes + v3s16(x+1,y,z));
-			MapNode n_minus_z = data->m_vmanip.getNodeNoEx(blockpos_nodes + v3s16(x,y,z-1));
-			MapNode n_plus_z = data->m_vmanip.getNodeNoEx(blockpos_nodes + v3s16(x,y,z+1));
-			MapNode n_plus_x_plus_y = data->m_vmanip.getNodeNoEx(blockpos_nodes + v3s16(x+1, y+1, z));
-			MapNode n_plus_x_minus_y = data->m_vmanip.getNodeNoEx(blockpos_nodes + v3s16(x+1, y-1, z));
-			MapNode n_minus_x_plus_y = data->m_vmanip.getNodeNoEx(blockpos_nodes + v3s16(x-1, y+1, z));
-			MapNode n_minus_x_minus_y = data->m_vmanip.getNodeNoEx(blockpos_nodes + v3s16(x-1, y-1, z));
-			MapNode n_plus_z_plus_y = data->m_vmanip.getNodeNoEx(blockpos_nodes + v3s16(x, y+1, z+1));
-			MapNode n_minus_z_plus_y = data->m_vmanip.getNodeNoEx(blockpos_nodes + v3s16(x, y+1, z-1));
-			MapNode n_plus_z_minus_y = data->m_vmanip.getNodeNoEx(blockpos_nodes + v3s16(x, y-1, z+1));
-			MapNode n_minus_z_minus_y = data->m_vmanip.getNodeNoEx(blockpos_nodes + v3s16(x, y-1, z-1));
+			MapNode n_minus_x = data->m_vmanip.getNodeNoExNoEmerge(blockpos_nodes + v3s16(x-1,y,z));
+			MapNode n_plus_x = data->m_vmanip.getNodeNoExNoEmerge(blockpos_nodes + v3s16(x+1,y,z));
+			MapNode n_minus_z = data->m_vmanip.getNodeNoExNoEmerge(blockpos_nodes + v3s16(x,y,z-1));
+			MapNode n_plus_z = data->m_vmanip.getNodeNoExNoEmerge(blockpos_nodes + v3s16(x,y,z+1));
+			MapNode n_plus_x_plus_y = data->m_vmanip.getNodeNoExNoEmerge(blockpos_nodes + v3s16(x+1, y+1, z));
+			MapNode n_plus_x_minus_y = data->m_vmanip.getNodeNoExNoEmerge(blockpos_nodes + v3s16(x+1, y-1, z));
+			MapNode n_minus_x_plus_y = data->m_vmanip.getNodeNoExNoEmerge(blockpos_nodes + v3s16(x-1, y+1, z));
+			MapNode n_minus_x_minus_y = data->m_vmanip.getNodeNoExNoEmerge(blockpos_nodes + v3s16(x-1, y-1, z));
+			MapNode n_plus_z_plus_y = data->m_vmanip.getNodeNoExNoEmerge(blockpos_nodes + v3s16(x, y+1, z+1));
+			MapNode n_minus_z_plus_y = data->m_vmanip.getNodeNoExNoEmerge(blockpos_nodes + v3s16(x, y+1, z-1));
+			MapNode n_plus_z_minus_y = data->m_vmanip.getNodeNoExNoEmerge(blockpos_nodes + v3s16(x, y-1, z+1));
+			MapNode n_minus_z_minus_y = data->m_vmanip.getNodeNoExNoEmerge(blockpos_nodes + v3s16(x, y-1, z-1));
 			
 			content_t thiscontent = n.getContent();
 			if(n_minus_x.getContent() == thiscontent)
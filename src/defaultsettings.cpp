@@ -135,7 +135,17 @@ void set_default_settings(Settings *settings)
 	settings->setDefault("time_send_interval", "5");
 	settings->setDefault("time_speed", "72");
 	settings->setDefault("server_unload_unused_data_timeout", "29");
+	settings->setDefault("server_map_memory_budget", "0");
 	settings->setDefault("server_map_save_interval", "5.3");
+	settings->setDefault("server_map_save_queue_size", "4096");
+	settings->setDefault("map_compression_disk", "zlib");
+	settings->setDefault("map_compression_level_disk", "-1");
+	settings->setDefault("map_compression_net", "zlib");
+	settings->setDefault("map_compression_level_net", "-1");
+	settings->setDefault("map_compression_dictionary", "false");
+	settings->setDefault("num_emerge_threads", "1");
+	settings->setDefault("num_map_scan_threads", "4");
+	settings->setDefault("map_prune_protected_areas", "");
 	settings->setDefault("full_block_send_enable_min_time_from_building", "2.0");
 	settings->setDefault("dedicated_server_step", "0.05");
 	settings->setDefault("ignore_world_load_errors", "false");
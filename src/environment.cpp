@@ -26,6 +26,7 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "collision.h"
 #include "content_mapnode.h"
 #include "mapblock.h"
+#include "mapsector.h"
 #include "serverobject.h"
 #include "content_sao.h"
 #include "mapgen.h"
@@ -37,6 +38,7 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "nodemetadata.h"
 #include "main.h" // For g_settings, g_profiler
 #include "gamedef.h"
+#include "playerdatabase.h"
 #ifndef SERVER
 #include "clientmap.h"
 #include "localplayer.h"
@@ -323,6 +325,7 @@ ServerEnvironment::ServerEnvironment(ServerMap *map, lua_State *L,
 	m_lua(L),
 	m_gamedef(gamedef),
 	m_emerger(emerger),
+	m_player_database(NULL),
 	m_random_spawn_timer(3),
 	m_send_recommended_timer(0),
 	m_game_time(0),
@@ -349,190 +352,76 @@ ServerEnvironment::~ServerEnvironment()
 	}
 }
 
-void ServerEnvironment::serializePlayers(const std::string &savedir)
+void ServerEnvironment::serializePlayers()
 {
-	std::string players_path = savedir + "/players";
-	fs::CreateDir(players_path);
-
-	core::map<Player*, bool> saved_players;
-
-	std::vector<fs::DirListNode> player_files = fs::GetDirListing(players_path);
-	for(u32 i=0; i<player_files.size(); i++)
-	{
-		if(player_files[i].dir)
-			continue;
-		
-		// Full path to this file
-		std::string path = players_path + "/" + player_files[i].name;
-
-		//infostream<<"Checking player file "<<path<<std::endl;
-
-		// Load player to see what is its name
-		RemotePlayer testplayer(m_gamedef);
-		{
-			// Open file and deserialize
-			std::ifstream is(path.c_str(), std::ios_base::binary);
-			if(is.good() == false)
-			{
-				infostream<<"Failed to read "<<path<<std::endl;
-				continue;
-			}
-			testplayer.deSerialize(is);
-		}
-
-		//infostream<<"Loaded test player with name "<<testplayer.getName()<<std::endl;
-		
-		// Search for the player
-		std::string playername = testplayer.getName();
-		Player *player = getPlayer(playername.c_str());
-		if(player == NULL)
-		{
-			infostream<<"Didn't find matching player, ignoring file "<<path<<std::endl;
-			continue;
-		}
-
-		//infostream<<"Found matching player, overwriting."<<std::endl;
+	if(m_player_database == NULL)
+		return;
 
-		// OK, found. Save player there.
-		{
-			// Open file and serialize
-			std::ofstream os(path.c_str(), std::ios_base::binary);
-			if(os.good() == false)
-			{
-				infostream<<"Failed to overwrite "<<path<<std::endl;
-				continue;
-			}
-			player->serialize(os);
-			saved_players.insert(player, true);
-		}
-	}
+	ScopeProfiler sp(g_profiler, "ServerEnv: save players", SPT_AVG);
 
+	u32 saved_count = 0;
 	for(core::list<Player*>::Iterator i = m_players.begin();
 			i != m_players.end(); i++)
 	{
 		Player *player = *i;
-		if(saved_players.find(player) != NULL)
-		{
-			/*infostream<<"Player "<<player->getName()
-					<<" was already saved."<<std::endl;*/
-			continue;
-		}
 		std::string playername = player->getName();
 		// Don't save unnamed player
 		if(playername == "")
-		{
-			//infostream<<"Not saving unnamed player."<<std::endl;
 			continue;
-		}
-		/*
-			Find a sane filename
-		*/
-		if(string_allowed(playername, PLAYERNAME_ALLOWED_CHARS) == false)
-			playername = "player";
-		std::string path = players_path + "/" + playername;
-		bool found = false;
-		for(u32 i=0; i<1000; i++)
-		{
-			if(fs::PathExists(path) == false)
-			{
-				found = true;
-				break;
-			}
-			path = players_path + "/" + playername + itos(i);
-		}
-		if(found == false)
-		{
-			infostream<<"Didn't find free file for player"<<std::endl;
+
+		std::ostringstream os(std::ios_base::binary);
+		player->serialize(os);
+		std::string data = os.str();
+
+		// Players that are offline or standing still don't change
+		core::map<std::string, std::string>::Node *n =
+				m_player_saved_data.find(playername);
+		if(n != NULL && n->getValue() == data)
 			continue;
-		}
 
-		{
-			/*infostream<<"Saving player "<<player->getName()<<" to "
-					<<path<<std::endl;*/
-			// Open file and serialize
-			std::ofstream os(path.c_str(), std::ios_base::binary);
-			if(os.good() == false)
-			{
-				infostream<<"Failed to overwrite "<<path<<std::endl;
-				continue;
-			}
-			player->serialize(os);
-			saved_players.insert(player, true);
-		}
+		if(saved_count == 0)
+			m_player_database->beginSave();
+		m_player_database->savePlayer(playername, data);
+		m_player_saved_data.set(playername, data);
+		saved_count++;
 	}
+	if(saved_count != 0)
+		m_player_database->endSave();
 
-	//infostream<<"Saved "<<saved_players.size()<<" players."<<std::endl;
+	g_profiler->avg("ServerEnv: players saved", saved_count);
 }
 
-void ServerEnvironment::deSerializePlayers(const std::string &savedir)
+Player * ServerEnvironment::loadPlayer(const std::string &name)
 {
-	std::string players_path = savedir + "/players";
+	if(m_player_database == NULL)
+		return NULL;
 
-	core::map<Player*, bool> saved_players;
+	std::string data;
+	if(m_player_database->loadPlayer(name, &data) == false)
+		return NULL;
 
-	std::vector<fs::DirListNode> player_files = fs::GetDirListing(players_path);
-	for(u32 i=0; i<player_files.size(); i++)
+	RemotePlayer *player = new RemotePlayer(m_gamedef);
+	try{
+		std::istringstream is(data, std::ios_base::binary);
+		player->deSerialize(is);
+	}
+	catch(SerializationError &e)
 	{
-		if(player_files[i].dir)
-			continue;
-		
-		// Full path to this file
-		std::string path = players_path + "/" + player_files[i].name;
-
-		//infostream<<"Checking player file "<<path<<std::endl;
-
-		// Load player to see what is its name
-		RemotePlayer testplayer(m_gamedef);
-		{
-			// Open file and deserialize
-			std::ifstream is(path.c_str(), std::ios_base::binary);
-			if(is.good() == false)
-			{
-				infostream<<"Failed to read "<<path<<std::endl;
-				continue;
-			}
-			testplayer.deSerialize(is);
-		}
-
-		if(!string_allowed(testplayer.getName(), PLAYERNAME_ALLOWED_CHARS))
-		{
-			infostream<<"Not loading player with invalid name: "
-					<<testplayer.getName()<<std::endl;
-		}
+		errorstream<<"Failed to load player "<<name<<": "
+				<<e.what()<<std::endl;
+		delete player;
+		return NULL;
+	}
+	verbosestream<<"Loaded player "<<name<<std::endl;
 
-		/*infostream<<"Loaded test player with name "<<testplayer.getName()
-				<<std::endl;*/
-		
-		// Search for the player
-		std::string playername = testplayer.getName();
-		Player *player = getPlayer(playername.c_str());
-		bool newplayer = false;
-		if(player == NULL)
-		{
-			//infostream<<"Is a new player"<<std::endl;
-			player = new RemotePlayer(m_gamedef);
-			newplayer = true;
-		}
+	addPlayer(player);
 
-		// Load player
-		{
-			verbosestream<<"Reading player "<<testplayer.getName()<<" from "
-					<<path<<std::endl;
-			// Open file and deserialize
-			std::ifstream is(path.c_str(), std::ios_base::binary);
-			if(is.good() == false)
-			{
-				infostream<<"Failed to read "<<path<<std::endl;
-				continue;
-			}
-			player->deSerialize(is);
-		}
+	// Serialized again, so that it is written only after it changes
+	std::ostringstream os(std::ios_base::binary);
+	player->serialize(os);
+	m_player_saved_data.set(name, os.str());
 
-		if(newplayer)
-		{
-			addPlayer(player);
-		}
-	}
+	return player;
 }
 
 void ServerEnvironment::saveMeta(const std::string &savedir)
@@ -855,52 +744,56 @@ void ServerEnvironment::clearAllObjects()
 		m_active_objects.remove(*i);
 	}
 
-	core::list<v3s16> loadable_blocks;
-	infostream<<"ServerEnvironment::clearAllObjects(): "
-			<<"Listing all loadable blocks"<<std::endl;
-	m_map->listAllLoadableBlocks(loadable_blocks);
-	infostream<<"ServerEnvironment::clearAllObjects(): "
-			<<"Done listing all loadable blocks: "
-			<<loadable_blocks.size()
-			<<", now clearing"<<std::endl;
-	u32 report_interval = loadable_blocks.size() / 10;
-	u32 num_blocks_checked = 0;
-	u32 num_blocks_cleared = 0;
-	u32 num_objs_cleared = 0;
-	for(core::list<v3s16>::Iterator i = loadable_blocks.begin();
-			i != loadable_blocks.end(); i++)
-	{
-		v3s16 p = *i;
-		MapBlock *block = m_map->emergeBlock(p, false);
-		if(!block){
-			errorstream<<"ServerEnvironment::clearAllObjects(): "
-					<<"Failed to emerge block "<<PP(p)<<std::endl;
-			continue;
-		}
-		u32 num_stored = block->m_static_objects.m_stored.size();
-		u32 num_active = block->m_static_objects.m_active.size();
-		if(num_stored != 0 || num_active != 0){
-			block->m_static_objects.m_stored.clear();
-			block->m_static_objects.m_active.clear();
-			block->raiseModified(MOD_STATE_WRITE_NEEDED,
-					"clearAllObjects");
-			num_objs_cleared += num_stored + num_active;
-			num_blocks_cleared++;
-		}
-		num_blocks_checked++;
-
-		if(num_blocks_checked % report_interval == 0){
-			float percent = 100.0 * (float)num_blocks_checked /
-					loadable_blocks.size();
-			infostream<<"ServerEnvironment::clearAllObjects(): "
-					<<"Cleared "<<num_objs_cleared<<" objects"
-					<<" in "<<num_blocks_cleared<<" blocks ("
-					<<percent<<"%)"<<std::endl;
+	/*
+		Clear the blocks in memory here and the stored ones without
+		loading them
+	*/
+	ClearObjectsVisitor visitor;
+	MapBlockPosSet loaded_blocks;
+	core::map<v2s16, MapSector*> *sectors = m_map->getSectorsPtr();
+	for(core::map<v2s16, MapSector*>::Iterator si = sectors->getIterator();
+			si.atEnd() == false; si++)
+	{
+		core::list<MapBlock*> blocks;
+		si.getNode()->getValue()->getBlocks(blocks);
+		for(core::list<MapBlock*>::Iterator i = blocks.begin();
+				i != blocks.end(); i++)
+		{
+			MapBlock *block = *i;
+			if(block->isDummy())
+				continue;
+			if(visitor.visitBlock(block))
+				block->raiseModified(MOD_STATE_WRITE_NEEDED,
+						"clearAllObjects");
+			loaded_blocks.insert(block->getPos());
 		}
 	}
 	infostream<<"ServerEnvironment::clearAllObjects(): "
-			<<"Finished: Cleared "<<num_objs_cleared<<" objects"
-			<<" in "<<num_blocks_cleared<<" blocks"<<std::endl;
+			<<"Cleared "<<visitor.getObjectsCleared()<<" objects in "
+			<<loaded_blocks.size()<<" loaded blocks, now clearing"
+			<<" stored blocks"<<std::endl;
+
+	m_map->scanStoredBlocks("ServerEnvironment::clearAllObjects()",
+			&visitor, &loaded_blocks);
+
+	infostream<<"ServerEnvironment::clearAllObjects(): "
+			<<"Finished: Cleared "<<visitor.getObjectsCleared()<<" objects"
+			<<" in "<<visitor.getBlocksCleared()<<" blocks"<<std::endl;
+}
+
+bool ClearObjectsVisitor::visitBlock(MapBlock *block)
+{
+	u32 num_stored = block->m_static_objects.m_stored.size();
+	u32 num_active = block->m_static_objects.m_active.size();
+	if(num_stored == 0 && num_active == 0)
+		return false;
+	block->m_static_objects.m_stored.clear();
+	block->m_static_objects.m_active.clear();
+
+	JMutexAutoLock lock(m_mutex);
+	m_objects_cleared += num_stored + num_active;
+	m_blocks_cleared++;
+	return true;
 }
 
 void ServerEnvironment::step(float dtime)
@@ -47,6 +47,7 @@ typedef struct lua_State lua_State;
 class ITextureSource;
 class IGameDef;
 class ClientMap;
+class PlayerDatabase;
 
 class Environment
 {
@@ -184,6 +185,34 @@ class IBackgroundBlockEmerger
 	This is not thread-safe. Server uses an environment mutex.
 */
 
+/*
+	Removes the static objects of blocks. Used by
+	ServerEnvironment::clearAllObjects() and --clearobjects.
+*/
+
+class ClearObjectsVisitor : public MapBlockVisitor
+{
+public:
+	ClearObjectsVisitor():
+		m_objects_cleared(0),
+		m_blocks_cleared(0)
+	{
+		m_mutex.Init();
+	}
+
+	bool visitBlock(MapBlock *block);
+
+	u32 getObjectsCleared()
+		{ JMutexAutoLock lock(m_mutex); return m_objects_cleared; }
+	u32 getBlocksCleared()
+		{ JMutexAutoLock lock(m_mutex); return m_blocks_cleared; }
+
+private:
+	JMutex m_mutex;
+	u32 m_objects_cleared;
+	u32 m_blocks_cleared;
+};
+
 class ServerEnvironment : public Environment
 {
 public:
@@ -209,10 +238,17 @@ class ServerEnvironment : public Environment
 	}
 
 	/*
-		Save players
+		Save and load players
+
+		Players are kept in the player database of the server and loaded
+		when they join.
 	*/
-	void serializePlayers(const std::string &savedir);
-	void deSerializePlayers(const std::string &savedir);
+	void setPlayerDatabase(PlayerDatabase *database)
+		{ m_player_database = database; }
+	// Saves the players that have changed since they were saved
+	void serializePlayers();
+	// Loads a saved player and adds it; returns NULL if it isn't saved
+	Player * loadPlayer(const std::string &name);
 
 	/*
 		Save and load time of day and game timer
@@ -346,6 +382,10 @@ class ServerEnvironment : public Environment
 	IGameDef *m_gamedef;
 	// Background block emerger (the server, in practice)
 	IBackgroundBlockEmerger *m_emerger;
+	// Saved players (owned by the server)
+	PlayerDatabase *m_player_database;
+	// Last saved data of players, by name
+	core::map<std::string, std::string> m_player_saved_data;
 	// Active object list
 	core::map<u16, ServerActiveObject*> m_active_objects;
 	// Outgoing network message buffer for active objects
@@ -207,6 +207,22 @@ bool DeleteSingleFileOrEmptyDirectory(std::string path)
 	}
 }
 
+bool SyncFile(std::string path)
+{
+	DWORD attr = GetFileAttributes(path.c_str());
+	// Directory entries are written through on Windows
+	if(attr != INVALID_FILE_ATTRIBUTES && (attr & FILE_ATTRIBUTE_DIRECTORY))
+		return true;
+	HANDLE file = CreateFile(path.c_str(), GENERIC_WRITE,
+			FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING,
+			FILE_ATTRIBUTE_NORMAL, NULL);
+	if(file == INVALID_HANDLE_VALUE)
+		return false;
+	bool did = FlushFileBuffers(file);
+	CloseHandle(file);
+	return did;
+}
+
 #else // POSIX
 
 #include <sys/types.h>
@@ -215,6 +231,7 @@ bool DeleteSingleFileOrEmptyDirectory(std::string path)
 #include <sys/stat.h>
 #include <sys/wait.h>
 #include <unistd.h>
+#include <fcntl.h>
 
 std::vector<DirListNode> GetDirListing(std::string pathstring)
 {
@@ -364,6 +381,19 @@ bool DeleteSingleFileOrEmptyDirectory(std::string path)
 	}
 }
 
+bool SyncFile(std::string path)
+{
+	int fd = open(path.c_str(), O_RDONLY);
+	if(fd == -1)
+		return false;
+	bool did = (fsync(fd) == 0);
+	if(!did)
+		errorstream<<"fsync errno: "<<errno<<": "<<strerror(errno)
+				<<std::endl;
+	close(fd);
+	return did;
+}
+
 #endif
 
 void GetRecursiveSubPaths(std::string path, std::vector<std::string> &dst)
@@ -55,6 +55,10 @@ bool RecursiveDelete(std::string path);
 
 bool DeleteSingleFileOrEmptyDirectory(std::string path);
 
+// Waits until the data written to a file, or the entries of a directory,
+// are on the disk. True on success.
+bool SyncFile(std::string path);
+
 /* Multiplatform */
 
 // The path itself not included
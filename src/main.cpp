@@ -71,6 +71,13 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "util/string.h"
 #include "subgame.h"
 #include "quicktune.h"
+#include "mapdatabase.h"
+#include "map.h"
+#include "mapsector.h"
+#include "mapblock.h"
+#include "mapscanner.h" // OfflineGameDef
+#include "mapgenbench.h"
+#include "util/serialize.h"
 
 /*
 	Settings.
@@ -650,6 +657,33 @@ v3f tempv3f2;
 std::string tempstring;
 std::string tempstring2;
 
+/*
+	A map filled with empty blocks, for the speed tests of node access
+*/
+class SpeedTestMap : public Map
+{
+public:
+	SpeedTestMap():
+		Map(dstream, NULL)
+	{
+	}
+
+	// Creates the blocks of a cube of (2*d)^3 blocks around the origin
+	void createBlocks(s16 d)
+	{
+		for(s16 z=-d; z<d; z++)
+		for(s16 x=-d; x<d; x++)
+		{
+			MapSector *sector = new ServerMapSector(this, v2s16(x,z), NULL);
+			m_sectors.insert(v2s16(x,z), sector);
+			for(s16 y=-d; y<d; y++)
+				sector->createBlankBlock(y);
+		}
+	}
+};
+
+u32 tempu32;
+
 void SpeedTests()
 {
 	{
@@ -737,6 +771,108 @@ void SpeedTests()
 		infostream<<"Done. "<<dtime<<"ms, "
 				<<per_ms<<"/ms"<<std::endl;
 	}
+
+	{
+		// 12^3 blocks, 7M nodes
+		const s16 d = 6;
+		const s16 nd = d * MAP_BLOCKSIZE;
+		SpeedTestMap map;
+		map.createBlocks(d);
+
+		// Made before timing; myrand() would take longer than the reads
+		const u32 count = 1000000;
+		core::array<v3s16> random_positions;
+		random_positions.reallocate(count);
+		for(u32 i=0; i<count; i++)
+			random_positions.push_back(v3s16(myrand_range(-nd, nd-1),
+					myrand_range(-nd, nd-1), myrand_range(-nd, nd-1)));
+
+		{
+			TimeTaker timer("Testing random node reads from Map");
+			for(u32 i=0; i<count; i++)
+				tempu32 += map.getNodeNoEx(random_positions[i]).getContent();
+			u32 dtime = timer.stop();
+			infostream<<"Done. "<<count<<" reads, "
+					<<(dtime == 0 ? count : count / dtime)<<"/ms"<<std::endl;
+		}
+
+		{
+			/*
+				Reads around each position like the voxel algorithms
+				and active block modifiers do
+			*/
+			TimeTaker timer("Testing local node reads from Map");
+			u32 reads = 0;
+			for(u32 i=0; i<count/27; i++)
+			{
+				v3s16 p0 = random_positions[i];
+				for(s16 z=-1; z<=1; z++)
+				for(s16 y=-1; y<=1; y++)
+				for(s16 x=-1; x<=1; x++)
+				{
+					tempu32 += map.getNodeNoEx(p0 + v3s16(x,y,z)).getContent();
+					reads++;
+				}
+			}
+			u32 dtime = timer.stop();
+			infostream<<"Done. "<<reads<<" reads, "
+					<<(dtime == 0 ? reads : reads / dtime)<<"/ms"<<std::endl;
+		}
+	}
+
+	{
+		/*
+			Loading of blocks from the database; the old stream path and
+			the one that reads the blob in place
+		*/
+		OfflineGameDef gamedef;
+		content_t stone = gamedef.allocateUnknownNodeId("test:stone");
+		content_t dirt = gamedef.allocateUnknownNodeId("test:dirt");
+		MapBlock block(NULL, v3s16(0,0,0), &gamedef);
+		for(s16 z=0; z<MAP_BLOCKSIZE; z++)
+		for(s16 y=0; y<MAP_BLOCKSIZE; y++)
+		for(s16 x=0; x<MAP_BLOCKSIZE; x++)
+		{
+			content_t c = y < 8 ? stone : (y == 8 ? dirt : CONTENT_AIR);
+			MapNode n(c, myrand_range(0, 15));
+			block.setNodeNoCheck(x, y, z, n);
+		}
+		block.m_static_objects.insert(0, StaticObject(1, v3f(0,0,0), "data"));
+		std::ostringstream os(std::ios_base::binary);
+		writeU8(os, SER_FMT_VER_HIGHEST);
+		block.serialize(os, SER_FMT_VER_HIGHEST, true);
+		std::string blob = os.str();
+
+		const u32 count = 2000;
+		{
+			TimeTaker timer("Testing block deserialization from stream");
+			for(u32 i=0; i<count; i++)
+			{
+				MapBlock b(NULL, v3s16(0,0,0), &gamedef);
+				std::istringstream is(blob, std::ios_base::binary);
+				u8 version = readU8(is);
+				b.deSerialize(is, version, true);
+			}
+			u32 dtime = timer.stop();
+			infostream<<"Done. "<<count<<" blocks, "
+					<<(dtime == 0 ? count * 1000 : count * 1000 / dtime)
+					<<" blocks/s"<<std::endl;
+		}
+		{
+			TimeTaker timer("Testing block deserialization from buffer");
+			for(u32 i=0; i<count; i++)
+			{
+				MapBlock b(NULL, v3s16(0,0,0), &gamedef);
+				BufReader reader((const u8*)blob.c_str(), blob.size());
+				u8 version = reader.getU8();
+				b.deSerialize(reader, version, true);
+			}
+			u32 dtime = timer.stop();
+			infostream<<"Done. "<<count<<" blocks, "
+					<<(dtime == 0 ? count * 1000 : count * 1000 / dtime)
+					<<" blocks/s"<<std::endl;
+		}
+	}
 }
 
 static void print_worldspecs(const std::vector<WorldSpec> &worldspecs,
@@ -803,6 +939,25 @@ int main(int argc, char *argv[])
 			_("Set logfile path ('' = no logging)")));
 	allowed_options.insert("gameid", ValueSpec(VALUETYPE_STRING,
 			_("Set gameid (\"--gameid list\" prints available ones)")));
+	allowed_options.insert("migrate", ValueSpec(VALUETYPE_STRING,
+			_("Migrate the map of the world to another backend (sqlite3, log)")));
+	allowed_options.insert("clearobjects", ValueSpec(VALUETYPE_FLAG,
+			_("Remove all objects from the map of the world")));
+	allowed_options.insert("compressiontest", ValueSpec(VALUETYPE_FLAG,
+			_("Compare the map compression codecs on blocks of the world")));
+	allowed_options.insert("prunemap", ValueSpec(VALUETYPE_FLAG,
+			_("Delete the unmodified parts of the map of the world")));
+	allowed_options.insert("mapgenbench", ValueSpec(VALUETYPE_STRING,
+			_("Generate an area \"(x1,y1,z1),(x2,y2,z2)\" of map in a "
+			"temporary world and report the speed")));
+	allowed_options.insert("pregenerate", ValueSpec(VALUETYPE_STRING,
+			_("Generate an area \"(x1,y1,z1),(x2,y2,z2)\" of the map of "
+			"the world")));
+	allowed_options.insert("pregenerate-threads", ValueSpec(VALUETYPE_STRING,
+			_("Number of threads for --pregenerate (default: "
+			"num_emerge_threads)")));
+	allowed_options.insert("pregenerate-spiral", ValueSpec(VALUETYPE_FLAG,
+			_("Pregenerate in a spiral from the origin")));
 #ifndef SERVER
 	allowed_options.insert("speedtests", ValueSpec(VALUETYPE_FLAG,
 			_("Run speed tests")));
@@ -1081,7 +1236,12 @@ int main(int argc, char *argv[])
 #ifdef SERVER
 	bool run_dedicated_server = true;
 #else
-	bool run_dedicated_server = cmd_args.getFlag("server");
+	// Offline world tasks select the world like the server does
+	bool run_dedicated_server = cmd_args.getFlag("server") ||
+			cmd_args.exists("migrate") || cmd_args.getFlag("clearobjects") ||
+			cmd_args.getFlag("compressiontest") ||
+			cmd_args.getFlag("prunemap") || cmd_args.exists("mapgenbench") ||
+			cmd_args.exists("pregenerate");
 #endif
 	if(run_dedicated_server)
 	{
@@ -1091,6 +1251,32 @@ int main(int argc, char *argv[])
 		g_timegetter = new SimpleTimeGetter();
 #endif
 
+		// Benchmark the map generator in a temporary world and exit
+		if(cmd_args.exists("mapgenbench"))
+		{
+			SubgameSpec gamespec = commanded_gamespec;
+			if(!gamespec.isValid())
+				gamespec = findSubgame(g_settings->get("default_game"));
+			if(!gamespec.isValid()){
+				errorstream<<"Subgame ["<<gamespec.id<<"] could not be found."
+						<<std::endl;
+				return 1;
+			}
+			core::list<core::aabbox3d<s16> > areas;
+			if(!parseMapAreas(cmd_args.get("mapgenbench"), areas)
+					|| areas.size() != 1){
+				errorstream<<"Invalid area for --mapgenbench"<<std::endl;
+				return 1;
+			}
+			core::aabbox3d<s16> area = *areas.begin();
+			std::string bench_path = porting::path_user + DIR_DELIM
+					+ "mapgenbench";
+			if(!benchmarkMapgen(bench_path, configpath, gamespec,
+					area.MinEdge, area.MaxEdge))
+				return 1;
+			return 0;
+		}
+
 		// World directory
 		std::string world_path;
 		verbosestream<<_("Determining world path")<<std::endl;
@@ -1151,6 +1337,64 @@ int main(int argc, char *argv[])
 		}
 		verbosestream<<_("Using world path")<<" ["<<world_path<<"]"<<std::endl;
 
+		// Convert the map to another backend and exit
+		if(cmd_args.exists("migrate"))
+		{
+			if(!getWorldExists(world_path)){
+				errorstream<<"World does not exist: "<<world_path<<std::endl;
+				return 1;
+			}
+			if(!migrateWorldMapBackend(world_path, cmd_args.get("migrate")))
+				return 1;
+			return 0;
+		}
+
+		// Remove all objects from the map and exit
+		if(cmd_args.getFlag("clearobjects"))
+		{
+			if(!getWorldExists(world_path)){
+				errorstream<<"World does not exist: "<<world_path<<std::endl;
+				return 1;
+			}
+			ClearObjectsVisitor visitor;
+			if(!scanWorldMap(world_path, "clearobjects", &visitor))
+				return 1;
+			actionstream<<"Cleared "<<visitor.getObjectsCleared()
+					<<" objects in "<<visitor.getBlocksCleared()
+					<<" blocks"<<std::endl;
+			return 0;
+		}
+
+		// Compare compression codecs on the map and exit
+		if(cmd_args.getFlag("compressiontest"))
+		{
+			if(!getWorldExists(world_path)){
+				errorstream<<"World does not exist: "<<world_path<<std::endl;
+				return 1;
+			}
+			if(!benchmarkWorldCompression(world_path, 2000))
+				return 1;
+			return 0;
+		}
+
+		// Delete the parts of the map that can be generated again and exit
+		if(cmd_args.getFlag("prunemap"))
+		{
+			if(!getWorldExists(world_path)){
+				errorstream<<"World does not exist: "<<world_path<<std::endl;
+				return 1;
+			}
+			core::list<core::aabbox3d<s16> > protected_areas;
+			if(!parseMapAreas(g_settings->get("map_prune_protected_areas"),
+					protected_areas)){
+				errorstream<<"Invalid map_prune_protected_areas"<<std::endl;
+				return 1;
+			}
+			if(!pruneWorldMap(world_path, protected_areas))
+				return 1;
+			return 0;
+		}
+
 		// We need a gamespec.
 		SubgameSpec gamespec;
 		verbosestream<<_("Determining gameid/gamespec")<<std::endl;
@@ -1194,6 +1438,27 @@ int main(int argc, char *argv[])
 		}
 		verbosestream<<_("Using gameid")<<" ["<<gamespec.id<<"]"<<std::endl;
 
+		// Generate an area of the map and exit
+		if(cmd_args.exists("pregenerate"))
+		{
+			core::list<core::aabbox3d<s16> > areas;
+			if(!parseMapAreas(cmd_args.get("pregenerate"), areas)
+					|| areas.size() != 1){
+				errorstream<<"Invalid area for --pregenerate"<<std::endl;
+				return 1;
+			}
+			core::aabbox3d<s16> area = *areas.begin();
+			if(cmd_args.exists("pregenerate-threads"))
+				g_settings->set("num_emerge_threads",
+						cmd_args.get("pregenerate-threads"));
+			Server server(world_path, configpath, gamespec, false);
+			if(!server.pregenerateMap(getNodeBlockPos(area.MinEdge),
+					getNodeBlockPos(area.MaxEdge),
+					cmd_args.getFlag("pregenerate-spiral"), kill))
+				return 1;
+			return 0;
+		}
+
 		// Create server
 		Server server(world_path, configpath, gamespec, false);
 		server.start(port);
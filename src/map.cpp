@@ -32,26 +32,30 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "nodedef.h"
 #include "gamedef.h"
 #include "util/directiontables.h"
+#include "mapsaver.h"
+#include "mapdatabase.h"
+#include "base64.h"
 
 #define PP(x) "("<<(x).X<<","<<(x).Y<<","<<(x).Z<<")"
 
 /*
-	SQLite format specification:
-	- Initially only replaces sectors/ and sectors2/
+	Blocks are stored in a MapDatabase (see mapdatabase.h), selected by
+	"backend" in world.mt:
+	- "sqlite3" (default): map.sqlite, table blocks((PK) INT pos, BLOB data)
+	- "log": append-only segment files in maplog/
 	
-	If map.sqlite does not exist in the save dir
-	or the block was not found in the database
-	the map will try to load from sectors folder.
-	In either case, map.sqlite will be created
-	and all future saves will save there.
-	
-	Structure of map.sqlite:
-	Tables:
-		blocks
-			(PK) INT pos
-			BLOB data
+	If the block was not found in the database the map will try to load
+	from the legacy sectors/ and sectors2/ folders. Loaded blocks will be
+	saved to the database.
 */
 
+MemoryPool * getMapEditEventPool()
+{
+	static MemoryPool *pool = new MemoryPool("MapEditEvent",
+			sizeof(MapEditEvent), 256);
+	return pool;
+}
+
 /*
 	Map
 */
@@ -59,7 +63,10 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 Map::Map(std::ostream &dout, IGameDef *gamedef):
 	m_dout(dout),
 	m_gamedef(gamedef),
-	m_sector_cache(NULL)
+	m_sector_cache(NULL),
+	m_modified_blocks(new ModifiedBlockList()),
+	m_block_usage(new BlockUsageList()),
+	m_block_index(new MapBlockIndex())
 {
 	/*m_sector_mutex.Init();
 	assert(m_sector_mutex.IsInitialized());*/
@@ -76,6 +83,10 @@ Map::~Map()
 		MapSector *sector = i.getNode()->getValue();
 		delete sector;
 	}
+
+	delete m_modified_blocks;
+	delete m_block_usage;
+	delete m_block_index;
 }
 
 void Map::addEventReceiver(MapEventReceiver *event_receiver)
@@ -138,12 +149,7 @@ MapSector * Map::getSectorNoGenerate(v2s16 p)
 
 MapBlock * Map::getBlockNoCreateNoEx(v3s16 p3d)
 {
-	v2s16 p2d(p3d.X, p3d.Z);
-	MapSector * sector = getSectorNoGenerateNoEx(p2d);
-	if(sector == NULL)
-		return NULL;
-	MapBlock *block = sector->getBlockNoCreateNoEx(p3d.Y);
-	return block;
+	return m_block_index->find(p3d);
 }
 
 MapBlock * Map::getBlockNoCreate(v3s16 p3d)
@@ -170,19 +176,80 @@ bool Map::isNodeUnderground(v3s16 p)
 bool Map::isValidPosition(v3s16 p)
 {
 	v3s16 blockpos = getNodeBlockPos(p);
-	MapBlock *block = getBlockNoCreate(blockpos);
+	MapBlock *block = getBlockNoCreateNoEx(blockpos);
 	return (block != NULL);
 }
 
 // Returns a CONTENT_IGNORE node if not found
-MapNode Map::getNodeNoEx(v3s16 p)
+MapNode Map::getNodeNoEx(v3s16 p, bool *is_valid_position)
 {
 	v3s16 blockpos = getNodeBlockPos(p);
 	MapBlock *block = getBlockNoCreateNoEx(blockpos);
 	if(block == NULL)
+	{
+		if(is_valid_position)
+			*is_valid_position = false;
 		return MapNode(CONTENT_IGNORE);
+	}
 	v3s16 relpos = p - blockpos*MAP_BLOCKSIZE;
-	return block->getNodeNoCheck(relpos);
+	bool valid;
+	MapNode n = block->getNodeNoCheck(relpos, &valid);
+	if(is_valid_position)
+		*is_valid_position = valid;
+	return n;
+}
+
+u32 Map::getNodesInArea(const VoxelArea &area, MapNode *dst, bool *is_valid)
+{
+	v3s16 extent = area.getExtent();
+	if(extent.X <= 0 || extent.Y <= 0 || extent.Z <= 0)
+		return 0;
+
+	u32 found = 0;
+	v3s16 bpmin = getNodeBlockPos(area.MinEdge);
+	v3s16 bpmax = getNodeBlockPos(area.MaxEdge);
+	// Go through the area block by block, so that every block is
+	// looked up only once
+	for(s16 bz=bpmin.Z; bz<=bpmax.Z; bz++)
+	for(s16 by=bpmin.Y; by<=bpmax.Y; by++)
+	for(s16 bx=bpmin.X; bx<=bpmax.X; bx++)
+	{
+		v3s16 bp(bx, by, bz);
+		MapBlock *block = getBlockNoCreateNoEx(bp);
+		if(block != NULL && block->isDummy())
+			block = NULL;
+		v3s16 relpos = bp * MAP_BLOCKSIZE;
+		// The part of the area in this block
+		v3s16 minp(
+			MYMAX(area.MinEdge.X, relpos.X),
+			MYMAX(area.MinEdge.Y, relpos.Y),
+			MYMAX(area.MinEdge.Z, relpos.Z));
+		v3s16 maxp(
+			MYMIN(area.MaxEdge.X, relpos.X + MAP_BLOCKSIZE - 1),
+			MYMIN(area.MaxEdge.Y, relpos.Y + MAP_BLOCKSIZE - 1),
+			MYMIN(area.MaxEdge.Z, relpos.Z + MAP_BLOCKSIZE - 1));
+		for(s16 z=minp.Z; z<=maxp.Z; z++)
+		for(s16 y=minp.Y; y<=maxp.Y; y++)
+		{
+			u32 i = area.index(minp.X, y, z);
+			for(s16 x=minp.X; x<=maxp.X; x++, i++)
+			{
+				if(block == NULL)
+				{
+					dst[i] = MapNode(CONTENT_IGNORE);
+					if(is_valid)
+						is_valid[i] = false;
+					continue;
+				}
+				dst[i] = block->getNodeNoCheck(x - relpos.X, y - relpos.Y,
+						z - relpos.Z);
+				if(is_valid)
+					is_valid[i] = true;
+				found++;
+			}
+		}
+	}
+	return found;
 }
 
 // throws InvalidPositionException if not found
@@ -271,28 +338,22 @@ void Map::unspreadLight(enum LightBank bank,
 		v3s16 blockpos = getNodeBlockPos(pos);
 		
 		// Only fetch a new block if the block position has changed
-		try{
-			if(block == NULL || blockpos != blockpos_last){
-				block = getBlockNoCreate(blockpos);
-				blockpos_last = blockpos;
+		if(block == NULL || blockpos != blockpos_last){
+			block = getBlockNoCreateNoEx(blockpos);
+			blockpos_last = blockpos;
 
-				block_checked_in_modified = false;
-				blockchangecount++;
-			}
-		}
-		catch(InvalidPositionException &e)
-		{
-			continue;
+			block_checked_in_modified = false;
+			blockchangecount++;
 		}
 
-		if(block->isDummy())
+		if(block == NULL || block->isDummy())
 			continue;
 
 		// Calculate relative position in block
 		v3s16 relpos = pos - blockpos_last * MAP_BLOCKSIZE;
 
 		// Get node straight from the block
-		MapNode n = block->getNode(relpos);
+		MapNode n = block->getNodeNoCheck(relpos);
 
 		u8 oldlight = j.getNode()->getValue();
 
@@ -305,88 +366,81 @@ void Map::unspreadLight(enum LightBank bank,
 			// Get the block where the node is located
 			v3s16 blockpos = getNodeBlockPos(n2pos);
 
-			try
-			{
-				// Only fetch a new block if the block position has changed
-				try{
-					if(block == NULL || blockpos != blockpos_last){
-						block = getBlockNoCreate(blockpos);
-						blockpos_last = blockpos;
+			// Only fetch a new block if the block position has changed
+			if(block == NULL || blockpos != blockpos_last){
+				block = getBlockNoCreateNoEx(blockpos);
+				blockpos_last = blockpos;
 
-						block_checked_in_modified = false;
-						blockchangecount++;
-					}
-				}
-				catch(InvalidPositionException &e)
-				{
-					continue;
-				}
+				block_checked_in_modified = false;
+				blockchangecount++;
+			}
+
+			if(block == NULL)
+				continue;
 
-				// Calculate relative position in block
-				v3s16 relpos = n2pos - blockpos * MAP_BLOCKSIZE;
-				// Get node straight from the block
-				MapNode n2 = block->getNode(relpos);
+			// Calculate relative position in block
+			v3s16 relpos = n2pos - blockpos * MAP_BLOCKSIZE;
+			// Get node straight from the block
+			bool is_valid_position;
+			MapNode n2 = block->getNodeNoCheck(relpos, &is_valid_position);
+			if(!is_valid_position)
+				continue;
 
-				bool changed = false;
+			bool changed = false;
 
-				//TODO: Optimize output by optimizing light_sources?
+			//TODO: Optimize output by optimizing light_sources?
 
+			/*
+				If the neighbor is dimmer than what was specified
+				as oldlight (the light of the previous node)
+			*/
+			if(n2.getLight(bank, nodemgr) < oldlight)
+			{
 				/*
-					If the neighbor is dimmer than what was specified
-					as oldlight (the light of the previous node)
+					And the neighbor is transparent and it has some light
 				*/
-				if(n2.getLight(bank, nodemgr) < oldlight)
+				if(nodemgr->get(n2).light_propagates
+						&& n2.getLight(bank, nodemgr) != 0)
 				{
 					/*
-						And the neighbor is transparent and it has some light
+						Set light to 0 and add to queue
 					*/
-					if(nodemgr->get(n2).light_propagates
-							&& n2.getLight(bank, nodemgr) != 0)
-					{
-						/*
-							Set light to 0 and add to queue
-						*/
-
-						u8 current_light = n2.getLight(bank, nodemgr);
-						n2.setLight(bank, 0, nodemgr);
-						block->setNode(relpos, n2);
-
-						unlighted_nodes.insert(n2pos, current_light);
-						changed = true;
-
-						/*
-							Remove from light_sources if it is there
-							NOTE: This doesn't happen nearly at all
-						*/
-						/*if(light_sources.find(n2pos))
-						{
-							infostream<<"Removed from light_sources"<<std::endl;
-							light_sources.remove(n2pos);
-						}*/
-					}
 
-					/*// DEBUG
-					if(light_sources.find(n2pos) != NULL)
-						light_sources.remove(n2pos);*/
-				}
-				else{
-					light_sources.insert(n2pos, true);
-				}
+					u8 current_light = n2.getLight(bank, nodemgr);
+					n2.setLight(bank, 0, nodemgr);
+					block->setNode(relpos, n2);
 
-				// Add to modified_blocks
-				if(changed == true && block_checked_in_modified == false)
-				{
-					// If the block is not found in modified_blocks, add.
-					if(modified_blocks.find(blockpos) == NULL)
+					unlighted_nodes.insert(n2pos, current_light);
+					changed = true;
+
+					/*
+						Remove from light_sources if it is there
+						NOTE: This doesn't happen nearly at all
+					*/
+					/*if(light_sources.find(n2pos))
 					{
-						modified_blocks.insert(blockpos, block);
-					}
-					block_checked_in_modified = true;
+						infostream<<"Removed from light_sources"<<std::endl;
+						light_sources.remove(n2pos);
+					}*/
 				}
+
+				/*// DEBUG
+				if(light_sources.find(n2pos) != NULL)
+					light_sources.remove(n2pos);*/
 			}
-			catch(InvalidPositionException &e)
+			else{
+				light_sources.insert(n2pos, true);
+			}
+
+			// Add to modified_blocks
+			if(changed == true && block_checked_in_modified == false)
 			{
-				continue;
+				// If the block is not found in modified_blocks, add.
+				if(modified_blocks.find(blockpos) == NULL)
+				{
+					modified_blocks.insert(blockpos, block);
+				}
+				block_checked_in_modified = true;
 			}
 		}
 	}
@@ -459,28 +513,22 @@ void Map::spreadLight(enum LightBank bank,
 		v3s16 blockpos = getNodeBlockPos(pos);
 
 		// Only fetch a new block if the block position has changed
-		try{
-			if(block == NULL || blockpos != blockpos_last){
-				block = getBlockNoCreate(blockpos);
-				blockpos_last = blockpos;
+		if(block == NULL || blockpos != blockpos_last){
+			block = getBlockNoCreateNoEx(blockpos);
+			blockpos_last = blockpos;
 
-				block_checked_in_modified = false;
-				blockchangecount++;
-			}
-		}
-		catch(InvalidPositionException &e)
-		{
-			continue;
+			block_checked_in_modified = false;
+			blockchangecount++;
 		}
 
-		if(block->isDummy())
+		if(block == NULL || block->isDummy())
 			continue;
 
 		// Calculate relative position in block
 		v3s16 relpos = pos - blockpos_last * MAP_BLOCKSIZE;
 
 		// Get node straight from the block
-		MapNode n = block->getNode(relpos);
+		MapNode n = block->getNodeNoCheck(relpos);
 
 		u8 oldlight = n.getLight(bank, nodemgr);
 		u8 newlight = diminish_light(oldlight);
@@ -493,69 +541,62 @@ void Map::spreadLight(enum LightBank bank,
 			// Get the block where the node is located
 			v3s16 blockpos = getNodeBlockPos(n2pos);
 
-			try
-			{
-				// Only fetch a new block if the block position has changed
-				try{
-					if(block == NULL || blockpos != blockpos_last){
-						block = getBlockNoCreate(blockpos);
-						blockpos_last = blockpos;
+			// Only fetch a new block if the block position has changed
+			if(block == NULL || blockpos != blockpos_last){
+				block = getBlockNoCreateNoEx(blockpos);
+				blockpos_last = blockpos;
 
-						block_checked_in_modified = false;
-						blockchangecount++;
-					}
-				}
-				catch(InvalidPositionException &e)
-				{
-					continue;
-				}
+				block_checked_in_modified = false;
+				blockchangecount++;
+			}
 
-				// Calculate relative position in block
-				v3s16 relpos = n2pos - blockpos * MAP_BLOCKSIZE;
-				// Get node straight from the block
-				MapNode n2 = block->getNode(relpos);
+			if(block == NULL)
+				continue;
 
-				bool changed = false;
-				/*
-					If the neighbor is brighter than the current node,
-					add to list (it will light up this node on its turn)
-				*/
-				if(n2.getLight(bank, nodemgr) > undiminish_light(oldlight))
+			// Calculate relative position in block
+			v3s16 relpos = n2pos - blockpos * MAP_BLOCKSIZE;
+			// Get node straight from the block
+			bool is_valid_position;
+			MapNode n2 = block->getNodeNoCheck(relpos, &is_valid_position);
+			if(!is_valid_position)
+				continue;
+
+			bool changed = false;
+			/*
+				If the neighbor is brighter than the current node,
+				add to list (it will light up this node on its turn)
+			*/
+			if(n2.getLight(bank, nodemgr) > undiminish_light(oldlight))
+			{
+				lighted_nodes.insert(n2pos, true);
+				//lighted_nodes.push_back(n2pos);
+				changed = true;
+			}
+			/*
+				If the neighbor is dimmer than how much light this node
+				would spread on it, add to list
+			*/
+			if(n2.getLight(bank, nodemgr) < newlight)
+			{
+				if(nodemgr->get(n2).light_propagates)
 				{
+					n2.setLight(bank, newlight, nodemgr);
+					block->setNode(relpos, n2);
 					lighted_nodes.insert(n2pos, true);
 					//lighted_nodes.push_back(n2pos);
 					changed = true;
 				}
-				/*
-					If the neighbor is dimmer than how much light this node
-					would spread on it, add to list
-				*/
-				if(n2.getLight(bank, nodemgr) < newlight)
-				{
-					if(nodemgr->get(n2).light_propagates)
-					{
-						n2.setLight(bank, newlight, nodemgr);
-						block->setNode(relpos, n2);
-						lighted_nodes.insert(n2pos, true);
-						//lighted_nodes.push_back(n2pos);
-						changed = true;
-					}
-				}
+			}
 
-				// Add to modified_blocks
-				if(changed == true && block_checked_in_modified == false)
+			// Add to modified_blocks
+			if(changed == true && block_checked_in_modified == false)
+			{
+				// If the block is not found in modified_blocks, add.
+				if(modified_blocks.find(blockpos) == NULL)
 				{
-					// If the block is not found in modified_blocks, add.
-					if(modified_blocks.find(blockpos) == NULL)
-					{
-						modified_blocks.insert(blockpos, block);
-					}
-					block_checked_in_modified = true;
+					modified_blocks.insert(blockpos, block);
 				}
-			}
-			catch(InvalidPositionException &e)
-			{
-				continue;
+				block_checked_in_modified = true;
 			}
 		}
 	}
@@ -602,14 +643,10 @@ v3s16 Map::getBrightestNeighbour(enum LightBank bank, v3s16 p)
 	for(u16 i=0; i<6; i++){
 		// Get the position of the neighbor node
 		v3s16 n2pos = p + dirs[i];
-		MapNode n2;
-		try{
-			n2 = getNode(n2pos);
-		}
-		catch(InvalidPositionException &e)
-		{
+		bool is_valid_position;
+		MapNode n2 = getNodeNoEx(n2pos, &is_valid_position);
+		if(!is_valid_position)
 			continue;
-		}
 		if(n2.getLight(bank, nodemgr) > brightest_light || found_something == false){
 			brightest_light = n2.getLight(bank, nodemgr);
 			brightest_pos = n2pos;
@@ -642,17 +679,15 @@ s16 Map::propagateSunlight(v3s16 start,
 		v3s16 pos(start.X, y, start.Z);
 
 		v3s16 blockpos = getNodeBlockPos(pos);
-		MapBlock *block;
-		try{
-			block = getBlockNoCreate(blockpos);
-		}
-		catch(InvalidPositionException &e)
-		{
+		MapBlock *block = getBlockNoCreateNoEx(blockpos);
+		if(block == NULL)
 			break;
-		}
 
 		v3s16 relpos = pos - blockpos*MAP_BLOCKSIZE;
-		MapNode n = block->getNode(relpos);
+		bool is_valid_position;
+		MapNode n = block->getNodeNoCheck(relpos, &is_valid_position);
+		if(!is_valid_position)
+			break;
 
 		if(nodemgr->get(n).sunlight_propagates)
 		{
@@ -721,38 +756,26 @@ void Map::updateLighting(enum LightBank bank,
 			for(s16 x=0; x<MAP_BLOCKSIZE; x++)
 			for(s16 y=0; y<MAP_BLOCKSIZE; y++)
 			{
-
-				try{
-					v3s16 p(x,y,z);
-					MapNode n = block->getNode(p);
-					u8 oldlight = n.getLight(bank, nodemgr);
-					n.setLight(bank, 0, nodemgr);
-					block->setNode(p, n);
-
-					// If node sources light, add to list
-					u8 source = nodemgr->get(n).light_source;
-					if(source != 0)
-						light_sources[p + posnodes] = true;
-
-					// Collect borders for unlighting
-					if((x==0 || x == MAP_BLOCKSIZE-1
-					|| y==0 || y == MAP_BLOCKSIZE-1
-					|| z==0 || z == MAP_BLOCKSIZE-1)
-					&& oldlight != 0)
-					{
-						v3s16 p_map = p + posnodes;
-						unlight_from.insert(p_map, oldlight);
-					}
-				}
-				catch(InvalidPositionException &e)
+				// Dummy blocks were skipped above
+				v3s16 p(x,y,z);
+				MapNode n = block->getNodeNoCheck(p);
+				u8 oldlight = n.getLight(bank, nodemgr);
+				n.setLight(bank, 0, nodemgr);
+				block->setNodeNoCheck(p, n);
+
+				// If node sources light, add to list
+				u8 source = nodemgr->get(n).light_source;
+				if(source != 0)
+					light_sources[p + posnodes] = true;
+
+				// Collect borders for unlighting
+				if((x==0 || x == MAP_BLOCKSIZE-1
+				|| y==0 || y == MAP_BLOCKSIZE-1
+				|| z==0 || z == MAP_BLOCKSIZE-1)
+				&& oldlight != 0)
 				{
-					/*
-						This would happen when dealing with a
-						dummy block.
-					*/
-					//assert(0);
-					infostream<<"updateLighting(): InvalidPositionException"
-							<<std::endl;
+					v3s16 p_map = p + posnodes;
+					unlight_from.insert(p_map, oldlight);
 				}
 			}
 
@@ -785,13 +808,8 @@ void Map::updateLighting(enum LightBank bank,
 			// Bottom sunlight is not valid; get the block and loop to it
 
 			pos.Y--;
-			try{
-				block = getBlockNoCreate(pos);
-			}
-			catch(InvalidPositionException &e)
-			{
-				assert(0);
-			}
+			block = getBlockNoCreateNoEx(pos);
+			assert(block != NULL);
 
 		}
 	}
@@ -1298,6 +1316,10 @@ bool Map::addNodeWithEvent(v3s16 p, MapNode n)
 		core::map<v3s16, MapBlock*> modified_blocks;
 		addNodeAndUpdate(p, n, modified_blocks);
 
+		MapBlock *block = getBlockNoCreateNoEx(getNodeBlockPos(p));
+		if(block)
+			setBlockPlayerModified(block);
+
 		// Copy modified_blocks to event
 		for(core::map<v3s16, MapBlock*>::Iterator
 				i = modified_blocks.getIterator();
@@ -1326,6 +1348,10 @@ bool Map::removeNodeWithEvent(v3s16 p)
 		core::map<v3s16, MapBlock*> modified_blocks;
 		removeNodeAndUpdate(p, modified_blocks);
 
+		MapBlock *block = getBlockNoCreateNoEx(getNodeBlockPos(p));
+		if(block)
+			setBlockPlayerModified(block);
+
 		// Copy modified_blocks to event
 		for(core::map<v3s16, MapBlock*>::Iterator
 				i = modified_blocks.getIterator();
@@ -1343,6 +1369,66 @@ bool Map::removeNodeWithEvent(v3s16 p)
 	return succeeded;
 }
 
+void Map::writeVoxelManipulator(ManualMapVoxelManipulator &vmanip)
+{
+	MapEditEvent event;
+	event.type = MEET_OTHER;
+
+	core::map<v3s16, MapBlock*> modified_blocks;
+	core::map<v3s16, MapBlock*> lighting_modified_blocks;
+	for(core::map<v3s16, bool>::Iterator
+			i = vmanip.m_changed_blocks.getIterator();
+			i.atEnd() == false; i++)
+	{
+		v3s16 p = i.getNode()->getKey();
+		// Load the block again if it was unloaded after reading
+		MapBlock *block = emergeBlock(p, false);
+		if(block == NULL || block->isDummy())
+			continue;
+		event.p = p;
+		// The metadata of replaced nodes goes with them, as in
+		// removeNodeMetadata()
+		std::vector<v3s16> meta_positions;
+		block->m_node_metadata.getPositions(meta_positions);
+		for(u32 j=0; j<meta_positions.size(); j++)
+		{
+			v3s16 p_rel = meta_positions[j];
+			v3s16 p_abs = block->getPosRelative() + p_rel;
+			if(!vmanip.m_area.contains(p_abs))
+				continue;
+			u32 vi = vmanip.m_area.index(p_abs);
+			if(vmanip.m_flags[vi] & VOXELFLAG_INEXISTENT)
+				continue;
+			if(vmanip.m_data[vi].getContent()
+					!= block->getNodeNoCheck(p_rel).getContent())
+				block->m_node_metadata.remove(p_rel);
+		}
+		// Same as blitBackAll(), but only for the changed blocks
+		block->copyFrom(vmanip);
+		setBlockPlayerModified(block);
+		modified_blocks.insert(p, block);
+		if(vmanip.m_relight_blocks.find(p) != NULL)
+			lighting_modified_blocks.insert(p, block);
+	}
+	vmanip.clearChanges();
+
+	updateLighting(lighting_modified_blocks, modified_blocks);
+
+	for(core::map<v3s16, MapBlock*>::Iterator
+			i = modified_blocks.getIterator();
+			i.atEnd() == false; i++)
+	{
+		MapBlock *block = i.getNode()->getValue();
+		block->expireDayNightDiff();
+		block->raiseModified(MOD_STATE_WRITE_NEEDED,
+				"writeVoxelManipulator");
+		event.modified_blocks.insert(i.getNode()->getKey(), false);
+	}
+
+	if(event.modified_blocks.size() != 0)
+		dispatchEvent(&event);
+}
+
 bool Map::getDayNightDiff(v3s16 blockpos)
 {
 	try{
@@ -1400,79 +1486,112 @@ bool Map::getDayNightDiff(v3s16 blockpos)
 	return false;
 }
 
+// Blocks that have not been used for this long (seconds) are stored
+// compactly by timerUpdate()
+#define BLOCK_COMPACT_UNUSED_TIME 10.0
+
 /*
 	Updates usage timers
 */
 void Map::timerUpdate(float dtime, float unload_timeout,
-		core::list<v3s16> *unloaded_blocks)
+		core::list<v3s16> *unloaded_blocks, u64 memory_budget)
 {
 	bool save_before_unloading = (mapType() == MAPTYPE_SERVER);
 	
 	// Profile modified reasons
 	Profiler modprofiler;
 	
-	core::list<v2s16> sector_deletion_queue;
 	u32 deleted_blocks_count = 0;
 	u32 saved_blocks_count = 0;
-	u32 block_count_all = 0;
+	// Sectors that may have been left empty
+	core::map<v2s16, bool> sectors_to_check;
 
-	core::map<v2s16, MapSector*>::Iterator si;
+	m_block_usage->step(dtime);
 
+	/*
+		Go through the blocks from the least recently used one until
+		one is found that is kept
+	*/
 	beginSave();
-	si = m_sectors.getIterator();
-	for(; si.atEnd() == false; si++)
+	for(;;)
 	{
-		MapSector *sector = si.getNode()->getValue();
-
-		bool all_blocks_deleted = true;
+		MapBlock *block = m_block_usage->getLeastRecentlyUsed();
+		if(block == NULL)
+			break;
 
-		core::list<MapBlock*> blocks;
-		sector->getBlocks(blocks);
-		
-		for(core::list<MapBlock*>::Iterator i = blocks.begin();
-				i != blocks.end(); i++)
-		{
-			MapBlock *block = (*i);
-			
-			block->incrementUsageTimer(dtime);
-			
-			if(block->getUsageTimer() > unload_timeout)
-			{
-				v3s16 p = block->getPos();
+		u32 usage_timer = block->getUsageTimer();
+		bool over_budget = (memory_budget != 0
+				&& m_block_usage->getMemoryUsage() > memory_budget
+				&& usage_timer > dtime);
+		if(usage_timer <= unload_timeout && over_budget == false)
+			break;
 
-				// Save if modified
-				if(block->getModified() != MOD_STATE_CLEAN
-						&& save_before_unloading)
-				{
-					modprofiler.add(block->getModifiedReason(), 1);
-					saveBlock(block);
-					saved_blocks_count++;
-				}
+		v3s16 p = block->getPos();
+		v2s16 p2d(p.X, p.Z);
+		MapSector *sector = getSectorNoGenerateNoEx(p2d);
+		assert(sector);
 
-				// Delete from memory
-				sector->deleteBlock(block);
+		// Save if modified
+		if(block->getModified() != MOD_STATE_CLEAN
+				&& save_before_unloading)
+		{
+			modprofiler.add(block->getModifiedReason(), 1);
+			saveBlock(block);
+			saved_blocks_count++;
+		}
 
-				if(unloaded_blocks)
-					unloaded_blocks->push_back(p);
+		// Delete from memory
+		sector->deleteBlock(block);
+		sectors_to_check.insert(p2d, true);
 
-				deleted_blocks_count++;
-			}
-			else
-			{
-				all_blocks_deleted = false;
-				block_count_all++;
-			}
-		}
+		if(unloaded_blocks)
+			unloaded_blocks->push_back(p);
 
-		if(all_blocks_deleted)
-		{
-			sector_deletion_queue.push_back(si.getNode()->getKey());
-		}
+		deleted_blocks_count++;
 	}
 	endSave();
 	
 	// Finally delete the empty sectors
+	core::list<v2s16> sector_deletion_queue;
+	for(core::map<v2s16, bool>::Iterator i = sectors_to_check.getIterator();
+			i.atEnd() == false; i++)
+	{
+		v2s16 p2d = i.getNode()->getKey();
+		if(getSectorNoGenerateNoEx(p2d)->getBlockCount() == 0)
+			sector_deletion_queue.push_back(p2d);
+	}
 	deleteSectors(sector_deletion_queue);
+
+	/*
+		Store the blocks that have just become unused compactly. The ones
+		in use are not, because they would be expanded again at the next
+		write.
+	*/
+	core::list<MapBlock*> unused_blocks;
+	m_block_usage->getBlocksUnusedFor(BLOCK_COMPACT_UNUSED_TIME,
+			BLOCK_COMPACT_UNUSED_TIME + dtime, unused_blocks);
+	u32 compacted_blocks_count = 0;
+	for(core::list<MapBlock*>::Iterator i = unused_blocks.begin();
+			i != unused_blocks.end(); i++)
+	{
+		MapBlock *block = *i;
+		if(block->isDummy() || block->isCompact())
+			continue;
+		if(block->compactNodes())
+			compacted_blocks_count++;
+	}
+	if(unused_blocks.size() != 0)
+		g_profiler->avg("Map: unused blocks compacted (%)",
+				100.0 * compacted_blocks_count / unused_blocks.size());
+
+	u32 block_count_all = m_block_usage->size();
+	if(memory_budget != 0 && m_block_usage->getMemoryUsage() > memory_budget)
+	{
+		infostream<<"Map: "<<block_count_all<<" blocks in use take "
+				<<(m_block_usage->getMemoryUsage() / 1024 / 1024)
+				<<" MB; the limit is "<<(memory_budget / 1024 / 1024)
+				<<" MB"<<std::endl;
+	}
 	
 	if(deleted_blocks_count != 0)
 	{
@@ -1612,7 +1731,10 @@ void Map::transformLiquids(core::map<v3s16, MapBlock*> & modified_blocks)
 		*/
 		v3s16 p0 = m_transforming_liquid.pop_front();
 
-		MapNode n0 = getNodeNoEx(p0);
+		bool is_valid_position;
+		MapNode n0 = getNodeNoEx(p0, &is_valid_position);
+		if(!is_valid_position)
+			continue;
 
 		/*
 			Collect information about current node
@@ -1865,6 +1987,7 @@ void Map::setNodeMetadata(v3s16 p, NodeMetadata *meta)
 		return;
 	}
 	block->m_node_metadata.set(p_rel, meta);
+	setBlockPlayerModified(block);
 }
 
 void Map::removeNodeMetadata(v3s16 p)
@@ -1879,6 +2002,14 @@ void Map::removeNodeMetadata(v3s16 p)
 		return;
 	}
 	block->m_node_metadata.remove(p_rel);
+	setBlockPlayerModified(block);
+}
+
+void Map::setBlockPlayerModified(MapBlock *block)
+{
+	if(m_generating_area.contains(block->getPos()))
+		return;
+	block->setPlayerModified();
 }
 
 /*
@@ -1890,19 +2021,57 @@ ServerMap::ServerMap(std::string savedir, IGameDef *gamedef):
 	m_seed(0),
 	m_map_metadata_changed(true),
 	m_database(NULL),
-	m_database_read(NULL),
-	m_database_write(NULL)
+	m_legacy_folders(false),
+	m_saver(NULL),
+	m_rewrite_count(0),
+	m_compression_dictionary_id(0)
 {
 	verbosestream<<__FUNCTION_NAME<<std::endl;
 
-	//m_chunksize = 8; // Takes a few seconds
+	/*
+		The storage backend is set in world.mt
+	*/
+	std::string backend = getWorldMapBackend(savedir);
+	m_database = createMapDatabase(backend, savedir, true);
+	if(m_database == NULL)
+	{
+		errorstream<<"ServerMap: Unknown map backend \""<<backend
+				<<"\" in world.mt"<<std::endl;
+		throw BaseException("Unknown map backend in world.mt");
+	}
+	infostream<<"ServerMap: Using map backend "<<backend<<std::endl;
 
-	if (g_settings->get("fixed_map_seed").empty())
 	{
-		m_seed = (((u64)(myrand()%0xffff)<<0)
-				+ ((u64)(myrand()%0xffff)<<16)
-				+ ((u64)(myrand()%0xffff)<<32)
-				+ ((u64)(myrand()%0xffff)<<48));
+		TimeTaker timer("ServerMap: Listing stored blocks");
+		m_database->listAllLoadableBlocks(m_stored_blocks);
+		infostream<<"ServerMap: "<<m_stored_blocks.size()
+				<<" blocks stored"<<std::endl;
+	}
+
+	m_legacy_folders = fs::PathExists(savedir + DIR_DELIM + "sectors") ||
+			fs::PathExists(savedir + DIR_DELIM + "sectors2");
+
+	/*
+		Blocks are written to the database in a separate thread.
+		With a queue size of 0 they are written synchronously.
+	*/
+	s32 save_queue_size = g_settings->getS32("server_map_save_queue_size");
+	if(save_queue_size < 0)
+		save_queue_size = 0;
+	m_saver = new MapSaveThread(this, gamedef->ndef(), save_queue_size);
+	if(save_queue_size != 0)
+		m_saver->Start();
+
+	m_compression = getWorldMapCompression(savedir);
+
+	//m_chunksize = 8; // Takes a few seconds
+
+	if (g_settings->get("fixed_map_seed").empty())
+	{
+		m_seed = (((u64)(myrand()%0xffff)<<0)
+				+ ((u64)(myrand()%0xffff)<<16)
+				+ ((u64)(myrand()%0xffff)<<32)
+				+ ((u64)(myrand()%0xffff)<<48));
 	}
 	else
 	{
@@ -1955,6 +2124,17 @@ ServerMap::ServerMap(std::string savedir, IGameDef *gamedef):
 						<<std::endl;
 
 				m_map_saving_enabled = true;
+
+				/*
+					Compress saved blocks against the dictionary of the
+					world; it is made once there are enough blocks
+				*/
+				if(g_settings->getBool("map_compression_dictionary"))
+				{
+					if(m_compression_dictionary_id == 0)
+						trainCompressionDictionary();
+					m_compression.dictionary = m_compression_dictionary_id;
+				}
 				// Map loaded, not creating new one
 				return;
 			}
@@ -2005,14 +2185,14 @@ ServerMap::~ServerMap()
 	}
 
 	/*
-		Close database if it was opened
+		Write everything that is still queued
 	*/
-	if(m_database_read)
-		sqlite3_finalize(m_database_read);
-	if(m_database_write)
-		sqlite3_finalize(m_database_write);
-	if(m_database)
-		sqlite3_close(m_database);
+	delete m_saver;
+
+	/*
+		Close database
+	*/
+	delete m_database;
 
 #if 0
 	/*
@@ -2027,15 +2207,9 @@ ServerMap::~ServerMap()
 #endif
 }
 
-void ServerMap::initBlockMake(mapgen::BlockMakeData *data, v3s16 blockpos)
+void getChunkOfBlock(v3s16 blockpos,
+		v3s16 &blockpos_min, v3s16 &blockpos_max)
 {
-	bool enable_mapgen_debug_info = g_settings->getBool("enable_mapgen_debug_info");
-	if(enable_mapgen_debug_info)
-		infostream<<"initBlockMake(): "
-				<<"("<<blockpos.X<<","<<blockpos.Y<<","<<blockpos.Z<<") - "
-				<<"("<<blockpos.X<<","<<blockpos.Y<<","<<blockpos.Z<<")"
-				<<std::endl;
-	
 	//s16 chunksize = 3;
 	//v3s16 chunk_offset(-1,-1,-1);
 	//s16 chunksize = 4;
@@ -2043,10 +2217,34 @@ void ServerMap::initBlockMake(mapgen::BlockMakeData *data, v3s16 blockpos)
 	s16 chunksize = 5;
 	v3s16 chunk_offset(-2,-2,-2);
 	v3s16 blockpos_div = getContainerPos(blockpos - chunk_offset, chunksize);
-	v3s16 blockpos_min = blockpos_div * chunksize;
-	v3s16 blockpos_max = blockpos_div * chunksize + v3s16(1,1,1)*(chunksize-1);
+	blockpos_min = blockpos_div * chunksize;
+	blockpos_max = blockpos_div * chunksize + v3s16(1,1,1)*(chunksize-1);
 	blockpos_min += chunk_offset;
 	blockpos_max += chunk_offset;
+}
+
+void ServerMap::getBlockMakeArea(v3s16 blockpos,
+		v3s16 &area_min, v3s16 &area_max)
+{
+	getChunkOfBlock(blockpos, area_min, area_max);
+
+	v3s16 extra_borders(1,1,1);
+	area_min -= extra_borders;
+	area_max += extra_borders;
+}
+
+void ServerMap::initBlockMake(mapgen::BlockMakeData *data, v3s16 blockpos)
+{
+	bool enable_mapgen_debug_info = g_settings->getBool("enable_mapgen_debug_info");
+	if(enable_mapgen_debug_info)
+		infostream<<"initBlockMake(): "
+				<<"("<<blockpos.X<<","<<blockpos.Y<<","<<blockpos.Z<<") - "
+				<<"("<<blockpos.X<<","<<blockpos.Y<<","<<blockpos.Z<<")"
+				<<std::endl;
+	
+	v3s16 blockpos_min;
+	v3s16 blockpos_max;
+	getChunkOfBlock(blockpos, blockpos_min, blockpos_max);
 
 	//v3s16 extra_borders(1,1,1);
 	v3s16 extra_borders(1,1,1);
@@ -2066,6 +2264,12 @@ void ServerMap::initBlockMake(mapgen::BlockMakeData *data, v3s16 blockpos)
 	data->blockpos_requested = blockpos;
 	data->nodedef = m_gamedef->ndef();
 
+	/*
+		Load the stored blocks of the area with one database lookup
+	*/
+	loadBlocksInArea(blockpos_min - extra_borders,
+			blockpos_max + extra_borders);
+
 	/*
 		Create the whole area of this and the neighboring blocks
 	*/
@@ -2087,8 +2291,13 @@ void ServerMap::initBlockMake(mapgen::BlockMakeData *data, v3s16 blockpos)
 			{
 				v3s16 p(x,y,z);
 				//MapBlock *block = createBlock(p);
-				// 1) get from memory, 2) load from disk
-				MapBlock *block = emergeBlock(p, false);
+				// 1) get from memory (stored ones were loaded above)
+				MapBlock *block = getBlockNoCreateNoEx(p);
+				if(block != NULL && block->isDummy())
+					block = NULL;
+				// 2) load from the flat files of an old world
+				if(block == NULL && m_legacy_folders)
+					block = loadBlockFromFolders(p);
 				// 3) create a blank one
 				if(block == NULL)
 				{
@@ -2640,81 +2849,6 @@ s16 ServerMap::findGroundLevel(v2s16 p2d)
 	//return (s16)level;
 }
 
-void ServerMap::createDatabase() {
-	int e;
-	assert(m_database);
-	e = sqlite3_exec(m_database,
-		"CREATE TABLE IF NOT EXISTS `blocks` ("
-			"`pos` INT NOT NULL PRIMARY KEY,"
-			"`data` BLOB"
-		");"
-	, NULL, NULL, NULL);
-	if(e == SQLITE_ABORT)
-		throw FileNotGoodException("Could not create database structure");
-	else
-		infostream<<"ServerMap: Database structure was created";
-}
-
-void ServerMap::verifyDatabase() {
-	if(m_database)
-		return;
-	
-	{
-		std::string dbp = m_savedir + DIR_DELIM + "map.sqlite";
-		bool needs_create = false;
-		int d;
-		
-		/*
-			Open the database connection
-		*/
-	
-		createDirs(m_savedir);
-	
-		if(!fs::PathExists(dbp))
-			needs_create = true;
-	
-		d = sqlite3_open_v2(dbp.c_str(), &m_database, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE, NULL);
-		if(d != SQLITE_OK) {
-			infostream<<"WARNING: Database failed to open: "<<sqlite3_errmsg(m_database)<<std::endl;
-			throw FileNotGoodException("Cannot open database file");
-		}
-		
-		if(needs_create)
-			createDatabase();
-	
-		d = sqlite3_prepare(m_database, "SELECT `data` FROM `blocks` WHERE `pos`=? LIMIT 1", -1, &m_database_read, NULL);
-		if(d != SQLITE_OK) {
-			infostream<<"WARNING: Database read statment failed to prepare: "<<sqlite3_errmsg(m_database)<<std::endl;
-			throw FileNotGoodException("Cannot prepare read statement");
-		}
-		
-		d = sqlite3_prepare(m_database, "REPLACE INTO `blocks` VALUES(?, ?)", -1, &m_database_write, NULL);
-		if(d != SQLITE_OK) {
-			infostream<<"WARNING: Database write statment failed to prepare: "<<sqlite3_errmsg(m_database)<<std::endl;
-			throw FileNotGoodException("Cannot prepare write statement");
-		}
-		
-		d = sqlite3_prepare(m_database, "SELECT `pos` FROM `blocks`", -1, &m_database_list, NULL);
-		if(d != SQLITE_OK) {
-			infostream<<"WARNING: Database list statment failed to prepare: "<<sqlite3_errmsg(m_database)<<std::endl;
-			throw FileNotGoodException("Cannot prepare read statement");
-		}
-		
-		infostream<<"ServerMap: Database opened"<<std::endl;
-	}
-}
-
-bool ServerMap::loadFromFolders() {
-	if(!m_database && !fs::PathExists(m_savedir + DIR_DELIM + "map.sqlite"))
-		return true;
-	return false;
-}
-
-sqlite3_int64 ServerMap::getBlockAsInteger(const v3s16 pos) {
-	return (sqlite3_int64)pos.Z*16777216 +
-		(sqlite3_int64)pos.Y*4096 + (sqlite3_int64)pos.X;
-}
-
 void ServerMap::createDirs(std::string path)
 {
 	if(fs::CreateAllDirs(path) == false)
@@ -2805,6 +2939,8 @@ void ServerMap::save(ModifiedState save_level)
 		return;
 	}
 	
+	ScopeProfiler sp(g_profiler, "ServerMap: save", SPT_AVG);
+
 	if(save_level == MOD_STATE_CLEAN)
 		infostream<<"ServerMap: Saving whole map, this can take time."
 				<<std::endl;
@@ -2819,51 +2955,77 @@ void ServerMap::save(ModifiedState save_level)
 	
 	u32 sector_meta_count = 0;
 	u32 block_count = 0;
-	u32 block_count_all = 0; // Number of blocks in memory
+	// Number of blocks in memory
+	u32 block_count_all = m_block_usage->size();
 	
 	// Don't do anything with sqlite unless something is really saved
 	bool save_started = false;
 
-	core::map<v2s16, MapSector*>::Iterator i = m_sectors.getIterator();
-	for(; i.atEnd() == false; i++)
+	/*
+		Only the modified blocks have to be gone through, unless the
+		whole map is saved
+	*/
+	core::list<MapBlock*> blocks;
+	if(save_level != MOD_STATE_CLEAN)
+		m_modified_blocks->getBlocks(blocks);
+
+	g_profiler->avg("ServerMap: modified blocks", m_modified_blocks->size());
+
+	/*
+		Likewise only the sectors whose metadata has changed
+	*/
+	if(save_level == MOD_STATE_CLEAN)
 	{
-		ServerMapSector *sector = (ServerMapSector*)i.getNode()->getValue();
-		assert(sector->getId() == MAPSECTOR_SERVER);
-	
-		if(sector->differs_from_disk || save_level == MOD_STATE_CLEAN)
+		core::map<v2s16, MapSector*>::Iterator i = m_sectors.getIterator();
+		for(; i.atEnd() == false; i++)
 		{
+			ServerMapSector *sector =
+					(ServerMapSector*)i.getNode()->getValue();
+			assert(sector->getId() == MAPSECTOR_SERVER);
 			saveSectorMeta(sector);
 			sector_meta_count++;
+			sector->getBlocks(blocks);
 		}
-		core::list<MapBlock*> blocks;
-		sector->getBlocks(blocks);
-		core::list<MapBlock*>::Iterator j;
-		
-		for(j=blocks.begin(); j!=blocks.end(); j++)
+	}
+	else
+	{
+		core::map<v2s16, bool>::Iterator i = m_dirty_sectors.getIterator();
+		for(; i.atEnd() == false; i++)
 		{
-			MapBlock *block = *j;
-			
-			block_count_all++;
+			// The sector may have been unloaded since
+			ServerMapSector *sector = (ServerMapSector*)
+					getSectorNoGenerateNoEx(i.getNode()->getKey());
+			if(sector == NULL || sector->differs_from_disk == false)
+				continue;
+			saveSectorMeta(sector);
+			sector_meta_count++;
+		}
+	}
+	m_dirty_sectors.clear();
 
-			if(block->getModified() >= save_level)
-			{
-				// Lazy beginSave()
-				if(!save_started){
-					beginSave();
-					save_started = true;
-				}
+	for(core::list<MapBlock*>::Iterator j = blocks.begin();
+			j != blocks.end(); j++)
+	{
+		MapBlock *block = *j;
+		
+		if(block->getModified() >= save_level)
+		{
+			// Lazy beginSave()
+			if(!save_started){
+				beginSave();
+				save_started = true;
+			}
 
-				modprofiler.add(block->getModifiedReason(), 1);
+			modprofiler.add(block->getModifiedReason(), 1);
 
-				saveBlock(block);
-				block_count++;
+			saveBlock(block);
+			block_count++;
 
-				/*infostream<<"ServerMap: Written block ("
-						<<block->getPos().X<<","
-						<<block->getPos().Y<<","
-						<<block->getPos().Z<<")"
-						<<std::endl;*/
-			}
+			/*infostream<<"ServerMap: Written block ("
+					<<block->getPos().X<<","
+					<<block->getPos().Y<<","
+					<<block->getPos().Z<<")"
+					<<std::endl;*/
 		}
 	}
 	if(save_started)
@@ -2886,50 +3048,44 @@ void ServerMap::save(ModifiedState save_level)
 	}
 }
 
-static s32 unsignedToSigned(s32 i, s32 max_positive)
+MapScanStats ServerMap::scanStoredBlocks(const std::string &name,
+		MapBlockVisitor *visitor, MapBlockPosSet *skip)
 {
-	if(i < max_positive)
-		return i;
-	else
-		return i - 2*max_positive;
-}
+	DSTACK(__FUNCTION_NAME);
 
-// modulo of a negative number does not work consistently in C
-static sqlite3_int64 pythonmodulo(sqlite3_int64 i, sqlite3_int64 mod)
-{
-	if(i >= 0)
-		return i % mod;
-	return mod - ((-i) % mod);
+	if(m_legacy_folders){
+		errorstream<<name<<": Blocks that are stored in flat files"
+				<<" are left out"<<std::endl;
+	}
+
+	// Get everything queued into the database first
+	m_saver->flush();
+
+	MapScanner scanner(name, m_database, m_gamedef,
+			g_settings->getS32("num_map_scan_threads"));
+	MapScanStats stats = scanner.run(m_stored_blocks, visitor, skip);
+	if(stats.blocks_changed != 0)
+		m_rewrite_count++;
+	return stats;
 }
 
-v3s16 ServerMap::getIntegerAsBlock(sqlite3_int64 i)
+void ServerMap::flushSavedBlocks()
 {
-	s32 x = unsignedToSigned(pythonmodulo(i, 4096), 2048);
-	i = (i - x) / 4096;
-	s32 y = unsignedToSigned(pythonmodulo(i, 4096), 2048);
-	i = (i - y) / 4096;
-	s32 z = unsignedToSigned(pythonmodulo(i, 4096), 2048);
-	return v3s16(x,y,z);
+	m_saver->flush();
 }
 
 void ServerMap::listAllLoadableBlocks(core::list<v3s16> &dst)
 {
-	if(loadFromFolders()){
+	if(fs::PathExists(m_savedir + DIR_DELIM + "sectors") ||
+			fs::PathExists(m_savedir + DIR_DELIM + "sectors2")){
 		errorstream<<"Map::listAllLoadableBlocks(): Result will be missing "
 				<<"all blocks that are stored in flat files"<<std::endl;
 	}
 	
-	{
-		verifyDatabase();
-		
-		while(sqlite3_step(m_database_list) == SQLITE_ROW)
-		{
-			sqlite3_int64 block_i = sqlite3_column_int64(m_database_list, 0);
-			v3s16 p = getIntegerAsBlock(block_i);
-			//dstream<<"block_i="<<block_i<<" p="<<PP(p)<<std::endl;
-			dst.push_back(p);
-		}
-	}
+	// Get everything queued into the database first
+	m_saver->flush();
+
+	m_database->listAllLoadableBlocks(dst);
 }
 
 void ServerMap::saveMapMeta()
@@ -2953,6 +3109,11 @@ void ServerMap::saveMapMeta()
 	
 	Settings params;
 	params.setU64("seed", m_seed);
+	if(m_compression_dictionary != "")
+		params.set("compression_dictionary",
+				base64_encode((const unsigned char*)
+				m_compression_dictionary.c_str(),
+				m_compression_dictionary.size()));
 
 	params.writeLines(os);
 
@@ -2994,9 +3155,73 @@ void ServerMap::loadMapMeta()
 
 	m_seed = params.getU64("seed");
 
+	if(params.exists("compression_dictionary"))
+	{
+		m_compression_dictionary = base64_decode(
+				params.get("compression_dictionary"));
+		m_compression_dictionary_id = registerCompressionDictionary(
+				m_compression_dictionary);
+	}
+
 	verbosestream<<"ServerMap::loadMapMeta(): "<<"seed="<<m_seed<<std::endl;
 }
 
+// Fewer blocks than this don't tell what the map is like
+#define COMPRESSION_DICTIONARY_MIN_BLOCKS 500
+#define COMPRESSION_DICTIONARY_SAMPLE_BLOCKS 2000
+
+void ServerMap::trainCompressionDictionary()
+{
+	if(m_stored_blocks.size() < COMPRESSION_DICTIONARY_MIN_BLOCKS)
+		return;
+
+	std::vector<std::string> samples;
+	{
+		TimeTaker timer("ServerMap: Training compression dictionary");
+		sampleStoredBlockData(m_database, COMPRESSION_DICTIONARY_SAMPLE_BLOCKS,
+				&samples);
+		m_compression_dictionary = ::trainCompressionDictionary(samples,
+				COMPRESSION_DICTIONARY_MAX_SIZE);
+	}
+	if(m_compression_dictionary == "")
+		return;
+	m_compression_dictionary_id = registerCompressionDictionary(
+			m_compression_dictionary);
+	infostream<<"ServerMap: Made a compression dictionary of "
+			<<m_compression_dictionary.size()<<" bytes from "
+			<<(samples.size() / 2)<<" blocks"<<std::endl;
+
+	// Blocks that use it can't be read without it, so it is saved first
+	saveMapMeta();
+}
+
+void registerWorldCompressionDictionary(const std::string &savedir)
+{
+	std::string fullpath = savedir + DIR_DELIM + "map_meta.txt";
+	std::ifstream is(fullpath.c_str(), std::ios_base::binary);
+	if(is.good() == false)
+		return;
+
+	Settings params;
+	std::string line;
+	while(std::getline(is, line))
+	{
+		if(trim(line) == "[end_of_params]")
+			break;
+		params.parseConfigLine(line);
+	}
+
+	if(params.exists("compression_dictionary"))
+		registerCompressionDictionary(
+				base64_decode(params.get("compression_dictionary")));
+}
+
+void ServerMap::setSectorDiffersFromDisk(ServerMapSector *sector)
+{
+	sector->differs_from_disk = true;
+	m_dirty_sectors.insert(sector->getPos(), true);
+}
+
 void ServerMap::saveSectorMeta(ServerMapSector *sector)
 {
 	DSTACK(__FUNCTION_NAME);
@@ -3174,15 +3399,16 @@ bool ServerMap::loadSectorFull(v2s16 p2d)
 #endif
 
 void ServerMap::beginSave() {
-	verifyDatabase();
-	if(sqlite3_exec(m_database, "BEGIN;", NULL, NULL, NULL) != SQLITE_OK)
-		infostream<<"WARNING: beginSave() failed, saving might be slow.";
+	// The save thread uses its own transactions
+	if(m_saver->IsRunning())
+		return;
+	m_database->beginSave();
 }
 
 void ServerMap::endSave() {
-	verifyDatabase();
-	if(sqlite3_exec(m_database, "COMMIT;", NULL, NULL, NULL) != SQLITE_OK)
-		infostream<<"WARNING: endSave() failed, map might not have saved.";
+	if(m_saver->IsRunning())
+		return;
+	m_database->endSave();
 }
 
 void ServerMap::saveBlock(MapBlock *block)
@@ -3196,60 +3422,42 @@ void ServerMap::saveBlock(MapBlock *block)
 		/*v3s16 p = block->getPos();
 		infostream<<"ServerMap::saveBlock(): WARNING: Not writing dummy block "
 				<<"("<<p.X<<","<<p.Y<<","<<p.Z<<")"<<std::endl;*/
+		// Keep it out of the list of modified blocks
+		block->resetModified();
 		return;
 	}
 
 	// Format used for writing
 	u8 version = SER_FMT_VER_HIGHEST;
-	// Get destination
-	v3s16 p3d = block->getPos();
-	
 	
-#if 0
-	v2s16 p2d(p3d.X, p3d.Z);
-	std::string sectordir = getSectorDir(p2d);
-
-	createDirs(sectordir);
-
-	std::string fullpath = sectordir+DIR_DELIM+getBlockFilename(p3d);
-	std::ofstream o(fullpath.c_str(), std::ios_base::binary);
-	if(o.good() == false)
-		throw FileNotGoodException("Cannot open block data");
-#endif
 	/*
-		[0] u8 serialization version
-		[1] data
+		Copy the block and let the save thread do the rest.
+		If the save thread is not running, this writes it right away.
 	*/
+	MapBlockSnapshot *snapshot = new MapBlockSnapshot();
+	block->takeSnapshot(*snapshot, version);
+	snapshot->compression = m_compression;
+	m_stored_blocks.insert(block->getPos());
+	m_saver->enqueue(snapshot);
 	
-	verifyDatabase();
-	
-	std::ostringstream o(std::ios_base::binary);
-	
-	o.write((char*)&version, 1);
-	
-	// Write basic data
-	block->serialize(o, version, true);
-	
-	// Write block to database
-	
-	std::string tmp = o.str();
-	const char *bytes = tmp.c_str();
-	
-	if(sqlite3_bind_int64(m_database_write, 1, getBlockAsInteger(p3d)) != SQLITE_OK)
-		infostream<<"WARNING: Block position failed to bind: "<<sqlite3_errmsg(m_database)<<std::endl;
-	if(sqlite3_bind_blob(m_database_write, 2, (void *)bytes, o.tellp(), NULL) != SQLITE_OK) // TODO this mught not be the right length
-		infostream<<"WARNING: Block data failed to bind: "<<sqlite3_errmsg(m_database)<<std::endl;
-	int written = sqlite3_step(m_database_write);
-	if(written != SQLITE_DONE)
-		infostream<<"WARNING: Block failed to save ("<<p3d.X<<", "<<p3d.Y<<", "<<p3d.Z<<") "
-		<<sqlite3_errmsg(m_database)<<std::endl;
-	// Make ready for later reuse
-	sqlite3_reset(m_database_write);
-	
-	// We just wrote it to the disk so clear modified flag
+	// The data is out of the block now so clear modified flag
 	block->resetModified();
 }
 
+void ServerMap::writeBlockBatch(core::map<v3s16, std::string> &blobs)
+{
+	DSTACK(__FUNCTION_NAME);
+
+	// A single block is written within the transaction of beginSave()
+	if(blobs.size() == 1)
+	{
+		core::map<v3s16, std::string>::Iterator i = blobs.getIterator();
+		m_database->saveBlock(i.getNode()->getKey(), i.getNode()->getValue());
+		return;
+	}
+	m_database->saveBlocks(blobs);
+}
+
 void ServerMap::loadBlock(std::string sectordir, std::string blockfile, MapSector *sector, bool save_after_load)
 {
 	DSTACK(__FUNCTION_NAME);
@@ -3331,14 +3539,8 @@ void ServerMap::loadBlock(std::string *blob, v3s16 p3d, MapSector *sector, bool
 	DSTACK(__FUNCTION_NAME);
 
 	try {
-		std::istringstream is(*blob, std::ios_base::binary);
-		
-		u8 version = SER_FMT_VER_INVALID;
-		is.read((char*)&version, 1);
-
-		if(is.fail())
-			throw SerializationError("ServerMap::loadBlock(): Failed"
-					" to read MapBlock version");
+		BufReader reader((const u8*)blob->c_str(), blob->size());
+		u8 version = reader.getU8();
 
 		/*u32 block_size = MapBlock::serializedLength(version);
 		SharedBuffer<u8> data(block_size);
@@ -3357,7 +3559,7 @@ void ServerMap::loadBlock(std::string *blob, v3s16 p3d, MapSector *sector, bool
 		}
 		
 		// Read basic data
-		block->deSerialize(is, version, true);
+		block->deSerialize(reader, version, true);
 		
 		// If it's a new block, insert it to the map
 		if(created_new)
@@ -3395,44 +3597,160 @@ void ServerMap::loadBlock(std::string *blob, v3s16 p3d, MapSector *sector, bool
 	}
 }
 
-MapBlock* ServerMap::loadBlock(v3s16 blockpos)
+bool ServerMap::fetchBlock(v3s16 blockpos, std::string *blob)
 {
 	DSTACK(__FUNCTION_NAME);
 
-	v2s16 p2d(blockpos.X, blockpos.Z);
+	/*
+		Blocks that have never been saved are not looked up from disk
+	*/
+	if(m_stored_blocks.contains(blockpos) == false)
+	{
+		g_profiler->add("ServerMap: stored block index misses (num)", 1);
+		return false;
+	}
+	g_profiler->add("ServerMap: stored block index hits (num)", 1);
 
-	if(!loadFromFolders()) {
-		verifyDatabase();
-		
-		if(sqlite3_bind_int64(m_database_read, 1, getBlockAsInteger(blockpos)) != SQLITE_OK)
-			infostream<<"WARNING: Could not bind block position for load: "
-				<<sqlite3_errmsg(m_database)<<std::endl;
-		if(sqlite3_step(m_database_read) == SQLITE_ROW) {
-			/*
-				Make sure sector is loaded
-			*/
-			MapSector *sector = createSector(p2d);
-			
-			/*
-				Load block
-			*/
-			const char * data = (const char *)sqlite3_column_blob(m_database_read, 0);
-			size_t len = sqlite3_column_bytes(m_database_read, 0);
-			
-			std::string datastr(data, len);
-			
-			loadBlock(&datastr, blockpos, sector, false);
+	/*
+		The newest data of a block can still be waiting in the save queue
+	*/
+	if(m_saver->getPending(blockpos, blob))
+		return true;
+
+	return m_database->loadBlock(blockpos, blob);
+}
 
-			sqlite3_step(m_database_read);
-			// We should never get more than 1 row, so ok to reset
-			sqlite3_reset(m_database_read);
+MapBlock* ServerMap::deSerializeBlock(v3s16 blockpos, const std::string &blob)
+{
+	DSTACK(__FUNCTION_NAME);
+	ScopeProfiler sp(g_profiler, "ServerMap: deserialize block", SPT_AVG);
+
+	MapBlock *block = new MapBlock(this, blockpos, m_gamedef);
+	try{
+		// Read in place; the blob is not copied anywhere
+		BufReader reader((const u8*)blob.c_str(), blob.size());
+		u8 version = reader.getU8();
 
-			return getBlockNoCreateNoEx(blockpos);
+		// Leave the node definitions alone; they belong to the server thread
+		if(block->deSerialize(reader, version, true, false) == false)
+		{
+			delete block;
+			return NULL;
 		}
-		sqlite3_reset(m_database_read);
-		
-		// Not found in database, try the files
 	}
+	catch(SerializationError &e)
+	{
+		// loadBlock() reports it
+		delete block;
+		return NULL;
+	}
+	catch(VersionMismatchException &e)
+	{
+		delete block;
+		return NULL;
+	}
+
+	// It is the same as the stored data
+	block->resetModified();
+
+	return block;
+}
+
+bool ServerMap::attachBlock(MapBlock *block)
+{
+	DSTACK(__FUNCTION_NAME);
+
+	v3s16 p = block->getPos();
+	MapSector *sector = createSector(v2s16(p.X, p.Z));
+	if(sector->getBlockNoCreateNoEx(p.Y) != NULL)
+		return false;
+	sector->insertBlock(block);
+	return true;
+}
+
+MapBlock* ServerMap::loadBlock(v3s16 blockpos)
+{
+	DSTACK(__FUNCTION_NAME);
+
+	std::string datastr;
+	if(fetchBlock(blockpos, &datastr))
+	{
+		/*
+			Make sure sector is loaded
+		*/
+		MapSector *sector = createSector(v2s16(blockpos.X, blockpos.Z));
+
+		/*
+			Load block
+		*/
+		loadBlock(&datastr, blockpos, sector, false);
+
+		return getBlockNoCreateNoEx(blockpos);
+	}
+
+	// Not found in database, try the files
+	if(m_legacy_folders)
+		return loadBlockFromFolders(blockpos);
+	return NULL;
+}
+
+void ServerMap::loadBlocksInArea(v3s16 blockpos_min, v3s16 blockpos_max)
+{
+	DSTACK(__FUNCTION_NAME);
+	ScopeProfiler sp(g_profiler, "ServerMap: load blocks in area", SPT_AVG);
+
+	/*
+		Skip it if all stored blocks of the area are in memory already
+	*/
+	u32 misses = 0;
+	u32 hits = 0;
+	v3s16 p;
+	for(p.Z=blockpos_min.Z; p.Z<=blockpos_max.Z; p.Z++)
+	for(p.Y=blockpos_min.Y; p.Y<=blockpos_max.Y; p.Y++)
+	for(p.X=blockpos_min.X; p.X<=blockpos_max.X; p.X++)
+	{
+		MapBlock *block = getBlockNoCreateNoEx(p);
+		if(block != NULL && block->isDummy() == false)
+			continue;
+		if(m_stored_blocks.contains(p))
+			hits++;
+		else
+			misses++;
+	}
+	g_profiler->add("ServerMap: stored block index hits (num)", hits);
+	g_profiler->add("ServerMap: stored block index misses (num)", misses);
+	if(hits == 0)
+		return;
+
+	/*
+		Fetch everything at once. The save queue has the newest data; it
+		is looked at first, because a block can be written and leave the
+		queue between the two.
+	*/
+	core::map<v3s16, std::string> blobs;
+	m_saver->getPendingInArea(blockpos_min, blockpos_max, blobs);
+	m_database->loadBlocksInArea(blockpos_min, blockpos_max, blobs);
+
+	u32 loaded_count = 0;
+	for(core::map<v3s16, std::string>::Iterator
+			i = blobs.getIterator(); i.atEnd() == false; i++)
+	{
+		v3s16 p = i.getNode()->getKey();
+		MapBlock *block = getBlockNoCreateNoEx(p);
+		if(block != NULL && block->isDummy() == false)
+			continue;
+		MapSector *sector = createSector(v2s16(p.X, p.Z));
+		loadBlock(&i.getNode()->getValue(), p, sector, false);
+		loaded_count++;
+	}
+	g_profiler->avg("ServerMap: blocks loaded per area", loaded_count);
+}
+
+MapBlock* ServerMap::loadBlockFromFolders(v3s16 blockpos)
+{
+	DSTACK(__FUNCTION_NAME);
+
+	v2s16 p2d(blockpos.X, blockpos.Z);
 
 	// The directory layout we're going to load from.
 	//  1 - original sectors/xxxxzzzz/
@@ -3728,6 +4046,50 @@ void ManualMapVoxelManipulator::initialEmerge(
 	}
 }
 
+bool ManualMapVoxelManipulator::setNodeContent(u32 i, content_t c,
+		INodeDefManager *ndef)
+{
+	if(c > MAX_CONTENT || c == CONTENT_IGNORE || ndef->get(c).name.empty())
+		return false;
+	MapNode &n = m_data[i];
+	if(n.getContent() == c || (m_flags[i] & VOXELFLAG_INEXISTENT))
+		return true;
+	const ContentFeatures &f_old = ndef->get(n);
+	const ContentFeatures &f_new = ndef->get(c);
+	bool relight = f_old.light_propagates != f_new.light_propagates
+			|| f_old.sunlight_propagates != f_new.sunlight_propagates
+			|| f_old.light_source != f_new.light_source;
+	n.setContent(c);
+	setChanged(i, relight);
+	return true;
+}
+
+void ManualMapVoxelManipulator::setNodeParam2(u32 i, u8 param2)
+{
+	MapNode &n = m_data[i];
+	if(n.getParam2() == param2 || (m_flags[i] & VOXELFLAG_INEXISTENT))
+		return;
+	n.setParam2(param2);
+	setChanged(i, false);
+}
+
+void ManualMapVoxelManipulator::clearChanges()
+{
+	m_changed_blocks.clear();
+	m_relight_blocks.clear();
+}
+
+void ManualMapVoxelManipulator::setChanged(u32 i, bool relight)
+{
+	v3s16 e = m_area.getExtent();
+	v3s16 p = m_area.MinEdge + v3s16(i % e.X, i / e.X % e.Y,
+			i / e.X / e.Y);
+	v3s16 blockpos = getNodeBlockPos(p);
+	m_changed_blocks[blockpos] = true;
+	if(relight)
+		m_relight_blocks[blockpos] = true;
+}
+
 void ManualMapVoxelManipulator::blitBackAll(
 		core::map<v3s16, MapBlock*> * modified_blocks)
 {
@@ -32,17 +32,22 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "voxel.h"
 #include "modifiedstate.h"
 #include "util/container.h"
-
-extern "C" {
-	#include "sqlite3.h"
-}
+#include "mapdatabase.h"
+#include "mapscanner.h"
+#include "mapblockindex.h"
+#include "mempool.h"
 
 class ClientMap;
 class MapSector;
 class ServerMapSector;
+class MapSaveThread;
 class MapBlock;
+class ModifiedBlockList;
+class BlockUsageList;
 class NodeMetadata;
 class IGameDef;
+class INodeDefManager;
+class ManualMapVoxelManipulator;
 
 namespace mapgen{
 	struct BlockMakeData;
@@ -68,6 +73,9 @@ enum MapEditEventType{
 	MEET_OTHER
 };
 
+// Pool of MapEditEvents; there is one for every changed node
+MemoryPool * getMapEditEventPool();
+
 struct MapEditEvent
 {
 	MapEditEventType type;
@@ -81,6 +89,8 @@ struct MapEditEvent
 		already_known_by_peer(0)
 	{
 	}
+
+	MEMORYPOOL_OPERATORS(getMapEditEventPool())
 	
 	MapEditEvent * clone()
 	{
@@ -206,8 +216,22 @@ class Map /*: public NodeContainer*/
 	// throws InvalidPositionException if not found
 	void setNode(v3s16 p, MapNode & n);
 	
-	// Returns a CONTENT_IGNORE node if not found
-	MapNode getNodeNoEx(v3s16 p);
+	/*
+		Returns a CONTENT_IGNORE node if not found; doesn't throw.
+		If is_valid_position is not NULL, it is set to whether the node
+		was found. Use these on paths that go through a lot of nodes.
+	*/
+	MapNode getNodeNoEx(v3s16 p, bool *is_valid_position = NULL);
+
+	/*
+		Copies the nodes of an area to dst, which has area.getVolume()
+		nodes in the order of VoxelArea::index(). Nodes that are not
+		found are set to CONTENT_IGNORE, and if is_valid is not NULL,
+		their entries in it are set to false.
+		Returns the number of nodes that were found.
+	*/
+	u32 getNodesInArea(const VoxelArea &area, MapNode *dst,
+			bool *is_valid = NULL);
 
 	void unspreadLight(enum LightBank bank,
 			core::map<v3s16, u8> & from_nodes,
@@ -254,6 +278,17 @@ class Map /*: public NodeContainer*/
 	*/
 	bool addNodeWithEvent(v3s16 p, MapNode n);
 	bool removeNodeWithEvent(v3s16 p);
+
+	/*
+		Copies the blocks changed with ManualMapVoxelManipulator::
+		setNodeContent() and setNodeParam2() to the map, for changing
+		many nodes at once, and forgets the changes. Like
+		addNodeWithEvent(), but the lighting is updated in one go and one
+		event is emitted for all of the blocks. The metadata of the nodes
+		whose content is changed is removed. The blocks are set
+		player-modified (see setBlockPlayerModified()).
+	*/
+	void writeVoxelManipulator(ManualMapVoxelManipulator &vmanip);
 	
 	/*
 		Takes the blocks at the edges into account
@@ -277,9 +312,17 @@ class Map /*: public NodeContainer*/
 	/*
 		Updates usage timers and unloads unused blocks and sectors.
 		Saves modified blocks before unloading on MAPTYPE_SERVER.
+		Blocks that have just become unused are stored compactly.
+
+		Blocks that have not been used for unload_timeout are unloaded.
+		If memory_budget is not 0, more blocks are unloaded, least
+		recently used first, until the blocks use at most that many
+		bytes of memory; blocks used during the last dtime are kept
+		anyway.
 	*/
 	void timerUpdate(float dtime, float unload_timeout,
-			core::list<v3s16> *unloaded_blocks=NULL);
+			core::list<v3s16> *unloaded_blocks=NULL,
+			u64 memory_budget=0);
 		
 	// Deletes sectors and their blocks from memory
 	// Takes cache into account
@@ -315,6 +358,25 @@ class Map /*: public NodeContainer*/
 	*/
 	core::map<v2s16, MapSector*> *getSectorsPtr(){return &m_sectors;}
 
+	// The loaded blocks that are not MOD_STATE_CLEAN
+	ModifiedBlockList *getModifiedBlocks(){return m_modified_blocks;}
+	// The loaded blocks in the order of their last use
+	BlockUsageList *getBlockUsage(){return m_block_usage;}
+	// The loaded blocks by position
+	MapBlockIndex *getBlockIndex(){return m_block_index;}
+
+	/*
+		Marks the block as edited after generation, unless it is in the
+		area that is being generated (see MapGeneratingGuard); what mods
+		do in on_generated is part of generation.
+	*/
+	void setBlockPlayerModified(MapBlock *block);
+	// In blocks. An empty area ends generation.
+	void setGeneratingArea(const VoxelArea &blockarea)
+	{
+		m_generating_area = blockarea;
+	}
+
 	/*
 		Variables
 	*/
@@ -335,6 +397,37 @@ class Map /*: public NodeContainer*/
 
 	// Queued transforming water nodes
 	UniqueQueue<v3s16> m_transforming_liquid;
+
+	// Kept up to date by the blocks in m_sectors
+	ModifiedBlockList *m_modified_blocks;
+	BlockUsageList *m_block_usage;
+	MapBlockIndex *m_block_index;
+
+	// Blocks that are being generated
+	VoxelArea m_generating_area;
+};
+
+/*
+	Edits of the blocks in the area are part of generating them while
+	this exists. Used with the environment locked, around the
+	on_generated callbacks of a chunk.
+*/
+class MapGeneratingGuard
+{
+public:
+	MapGeneratingGuard(Map *map, v3s16 blockpos_min, v3s16 blockpos_max):
+		m_map(map)
+	{
+		m_map->setGeneratingArea(VoxelArea(blockpos_min, blockpos_max));
+	}
+
+	~MapGeneratingGuard()
+	{
+		m_map->setGeneratingArea(VoxelArea());
+	}
+
+private:
+	Map *m_map;
 };
 
 /*
@@ -371,6 +464,9 @@ class ServerMap : public Map
 	void initBlockMake(mapgen::BlockMakeData *data, v3s16 blockpos);
 	MapBlock* finishBlockMake(mapgen::BlockMakeData *data,
 			core::map<v3s16, MapBlock*> &changed_blocks);
+	// The blocks that initBlockMake() copies for generating blockpos and
+	// finishBlockMake() writes back: the chunk and its borders
+	void getBlockMakeArea(v3s16 blockpos, v3s16 &area_min, v3s16 &area_max);
 	
 	// A non-threaded wrapper to the above
 	MapBlock * generateBlock(
@@ -408,25 +504,13 @@ class ServerMap : public Map
 	v3s16 getBlockPos(std::string sectordir, std::string blockfile);
 	static std::string getBlockFilename(v3s16 p);
 
-	/*
-		Database functions
-	*/
-	// Create the database structure
-	void createDatabase();
-	// Verify we can read/write to the database
-	void verifyDatabase();
-	// Get an integer suitable for a block
-	static sqlite3_int64 getBlockAsInteger(const v3s16 pos);
-	static v3s16 getIntegerAsBlock(sqlite3_int64 i);
-
-	// Returns true if the database file does not exist
-	bool loadFromFolders();
-
 	// Call these before and after saving of blocks
 	void beginSave();
 	void endSave();
 
 	void save(ModifiedState save_level);
+	// Waits until the blocks saved so far are in the database
+	void flushSavedBlocks();
 	//void loadAll();
 	
 	void listAllLoadableBlocks(core::list<v3s16> &dst);
@@ -444,6 +528,9 @@ class ServerMap : public Map
 	// (no MapBlocks)
 	// DEPRECATED? Sectors have no metadata anymore.
 	void saveSectorMeta(ServerMapSector *sector);
+	// Sets differs_from_disk of the sector and remembers it, so that
+	// save() doesn't have to go through all the sectors to find it
+	void setSectorDiffersFromDisk(ServerMapSector *sector);
 	MapSector* loadSectorMeta(std::string dirname, bool save_after_load);
 	bool loadSectorMeta(v2s16 p2d);
 	
@@ -454,10 +541,46 @@ class ServerMap : public Map
 	// Returns true if sector now resides in memory
 	//bool deFlushSector(v2s16 p2d);
 	
+	// Queues the block to be written by the save thread
 	void saveBlock(MapBlock *block);
+	// Writes serialized blocks to the database.
+	// Called by MapSaveThread; can be called from any thread.
+	void writeBlockBatch(core::map<v3s16, std::string> &blobs);
 	// This will generate a sector with getSector if not found.
 	void loadBlock(std::string sectordir, std::string blockfile, MapSector *sector, bool save_after_load=false);
 	MapBlock* loadBlock(v3s16 p);
+
+	/*
+		Loading of a block in steps. Only attachBlock() touches the map;
+		the others can be done without locking the environment.
+	*/
+	// Gets the stored data of a block from the save queue or the
+	// database. Returns false if it is not stored there.
+	bool fetchBlock(v3s16 p, std::string *blob);
+	// Makes a block that is not in the map out of stored data.
+	// Returns NULL if it has to be loaded with loadBlock() instead.
+	MapBlock* deSerializeBlock(v3s16 p, const std::string &blob);
+	// Inserts a block made by deSerializeBlock() to the map. Returns
+	// false if there already is a block; the caller still owns it then.
+	bool attachBlock(MapBlock *block);
+
+	// Loads the stored blocks in the area that are not in memory,
+	// fetching them from the database at once
+	void loadBlocksInArea(v3s16 blockpos_min, v3s16 blockpos_max);
+	// Loads a block from sectors/ or sectors2/ and saves it to the database
+	MapBlock* loadBlockFromFolders(v3s16 p);
+
+	/*
+		Runs visitor on the stored blocks that are not in skip without
+		loading them, and writes the ones it changes; see MapScanner.
+		Blocks in memory should be in skip.
+	*/
+	MapScanStats scanStoredBlocks(const std::string &name,
+			MapBlockVisitor *visitor, MapBlockPosSet *skip);
+	// Changes when scanStoredBlocks() rewrites blocks; data that was
+	// fetched with fetchBlock() before that is outdated.
+	u32 getRewriteCount()
+		{ return m_rewrite_count; }
 	// Database version
 	void loadBlock(std::string *blob, v3s16 p3d, MapSector *sector, bool save_after_load=false);
 
@@ -468,7 +591,18 @@ class ServerMap : public Map
 
 	u64 getSeed(){ return m_seed; }
 
+	// The compression dictionary of the world and its id; "" and 0 if it
+	// has none
+	const std::string & getCompressionDictionary()
+		{ return m_compression_dictionary; }
+	u32 getCompressionDictionaryId()
+		{ return m_compression_dictionary_id; }
+
 private:
+	// Trains a compression dictionary from the stored blocks if there
+	// are enough of them, and saves it to the map metadata
+	void trainCompressionDictionary();
+
 	// Seed used for all kinds of randomness in generation
 	u64 m_seed;
 	
@@ -488,14 +622,25 @@ class ServerMap : public Map
 		This is reset to false when written on disk.
 	*/
 	bool m_map_metadata_changed;
+	// Sectors given to setSectorDiffersFromDisk() since the last save
+	core::map<v2s16, bool> m_dirty_sectors;
 	
-	/*
-		SQLite database and statements
-	*/
-	sqlite3 *m_database;
-	sqlite3_stmt *m_database_read;
-	sqlite3_stmt *m_database_write;
-	sqlite3_stmt *m_database_list;
+	// Storage of the blocks; selected in world.mt
+	MapDatabase *m_database;
+	// Positions of the blocks in m_database, so that blocks that have
+	// never been saved are not looked up from it
+	MapBlockPosSet m_stored_blocks;
+	// True if the world has blocks in the old flat file format
+	bool m_legacy_folders;
+
+	// Writes blocks in the background
+	MapSaveThread *m_saver;
+	u32 m_rewrite_count;
+	// Codec of saved blocks
+	CompressionParams m_compression;
+	// Saved in the map metadata
+	std::string m_compression_dictionary;
+	u32 m_compression_dictionary_id;
 };
 
 class MapVoxelManipulator : public VoxelManipulator
@@ -539,9 +684,38 @@ class ManualMapVoxelManipulator : public MapVoxelManipulator
 	// This is much faster with big chunks of generated data
 	void blitBackAll(core::map<v3s16, MapBlock*> * modified_blocks);
 
+	/*
+		Changing nodes for Map::writeVoxelManipulator(); i is an index of
+		m_data. Nodes that are not in the map are left as they are.
+		setNodeContent() returns false and changes nothing if c is
+		CONTENT_IGNORE or not a defined node.
+	*/
+	bool setNodeContent(u32 i, content_t c, INodeDefManager *ndef);
+	void setNodeParam2(u32 i, u8 param2);
+	void clearChanges();
+
+	// Blocks with nodes changed by the above
+	core::map<v3s16, bool> m_changed_blocks;
+	// Those of them where the change can affect light
+	core::map<v3s16, bool> m_relight_blocks;
+
 protected:
+	void setChanged(u32 i, bool relight);
+
 	bool m_create_area;
 };
 
+/*
+	The chunk that is generated at once when blockpos is generated
+*/
+void getChunkOfBlock(v3s16 blockpos,
+		v3s16 &blockpos_min, v3s16 &blockpos_max);
+
+/*
+	Registers the compression dictionary in the map metadata of a world,
+	if it has one, so that its blocks can be read without a ServerMap
+*/
+void registerWorldCompressionDictionary(const std::string &savedir);
+
 #endif
 
@@ -20,6 +20,7 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "mapblock.h"
 
 #include <sstream>
+#include <iterator>
 #include "map.h"
 // For g_settings
 #include "main.h"
@@ -35,9 +36,40 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "mapblock_mesh.h"
 #endif
 #include "util/string.h"
+#include "mempool.h"
 
 #define PP(x) "("<<(x).X<<","<<(x).Y<<","<<(x).Z<<")"
 
+/*
+	The node arrays and the indices of compact blocks come from pools,
+	because blocks are loaded and unloaded all the time
+*/
+
+static MemoryPool * getNodeArrayPool()
+{
+	static MemoryPool *pool = new MemoryPool("MapNode arrays",
+			MAP_BLOCKSIZE*MAP_BLOCKSIZE*MAP_BLOCKSIZE*sizeof(MapNode), 16);
+	return pool;
+}
+
+static MemoryPool * getNodeIndexPool()
+{
+	static MemoryPool *pool = new MemoryPool("MapNode indices",
+			MAP_BLOCKSIZE*MAP_BLOCKSIZE*MAP_BLOCKSIZE/2, 64);
+	return pool;
+}
+
+// Returns an array of MAP_BLOCKSIZE^3 nodes with undefined contents
+static MapNode * allocateNodeArray()
+{
+	return (MapNode*)getNodeArrayPool()->allocate();
+}
+
+static void freeNodeArray(MapNode *nodes)
+{
+	getNodeArrayPool()->free(nodes);
+}
+
 /*
 	MapBlock
 */
@@ -49,16 +81,27 @@ MapBlock::MapBlock(Map *parent, v3s16 pos, IGameDef *gamedef, bool dummy):
 		m_modified(MOD_STATE_WRITE_NEEDED),
 		m_modified_reason("initial"),
 		m_modified_reason_too_long(false),
+		m_modified_list(NULL),
+		m_in_modified_list(false),
+		m_modified_prev(NULL),
+		m_modified_next(NULL),
 		is_underground(false),
 		m_lighting_expired(true),
 		m_day_night_differs(false),
 		m_day_night_differs_expired(true),
 		m_generated(false),
+		m_player_modified(false),
 		m_timestamp(BLOCK_TIMESTAMP_UNDEFINED),
 		m_disk_timestamp(BLOCK_TIMESTAMP_UNDEFINED),
-		m_usage_timer(0)
+		m_usage_time(0),
+		m_usage_list(NULL),
+		m_usage_prev(NULL),
+		m_usage_next(NULL),
+		m_usage_memory(0)
 {
 	data = NULL;
+	m_palette_size = 0;
+	m_indices = NULL;
 	if(dummy == false)
 		reallocate();
 	
@@ -70,6 +113,9 @@ MapBlock::MapBlock(Map *parent, v3s16 pos, IGameDef *gamedef, bool dummy):
 
 MapBlock::~MapBlock()
 {
+	setModifiedList(NULL);
+	setUsageList(NULL);
+
 #ifndef SERVER
 	{
 		//JMutexAutoLock lock(mesh_mutex);
@@ -82,8 +128,160 @@ MapBlock::~MapBlock()
 	}
 #endif
 
-	if(data)
-		delete[] data;
+	freeNodes();
+}
+
+void MapBlock::setModifiedList(ModifiedBlockList *list)
+{
+	if(m_modified_list != NULL)
+		m_modified_list->remove(this);
+	m_modified_list = list;
+	if(m_modified_list != NULL && m_modified != MOD_STATE_CLEAN)
+		m_modified_list->add(this);
+}
+
+bool MapBlock::compactNodes()
+{
+	if(data == NULL)
+		return m_palette_size != 0;
+
+	u32 nodecount = MAP_BLOCKSIZE*MAP_BLOCKSIZE*MAP_BLOCKSIZE;
+
+	/*
+		Find the different nodes; give up if there are too many
+	*/
+	MapNode palette[MAPBLOCK_PALETTE_SIZE];
+	u32 palette_size = 0;
+	u8 last_index = 0;
+	for(u32 i=0; i<nodecount; i++)
+	{
+		MapNode &n = data[i];
+		// Runs of the same node are common
+		if(palette_size != 0 && palette[last_index] == n)
+			continue;
+		u32 j = 0;
+		while(j < palette_size && !(palette[j] == n))
+			j++;
+		if(j == palette_size)
+		{
+			if(palette_size == MAPBLOCK_PALETTE_SIZE)
+				return false;
+			palette[palette_size++] = n;
+		}
+		last_index = j;
+	}
+
+	u8 *indices = NULL;
+	if(palette_size > 1)
+	{
+		indices = (u8*)getNodeIndexPool()->allocate();
+		memset(indices, 0, nodecount / 2);
+		last_index = 0;
+		for(u32 i=0; i<nodecount; i++)
+		{
+			MapNode &n = data[i];
+			if(!(palette[last_index] == n))
+			{
+				last_index = 0;
+				while(!(palette[last_index] == n))
+					last_index++;
+			}
+			indices[i >> 1] |= last_index << ((i & 1) << 2);
+		}
+	}
+
+	freeNodeArray(data);
+	data = NULL;
+	for(u32 j=0; j<palette_size; j++)
+		m_palette[j] = palette[j];
+	m_palette_size = palette_size;
+	m_indices = indices;
+	if(m_usage_list != NULL)
+		m_usage_list->updateMemoryUsage(this);
+	return true;
+}
+
+void MapBlock::expandNodes()
+{
+	if(data != NULL)
+		return;
+	if(m_palette_size == 0)
+		throw InvalidPositionException();
+
+	MapNode *nodes = allocateNodeArray();
+	getNodes(nodes);
+
+	getNodeIndexPool()->free(m_indices);
+	m_indices = NULL;
+	m_palette_size = 0;
+	data = nodes;
+	if(m_usage_list != NULL)
+		m_usage_list->updateMemoryUsage(this);
+}
+
+void MapBlock::getNodes(MapNode *dst)
+{
+	u32 nodecount = MAP_BLOCKSIZE*MAP_BLOCKSIZE*MAP_BLOCKSIZE;
+	if(data != NULL)
+	{
+		// MapNode has a constructor, so not memcpy(); this compiles
+		// to a plain copy anyway
+		for(u32 i=0; i<nodecount; i++)
+			dst[i] = data[i];
+	}
+	else if(m_indices == NULL)
+	{
+		assert(m_palette_size == 1);
+		for(u32 i=0; i<nodecount; i++)
+			dst[i] = m_palette[0];
+	}
+	else
+	{
+		for(u32 i=0; i<nodecount; i+=2)
+		{
+			u8 b = m_indices[i >> 1];
+			dst[i] = m_palette[b & 0x0f];
+			dst[i + 1] = m_palette[b >> 4];
+		}
+	}
+}
+
+u32 MapBlock::getNodesMemoryUsage()
+{
+	u32 nodecount = MAP_BLOCKSIZE*MAP_BLOCKSIZE*MAP_BLOCKSIZE;
+	if(data != NULL)
+		return nodecount * sizeof(MapNode);
+	if(m_indices != NULL)
+		return nodecount / 2;
+	return 0;
+}
+
+u32 MapBlock::getMemoryUsage()
+{
+	return sizeof(MapBlock) + getNodesMemoryUsage()
+			+ m_node_metadata.getMemoryUsage()
+			+ m_static_objects.getMemoryUsage();
+}
+
+void MapBlock::freeNodes()
+{
+	freeNodeArray(data);
+	data = NULL;
+	getNodeIndexPool()->free(m_indices);
+	m_indices = NULL;
+	m_palette_size = 0;
+}
+
+void MapBlock::setUsageList(BlockUsageList *list)
+{
+	if(m_usage_list != NULL)
+		m_usage_list->remove(this);
+	m_usage_list = list;
+	if(m_usage_list != NULL)
+	{
+		m_usage_list->touch(this);
+		m_usage_list->updateMemoryUsage(this);
+	}
 }
 
 bool MapBlock::isValidPositionParent(v3s16 p)
@@ -105,9 +303,9 @@ MapNode MapBlock::getNodeParent(v3s16 p)
 	}
 	else
 	{
-		if(data == NULL)
+		if(isDummy())
 			throw InvalidPositionException();
-		return data[p.Z*MAP_BLOCKSIZE*MAP_BLOCKSIZE + p.Y*MAP_BLOCKSIZE + p.X];
+		return readNode(p.Z*MAP_BLOCKSIZE*MAP_BLOCKSIZE + p.Y*MAP_BLOCKSIZE + p.X);
 	}
 }
 
@@ -119,32 +317,23 @@ void MapBlock::setNodeParent(v3s16 p, MapNode & n)
 	}
 	else
 	{
-		if(data == NULL)
+		if(isDummy())
 			throw InvalidPositionException();
-		data[p.Z*MAP_BLOCKSIZE*MAP_BLOCKSIZE + p.Y*MAP_BLOCKSIZE + p.X] = n;
+		writeNode(p.Z*MAP_BLOCKSIZE*MAP_BLOCKSIZE + p.Y*MAP_BLOCKSIZE + p.X, n);
 	}
 }
 
-MapNode MapBlock::getNodeParentNoEx(v3s16 p)
+MapNode MapBlock::getNodeParentNoEx(v3s16 p, bool *is_valid_position)
 {
-	if(isValidPosition(p) == false)
-	{
-		try{
-			return m_parent->getNode(getPosRelative() + p);
-		}
-		catch(InvalidPositionException &e)
-		{
-			return MapNode(CONTENT_IGNORE);
-		}
-	}
-	else
-	{
-		if(data == NULL)
-		{
-			return MapNode(CONTENT_IGNORE);
-		}
-		return data[p.Z*MAP_BLOCKSIZE*MAP_BLOCKSIZE + p.Y*MAP_BLOCKSIZE + p.X];
-	}
+	if(p.X < 0 || p.X >= MAP_BLOCKSIZE
+			|| p.Y < 0 || p.Y >= MAP_BLOCKSIZE
+			|| p.Z < 0 || p.Z >= MAP_BLOCKSIZE)
+		return m_parent->getNodeNoEx(getPosRelative() + p, is_valid_position);
+	if(is_valid_position)
+		*is_valid_position = !isDummy();
+	if(isDummy())
+		return MapNode(CONTENT_IGNORE);
+	return readNode(p.Z*MAP_BLOCKSIZE*MAP_BLOCKSIZE + p.Y*MAP_BLOCKSIZE + p.X);
 }
 
 /*
@@ -184,8 +373,11 @@ bool MapBlock::propagateSunlight(core::map<v3s16, bool> & light_sources,
 			bool no_sunlight = false;
 			bool no_top_block = false;
 			// Check if node above block has sunlight
-			try{
-				MapNode n = getNodeParent(v3s16(x, MAP_BLOCKSIZE, z));
+			bool is_valid_position;
+			MapNode n = getNodeParentNoEx(v3s16(x, MAP_BLOCKSIZE, z),
+					&is_valid_position);
+			if(is_valid_position)
+			{
 				if(n.getContent() == CONTENT_IGNORE)
 				{
 					// Trust heuristics
@@ -196,7 +388,7 @@ bool MapBlock::propagateSunlight(core::map<v3s16, bool> & light_sources,
 					no_sunlight = true;
 				}
 			}
-			catch(InvalidPositionException &e)
+			else
 			{
 				no_top_block = true;
 				
@@ -308,12 +500,12 @@ bool MapBlock::propagateSunlight(core::map<v3s16, bool> & light_sources,
 				
 				Ignore non-transparent nodes as they always have no light
 			*/
-			try
-			{
 			if(block_below_is_valid)
 			{
-				MapNode n = getNodeParent(v3s16(x, -1, z));
-				if(nodemgr->get(n).light_propagates)
+				// If there is no block below, there is no need to panic
+				MapNode n = getNodeParentNoEx(v3s16(x, -1, z),
+						&is_valid_position);
+				if(is_valid_position && nodemgr->get(n).light_propagates)
 				{
 					if(n.getLight(LIGHTBANK_DAY, nodemgr) == LIGHT_SUN
 							&& sunlight_should_go_down == false)
@@ -322,13 +514,6 @@ bool MapBlock::propagateSunlight(core::map<v3s16, bool> & light_sources,
 							&& sunlight_should_go_down == true)
 						block_below_is_valid = false;
 				}
-			}//if
-			}//try
-			catch(InvalidPositionException &e)
-			{
-				/*std::cout<<"InvalidBlockException for bottom block node"
-						<<std::endl;*/
-				// Just no block below, no need to panic.
 			}
 		}
 	}
@@ -343,7 +528,15 @@ void MapBlock::copyTo(VoxelManipulator &dst)
 	VoxelArea data_area(v3s16(0,0,0), data_size - v3s16(1,1,1));
 	
 	// Copy from data to VoxelManipulator
-	dst.copyFrom(data, data_area, v3s16(0,0,0),
+	if(data != NULL)
+	{
+		dst.copyFrom(data, data_area, v3s16(0,0,0),
+				getPosRelative(), data_size);
+		return;
+	}
+	MapNode nodes[MAP_BLOCKSIZE*MAP_BLOCKSIZE*MAP_BLOCKSIZE];
+	getNodes(nodes);
+	dst.copyFrom(nodes, data_area, v3s16(0,0,0),
 			getPosRelative(), data_size);
 }
 
@@ -353,6 +546,7 @@ void MapBlock::copyFrom(VoxelManipulator &dst)
 	VoxelArea data_area(v3s16(0,0,0), data_size - v3s16(1,1,1));
 	
 	// Copy from VoxelManipulator to data
+	expandNodes();
 	dst.copyTo(data, data_area, v3s16(0,0,0),
 			getPosRelative(), data_size);
 }
@@ -363,20 +557,29 @@ void MapBlock::actuallyUpdateDayNightDiff()
 	// Running this function un-expires m_day_night_differs
 	m_day_night_differs_expired = false;
 
-	if(data == NULL)
+	if(isDummy())
 	{
 		m_day_night_differs = false;
 		return;
 	}
 
+	// A compact block has all of its different nodes in the palette
+	MapNode *nodes = data;
+	u32 nodecount = MAP_BLOCKSIZE*MAP_BLOCKSIZE*MAP_BLOCKSIZE;
+	if(data == NULL)
+	{
+		nodes = m_palette;
+		nodecount = m_palette_size;
+	}
+
 	bool differs = false;
 
 	/*
 		Check if any lighting value differs
 	*/
-	for(u32 i=0; i<MAP_BLOCKSIZE*MAP_BLOCKSIZE*MAP_BLOCKSIZE; i++)
+	for(u32 i=0; i<nodecount; i++)
 	{
-		MapNode &n = data[i];
+		MapNode &n = nodes[i];
 		if(n.getLight(LIGHTBANK_DAY, nodemgr) != n.getLight(LIGHTBANK_NIGHT, nodemgr))
 		{
 			differs = true;
@@ -391,9 +594,9 @@ void MapBlock::actuallyUpdateDayNightDiff()
 	if(differs)
 	{
 		bool only_air = true;
-		for(u32 i=0; i<MAP_BLOCKSIZE*MAP_BLOCKSIZE*MAP_BLOCKSIZE; i++)
+		for(u32 i=0; i<nodecount; i++)
 		{
-			MapNode &n = data[i];
+			MapNode &n = nodes[i];
 			if(n.getContent() != CONTENT_AIR)
 			{
 				only_air = false;
@@ -412,7 +615,7 @@ void MapBlock::expireDayNightDiff()
 {
 	//INodeDefManager *nodemgr = m_gamedef->ndef();
 
-	if(data == NULL){
+	if(isDummy()){
 		m_day_night_differs = false;
 		m_day_night_differs_expired = false;
 		return;
@@ -430,7 +633,7 @@ s16 MapBlock::getGroundLevel(v2s16 p2d)
 		s16 y = MAP_BLOCKSIZE-1;
 		for(; y>=0; y--)
 		{
-			MapNode n = getNodeRef(p2d.X, y, p2d.Y);
+			MapNode n = getNode(p2d.X, y, p2d.Y);
 			if(m_gamedef->ndef()->get(n).walkable)
 			{
 				if(y == MAP_BLOCKSIZE-1)
@@ -496,8 +699,12 @@ static void getBlockNodeIdMapping(NameIdMapping *nimap, MapNode *nodes,
 // Correct ids in the block to match nodedef based on names.
 // Unknown ones are added to nodedef.
 // Will not update itself to match id-name pairs in nodedef.
-static void correctBlockNodeIds(const NameIdMapping *nimap, MapNode *nodes,
-		IGameDef *gamedef)
+/*
+	Returns false if allocate_unknown_ids is false and a name has no id;
+	the nodes are then left partly corrected.
+*/
+static bool correctBlockNodeIds(const NameIdMapping *nimap, MapNode *nodes,
+		IGameDef *gamedef, bool allocate_unknown_ids=true)
 {
 	INodeDefManager *nodedef = gamedef->ndef();
 	// This means the block contains incorrect ids, and we contain
@@ -506,9 +713,19 @@ static void correctBlockNodeIds(const NameIdMapping *nimap, MapNode *nodes,
 	// correct ids.
 	std::set<content_t> unnamed_contents;
 	std::set<std::string> unallocatable_contents;
+	// Blocks have long runs of the same node; don't look up the names
+	// again for them
+	bool have_last = false;
+	content_t last_local_id = 0;
+	content_t last_global_id = 0;
 	for(u32 i=0; i<MAP_BLOCKSIZE*MAP_BLOCKSIZE*MAP_BLOCKSIZE; i++)
 	{
 		content_t local_id = nodes[i].getContent();
+		if(have_last && local_id == last_local_id)
+		{
+			nodes[i].setContent(last_global_id);
+			continue;
+		}
 		std::string name;
 		bool found = nimap->getName(local_id, name);
 		if(!found){
@@ -518,6 +735,8 @@ static void correctBlockNodeIds(const NameIdMapping *nimap, MapNode *nodes,
 		content_t global_id;
 		found = nodedef->getId(name, global_id);
 		if(!found){
+			if(!allocate_unknown_ids)
+				return false;
 			global_id = gamedef->allocateUnknownNodeId(name);
 			if(global_id == CONTENT_IGNORE){
 				unallocatable_contents.insert(name);
@@ -525,6 +744,9 @@ static void correctBlockNodeIds(const NameIdMapping *nimap, MapNode *nodes,
 			}
 		}
 		nodes[i].setContent(global_id);
+		have_last = true;
+		last_local_id = local_id;
+		last_global_id = global_id;
 	}
 	for(std::set<content_t>::const_iterator
 			i = unnamed_contents.begin();
@@ -540,14 +762,16 @@ static void correctBlockNodeIds(const NameIdMapping *nimap, MapNode *nodes,
 				<<"Could not allocate global id for node name \""
 				<<(*i)<<"\""<<std::endl;
 	}
+	return true;
 }
 
-void MapBlock::serialize(std::ostream &os, u8 version, bool disk)
+void MapBlock::serialize(std::ostream &os, u8 version, bool disk,
+		const CompressionParams &compression)
 {
 	if(!ser_ver_supported(version))
 		throw VersionMismatchException("ERROR: MapBlock format not supported");
 	
-	if(data == NULL)
+	if(isDummy())
 	{
 		throw SerializationError("ERROR: Not writing dummy block.");
 	}
@@ -558,7 +782,97 @@ void MapBlock::serialize(std::ostream &os, u8 version, bool disk)
 		return;
 	}
 
+	/*
+		The disk format is written through a snapshot so that the
+		format only lives in MapBlockSnapshot::serialize()
+	*/
+	if(disk)
+	{
+		MapBlockSnapshot snapshot;
+		takeSnapshot(snapshot, version);
+		snapshot.compression = compression;
+		snapshot.serialize(os, m_gamedef->ndef());
+		return;
+	}
+
 	// First byte
+	writeU8(os, getFlags());
+	
+	/*
+		Bulk node data
+	*/
+	u32 nodecount = MAP_BLOCKSIZE*MAP_BLOCKSIZE*MAP_BLOCKSIZE;
+	u8 content_width = 1;
+	/*u8 content_width = 2;*/
+	u8 params_width = 2;
+	writeU8(os, content_width);
+	writeU8(os, params_width);
+	CompressionParams params = compression;
+	if(version >= 24)
+	{
+		writeU8(os, params.codec);
+	}
+	else
+	{
+		params.codec = COMPRESSION_ZLIB;
+		params.dictionary = 0;
+	}
+	if(data != NULL)
+	{
+		MapNode::serializeBulk(os, version, data, nodecount,
+				content_width, params_width, true, params);
+	}
+	else
+	{
+		MapNode nodes[MAP_BLOCKSIZE*MAP_BLOCKSIZE*MAP_BLOCKSIZE];
+		getNodes(nodes);
+		MapNode::serializeBulk(os, version, nodes, nodecount,
+				content_width, params_width, true, params);
+	}
+	
+	/*
+		Node metadata
+	*/
+	std::ostringstream oss(std::ios_base::binary);
+	if(version >= 23)
+		m_node_metadata.serialize(oss);
+	else
+		content_nodemeta_serialize_legacy(oss, &m_node_metadata);
+	std::string metadata = oss.str();
+	compressWith(params, (const u8*)metadata.c_str(), metadata.size(), os);
+}
+
+void MapBlock::takeSnapshot(MapBlockSnapshot &snapshot, u8 version)
+{
+	assert(version >= 22);
+	
+	if(isDummy())
+		throw SerializationError("ERROR: Not snapshotting dummy block.");
+
+	snapshot.pos = getPos();
+	snapshot.version = version;
+	snapshot.flags = getFlags();
+	
+	if(snapshot.data == NULL)
+		snapshot.data = allocateNodeArray();
+	getNodes(snapshot.data);
+
+	std::ostringstream oss(std::ios_base::binary);
+	if(version >= 23)
+		m_node_metadata.serialize(oss);
+	else
+		content_nodemeta_serialize_legacy(oss, &m_node_metadata);
+	snapshot.node_metadata = oss.str();
+
+	std::ostringstream oss2(std::ios_base::binary);
+	m_static_objects.serialize(oss2);
+	snapshot.static_objects = oss2.str();
+
+	snapshot.timestamp = getTimestamp();
+}
+
+u8 MapBlock::getFlags()
+{
 	u8 flags = 0;
 	if(is_underground)
 		flags |= 0x01;
@@ -568,6 +882,170 @@ void MapBlock::serialize(std::ostream &os, u8 version, bool disk)
 		flags |= 0x04;
 	if(m_generated == false)
 		flags |= 0x08;
+	if(m_player_modified)
+		flags |= 0x10;
+	return flags;
+}
+
+/*
+	ModifiedBlockList
+*/
+
+ModifiedBlockList::ModifiedBlockList():
+	m_first(NULL),
+	m_count(0)
+{
+}
+
+ModifiedBlockList::~ModifiedBlockList()
+{
+	// Detach the blocks that are still in the list
+	while(m_first != NULL)
+		m_first->setModifiedList(NULL);
+}
+
+void ModifiedBlockList::add(MapBlock *block)
+{
+	if(block->m_in_modified_list)
+		return;
+	block->m_in_modified_list = true;
+	block->m_modified_prev = NULL;
+	block->m_modified_next = m_first;
+	if(m_first != NULL)
+		m_first->m_modified_prev = block;
+	m_first = block;
+	m_count++;
+}
+
+void ModifiedBlockList::remove(MapBlock *block)
+{
+	if(block->m_in_modified_list == false)
+		return;
+	if(block->m_modified_prev != NULL)
+		block->m_modified_prev->m_modified_next = block->m_modified_next;
+	else
+		m_first = block->m_modified_next;
+	if(block->m_modified_next != NULL)
+		block->m_modified_next->m_modified_prev = block->m_modified_prev;
+	block->m_in_modified_list = false;
+	block->m_modified_prev = NULL;
+	block->m_modified_next = NULL;
+	m_count--;
+}
+
+void ModifiedBlockList::getBlocks(core::list<MapBlock*> &dst)
+{
+	for(MapBlock *block = m_first; block != NULL;
+			block = block->m_modified_next)
+		dst.push_back(block);
+}
+
+/*
+	BlockUsageList
+*/
+
+BlockUsageList::BlockUsageList():
+	m_first(NULL),
+	m_last(NULL),
+	m_count(0),
+	m_time(0),
+	m_memory_usage(0)
+{
+}
+
+BlockUsageList::~BlockUsageList()
+{
+	while(m_first != NULL)
+		m_first->setUsageList(NULL);
+}
+
+void BlockUsageList::touch(MapBlock *block)
+{
+	block->m_usage_time = m_time;
+	if(block == m_first)
+		return;
+	unlink(block);
+	block->m_usage_prev = NULL;
+	block->m_usage_next = m_first;
+	if(m_first != NULL)
+		m_first->m_usage_prev = block;
+	else
+		m_last = block;
+	m_first = block;
+	m_count++;
+}
+
+void BlockUsageList::remove(MapBlock *block)
+{
+	if(block->m_usage_prev == NULL && block != m_first)
+		return;
+	unlink(block);
+	m_memory_usage -= block->m_usage_memory;
+	block->m_usage_memory = 0;
+}
+
+void BlockUsageList::updateMemoryUsage(MapBlock *block)
+{
+	u32 usage = block->getMemoryUsage();
+	m_memory_usage = m_memory_usage - block->m_usage_memory + usage;
+	block->m_usage_memory = usage;
+}
+
+void BlockUsageList::getBlocksUnusedFor(double min_time, double max_time,
+		core::list<MapBlock*> &dst)
+{
+	for(MapBlock *block = m_last; block != NULL; block = block->m_usage_prev)
+	{
+		double unused_time = m_time - block->m_usage_time;
+		if(unused_time <= min_time)
+			break;
+		if(unused_time <= max_time)
+			dst.push_back(block);
+	}
+}
+
+void BlockUsageList::unlink(MapBlock *block)
+{
+	if(block->m_usage_prev == NULL && block != m_first)
+		return;
+	if(block->m_usage_prev != NULL)
+		block->m_usage_prev->m_usage_next = block->m_usage_next;
+	else
+		m_first = block->m_usage_next;
+	if(block->m_usage_next != NULL)
+		block->m_usage_next->m_usage_prev = block->m_usage_prev;
+	else
+		m_last = block->m_usage_prev;
+	block->m_usage_prev = NULL;
+	block->m_usage_next = NULL;
+	m_count--;
+}
+
+/*
+	MapBlockSnapshot
+*/
+
+MapBlockSnapshot::MapBlockSnapshot():
+	pos(0,0,0),
+	version(SER_FMT_VER_HIGHEST),
+	flags(0),
+	data(NULL),
+	timestamp(BLOCK_TIMESTAMP_UNDEFINED),
+	compression(COMPRESSION_ZLIB)
+{
+}
+
+MapBlockSnapshot::~MapBlockSnapshot()
+{
+	freeNodeArray(data);
+}
+
+void MapBlockSnapshot::serialize(std::ostream &os,
+		INodeDefManager *nodedef) const
+{
+	assert(data != NULL);
+	assert(version >= 22);
+
 	writeU8(os, flags);
 	
 	/*
@@ -575,69 +1053,76 @@ void MapBlock::serialize(std::ostream &os, u8 version, bool disk)
 	*/
 	NameIdMapping nimap;
 	u32 nodecount = MAP_BLOCKSIZE*MAP_BLOCKSIZE*MAP_BLOCKSIZE;
-	if(disk)
+	MapNode *tmp_nodes = allocateNodeArray();
+	for(u32 i=0; i<nodecount; i++)
+		tmp_nodes[i] = data[i];
+	getBlockNodeIdMapping(&nimap, tmp_nodes, nodedef);
+
+	u8 content_width = 1;
+	/*u8 content_width = (nimap.size() <= 255) ? 1 : 2;*/
+	u8 params_width = 2;
+	writeU8(os, content_width);
+	writeU8(os, params_width);
+	CompressionParams params = compression;
+	if(version >= 24)
 	{
-		MapNode *tmp_nodes = new MapNode[nodecount];
-		for(u32 i=0; i<nodecount; i++)
-			tmp_nodes[i] = data[i];
-		getBlockNodeIdMapping(&nimap, tmp_nodes, m_gamedef->ndef());
-
-		u8 content_width = 1;
-		/*u8 content_width = (nimap.size() <= 255) ? 1 : 2;*/
-		u8 params_width = 2;
-		writeU8(os, content_width);
-		writeU8(os, params_width);
-		MapNode::serializeBulk(os, version, tmp_nodes, nodecount,
-				content_width, params_width, true);
-		delete[] tmp_nodes;
+		writeU8(os, params.codec);
 	}
 	else
 	{
-		u8 content_width = 1;
-		/*u8 content_width = 2;*/
-		u8 params_width = 2;
-		writeU8(os, content_width);
-		writeU8(os, params_width);
-		MapNode::serializeBulk(os, version, data, nodecount,
-				content_width, params_width, true);
+		params.codec = COMPRESSION_ZLIB;
+		params.dictionary = 0;
 	}
+	MapNode::serializeBulk(os, version, tmp_nodes, nodecount,
+			content_width, params_width, true, params);
+	freeNodeArray(tmp_nodes);
 	
 	/*
 		Node metadata
 	*/
-	std::ostringstream oss(std::ios_base::binary);
-	if(version >= 23)
-		m_node_metadata.serialize(oss);
-	else
-		content_nodemeta_serialize_legacy(oss, &m_node_metadata);
-	compressZlib(oss.str(), os);
+	compressWith(params, (const u8*)node_metadata.c_str(),
+			node_metadata.size(), os);
 
 	/*
 		Data that goes to disk, but not the network
 	*/
-	if(disk)
-	{
-		// Version 23 doesn't actually contain node timers
-		// (this field should have not been added)
-		if(version == 23)
-			writeU8(os, 0);
-		// Node timers (uncomment when node timers are taken into use)
-		/*if(version >= 24)
-			m_node_timers.serialize(os);*/
-
-		// Static objects
-		m_static_objects.serialize(os);
-
-		// Timestamp
-		writeU32(os, getTimestamp());
-
-		// Write block-specific node definition id mapping
-		nimap.serialize(os);
-	}
+	// Version 23 doesn't actually contain node timers
+	// (this field should have not been added)
+	if(version == 23)
+		writeU8(os, 0);
+	// Node timers (uncomment when node timers are taken into use)
+	/*if(version >= 26)
+		m_node_timers.serialize(os);*/
+
+	// Static objects
+	os<<static_objects;
+
+	// Timestamp
+	writeU32(os, timestamp);
+
+	// Write block-specific node definition id mapping
+	nimap.serialize(os);
 }
 
+bool MapBlock::deSerialize(std::istream &is, u8 version, bool disk,
+		bool allocate_unknown_ids)
+{
+	/*
+		Read the rest of the stream to memory, and put back what is left
+		after the block
+	*/
+	std::streampos start = is.tellg();
+	std::string buf((std::istreambuf_iterator<char>(is)),
+			std::istreambuf_iterator<char>());
+	BufReader reader((const u8*)buf.c_str(), buf.size());
+	bool result = deSerialize(reader, version, disk, allocate_unknown_ids);
+	is.clear();
+	is.seekg(start + (std::streamoff)(buf.size() - reader.getRemaining()));
+	return result;
+}
 
-void MapBlock::deSerialize(std::istream &is, u8 version, bool disk)
+bool MapBlock::deSerialize(BufReader &reader, u8 version, bool disk,
+		bool allocate_unknown_ids)
 {
 	if(!ser_ver_supported(version))
 		throw VersionMismatchException("ERROR: MapBlock format not supported");
@@ -646,49 +1131,72 @@ void MapBlock::deSerialize(std::istream &is, u8 version, bool disk)
 
 	m_day_night_differs_expired = false;
 
+	// The nodes are read to the full array and compacted afterwards
+	if(isCompact())
+		expandNodes();
+
+	// The old formats are read with streams, in place
 	if(version <= 21)
 	{
+		if(!allocate_unknown_ids)
+			return false;
+		MemoryStreamBuf buf(reader.getData(), reader.getRemaining());
+		std::istream is(&buf);
 		deSerialize_pre22(is, version, disk);
-		return;
+		reader.skip(buf.getPosition());
+		m_player_modified = true;
+		compactNodes();
+		if(m_usage_list != NULL)
+			m_usage_list->updateMemoryUsage(this);
+		return true;
 	}
 
-	u8 flags = readU8(is);
+	u8 flags = reader.getU8();
 	is_underground = (flags & 0x01) ? true : false;
 	m_day_night_differs = (flags & 0x02) ? true : false;
 	m_lighting_expired = (flags & 0x04) ? true : false;
 	m_generated = (flags & 0x08) ? false : true;
+	// Older blocks may have been modified
+	m_player_modified = (flags & 0x10) || version < 25;
 
 	/*
 		Bulk node data
 	*/
-	TRACESTREAM(<<"MapBlock::deSerialize "<<PP(getPos())
-			<<": Bulk node data"<<std::endl);
 	u32 nodecount = MAP_BLOCKSIZE*MAP_BLOCKSIZE*MAP_BLOCKSIZE;
-	u8 content_width = readU8(is);
-	u8 params_width = readU8(is);
+	u8 content_width = reader.getU8();
+	u8 params_width = reader.getU8();
 	if(content_width != 1)
 		throw SerializationError("MapBlock::deSerialize(): invalid content_width");
 	if(params_width != 2)
 		throw SerializationError("MapBlock::deSerialize(): invalid params_width");
-	MapNode::deSerializeBulk(is, version, data, nodecount,
-			content_width, params_width, true);
+	u8 codec = COMPRESSION_ZLIB;
+	if(version >= 24)
+		codec = reader.getU8();
+	MapNode::deSerializeBulk(reader, version, data, nodecount,
+			content_width, params_width, true, codec);
 
 	/*
 		NodeMetadata
 	*/
-	TRACESTREAM(<<"MapBlock::deSerialize "<<PP(getPos())
-			<<": Node metadata"<<std::endl);
 	// Ignore errors
 	try{
-		std::ostringstream oss(std::ios_base::binary);
-		decompressZlib(is, oss);
-		std::istringstream iss(oss.str(), std::ios_base::binary);
+		std::string metadata;
+		reader.skip(decompressWith(codec, reader.getData(),
+				reader.getRemaining(), &metadata));
 		if(version >= 23)
-			m_node_metadata.deSerialize(iss, m_gamedef);
+		{
+			BufReader metadata_reader((const u8*)metadata.c_str(),
+					metadata.size());
+			m_node_metadata.deSerialize(metadata_reader, m_gamedef);
+		}
 		else
-			content_nodemeta_deserialize_legacy(iss,
+		{
+			MemoryStreamBuf buf((const u8*)metadata.c_str(), metadata.size());
+			std::istream is(&buf);
+			content_nodemeta_deserialize_legacy(is,
 					&m_node_metadata, &m_node_timers,
 					m_gamedef);
+		}
 	}
 	catch(SerializationError &e)
 	{
@@ -705,35 +1213,34 @@ void MapBlock::deSerialize(std::istream &is, u8 version, bool disk)
 		// Node timers
 		if(version == 23)
 			// Read unused zero
-			readU8(is);
+			reader.getU8();
 		// Uncomment when node timers are taken into use
-		/*else if(version >= 24){
-			TRACESTREAM(<<"MapBlock::deSerialize "<<PP(getPos())
-					<<": Node timers"<<std::endl);
-			m_node_timers.deSerialize(is);
-		}*/
+		/*else if(version >= 26)
+			m_node_timers.deSerialize(reader);*/
 
 		// Static objects
-		TRACESTREAM(<<"MapBlock::deSerialize "<<PP(getPos())
-				<<": Static objects"<<std::endl);
-		m_static_objects.deSerialize(is);
+		m_static_objects.deSerialize(reader);
 		
 		// Timestamp
-		TRACESTREAM(<<"MapBlock::deSerialize "<<PP(getPos())
-				<<": Timestamp"<<std::endl);
-		setTimestamp(readU32(is));
+		setTimestamp(reader.getU32());
 		m_disk_timestamp = m_timestamp;
 		
 		// Dynamically re-set ids based on node names
-		TRACESTREAM(<<"MapBlock::deSerialize "<<PP(getPos())
-				<<": NameIdMapping"<<std::endl);
 		NameIdMapping nimap;
-		nimap.deSerialize(is);
-		correctBlockNodeIds(&nimap, data, m_gamedef);
+		nimap.deSerialize(reader);
+		if(!correctBlockNodeIds(&nimap, data, m_gamedef,
+				allocate_unknown_ids))
+			return false;
 	}
 		
+	compactNodes();
+	// The metadata and the objects have changed too
+	if(m_usage_list != NULL)
+		m_usage_list->updateMemoryUsage(this);
+
 	TRACESTREAM(<<"MapBlock::deSerialize "<<PP(getPos())
 			<<": Done."<<std::endl);
+	return true;
 }
 
 /*
@@ -767,6 +1274,9 @@ void MapBlock::serialize_pre22(std::ostream &os, u8 version, bool disk)
 {
 	u32 nodecount = MAP_BLOCKSIZE*MAP_BLOCKSIZE*MAP_BLOCKSIZE;
 
+	// The legacy code works on the full array
+	expandNodes();
+
 	MapNode *tmp_data = new MapNode[nodecount];
 	
 	// Legacy data changes
@@ -1281,3 +1791,24 @@ std::string analyze_block(MapBlock *block)
 
 
 //END
+
+bool getBlockUncompressedData(const std::string &blob, std::string *nodes,
+		std::string *metadata)
+{
+	BufReader reader((const u8*)blob.c_str(), blob.size());
+	u8 version = reader.getU8();
+	if(!ser_ver_supported(version))
+		throw VersionMismatchException("ERROR: MapBlock format not supported");
+	if(version < 22)
+		return false;
+	// Flags, content_width, params_width
+	reader.skip(3);
+	u8 codec = COMPRESSION_ZLIB;
+	if(version >= 24)
+		codec = reader.getU8();
+	reader.skip(decompressWith(codec, reader.getData(),
+			reader.getRemaining(), nodes));
+	reader.skip(decompressWith(codec, reader.getData(),
+			reader.getRemaining(), metadata));
+	return true;
+}
@@ -39,9 +39,11 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "util/numeric.h" // getContainerPos
 
 class Map;
+class MapBlock;
 class NodeMetadataList;
 class IGameDef;
 class MapBlockMesh;
+class INodeDefManager;
 
 #define BLOCK_TIMESTAMP_UNDEFINED 0xffffffff
 
@@ -102,6 +104,151 @@ class NodeContainer
 };
 #endif
 
+/*
+	A copy of everything that goes to disk from a MapBlock.
+
+	Taken in the environment thread by MapBlock::takeSnapshot(), after
+	which it can be serialized in any thread without touching the block.
+	Only serialization versions >= 22 are supported.
+
+	The nodes are copied, not shared copy-on-write with the block: the
+	node array is written through its pointer in too many places (voxel
+	manipulators, lighting) to catch every write. The copy is one 16kB
+	array copy per saved block (a fill from the palette for compact blocks),
+	which is small next to the serialization and compression that the
+	save thread does.
+*/
+
+class MapBlockSnapshot
+{
+public:
+	MapBlockSnapshot();
+	~MapBlockSnapshot();
+
+	// Writes the same data as MapBlock::serialize() with disk=true
+	// (no version byte). nodedef is only read from.
+	void serialize(std::ostream &os, INodeDefManager *nodedef) const;
+
+	v3s16 pos;
+	u8 version;
+	u8 flags;
+	// MAP_BLOCKSIZE^3 nodes with global content ids
+	MapNode *data;
+	// Uncompressed node metadata in the format of version
+	std::string node_metadata;
+	// Serialized StaticObjectList
+	std::string static_objects;
+	u32 timestamp;
+	// Codec of the written data; zlib below version 24
+	CompressionParams compression;
+
+private:
+	MapBlockSnapshot(const MapBlockSnapshot &);
+	MapBlockSnapshot& operator=(const MapBlockSnapshot &);
+};
+
+// Maximum number of different nodes in a compactly stored block
+#define MAPBLOCK_PALETTE_SIZE 16
+
+/*
+	The modified blocks of a Map, so that saving doesn't have to go
+	through all the loaded blocks.
+
+	The links are in the blocks themselves. A block is in the list when
+	it is attached to the list with MapBlock::setModifiedList() and its
+	modified state is not MOD_STATE_CLEAN; raiseModified(),
+	resetModified() and the destructor of the block keep it up to date.
+
+	Not thread-safe; it belongs to the thread that owns the map.
+*/
+
+class ModifiedBlockList
+{
+public:
+	ModifiedBlockList();
+	~ModifiedBlockList();
+
+	void add(MapBlock *block);
+	void remove(MapBlock *block);
+	// Copies the blocks to dst, so that they can be saved while going
+	// through them
+	void getBlocks(core::list<MapBlock*> &dst);
+	u32 size()
+	{
+		return m_count;
+	}
+
+private:
+	MapBlock *m_first;
+	u32 m_count;
+};
+
+/*
+	The loaded blocks of a Map in the order of their last use, so that
+	the ones that have not been used for the longest time can be
+	unloaded first without going through all of them.
+
+	Same as ModifiedBlockList, the links are in the blocks. A block is
+	moved to the front when its usage timer is reset. The usage timers
+	are counted from the clock of the list, which is advanced by
+	step().
+
+	The list also keeps the total of MapBlock::getMemoryUsage() of its
+	blocks. The usage of a block is counted again when it is attached,
+	and when its nodes are compacted, expanded or deserialized.
+
+	Not thread-safe; it belongs to the thread that owns the map.
+*/
+
+class BlockUsageList
+{
+public:
+	BlockUsageList();
+	~BlockUsageList();
+
+	// Moves the block to the front, or adds it there
+	void touch(MapBlock *block);
+	void remove(MapBlock *block);
+	// Counts the memory usage of a block in the list again
+	void updateMemoryUsage(MapBlock *block);
+	// Adds the blocks that have been unused for more than min_time and
+	// at most max_time to dst, least recently used first
+	void getBlocksUnusedFor(double min_time, double max_time,
+			core::list<MapBlock*> &dst);
+	// Bytes
+	u64 getMemoryUsage()
+	{
+		return m_memory_usage;
+	}
+	// The block that has been used least recently; NULL if empty
+	MapBlock * getLeastRecentlyUsed()
+	{
+		return m_last;
+	}
+	u32 size()
+	{
+		return m_count;
+	}
+
+	void step(float dtime)
+	{
+		m_time += dtime;
+	}
+	double getTime()
+	{
+		return m_time;
+	}
+
+private:
+	void unlink(MapBlock *block);
+
+	MapBlock *m_first;
+	MapBlock *m_last;
+	u32 m_count;
+	double m_time;
+	u64 m_memory_usage;
+};
+
 /*
 	MapBlock itself
 */
@@ -122,16 +269,12 @@ class MapBlock /*: public NodeContainer*/
 		return m_parent;
 	}
 
+	// Fills the block with CONTENT_IGNORE
 	void reallocate()
 	{
-		if(data != NULL)
-			delete[] data;
-		u32 l = MAP_BLOCKSIZE * MAP_BLOCKSIZE * MAP_BLOCKSIZE;
-		data = new MapNode[l];
-		for(u32 i=0; i<l; i++){
-			//data[i] = MapNode();
-			data[i] = MapNode(CONTENT_IGNORE);
-		}
+		freeNodes();
+		m_palette[0] = MapNode(CONTENT_IGNORE);
+		m_palette_size = 1;
 		raiseModified(MOD_STATE_WRITE_NEEDED, "reallocate");
 	}
 
@@ -141,7 +284,7 @@ class MapBlock /*: public NodeContainer*/
 
 	bool isDummy()
 	{
-		return (data == NULL);
+		return (data == NULL && m_palette_size == 0);
 	}
 	void unDummify()
 	{
@@ -160,6 +303,8 @@ class MapBlock /*: public NodeContainer*/
 			if(m_modified >= MOD_STATE_WRITE_AT_UNLOAD){
 				m_disk_timestamp = m_timestamp;
 			}
+			if(m_modified_list != NULL)
+				m_modified_list->add(this);
 		} else if(mod == m_modified){
 			if(!m_modified_reason_too_long){
 				if(m_modified_reason.size() < 40)
@@ -184,7 +329,15 @@ class MapBlock /*: public NodeContainer*/
 		m_modified = MOD_STATE_CLEAN;
 		m_modified_reason = "none";
 		m_modified_reason_too_long = false;
+		if(m_modified_list != NULL)
+			m_modified_list->remove(this);
 	}
+	/*
+		Sets the list that is kept up to date with the modified state
+		of this block. Done by the sector when the block is added to the
+		map; blocks that are not in a map are in no list.
+	*/
+	void setModifiedList(ModifiedBlockList *list);
 	
 	// is_underground getter/setter
 	bool getIsUnderground()
@@ -221,11 +374,29 @@ class MapBlock /*: public NodeContainer*/
 		}
 	}
 
+	/*
+		Set when the nodes or node metadata of the block are edited after
+		generation, by players, mods or ABMs. Map generation, lighting and
+		liquid flow don't set it. Blocks without it can be generated again
+		as they are, so they can be pruned from the map database.
+	*/
+	bool isPlayerModified()
+	{
+		return m_player_modified;
+	}
+	void setPlayerModified()
+	{
+		if(m_player_modified == false){
+			m_player_modified = true;
+			raiseModified(MOD_STATE_WRITE_NEEDED, "setPlayerModified");
+		}
+	}
+
 	bool isValid()
 	{
 		if(m_lighting_expired)
 			return false;
-		if(data == NULL)
+		if(isDummy())
 			return false;
 		return true;
 	}
@@ -258,7 +429,7 @@ class MapBlock /*: public NodeContainer*/
 	
 	bool isValidPosition(v3s16 p)
 	{
-		if(data == NULL)
+		if(isDummy())
 			return false;
 		return (p.X >= 0 && p.X < MAP_BLOCKSIZE
 				&& p.Y >= 0 && p.Y < MAP_BLOCKSIZE
@@ -267,12 +438,12 @@ class MapBlock /*: public NodeContainer*/
 
 	MapNode getNode(s16 x, s16 y, s16 z)
 	{
-		if(data == NULL)
+		if(isDummy())
 			throw InvalidPositionException();
 		if(x < 0 || x >= MAP_BLOCKSIZE) throw InvalidPositionException();
 		if(y < 0 || y >= MAP_BLOCKSIZE) throw InvalidPositionException();
 		if(z < 0 || z >= MAP_BLOCKSIZE) throw InvalidPositionException();
-		return data[z*MAP_BLOCKSIZE*MAP_BLOCKSIZE + y*MAP_BLOCKSIZE + x];
+		return readNode(z*MAP_BLOCKSIZE*MAP_BLOCKSIZE + y*MAP_BLOCKSIZE + x);
 	}
 	
 	MapNode getNode(v3s16 p)
@@ -280,23 +451,28 @@ class MapBlock /*: public NodeContainer*/
 		return getNode(p.X, p.Y, p.Z);
 	}
 	
-	MapNode getNodeNoEx(v3s16 p)
+	/*
+		Returns a CONTENT_IGNORE node if the position is not valid.
+		If is_valid_position is not NULL, it is set to whether it was.
+	*/
+	MapNode getNodeNoEx(v3s16 p, bool *is_valid_position = NULL)
 	{
-		try{
-			return getNode(p.X, p.Y, p.Z);
-		}catch(InvalidPositionException &e){
+		bool valid = isValidPosition(p);
+		if(is_valid_position)
+			*is_valid_position = valid;
+		if(!valid)
 			return MapNode(CONTENT_IGNORE);
-		}
+		return readNode(p.Z*MAP_BLOCKSIZE*MAP_BLOCKSIZE + p.Y*MAP_BLOCKSIZE + p.X);
 	}
 	
 	void setNode(s16 x, s16 y, s16 z, MapNode & n)
 	{
-		if(data == NULL)
+		if(isDummy())
 			throw InvalidPositionException();
 		if(x < 0 || x >= MAP_BLOCKSIZE) throw InvalidPositionException();
 		if(y < 0 || y >= MAP_BLOCKSIZE) throw InvalidPositionException();
 		if(z < 0 || z >= MAP_BLOCKSIZE) throw InvalidPositionException();
-		data[z*MAP_BLOCKSIZE*MAP_BLOCKSIZE + y*MAP_BLOCKSIZE + x] = n;
+		writeNode(z*MAP_BLOCKSIZE*MAP_BLOCKSIZE + y*MAP_BLOCKSIZE + x, n);
 		raiseModified(MOD_STATE_WRITE_NEEDED, "setNode");
 	}
 	
@@ -311,21 +487,36 @@ class MapBlock /*: public NodeContainer*/
 
 	MapNode getNodeNoCheck(s16 x, s16 y, s16 z)
 	{
-		if(data == NULL)
+		if(isDummy())
 			throw InvalidPositionException();
-		return data[z*MAP_BLOCKSIZE*MAP_BLOCKSIZE + y*MAP_BLOCKSIZE + x];
+		return readNode(z*MAP_BLOCKSIZE*MAP_BLOCKSIZE + y*MAP_BLOCKSIZE + x);
 	}
 	
 	MapNode getNodeNoCheck(v3s16 p)
 	{
 		return getNodeNoCheck(p.X, p.Y, p.Z);
 	}
+
+	// Doesn't throw; a dummy block gives CONTENT_IGNORE and sets
+	// is_valid_position to false
+	MapNode getNodeNoCheck(s16 x, s16 y, s16 z, bool *is_valid_position)
+	{
+		*is_valid_position = !isDummy();
+		if(!*is_valid_position)
+			return MapNode(CONTENT_IGNORE);
+		return readNode(z*MAP_BLOCKSIZE*MAP_BLOCKSIZE + y*MAP_BLOCKSIZE + x);
+	}
+
+	MapNode getNodeNoCheck(v3s16 p, bool *is_valid_position)
+	{
+		return getNodeNoCheck(p.X, p.Y, p.Z, is_valid_position);
+	}
 	
 	void setNodeNoCheck(s16 x, s16 y, s16 z, MapNode & n)
 	{
-		if(data == NULL)
+		if(isDummy())
 			throw InvalidPositionException();
-		data[z*MAP_BLOCKSIZE*MAP_BLOCKSIZE + y*MAP_BLOCKSIZE + x] = n;
+		writeNode(z*MAP_BLOCKSIZE*MAP_BLOCKSIZE + y*MAP_BLOCKSIZE + x, n);
 		raiseModified(MOD_STATE_WRITE_NEEDED, "setNodeNoCheck");
 	}
 	
@@ -341,7 +532,35 @@ class MapBlock /*: public NodeContainer*/
 	bool isValidPositionParent(v3s16 p);
 	MapNode getNodeParent(v3s16 p);
 	void setNodeParent(v3s16 p, MapNode & n);
-	MapNode getNodeParentNoEx(v3s16 p);
+	// Returns a CONTENT_IGNORE node if not found
+	MapNode getNodeParentNoEx(v3s16 p, bool *is_valid_position = NULL);
+
+	/*
+		Storage of the nodes
+
+		A block of only one kind of node is stored as that node, and a
+		block of at most MAPBLOCK_PALETTE_SIZE kinds of nodes as a palette
+		and 4-bit indices to it. The full array is made when a node is
+		changed.
+	*/
+
+	// Stores the nodes compactly if they allow it. Returns true if the
+	// block is compact after the call.
+	bool compactNodes();
+	// Makes the full array; throws InvalidPositionException on dummy blocks
+	void expandNodes();
+	bool isCompact()
+	{
+		return (data == NULL && m_palette_size != 0);
+	}
+	// Copies all nodes to dst, which has room for MAP_BLOCKSIZE^3 nodes,
+	// in the order of the full array. The block can not be a dummy.
+	void getNodes(MapNode *dst);
+	// Bytes of memory used by the nodes
+	u32 getNodesMemoryUsage();
+	// Rough bytes of memory used by the block with its nodes, metadata
+	// and static objects
+	u32 getMemoryUsage();
 
 	void drawbox(s16 x0, s16 y0, s16 z0, s16 w, s16 h, s16 d, MapNode node)
 	{
@@ -416,20 +635,25 @@ class MapBlock /*: public NodeContainer*/
 	}
 	
 	/*
-		See m_usage_timer
+		See m_usage_time
 	*/
 	void resetUsageTimer()
 	{
-		m_usage_timer = 0;
-	}
-	void incrementUsageTimer(float dtime)
-	{
-		m_usage_timer += dtime;
+		if(m_usage_list != NULL)
+			m_usage_list->touch(this);
 	}
 	u32 getUsageTimer()
 	{
-		return m_usage_timer;
+		if(m_usage_list == NULL)
+			return 0;
+		return m_usage_list->getTime() - m_usage_time;
 	}
+	/*
+		Sets the list that orders the loaded blocks of the map by their
+		last use, and resets the usage timer. Done by the sector when the
+		block is added to the map.
+	*/
+	void setUsageList(BlockUsageList *list);
 
 	/*
 		Serialization
@@ -437,10 +661,25 @@ class MapBlock /*: public NodeContainer*/
 	
 	// These don't write or read version by itself
 	// Set disk to true for on-disk format, false for over-the-network format
-	void serialize(std::ostream &os, u8 version, bool disk);
+	// The data is compressed with compression from version 24 on, and
+	// with zlib without a dictionary before that
+	void serialize(std::ostream &os, u8 version, bool disk,
+			const CompressionParams &compression = CompressionParams());
 	// If disk == true: In addition to doing other things, will add
 	// unknown blocks from id-name mapping to wndef
-	void deSerialize(std::istream &is, u8 version, bool disk);
+	// With allocate_unknown_ids == false the node definitions are not
+	// touched, which makes it safe to call from another thread than the
+	// one that owns them; false is returned if that would have been
+	// needed (also for formats < 22), and the block is not usable then.
+	bool deSerialize(BufReader &reader, u8 version, bool disk,
+			bool allocate_unknown_ids=true);
+	// Same as above; reads the rest of the stream to memory for that
+	bool deSerialize(std::istream &is, u8 version, bool disk,
+			bool allocate_unknown_ids=true);
+
+	// Copies the on-disk state of the block to snapshot.
+	// version has to be >= 22 and the block can not be a dummy.
+	void takeSnapshot(MapBlockSnapshot &snapshot, u8 version);
 
 private:
 	/*
@@ -450,17 +689,20 @@ class MapBlock /*: public NodeContainer*/
 	void serialize_pre22(std::ostream &os, u8 version, bool disk);
 	void deSerialize_pre22(std::istream &is, u8 version, bool disk);
 
+	// The flags byte of serialization versions >= 22
+	u8 getFlags();
+
 	/*
 		Used only internally, because changes can't be tracked
 	*/
 
 	MapNode & getNodeRef(s16 x, s16 y, s16 z)
 	{
-		if(data == NULL)
-			throw InvalidPositionException();
 		if(x < 0 || x >= MAP_BLOCKSIZE) throw InvalidPositionException();
 		if(y < 0 || y >= MAP_BLOCKSIZE) throw InvalidPositionException();
 		if(z < 0 || z >= MAP_BLOCKSIZE) throw InvalidPositionException();
+		// The node can be changed through the reference
+		expandNodes();
 		return data[z*MAP_BLOCKSIZE*MAP_BLOCKSIZE + y*MAP_BLOCKSIZE + x];
 	}
 	MapNode & getNodeRef(v3s16 &p)
@@ -468,6 +710,36 @@ class MapBlock /*: public NodeContainer*/
 		return getNodeRef(p.X, p.Y, p.Z);
 	}
 
+	/*
+		Node access by index in any form of storage.
+		The block can not be a dummy.
+	*/
+
+	MapNode readNode(u32 i)
+	{
+		if(data != NULL)
+			return data[i];
+		if(m_indices == NULL)
+			return m_palette[0];
+		return m_palette[(m_indices[i >> 1] >> ((i & 1) << 2)) & 0x0f];
+	}
+	void writeNode(u32 i, MapNode &n)
+	{
+		if(data == NULL)
+		{
+			// Writing the node that is there already doesn't need the
+			// full array
+			MapNode old = readNode(i);
+			if(old == n)
+				return;
+			expandNodes();
+		}
+		data[i] = n;
+	}
+
+	// Frees the nodes in any form; makes the block a dummy
+	void freeNodes();
+
 public:
 	/*
 		Public member variables
@@ -495,10 +767,16 @@ class MapBlock /*: public NodeContainer*/
 	IGameDef *m_gamedef;
 	
 	/*
-		If NULL, block is a dummy block.
+		The full array of nodes; NULL if the nodes are stored compactly.
+		If there is no palette either, block is a dummy block.
 		Dummy blocks are used for caching not-found-on-disk blocks.
 	*/
 	MapNode * data;
+	// Compact storage: the different nodes of the block, and if there is
+	// more than one, MAP_BLOCKSIZE^3 4-bit indices to them
+	MapNode m_palette[MAPBLOCK_PALETTE_SIZE];
+	u8 m_palette_size;
+	u8 *m_indices;
 
 	/*
 		- On the server, this is used for telling whether the
@@ -509,6 +787,13 @@ class MapBlock /*: public NodeContainer*/
 	std::string m_modified_reason;
 	bool m_modified_reason_too_long;
 
+	// The list of modified blocks of the map and the links in it
+	ModifiedBlockList *m_modified_list;
+	bool m_in_modified_list;
+	MapBlock *m_modified_prev;
+	MapBlock *m_modified_next;
+	friend class ModifiedBlockList;
+
 	/*
 		When propagating sunlight and the above block doesn't exist,
 		sunlight is assumed if this is false.
@@ -533,6 +818,8 @@ class MapBlock /*: public NodeContainer*/
 	bool m_day_night_differs_expired;
 
 	bool m_generated;
+	// See isPlayerModified()
+	bool m_player_modified;
 	
 	/*
 		When block is removed from active blocks, this is set to gametime.
@@ -543,10 +830,18 @@ class MapBlock /*: public NodeContainer*/
 	u32 m_disk_timestamp;
 
 	/*
-		When the block is accessed, this is set to 0.
-		Map will unload the block when this reaches a timeout.
+		When the block is accessed, this is set to the time of the
+		BlockUsageList and the block is moved to the front of it.
+		Map will unload the block when it has not been accessed for a
+		timeout, or earlier if there are too many blocks loaded.
 	*/
-	float m_usage_timer;
+	double m_usage_time;
+	BlockUsageList *m_usage_list;
+	MapBlock *m_usage_prev;
+	MapBlock *m_usage_next;
+	// The memory usage counted in the total of m_usage_list
+	u32 m_usage_memory;
+	friend class BlockUsageList;
 };
 
 inline bool blockpos_over_limit(v3s16 p)
@@ -583,5 +878,15 @@ inline s16 getNodeBlockY(s16 y)
 */
 std::string analyze_block(MapBlock *block);
 
+/*
+	Gets the compressed parts of a block saved by ServerMap (starting
+	with the version byte) uncompressed: the bulk node data and the node
+	metadata. For training and testing compression.
+	Returns false for versions without them (< 22). Throws
+	SerializationError if the data is broken.
+*/
+bool getBlockUncompressedData(const std::string &blob, std::string *nodes,
+		std::string *metadata);
+
 #endif
 
@@ -0,0 +1,126 @@
+/*
+Minetest-c55
+Copyright (C) 2010 celeron55, Perttu Ahola <celeron55@gmail.com>
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation; either version 2.1 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include "mapblockindex.h"
+#include "debug.h"
+
+// Initial number of slots; a power of two
+#define MAPBLOCKINDEX_INITIAL_SIZE 1024
+
+THREAD_LOCAL MapBlockIndex::Recent MapBlockIndex::s_recent = {NULL, 0, 0, NULL};
+
+MapBlockIndex::MapBlockIndex():
+	m_slots(NULL),
+	m_mask(0),
+	m_count(0),
+	m_generation(0)
+{
+	rehash(MAPBLOCKINDEX_INITIAL_SIZE);
+}
+
+MapBlockIndex::~MapBlockIndex()
+{
+	// Another index may be made at the same address. The threads that
+	// used this one have been stopped before the map is deleted, except
+	// the one deleting it.
+	if(s_recent.index == this)
+		s_recent.index = NULL;
+	delete[] m_slots;
+}
+
+void MapBlockIndex::insert(v3s16 p, MapBlock *block)
+{
+	assert(block != NULL);
+
+	// Keep at most half of the slots in use
+	if((m_count + 1) * 2 > m_mask + 1)
+		rehash((m_mask + 1) * 2);
+
+	u64 key = packKey(p);
+	u32 i = hashKey(key) & m_mask;
+	while(m_slots[i].block != NULL && m_slots[i].key != key)
+		i = (i + 1) & m_mask;
+	if(m_slots[i].block == NULL)
+		m_count++;
+	else
+		m_generation++;
+	m_slots[i].key = key;
+	m_slots[i].block = block;
+}
+
+void MapBlockIndex::remove(v3s16 p)
+{
+	u64 key = packKey(p);
+	u32 i = hashKey(key) & m_mask;
+	for(;; i = (i + 1) & m_mask)
+	{
+		if(m_slots[i].block == NULL)
+			return;
+		if(m_slots[i].key == key)
+			break;
+	}
+	m_slots[i].block = NULL;
+	m_count--;
+	m_generation++;
+
+	/*
+		Move the following entries of the same run back to where they
+		can be found without the removed one
+	*/
+	u32 hole = i;
+	for(u32 j = (i + 1) & m_mask; m_slots[j].block != NULL;
+			j = (j + 1) & m_mask)
+	{
+		u32 home = hashKey(m_slots[j].key) & m_mask;
+		// Move it if its home is not in the cyclic range (hole, j]
+		bool in_range = (hole < j) ? (home > hole && home <= j)
+				: (home > hole || home <= j);
+		if(in_range)
+			continue;
+		m_slots[hole] = m_slots[j];
+		m_slots[j].block = NULL;
+		hole = j;
+	}
+}
+
+void MapBlockIndex::rehash(u32 new_size)
+{
+	Slot *old_slots = m_slots;
+	u32 old_size = old_slots ? m_mask + 1 : 0;
+
+	m_slots = new Slot[new_size];
+	for(u32 i=0; i<new_size; i++)
+	{
+		m_slots[i].key = 0;
+		m_slots[i].block = NULL;
+	}
+	m_mask = new_size - 1;
+
+	for(u32 i=0; i<old_size; i++)
+	{
+		if(old_slots[i].block == NULL)
+			continue;
+		u32 j = hashKey(old_slots[i].key) & m_mask;
+		while(m_slots[j].block != NULL)
+			j = (j + 1) & m_mask;
+		m_slots[j] = old_slots[i];
+	}
+	delete[] old_slots;
+}
+
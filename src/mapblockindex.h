@@ -0,0 +1,127 @@
+/*
+Minetest-c55
+Copyright (C) 2010 celeron55, Perttu Ahola <celeron55@gmail.com>
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation; either version 2.1 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#ifndef MAPBLOCKINDEX_HEADER
+#define MAPBLOCKINDEX_HEADER
+
+#include "irrlichttypes_bloated.h"
+#include "porting.h" // THREAD_LOCAL
+
+class MapBlock;
+
+/*
+	Hash table of the loaded blocks of a Map by their positions, so that
+	finding a block doesn't need going through the trees of sectors and
+	blocks.
+
+	Open addressing with linear probing. Positions are packed into an u64
+	key. Each thread remembers the block it found last, because node
+	accesses come mostly many in a row from the same block.
+
+	MapSector keeps it up to date when blocks are added and removed.
+	find() doesn't change the index, so many threads can find blocks at
+	the same time, but not while another one inserts or removes them.
+*/
+
+class MapBlockIndex
+{
+public:
+	MapBlockIndex();
+	~MapBlockIndex();
+
+	// Returns NULL if there is no such block
+	MapBlock * find(v3s16 p)
+	{
+		u64 key = packKey(p);
+		Recent &recent = s_recent;
+		if(recent.key == key && recent.index == this
+				&& recent.generation == m_generation)
+			return recent.block;
+		for(u32 i = hashKey(key) & m_mask;; i = (i + 1) & m_mask)
+		{
+			Slot &slot = m_slots[i];
+			if(slot.block == NULL)
+				return NULL;
+			if(slot.key == key)
+			{
+				recent.index = this;
+				recent.generation = m_generation;
+				recent.key = key;
+				recent.block = slot.block;
+				return slot.block;
+			}
+		}
+	}
+	// Replaces the block if there is one at p already
+	void insert(v3s16 p, MapBlock *block);
+	void remove(v3s16 p);
+	u32 size()
+	{
+		return m_count;
+	}
+
+private:
+	struct Slot
+	{
+		u64 key;
+		// NULL if the slot is free
+		MapBlock *block;
+	};
+
+	static u64 packKey(v3s16 p)
+	{
+		return (u64)(u16)p.X | ((u64)(u16)p.Y << 16)
+				| ((u64)(u16)p.Z << 32);
+	}
+	static u32 hashKey(u64 key)
+	{
+		u32 h = (u32)key ^ ((u32)(key >> 32) * 0x9e3779b1);
+		h ^= h >> 16;
+		h *= 0x85ebca6b;
+		h ^= h >> 13;
+		h *= 0xc2b2ae35;
+		h ^= h >> 16;
+		return h;
+	}
+
+	// Makes a table of new_size slots, which has to be a power of two
+	void rehash(u32 new_size);
+
+	/*
+		The block that a thread found last. It is valid if the
+		generation of the index hasn't changed since; it is changed when
+		a block is removed or replaced.
+	*/
+	struct Recent
+	{
+		const MapBlockIndex *index;
+		u32 generation;
+		u64 key;
+		MapBlock *block;
+	};
+	static THREAD_LOCAL Recent s_recent;
+
+	Slot *m_slots;
+	u32 m_mask;
+	u32 m_count;
+	u32 m_generation;
+};
+
+#endif
+
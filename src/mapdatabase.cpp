@@ -0,0 +1,304 @@
+/*
+Minetest-c55
+Copyright (C) 2010-2012 celeron55, Perttu Ahola <celeron55@gmail.com>
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation; either version 2.1 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include "mapdatabase.h"
+#include "mapdatabase_sqlite3.h"
+#include "mapdatabase_log.h"
+#include <jmutexautolock.h>
+#include <cstring> // memset
+#include "settings.h"
+#include "main.h" // g_settings
+#include "filesys.h"
+#include "log.h"
+#include "util/numeric.h" // getContainerPos
+
+#define PP(x) "("<<(x).X<<","<<(x).Y<<","<<(x).Z<<")"
+
+// Number of blocks written at once when copying
+#define COPY_BATCH_SIZE 1000
+
+void MapDatabase::saveBlocks(core::map<v3s16, std::string> &blobs)
+{
+	beginSave();
+	for(core::map<v3s16, std::string>::Iterator
+			i = blobs.getIterator(); i.atEnd() == false; i++)
+		saveBlock(i.getNode()->getKey(), i.getNode()->getValue());
+	endSave();
+}
+
+void MapDatabase::deleteBlocks(core::list<v3s16> &positions)
+{
+	beginSave();
+	for(core::list<v3s16>::Iterator i = positions.begin();
+			i != positions.end(); i++)
+		deleteBlock(*i);
+	endSave();
+}
+
+void MapDatabase::loadBlocksInArea(v3s16 blockpos_min, v3s16 blockpos_max,
+		core::map<v3s16, std::string> &dst)
+{
+	v3s16 p;
+	for(p.Z=blockpos_min.Z; p.Z<=blockpos_max.Z; p.Z++)
+	for(p.Y=blockpos_min.Y; p.Y<=blockpos_max.Y; p.Y++)
+	for(p.X=blockpos_min.X; p.X<=blockpos_max.X; p.X++)
+	{
+		if(dst.find(p) != NULL)
+			continue;
+		std::string blob;
+		if(loadBlock(p, &blob))
+			dst.insert(p, blob);
+	}
+}
+
+void MapDatabase::listAllLoadableBlocks(MapBlockPosSet &dst)
+{
+	core::list<v3s16> blocks;
+	listAllLoadableBlocks(blocks);
+	for(core::list<v3s16>::Iterator i = blocks.begin();
+			i != blocks.end(); i++)
+		dst.insert(*i);
+}
+
+/*
+	MapBlockPosSet
+*/
+
+MapBlockPosSet::MapBlockPosSet():
+	m_count(0)
+{
+	m_mutex.Init();
+}
+
+MapBlockPosSet::~MapBlockPosSet()
+{
+	clear();
+}
+
+void MapBlockPosSet::clear()
+{
+	JMutexAutoLock lock(m_mutex);
+
+	for(core::map<v3s16, Region*>::Iterator
+			i = m_regions.getIterator(); i.atEnd() == false; i++)
+		delete i.getNode()->getValue();
+	m_regions.clear();
+	m_count = 0;
+}
+
+MapBlockPosSet::Region * MapBlockPosSet::getRegion(v3s16 p, bool create,
+		u32 &bit_i)
+{
+	const s16 d = MAPBLOCKPOSSET_REGION_SIZE;
+	v3s16 rp = getContainerPos(p, d);
+	v3s16 rel = p - rp * d;
+	bit_i = (rel.Z * d + rel.Y) * d + rel.X;
+
+	core::map<v3s16, Region*>::Node *n = m_regions.find(rp);
+	if(n != NULL)
+		return n->getValue();
+	if(!create)
+		return NULL;
+	Region *r = new Region;
+	memset(r->bits, 0, sizeof(r->bits));
+	r->count = 0;
+	m_regions.insert(rp, r);
+	return r;
+}
+
+void MapBlockPosSet::insert(v3s16 p)
+{
+	JMutexAutoLock lock(m_mutex);
+
+	u32 bit_i;
+	Region *r = getRegion(p, true, bit_i);
+	u32 mask = 1 << (bit_i % 32);
+	if(r->bits[bit_i / 32] & mask)
+		return;
+	r->bits[bit_i / 32] |= mask;
+	r->count++;
+	m_count++;
+}
+
+void MapBlockPosSet::remove(v3s16 p)
+{
+	JMutexAutoLock lock(m_mutex);
+
+	u32 bit_i;
+	Region *r = getRegion(p, false, bit_i);
+	if(r == NULL)
+		return;
+	u32 mask = 1 << (bit_i % 32);
+	if((r->bits[bit_i / 32] & mask) == 0)
+		return;
+	r->bits[bit_i / 32] &= ~mask;
+	r->count--;
+	m_count--;
+	if(r->count == 0)
+	{
+		m_regions.remove(getContainerPos(p, MAPBLOCKPOSSET_REGION_SIZE));
+		delete r;
+	}
+}
+
+bool MapBlockPosSet::contains(v3s16 p)
+{
+	JMutexAutoLock lock(m_mutex);
+
+	u32 bit_i;
+	Region *r = getRegion(p, false, bit_i);
+	if(r == NULL)
+		return false;
+	return (r->bits[bit_i / 32] & (1 << (bit_i % 32))) != 0;
+}
+
+u32 MapBlockPosSet::size()
+{
+	JMutexAutoLock lock(m_mutex);
+	return m_count;
+}
+
+void MapBlockPosSet::listRegions(core::list<v3s16> &dst)
+{
+	JMutexAutoLock lock(m_mutex);
+
+	for(core::map<v3s16, Region*>::Iterator
+			i = m_regions.getIterator(); i.atEnd() == false; i++)
+		dst.push_back(i.getNode()->getKey());
+}
+
+MapDatabase* createMapDatabase(const std::string &backend,
+		const std::string &savedir, bool live)
+{
+	if(backend == "sqlite3")
+		return new MapDatabaseSQLite3(savedir);
+	if(backend == "log")
+		return new MapDatabaseLog(savedir, live);
+	return NULL;
+}
+
+std::string getWorldMapBackend(const std::string &savedir)
+{
+	std::string conf_path = savedir + DIR_DELIM + "world.mt";
+	Settings conf;
+	if(!conf.readConfigFile(conf_path.c_str()) || !conf.exists("backend"))
+		return "sqlite3";
+	return conf.get("backend");
+}
+
+bool setWorldMapBackend(const std::string &savedir,
+		const std::string &backend)
+{
+	std::string conf_path = savedir + DIR_DELIM + "world.mt";
+	Settings conf;
+	conf.readConfigFile(conf_path.c_str());
+	conf.set("backend", backend);
+	return conf.updateConfigFile(conf_path.c_str());
+}
+
+CompressionParams getWorldMapCompression(const std::string &savedir)
+{
+	std::string conf_path = savedir + DIR_DELIM + "world.mt";
+	Settings conf;
+	conf.readConfigFile(conf_path.c_str());
+	std::string codec = conf.exists("map_compression_disk") ?
+			conf.get("map_compression_disk") :
+			g_settings->get("map_compression_disk");
+	s32 level = conf.exists("map_compression_level_disk") ?
+			conf.getS32("map_compression_level_disk") :
+			g_settings->getS32("map_compression_level_disk");
+	return parseCompressionParams(codec, level);
+}
+
+u32 copyMapDatabase(MapDatabase *src, MapDatabase *dst)
+{
+	core::list<v3s16> blocks;
+	src->listAllLoadableBlocks(blocks);
+
+	u32 count = 0;
+	core::map<v3s16, std::string> batch;
+	for(core::list<v3s16>::Iterator i = blocks.begin();
+			i != blocks.end(); i++)
+	{
+		std::string blob;
+		if(!src->loadBlock(*i, &blob))
+		{
+			errorstream<<"copyMapDatabase(): Could not load listed block "
+					<<PP(*i)<<std::endl;
+			continue;
+		}
+		batch.insert(*i, blob);
+		if(batch.size() >= COPY_BATCH_SIZE)
+		{
+			dst->saveBlocks(batch);
+			count += batch.size();
+			batch.clear();
+			actionstream<<"Copied "<<count<<" of "<<blocks.size()
+					<<" blocks"<<std::endl;
+		}
+	}
+	if(batch.size() != 0)
+	{
+		dst->saveBlocks(batch);
+		count += batch.size();
+	}
+	return count;
+}
+
+bool migrateWorldMapBackend(const std::string &savedir,
+		const std::string &new_backend)
+{
+	std::string old_backend = getWorldMapBackend(savedir);
+	if(old_backend == new_backend)
+	{
+		errorstream<<"The world already uses backend \""<<new_backend
+				<<"\""<<std::endl;
+		return false;
+	}
+
+	MapDatabase *src = createMapDatabase(old_backend, savedir);
+	if(src == NULL)
+	{
+		errorstream<<"Unknown map backend \""<<old_backend<<"\" in world.mt"
+				<<std::endl;
+		return false;
+	}
+	MapDatabase *dst = createMapDatabase(new_backend, savedir);
+	if(dst == NULL)
+	{
+		errorstream<<"Unknown map backend \""<<new_backend<<"\""<<std::endl;
+		delete src;
+		return false;
+	}
+
+	actionstream<<"Migrating map of "<<savedir<<" from "<<old_backend
+			<<" to "<<new_backend<<std::endl;
+	u32 count = copyMapDatabase(src, dst);
+	delete dst;
+	delete src;
+
+	if(!setWorldMapBackend(savedir, new_backend))
+	{
+		errorstream<<"Could not update world.mt"<<std::endl;
+		return false;
+	}
+	actionstream<<"Migrated "<<count<<" blocks"<<std::endl;
+	return true;
+}
+
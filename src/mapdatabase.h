@@ -0,0 +1,148 @@
+/*
+Minetest-c55
+Copyright (C) 2010-2012 celeron55, Perttu Ahola <celeron55@gmail.com>
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation; either version 2.1 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#ifndef MAPDATABASE_HEADER
+#define MAPDATABASE_HEADER
+
+#include "irrlichttypes_bloated.h"
+#include <jmutex.h>
+#include <string>
+#include "serialization.h" // CompressionParams
+
+class MapBlockPosSet;
+
+/*
+	Storage of serialized MapBlocks.
+
+	A blob is what ServerMap writes: the serialization version byte
+	followed by the block data. The database doesn't look inside it.
+
+	Implementations have to be thread-safe; the map save thread writes
+	while the server thread reads.
+*/
+
+class MapDatabase
+{
+public:
+	virtual ~MapDatabase() {}
+
+	// Name used in world.mt ("backend = <name>")
+	virtual std::string getName() = 0;
+
+	// Returns false if the block is not in the database
+	virtual bool loadBlock(v3s16 blockpos, std::string *blob) = 0;
+	// Loads all stored blocks in the area into dst; blocks already in dst
+	// are left as they are. The default does it with loadBlock(); backends
+	// should do it with one lookup if they can.
+	virtual void loadBlocksInArea(v3s16 blockpos_min, v3s16 blockpos_max,
+			core::map<v3s16, std::string> &dst);
+	virtual void saveBlock(v3s16 blockpos, const std::string &blob) = 0;
+	// Writes many blocks at once. The default does it with saveBlock()
+	// between beginSave() and endSave().
+	virtual void saveBlocks(core::map<v3s16, std::string> &blobs);
+	// Does nothing if the block is not in the database
+	virtual void deleteBlock(v3s16 blockpos) = 0;
+	// Deletes many blocks at once; the default works like saveBlocks()
+	virtual void deleteBlocks(core::list<v3s16> &positions);
+
+	// Call these before and after saving of many blocks
+	virtual void beginSave() {}
+	virtual void endSave() {}
+
+	virtual void listAllLoadableBlocks(core::list<v3s16> &dst) = 0;
+	// Same as above, but without making a list of all of them first
+	virtual void listAllLoadableBlocks(MapBlockPosSet &dst);
+};
+
+/*
+	A set of block positions, used for keeping in memory which blocks
+	are stored in the database.
+
+	Positions are kept in bitmaps of 16x16x16 blocks; one bit per block.
+	A world of tens of millions of blocks fits in some megabytes.
+
+	Thread-safe.
+*/
+
+#define MAPBLOCKPOSSET_REGION_SIZE 16
+
+class MapBlockPosSet
+{
+public:
+	MapBlockPosSet();
+	~MapBlockPosSet();
+
+	void clear();
+	void insert(v3s16 p);
+	void remove(v3s16 p);
+	bool contains(v3s16 p);
+	u32 size();
+	// Lists the regions that have positions, in units of
+	// MAPBLOCKPOSSET_REGION_SIZE blocks
+	void listRegions(core::list<v3s16> &dst);
+
+private:
+	// Number of u32 words in the bitmap of a region
+	enum { REGION_WORDS = MAPBLOCKPOSSET_REGION_SIZE
+			* MAPBLOCKPOSSET_REGION_SIZE * MAPBLOCKPOSSET_REGION_SIZE / 32 };
+
+	struct Region
+	{
+		u32 bits[REGION_WORDS];
+		u32 count;
+	};
+
+	// Returns the region of p, or NULL if there is none and create=false.
+	// Sets bit_i to the index of the bit of p in the region.
+	Region * getRegion(v3s16 p, bool create, u32 &bit_i);
+
+	JMutex m_mutex;
+	core::map<v3s16, Region*> m_regions;
+	u32 m_count;
+};
+
+// Returns NULL if the backend name is unknown. Background maintenance of
+// the files, like compaction, is only done if live is true; set it for
+// the map of a running server, not for tools that work on a world.
+MapDatabase* createMapDatabase(const std::string &backend,
+		const std::string &savedir, bool live=false);
+
+// The backend set in world.mt of the world; "sqlite3" if there is none
+std::string getWorldMapBackend(const std::string &savedir);
+bool setWorldMapBackend(const std::string &savedir,
+		const std::string &backend);
+
+// The codec of saved blocks set in world.mt of the world with
+// map_compression_disk and map_compression_level_disk; the global
+// settings of the same names if they are not set there
+CompressionParams getWorldMapCompression(const std::string &savedir);
+
+// Copies all blocks from src to dst. Returns the number of blocks copied.
+u32 copyMapDatabase(MapDatabase *src, MapDatabase *dst);
+
+/*
+	Converts the map of a world to another backend and sets the new
+	backend in world.mt. The old data is left in place.
+	Returns false on failure.
+*/
+bool migrateWorldMapBackend(const std::string &savedir,
+		const std::string &new_backend);
+
+#endif
+
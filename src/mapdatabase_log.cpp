@@ -0,0 +1,904 @@
+/*
+Minetest-c55
+Copyright (C) 2010-2012 celeron55, Perttu Ahola <celeron55@gmail.com>
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation; either version 2.1 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include "mapdatabase_log.h"
+#include <jmutexautolock.h>
+#include <zlib.h>
+#include <vector>
+#include <algorithm>
+#include "filesys.h"
+#include "exceptions.h"
+#include "log.h"
+#include "debug.h"
+#include "util/serialize.h"
+#include "util/numeric.h"
+
+#define PP(x) "("<<(x).X<<","<<(x).Y<<","<<(x).Z<<")"
+
+// A segment is sealed when it grows larger than this
+#define SEGMENT_MAX_SIZE (64*1024*1024)
+// Sealed segments with less current data than this are compacted.
+// Segments smaller than 1/8 of the maximum are always merged.
+#define COMPACT_MAX_LIVE_FRACTION 0.5
+// Maximum number of segment files kept open for reading
+#define MAX_OPEN_READERS 16
+
+#define SEGMENT_HEADER_SIZE 6
+#define RECORD_HEADER_SIZE 15
+#define RECORD_TYPE_BLOCK 1
+#define RECORD_TYPE_DELETE 2
+
+static u32 dataChecksum(const std::string &data)
+{
+	uLong a = adler32(0L, Z_NULL, 0);
+	return adler32(a, (const Bytef*)data.c_str(), data.size());
+}
+
+static u32 getFileSize(const std::string &path)
+{
+	std::ifstream is(path.c_str(), std::ios_base::binary);
+	if(!is.good())
+		return 0;
+	is.seekg(0, std::ios_base::end);
+	return is.tellg();
+}
+
+/*
+	MapDatabaseLogCompactThread
+*/
+
+void * MapDatabaseLogCompactThread::Thread()
+{
+	ThreadStarted();
+
+	log_register_thread("MapDatabaseLogCompactThread");
+
+	DSTACK(__FUNCTION_NAME);
+
+	BEGIN_DEBUG_EXCEPTION_HANDLER
+
+	while(getRun())
+	{
+		u32 id = m_db->findSegmentToCompact(COMPACT_MAX_LIVE_FRACTION);
+		if(id != 0)
+		{
+			m_db->compactSegment(id);
+			continue;
+		}
+		// Nothing to do; check again in a while
+		for(u32 i=0; i<50 && getRun(); i++)
+			sleep_ms(100);
+	}
+
+	END_DEBUG_EXCEPTION_HANDLER(errorstream)
+
+	log_deregister_thread();
+
+	return NULL;
+}
+
+/*
+	MapDatabaseLog
+*/
+
+MapDatabaseLog::MapDatabaseLog(const std::string &savedir, bool compact):
+	m_dir(savedir + DIR_DELIM + "maplog"),
+	m_opened(false),
+	m_next_segment_id(1),
+	m_active_id(0),
+	m_active_unflushed(false),
+	m_compact(compact),
+	m_compactor(this)
+{
+	m_mutex.Init();
+}
+
+MapDatabaseLog::~MapDatabaseLog()
+{
+	m_compactor.stop();
+
+	JMutexAutoLock lock(m_mutex);
+
+	if(m_active.is_open())
+		m_active.close();
+
+	for(core::map<u32, std::ifstream*>::Iterator
+			i = m_readers.getIterator(); i.atEnd() == false; i++)
+		delete i.getNode()->getValue();
+	m_readers.clear();
+
+	if(m_opened)
+		writeIndexFile();
+}
+
+MapDatabaseLog::SegmentInfo & MapDatabaseLog::getSegment(u32 id)
+{
+	core::map<u32, SegmentInfo>::Node *n = m_segments.find(id);
+	assert(n);
+	return n->getValue();
+}
+
+std::string MapDatabaseLog::getSegmentPath(u32 id)
+{
+	char cc[13];
+	snprintf(cc, 13, "%.8x.seg", id);
+	return m_dir + DIR_DELIM + cc;
+}
+
+bool MapDatabaseLog::open(bool create)
+{
+	if(m_opened)
+		return true;
+
+	if(!fs::PathExists(m_dir))
+	{
+		// Don't create anything unless something is really saved
+		if(!create)
+			return false;
+		if(!fs::CreateAllDirs(m_dir))
+		{
+			errorstream<<"MapDatabaseLog: Cannot create "<<m_dir<<std::endl;
+			throw FileNotGoodException("Cannot create map log directory");
+		}
+	}
+
+	if(readIndexFile())
+	{
+		infostream<<"MapDatabaseLog: Loaded index of "<<m_index.size()
+				<<" blocks"<<std::endl;
+	}
+	else
+	{
+		/*
+			Read all segments in order; newer records replace older ones
+		*/
+		m_index.clear();
+		m_deleted.clear();
+		m_segments.clear();
+		m_next_segment_id = 1;
+		std::vector<u32> ids;
+		std::vector<fs::DirListNode> list = fs::GetDirListing(m_dir);
+		for(u32 i=0; i<list.size(); i++)
+		{
+			const std::string &name = list[i].name;
+			if(list[i].dir || name.size() != 12 || name.substr(8) != ".seg")
+				continue;
+			ids.push_back(strtoul(name.substr(0, 8).c_str(), NULL, 16));
+		}
+		std::sort(ids.begin(), ids.end());
+		for(u32 i=0; i<ids.size(); i++)
+			scanSegment(ids[i]);
+		infostream<<"MapDatabaseLog: Scanned "<<ids.size()<<" segments, "
+				<<m_index.size()<<" blocks"<<std::endl;
+	}
+
+	// A crash from now on has to be detected by not having an index
+	std::string index_path = m_dir + DIR_DELIM + "index";
+	if(fs::PathExists(index_path))
+		fs::DeleteSingleFileOrEmptyDirectory(index_path);
+
+	m_opened = true;
+
+	if(m_compact)
+		m_compactor.Start();
+
+	return true;
+}
+
+void MapDatabaseLog::scanSegment(u32 id)
+{
+	std::string path = getSegmentPath(id);
+	std::ifstream is(path.c_str(), std::ios_base::binary);
+	if(!is.good())
+	{
+		errorstream<<"MapDatabaseLog: Cannot open "<<path<<std::endl;
+		throw FileNotGoodException("Cannot open map log segment");
+	}
+
+	// Never reuse the id, even if the file is not usable
+	m_next_segment_id = MYMAX(m_next_segment_id, id + 1);
+
+	char header[RECORD_HEADER_SIZE];
+	is.read(header, SEGMENT_HEADER_SIZE);
+	if(is.gcount() != SEGMENT_HEADER_SIZE || memcmp(header, "MTLG", 4) != 0
+			|| readU16((u8*)&header[4]) != 1)
+	{
+		// Left on disk as it is
+		errorstream<<"MapDatabaseLog: "<<path<<": Invalid header"<<std::endl;
+		return;
+	}
+	u32 offset = SEGMENT_HEADER_SIZE;
+
+	SegmentInfo info;
+	info.size = offset;
+	info.live_size = 0;
+	m_segments.insert(id, info);
+
+	std::string data;
+	for(;;)
+	{
+		is.read(header, RECORD_HEADER_SIZE);
+		if(is.gcount() == 0)
+			break;
+		u8 type = readU8((u8*)&header[0]);
+		if(is.gcount() != RECORD_HEADER_SIZE
+				|| (type != RECORD_TYPE_BLOCK && type != RECORD_TYPE_DELETE))
+		{
+			errorstream<<"MapDatabaseLog: "<<path<<": Invalid record at "
+					<<offset<<", ignoring rest of segment"<<std::endl;
+			break;
+		}
+		v3s16 p = readV3S16((u8*)&header[1]);
+		u32 length = readU32((u8*)&header[7]);
+		u32 checksum = readU32((u8*)&header[11]);
+		data.resize(length);
+		if(length != 0)
+			is.read(&data[0], length);
+		if((length != 0 && (u32)is.gcount() != length)
+				|| dataChecksum(data) != checksum)
+		{
+			errorstream<<"MapDatabaseLog: "<<path<<": Broken record at "
+					<<offset<<", ignoring rest of segment"<<std::endl;
+			break;
+		}
+
+		u32 record_offset = offset;
+		offset += RECORD_HEADER_SIZE + length;
+		SegmentInfo &si = getSegment(id);
+		si.size = offset;
+
+		// Replace older copy or deletion
+		u32 oldest = id;
+		core::map<v3s16, IndexEntry>::Node *n = m_index.find(p);
+		core::map<v3s16, DeletedEntry>::Node *dn = m_deleted.find(p);
+		if(n != NULL)
+		{
+			IndexEntry &old = n->getValue();
+			getSegment(old.segment).live_size -= RECORD_HEADER_SIZE + old.length;
+			oldest = old.oldest;
+			m_index.remove(p);
+		}
+		else if(dn != NULL)
+		{
+			oldest = dn->getValue().oldest;
+			removeDeleted(dn);
+		}
+		else if(type == RECORD_TYPE_DELETE)
+		{
+			// No older segment has a copy to hide
+			continue;
+		}
+
+		if(type == RECORD_TYPE_DELETE)
+		{
+			DeletedEntry d;
+			d.segment = id;
+			d.offset = record_offset;
+			d.oldest = oldest;
+			m_deleted[p] = d;
+			si.live_size += RECORD_HEADER_SIZE;
+			continue;
+		}
+
+		IndexEntry e;
+		e.segment = id;
+		e.offset = record_offset;
+		e.length = length;
+		e.oldest = oldest;
+		m_index[p] = e;
+		si.live_size += RECORD_HEADER_SIZE + length;
+	}
+}
+
+bool MapDatabaseLog::readIndexFile()
+{
+	std::string path = m_dir + DIR_DELIM + "index";
+	std::ifstream is(path.c_str(), std::ios_base::binary);
+	if(!is.good())
+		return false;
+
+	try{
+		char magic[4];
+		is.read(magic, 4);
+		// Version 1 didn't have the deleted blocks; the segments are
+		// read instead
+		if(is.gcount() != 4 || memcmp(magic, "MTLI", 4) != 0
+				|| readU16(is) != 2)
+			return false;
+
+		u32 segment_count = readU32(is);
+		for(u32 i=0; i<segment_count; i++)
+		{
+			u32 id = readU32(is);
+			SegmentInfo info;
+			info.size = readU32(is);
+			info.live_size = readU32(is);
+			// The segments have to be exactly as they were
+			if(!is.good() || getFileSize(getSegmentPath(id)) != info.size)
+				throw SerializationError("segment changed");
+			m_segments.insert(id, info);
+			m_next_segment_id = MYMAX(m_next_segment_id, id + 1);
+		}
+		// No extra segments either
+		u32 segment_files = 0;
+		std::vector<fs::DirListNode> list = fs::GetDirListing(m_dir);
+		for(u32 i=0; i<list.size(); i++)
+			if(list[i].name.size() == 12 && list[i].name.substr(8) == ".seg")
+				segment_files++;
+		if(segment_files != segment_count)
+			throw SerializationError("segment count changed");
+
+		u32 entry_count = readU32(is);
+		for(u32 i=0; i<entry_count; i++)
+		{
+			char buf[22];
+			is.read(buf, 22);
+			if(is.gcount() != 22)
+				throw SerializationError("truncated index");
+			v3s16 p = readV3S16((u8*)&buf[0]);
+			IndexEntry e;
+			e.segment = readU32((u8*)&buf[6]);
+			e.offset = readU32((u8*)&buf[10]);
+			e.length = readU32((u8*)&buf[14]);
+			e.oldest = readU32((u8*)&buf[18]);
+			m_index.insert(p, e);
+		}
+
+		u32 deleted_count = readU32(is);
+		for(u32 i=0; i<deleted_count; i++)
+		{
+			char buf[18];
+			is.read(buf, 18);
+			if(is.gcount() != 18)
+				throw SerializationError("truncated index");
+			v3s16 p = readV3S16((u8*)&buf[0]);
+			DeletedEntry d;
+			d.segment = readU32((u8*)&buf[6]);
+			d.offset = readU32((u8*)&buf[10]);
+			d.oldest = readU32((u8*)&buf[14]);
+			m_deleted.insert(p, d);
+		}
+	}
+	catch(SerializationError &e)
+	{
+		infostream<<"MapDatabaseLog: Not using index file: "<<e.what()
+				<<std::endl;
+		m_index.clear();
+		m_deleted.clear();
+		m_segments.clear();
+		return false;
+	}
+	return true;
+}
+
+void MapDatabaseLog::writeIndexFile()
+{
+	std::string path = m_dir + DIR_DELIM + "index";
+	std::ofstream os(path.c_str(), std::ios_base::binary);
+	if(!os.good())
+	{
+		errorstream<<"MapDatabaseLog: Cannot write "<<path<<std::endl;
+		return;
+	}
+	os.write("MTLI", 4);
+	writeU16(os, 2);
+	writeU32(os, m_segments.size());
+	for(core::map<u32, SegmentInfo>::Iterator
+			i = m_segments.getIterator(); i.atEnd() == false; i++)
+	{
+		writeU32(os, i.getNode()->getKey());
+		writeU32(os, i.getNode()->getValue().size);
+		writeU32(os, i.getNode()->getValue().live_size);
+	}
+	writeU32(os, m_index.size());
+	for(core::map<v3s16, IndexEntry>::Iterator
+			i = m_index.getIterator(); i.atEnd() == false; i++)
+	{
+		char buf[22];
+		const IndexEntry &e = i.getNode()->getValue();
+		writeV3S16((u8*)&buf[0], i.getNode()->getKey());
+		writeU32((u8*)&buf[6], e.segment);
+		writeU32((u8*)&buf[10], e.offset);
+		writeU32((u8*)&buf[14], e.length);
+		writeU32((u8*)&buf[18], e.oldest);
+		os.write(buf, 22);
+	}
+	writeU32(os, m_deleted.size());
+	for(core::map<v3s16, DeletedEntry>::Iterator
+			i = m_deleted.getIterator(); i.atEnd() == false; i++)
+	{
+		char buf[18];
+		const DeletedEntry &d = i.getNode()->getValue();
+		writeV3S16((u8*)&buf[0], i.getNode()->getKey());
+		writeU32((u8*)&buf[6], d.segment);
+		writeU32((u8*)&buf[10], d.offset);
+		writeU32((u8*)&buf[14], d.oldest);
+		os.write(buf, 18);
+	}
+}
+
+void MapDatabaseLog::startNewSegment()
+{
+	if(m_active.is_open())
+		m_active.close();
+
+	u32 id = m_next_segment_id++;
+
+	std::string path = getSegmentPath(id);
+	m_active.open(path.c_str(), std::ios_base::binary);
+	if(!m_active.good())
+	{
+		errorstream<<"MapDatabaseLog: Cannot open "<<path<<std::endl;
+		throw FileNotGoodException("Cannot open map log segment");
+	}
+	m_active.write("MTLG", 4);
+	writeU16(m_active, 1);
+
+	SegmentInfo info;
+	info.size = SEGMENT_HEADER_SIZE;
+	info.live_size = 0;
+	m_segments.insert(id, info);
+	m_active_id = id;
+}
+
+void MapDatabaseLog::writeRecordHeader(u8 type, v3s16 p,
+		const std::string &data)
+{
+	if(m_active_id == 0 || getSegment(m_active_id).size >= SEGMENT_MAX_SIZE)
+		startNewSegment();
+
+	char header[RECORD_HEADER_SIZE];
+	writeU8((u8*)&header[0], type);
+	writeV3S16((u8*)&header[1], p);
+	writeU32((u8*)&header[7], data.size());
+	writeU32((u8*)&header[11], dataChecksum(data));
+	m_active.write(header, RECORD_HEADER_SIZE);
+}
+
+void MapDatabaseLog::appendRecord(v3s16 p, const std::string &data)
+{
+	writeRecordHeader(RECORD_TYPE_BLOCK, p, data);
+	SegmentInfo &si = getSegment(m_active_id);
+
+	m_active.write(data.c_str(), data.size());
+	if(!m_active.good())
+		throw FileNotGoodException("Cannot write to map log");
+	m_active_unflushed = true;
+
+	// Replace older copy or deletion; this one hides the older copies
+	// from now on
+	u32 oldest = m_active_id;
+	core::map<v3s16, IndexEntry>::Node *n = m_index.find(p);
+	if(n != NULL)
+	{
+		IndexEntry &old = n->getValue();
+		getSegment(old.segment).live_size -= RECORD_HEADER_SIZE + old.length;
+		oldest = old.oldest;
+	}
+	else
+	{
+		core::map<v3s16, DeletedEntry>::Node *dn = m_deleted.find(p);
+		if(dn != NULL)
+		{
+			oldest = dn->getValue().oldest;
+			removeDeleted(dn);
+		}
+	}
+	IndexEntry e;
+	e.segment = m_active_id;
+	e.offset = si.size;
+	e.length = data.size();
+	e.oldest = oldest;
+	m_index[p] = e;
+
+	si.size += RECORD_HEADER_SIZE + data.size();
+	si.live_size += RECORD_HEADER_SIZE + data.size();
+}
+
+void MapDatabaseLog::appendDeleteRecord(v3s16 p)
+{
+	core::map<v3s16, IndexEntry>::Node *n = m_index.find(p);
+	if(n == NULL)
+		return;
+	IndexEntry &old = n->getValue();
+	getSegment(old.segment).live_size -= RECORD_HEADER_SIZE + old.length;
+	u32 oldest = old.oldest;
+	m_index.remove(p);
+
+	writeDeleteRecord(p, oldest);
+}
+
+void MapDatabaseLog::writeDeleteRecord(v3s16 p, u32 oldest)
+{
+	writeRecordHeader(RECORD_TYPE_DELETE, p, "");
+	if(!m_active.good())
+		throw FileNotGoodException("Cannot write to map log");
+	m_active_unflushed = true;
+
+	SegmentInfo &si = getSegment(m_active_id);
+	DeletedEntry d;
+	d.segment = m_active_id;
+	d.offset = si.size;
+	d.oldest = oldest;
+	m_deleted[p] = d;
+
+	si.size += RECORD_HEADER_SIZE;
+	si.live_size += RECORD_HEADER_SIZE;
+}
+
+void MapDatabaseLog::removeDeleted(core::map<v3s16, DeletedEntry>::Node *n)
+{
+	getSegment(n->getValue().segment).live_size -= RECORD_HEADER_SIZE;
+	m_deleted.remove(n->getKey());
+}
+
+bool MapDatabaseLog::hasSegmentInRange(u32 min_id, u32 max_id)
+{
+	for(core::map<u32, SegmentInfo>::Iterator
+			i = m_segments.getIterator(); i.atEnd() == false; i++)
+	{
+		u32 id = i.getNode()->getKey();
+		if(id >= min_id && id <= max_id)
+			return true;
+	}
+	return false;
+}
+
+void MapDatabaseLog::retireDeleteRecords()
+{
+	if(m_deleted.size() == 0)
+		return;
+
+	std::vector<u32> ids;
+	for(core::map<u32, SegmentInfo>::Iterator
+			i = m_segments.getIterator(); i.atEnd() == false; i++)
+		ids.push_back(i.getNode()->getKey());
+	std::sort(ids.begin(), ids.end());
+
+	core::list<v3s16> retired;
+	for(core::map<v3s16, DeletedEntry>::Iterator
+			i = m_deleted.getIterator(); i.atEnd() == false; i++)
+	{
+		const DeletedEntry &d = i.getNode()->getValue();
+		// The first segment that may have a copy
+		std::vector<u32>::iterator j =
+				std::lower_bound(ids.begin(), ids.end(), d.oldest);
+		if(j == ids.end() || *j >= d.segment)
+			retired.push_back(i.getNode()->getKey());
+	}
+	for(core::list<v3s16>::Iterator i = retired.begin();
+			i != retired.end(); i++)
+		removeDeleted(m_deleted.find(*i));
+}
+
+std::ifstream * MapDatabaseLog::getReader(u32 id)
+{
+	core::map<u32, std::ifstream*>::Node *n = m_readers.find(id);
+	if(n != NULL)
+		return n->getValue();
+
+	// Make room
+	if(m_readers.size() >= MAX_OPEN_READERS)
+		closeReader(m_readers.getIterator().getNode()->getKey());
+
+	std::string path = getSegmentPath(id);
+	std::ifstream *is = new std::ifstream(path.c_str(),
+			std::ios_base::binary);
+	if(!is->good())
+	{
+		delete is;
+		errorstream<<"MapDatabaseLog: Cannot open "<<path<<std::endl;
+		throw FileNotGoodException("Cannot open map log segment");
+	}
+	m_readers.insert(id, is);
+	return is;
+}
+
+void MapDatabaseLog::closeReader(u32 id)
+{
+	core::map<u32, std::ifstream*>::Node *n = m_readers.find(id);
+	if(n == NULL)
+		return;
+	delete n->getValue();
+	m_readers.remove(id);
+}
+
+bool MapDatabaseLog::readRecord(const IndexEntry &e, v3s16 p,
+		std::string *data)
+{
+	if(e.segment == m_active_id && m_active_unflushed)
+	{
+		m_active.flush();
+		m_active_unflushed = false;
+	}
+
+	std::ifstream *is = getReader(e.segment);
+	is->clear();
+	is->seekg(e.offset + RECORD_HEADER_SIZE);
+	data->resize(e.length);
+	if(e.length != 0)
+		is->read(&(*data)[0], e.length);
+	if((u32)is->gcount() != e.length)
+	{
+		errorstream<<"MapDatabaseLog: Could not read block "<<PP(p)
+				<<" from "<<getSegmentPath(e.segment)<<std::endl;
+		return false;
+	}
+	return true;
+}
+
+bool MapDatabaseLog::loadBlock(v3s16 blockpos, std::string *blob)
+{
+	JMutexAutoLock lock(m_mutex);
+
+	if(!open(false))
+		return false;
+
+	core::map<v3s16, IndexEntry>::Node *n = m_index.find(blockpos);
+	if(n == NULL)
+		return false;
+	return readRecord(n->getValue(), blockpos, blob);
+}
+
+void MapDatabaseLog::loadBlocksInArea(v3s16 blockpos_min,
+		v3s16 blockpos_max, core::map<v3s16, std::string> &dst)
+{
+	JMutexAutoLock lock(m_mutex);
+
+	if(!open(false))
+		return;
+
+	v3s16 p;
+	for(p.Z=blockpos_min.Z; p.Z<=blockpos_max.Z; p.Z++)
+	for(p.Y=blockpos_min.Y; p.Y<=blockpos_max.Y; p.Y++)
+	for(p.X=blockpos_min.X; p.X<=blockpos_max.X; p.X++)
+	{
+		core::map<v3s16, IndexEntry>::Node *n = m_index.find(p);
+		if(n == NULL || dst.find(p) != NULL)
+			continue;
+		std::string blob;
+		if(readRecord(n->getValue(), p, &blob))
+			dst.insert(p, blob);
+	}
+}
+
+void MapDatabaseLog::saveBlock(v3s16 blockpos, const std::string &blob)
+{
+	JMutexAutoLock lock(m_mutex);
+	open(true);
+	appendRecord(blockpos, blob);
+}
+
+void MapDatabaseLog::saveBlocks(core::map<v3s16, std::string> &blobs)
+{
+	JMutexAutoLock lock(m_mutex);
+	open(true);
+	for(core::map<v3s16, std::string>::Iterator
+			i = blobs.getIterator(); i.atEnd() == false; i++)
+		appendRecord(i.getNode()->getKey(), i.getNode()->getValue());
+	m_active.flush();
+	m_active_unflushed = false;
+}
+
+void MapDatabaseLog::deleteBlock(v3s16 blockpos)
+{
+	JMutexAutoLock lock(m_mutex);
+	if(!open(false) || m_index.find(blockpos) == NULL)
+		return;
+	appendDeleteRecord(blockpos);
+}
+
+void MapDatabaseLog::deleteBlocks(core::list<v3s16> &positions)
+{
+	JMutexAutoLock lock(m_mutex);
+	if(!open(false))
+		return;
+	for(core::list<v3s16>::Iterator i = positions.begin();
+			i != positions.end(); i++)
+	{
+		if(m_index.find(*i) != NULL)
+			appendDeleteRecord(*i);
+	}
+	m_active.flush();
+	m_active_unflushed = false;
+}
+
+void MapDatabaseLog::endSave()
+{
+	JMutexAutoLock lock(m_mutex);
+	if(m_active.is_open())
+	{
+		m_active.flush();
+		m_active_unflushed = false;
+	}
+}
+
+void MapDatabaseLog::listAllLoadableBlocks(core::list<v3s16> &dst)
+{
+	JMutexAutoLock lock(m_mutex);
+
+	if(!open(false))
+		return;
+
+	for(core::map<v3s16, IndexEntry>::Iterator
+			i = m_index.getIterator(); i.atEnd() == false; i++)
+		dst.push_back(i.getNode()->getKey());
+}
+
+void MapDatabaseLog::listAllLoadableBlocks(MapBlockPosSet &dst)
+{
+	JMutexAutoLock lock(m_mutex);
+
+	if(!open(false))
+		return;
+
+	for(core::map<v3s16, IndexEntry>::Iterator
+			i = m_index.getIterator(); i.atEnd() == false; i++)
+		dst.insert(i.getNode()->getKey());
+}
+
+u32 MapDatabaseLog::findSegmentToCompact(float max_live_fraction)
+{
+	JMutexAutoLock lock(m_mutex);
+
+	for(core::map<u32, SegmentInfo>::Iterator
+			i = m_segments.getIterator(); i.atEnd() == false; i++)
+	{
+		u32 id = i.getNode()->getKey();
+		const SegmentInfo &si = i.getNode()->getValue();
+		if(id == m_active_id || m_uncompactable.find(id) != NULL)
+			continue;
+		// Mostly outdated data, or a small leftover of an earlier run
+		if((float)si.live_size < (float)si.size * max_live_fraction
+				|| si.size < SEGMENT_MAX_SIZE / 8)
+			return id;
+	}
+	return 0;
+}
+
+void MapDatabaseLog::compactSegment(u32 id)
+{
+	DSTACK(__FUNCTION_NAME);
+
+	std::string path = getSegmentPath(id);
+	u32 moved_count = 0;
+	u32 moved_deleted_count = 0;
+
+	/*
+		Sealed segments don't change, so it is read without locking.
+		Records that are still current are appended to the active
+		segment.
+	*/
+	std::ifstream is(path.c_str(), std::ios_base::binary);
+	if(is.good())
+	{
+		is.seekg(SEGMENT_HEADER_SIZE);
+		u32 offset = SEGMENT_HEADER_SIZE;
+		std::string data;
+		for(;;)
+		{
+			char header[RECORD_HEADER_SIZE];
+			is.read(header, RECORD_HEADER_SIZE);
+			if(is.gcount() != RECORD_HEADER_SIZE)
+				break;
+			v3s16 p = readV3S16((u8*)&header[1]);
+			u32 length = readU32((u8*)&header[7]);
+			data.resize(length);
+			if(length != 0)
+				is.read(&data[0], length);
+			if(length != 0 && (u32)is.gcount() != length)
+				break;
+
+			if(readU8((u8*)&header[0]) == RECORD_TYPE_DELETE)
+			{
+				/*
+					Keep hiding the copies in older segments, unless the
+					block has been saved again since or the segments that
+					may have a copy are gone
+				*/
+				JMutexAutoLock lock(m_mutex);
+				core::map<v3s16, DeletedEntry>::Node *n = m_deleted.find(p);
+				if(n != NULL && n->getValue().segment == id
+						&& n->getValue().offset == offset)
+				{
+					u32 oldest = n->getValue().oldest;
+					removeDeleted(n);
+					if(hasSegmentInRange(oldest, id - 1))
+					{
+						writeDeleteRecord(p, oldest);
+						moved_deleted_count++;
+					}
+				}
+			}
+			else
+			{
+				JMutexAutoLock lock(m_mutex);
+				core::map<v3s16, IndexEntry>::Node *n = m_index.find(p);
+				if(n != NULL && n->getValue().segment == id
+						&& n->getValue().offset == offset)
+				{
+					appendRecord(p, data);
+					moved_count++;
+				}
+			}
+
+			offset += RECORD_HEADER_SIZE + length;
+		}
+	}
+
+	JMutexAutoLock lock(m_mutex);
+
+	core::map<u32, SegmentInfo>::Node *n = m_segments.find(id);
+	if(n == NULL)
+		return;
+	if(n->getValue().live_size != 0)
+	{
+		// Should not happen; leave it alone so that nothing is lost
+		errorstream<<"MapDatabaseLog: "<<path<<" still has current data"
+				<<" after compaction"<<std::endl;
+		m_uncompactable.insert(id, true);
+		return;
+	}
+
+	// The moved data has to be on the disk before the old copy is removed
+	if(m_active.is_open())
+	{
+		m_active.flush();
+		// The entry of the active segment in the directory too
+		if(!fs::SyncFile(getSegmentPath(m_active_id))
+				|| !fs::SyncFile(m_dir))
+		{
+			errorstream<<"MapDatabaseLog: Cannot sync "
+					<<getSegmentPath(m_active_id)<<", not deleting "
+					<<path<<std::endl;
+			m_uncompactable.insert(id, true);
+			return;
+		}
+	}
+	m_active_unflushed = false;
+
+	closeReader(id);
+	m_segments.remove(id);
+	fs::DeleteSingleFileOrEmptyDirectory(path);
+
+	// The copies in this segment don't have to be hidden anymore
+	retireDeleteRecords();
+
+	infostream<<"MapDatabaseLog: Compacted "<<path<<", moved "
+			<<moved_count<<" blocks and "<<moved_deleted_count
+			<<" deletions"<<std::endl;
+}
+
+u32 MapDatabaseLog::getSegmentCount()
+{
+	JMutexAutoLock lock(m_mutex);
+	return m_segments.size();
+}
+
+u32 MapDatabaseLog::getBlockCount()
+{
+	JMutexAutoLock lock(m_mutex);
+	return m_index.size();
+}
+
+u32 MapDatabaseLog::getDeletedCount()
+{
+	JMutexAutoLock lock(m_mutex);
+	return m_deleted.size();
+}
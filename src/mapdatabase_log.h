@@ -0,0 +1,196 @@
+/*
+Minetest-c55
+Copyright (C) 2010-2012 celeron55, Perttu Ahola <celeron55@gmail.com>
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation; either version 2.1 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#ifndef MAPDATABASE_LOG_HEADER
+#define MAPDATABASE_LOG_HEADER
+
+#include "mapdatabase.h"
+#include "porting.h" // sleep_ms
+#include "util/container.h"
+#include "util/thread.h"
+#include <fstream>
+
+/*
+	Append-only log of blocks in <world>/maplog/.
+
+	Blocks are only ever appended to the newest segment file, so saving
+	is sequential I/O. An index in memory tells where the newest copy of
+	each block is. A segment is sealed when it grows over a limit; sealed
+	segments are immutable.
+
+	A background thread (if enabled) compacts sealed segments that are mostly
+	outdated copies: the still current blocks are appended to the newest
+	segment and the old file is deleted.
+
+	Segment file "<id>.seg" (8 hex digits, ids are increasing):
+		u8[4] "MTLG"
+		u16 format version (1)
+		records:
+			u8 type (1 = block, 2 = deleted block)
+			s16 x, s16 y, s16 z
+			u32 data length (0 for a deleted block)
+			u32 adler32 of data
+			u8[length] data
+
+	A deleted block leaves a record that hides the older copies. The
+	oldest segment that may have a copy of a block is remembered; the
+	record is needed while there is a segment from that one up to the
+	record. When the segment of the record is compacted, the record is
+	moved along if it is still needed, and it is forgotten when the
+	segments that may have a copy have been compacted away. Needed
+	records count as current data of their segment.
+
+	Each run appends to a new segment, so a record cut short by a crash
+	only ends the scan of that segment.
+
+	At a clean shutdown the index is written to "index"; it is used on
+	the next startup instead of reading all segments, and removed while
+	the database is open.
+*/
+
+class MapDatabaseLog;
+
+class MapDatabaseLogCompactThread : public SimpleThread
+{
+public:
+	MapDatabaseLogCompactThread(MapDatabaseLog *db):
+		SimpleThread(),
+		m_db(db)
+	{}
+
+	void * Thread();
+
+private:
+	MapDatabaseLog *m_db;
+};
+
+class MapDatabaseLog : public MapDatabase
+{
+public:
+	// Segments are compacted in the background only if compact is true;
+	// otherwise the existing files are never rewritten or deleted
+	MapDatabaseLog(const std::string &savedir, bool compact=false);
+	~MapDatabaseLog();
+
+	std::string getName() { return "log"; }
+
+	bool loadBlock(v3s16 blockpos, std::string *blob);
+	void loadBlocksInArea(v3s16 blockpos_min, v3s16 blockpos_max,
+			core::map<v3s16, std::string> &dst);
+	void saveBlock(v3s16 blockpos, const std::string &blob);
+	void saveBlocks(core::map<v3s16, std::string> &blobs);
+	void deleteBlock(v3s16 blockpos);
+	void deleteBlocks(core::list<v3s16> &positions);
+	void endSave();
+	void listAllLoadableBlocks(core::list<v3s16> &dst);
+	void listAllLoadableBlocks(MapBlockPosSet &dst);
+
+	/*
+		Compaction
+	*/
+	// Returns the id of a sealed segment of which less than the given
+	// fraction is current data or which is small, or 0 if there is none
+	u32 findSegmentToCompact(float max_live_fraction);
+	// Moves the current blocks out of the segment and deletes it
+	void compactSegment(u32 id);
+
+	// For statistics and testing
+	u32 getSegmentCount();
+	u32 getBlockCount();
+	// Number of deletion records that are needed
+	u32 getDeletedCount();
+
+private:
+	struct IndexEntry
+	{
+		u32 segment;
+		// Offset of the record header
+		u32 offset;
+		u32 length;
+		// The oldest segment that may have a copy of the block
+		u32 oldest;
+	};
+
+	// A deletion record that hides older copies of a block
+	struct DeletedEntry
+	{
+		u32 segment;
+		u32 offset;
+		// As in IndexEntry
+		u32 oldest;
+	};
+
+	struct SegmentInfo
+	{
+		u32 size;
+		// Bytes of records that are current in the index
+		u32 live_size;
+	};
+
+	// These need m_mutex to be locked
+	SegmentInfo & getSegment(u32 id);
+	bool open(bool create);
+	void scanSegment(u32 id);
+	bool readIndexFile();
+	void writeIndexFile();
+	void startNewSegment();
+	void appendRecord(v3s16 p, const std::string &data);
+	void appendDeleteRecord(v3s16 p);
+	// Writes a deletion record that hides the copies from segment oldest
+	// on
+	void writeDeleteRecord(v3s16 p, u32 oldest);
+	// Forgets a deletion record that is not needed anymore
+	void removeDeleted(core::map<v3s16, DeletedEntry>::Node *n);
+	// True if a segment of an id from min_id to max_id exists
+	bool hasSegmentInRange(u32 min_id, u32 max_id);
+	// Forgets the deletion records of which no copy can be left
+	void retireDeleteRecords();
+	void writeRecordHeader(u8 type, v3s16 p, const std::string &data);
+	bool readRecord(const IndexEntry &e, v3s16 p, std::string *data);
+	std::ifstream * getReader(u32 id);
+	void closeReader(u32 id);
+	std::string getSegmentPath(u32 id);
+
+	std::string m_dir;
+	JMutex m_mutex;
+	bool m_opened;
+
+	core::map<v3s16, IndexEntry> m_index;
+	// Deleted blocks of which there may be older copies
+	core::map<v3s16, DeletedEntry> m_deleted;
+	core::map<u32, SegmentInfo> m_segments;
+	// Segments that failed to compact
+	core::map<u32, bool> m_uncompactable;
+
+	u32 m_next_segment_id;
+	// The segment that is appended to
+	u32 m_active_id;
+	std::ofstream m_active;
+	// Has data that has not been flushed to m_active
+	bool m_active_unflushed;
+
+	// Open files of segments for reading
+	core::map<u32, std::ifstream*> m_readers;
+
+	bool m_compact;
+	MapDatabaseLogCompactThread m_compactor;
+};
+
+#endif
+
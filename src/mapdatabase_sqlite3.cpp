@@ -0,0 +1,346 @@
+/*
+Minetest-c55
+Copyright (C) 2010-2012 celeron55, Perttu Ahola <celeron55@gmail.com>
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation; either version 2.1 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include "mapdatabase_sqlite3.h"
+#include <jmutexautolock.h>
+#include "filesys.h"
+#include "exceptions.h"
+#include "log.h"
+#include "debug.h"
+
+MapDatabaseSQLite3::MapDatabaseSQLite3(const std::string &savedir):
+	m_savedir(savedir),
+	m_in_transaction(false),
+	m_database(NULL),
+	m_database_read(NULL),
+	m_database_read_range(NULL),
+	m_database_write(NULL),
+	m_database_delete(NULL),
+	m_database_list(NULL)
+{
+	m_mutex.Init();
+}
+
+MapDatabaseSQLite3::~MapDatabaseSQLite3()
+{
+	/*
+		Close database if it was opened
+	*/
+	if(m_database_read)
+		sqlite3_finalize(m_database_read);
+	if(m_database_read_range)
+		sqlite3_finalize(m_database_read_range);
+	if(m_database_write)
+		sqlite3_finalize(m_database_write);
+	if(m_database_delete)
+		sqlite3_finalize(m_database_delete);
+	if(m_database_list)
+		sqlite3_finalize(m_database_list);
+	if(m_database)
+		sqlite3_close(m_database);
+}
+
+void MapDatabaseSQLite3::createDatabase()
+{
+	int e;
+	assert(m_database);
+	e = sqlite3_exec(m_database,
+		"CREATE TABLE IF NOT EXISTS `blocks` ("
+			"`pos` INT NOT NULL PRIMARY KEY,"
+			"`data` BLOB"
+		");"
+	, NULL, NULL, NULL);
+	if(e == SQLITE_ABORT)
+		throw FileNotGoodException("Could not create database structure");
+	else
+		infostream<<"MapDatabaseSQLite3: Database structure was created";
+}
+
+bool MapDatabaseSQLite3::verifyDatabase(bool create)
+{
+	if(m_database)
+		return true;
+	
+	std::string dbp = m_savedir + DIR_DELIM + "map.sqlite";
+	bool needs_create = false;
+	int d;
+	
+	/*
+		Open the database connection
+	*/
+
+	if(!fs::PathExists(dbp))
+	{
+		// Don't do anything with sqlite unless something is really saved
+		if(!create)
+			return false;
+		needs_create = true;
+	}
+
+	fs::CreateAllDirs(m_savedir);
+
+	d = sqlite3_open_v2(dbp.c_str(), &m_database, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE, NULL);
+	if(d != SQLITE_OK) {
+		infostream<<"WARNING: Database failed to open: "<<sqlite3_errmsg(m_database)<<std::endl;
+		throw FileNotGoodException("Cannot open database file");
+	}
+	
+	if(needs_create)
+		createDatabase();
+
+	d = sqlite3_prepare(m_database, "SELECT `data` FROM `blocks` WHERE `pos`=? LIMIT 1", -1, &m_database_read, NULL);
+	if(d != SQLITE_OK) {
+		infostream<<"WARNING: Database read statment failed to prepare: "<<sqlite3_errmsg(m_database)<<std::endl;
+		throw FileNotGoodException("Cannot prepare read statement");
+	}
+	
+	d = sqlite3_prepare(m_database, "SELECT `pos`, `data` FROM `blocks` WHERE `pos` BETWEEN ? AND ?", -1, &m_database_read_range, NULL);
+	if(d != SQLITE_OK) {
+		infostream<<"WARNING: Database range read statment failed to prepare: "<<sqlite3_errmsg(m_database)<<std::endl;
+		throw FileNotGoodException("Cannot prepare read statement");
+	}
+	
+	d = sqlite3_prepare(m_database, "REPLACE INTO `blocks` VALUES(?, ?)", -1, &m_database_write, NULL);
+	if(d != SQLITE_OK) {
+		infostream<<"WARNING: Database write statment failed to prepare: "<<sqlite3_errmsg(m_database)<<std::endl;
+		throw FileNotGoodException("Cannot prepare write statement");
+	}
+	
+	d = sqlite3_prepare(m_database, "DELETE FROM `blocks` WHERE `pos`=?", -1, &m_database_delete, NULL);
+	if(d != SQLITE_OK) {
+		infostream<<"WARNING: Database delete statment failed to prepare: "<<sqlite3_errmsg(m_database)<<std::endl;
+		throw FileNotGoodException("Cannot prepare delete statement");
+	}
+	
+	d = sqlite3_prepare(m_database, "SELECT `pos` FROM `blocks`", -1, &m_database_list, NULL);
+	if(d != SQLITE_OK) {
+		infostream<<"WARNING: Database list statment failed to prepare: "<<sqlite3_errmsg(m_database)<<std::endl;
+		throw FileNotGoodException("Cannot prepare read statement");
+	}
+	
+	infostream<<"MapDatabaseSQLite3: Database opened"<<std::endl;
+	return true;
+}
+
+sqlite3_int64 MapDatabaseSQLite3::getBlockAsInteger(const v3s16 pos)
+{
+	return (sqlite3_int64)pos.Z*16777216 +
+		(sqlite3_int64)pos.Y*4096 + (sqlite3_int64)pos.X;
+}
+
+static s32 unsignedToSigned(s32 i, s32 max_positive)
+{
+	if(i < max_positive)
+		return i;
+	else
+		return i - 2*max_positive;
+}
+
+// modulo of a negative number does not work consistently in C
+static sqlite3_int64 pythonmodulo(sqlite3_int64 i, sqlite3_int64 mod)
+{
+	if(i >= 0)
+		return i % mod;
+	return mod - ((-i) % mod);
+}
+
+v3s16 MapDatabaseSQLite3::getIntegerAsBlock(sqlite3_int64 i)
+{
+	s32 x = unsignedToSigned(pythonmodulo(i, 4096), 2048);
+	i = (i - x) / 4096;
+	s32 y = unsignedToSigned(pythonmodulo(i, 4096), 2048);
+	i = (i - y) / 4096;
+	s32 z = unsignedToSigned(pythonmodulo(i, 4096), 2048);
+	return v3s16(x,y,z);
+}
+
+bool MapDatabaseSQLite3::loadBlock(v3s16 blockpos, std::string *blob)
+{
+	JMutexAutoLock lock(m_mutex);
+
+	if(!verifyDatabase(false))
+		return false;
+	
+	if(sqlite3_bind_int64(m_database_read, 1, getBlockAsInteger(blockpos)) != SQLITE_OK)
+		infostream<<"WARNING: Could not bind block position for load: "
+			<<sqlite3_errmsg(m_database)<<std::endl;
+	bool found = false;
+	if(sqlite3_step(m_database_read) == SQLITE_ROW) {
+		const char * data = (const char *)sqlite3_column_blob(m_database_read, 0);
+		size_t len = sqlite3_column_bytes(m_database_read, 0);
+		
+		*blob = std::string(data, len);
+		found = true;
+
+		sqlite3_step(m_database_read);
+	}
+	// We should never get more than 1 row, so ok to reset
+	sqlite3_reset(m_database_read);
+	return found;
+}
+
+void MapDatabaseSQLite3::loadBlocksInArea(v3s16 blockpos_min,
+		v3s16 blockpos_max, core::map<v3s16, std::string> &dst)
+{
+	JMutexAutoLock lock(m_mutex);
+
+	if(!verifyDatabase(false))
+		return;
+
+	/*
+		Positions along X are consecutive integers, so each row of the
+		area is a single range of the primary key.
+	*/
+	for(s16 z=blockpos_min.Z; z<=blockpos_max.Z; z++)
+	for(s16 y=blockpos_min.Y; y<=blockpos_max.Y; y++)
+	{
+		sqlite3_int64 first = getBlockAsInteger(v3s16(blockpos_min.X, y, z));
+		sqlite3_int64 last = getBlockAsInteger(v3s16(blockpos_max.X, y, z));
+		if(sqlite3_bind_int64(m_database_read_range, 1, first) != SQLITE_OK ||
+				sqlite3_bind_int64(m_database_read_range, 2, last) != SQLITE_OK)
+			infostream<<"WARNING: Could not bind block range for load: "
+				<<sqlite3_errmsg(m_database)<<std::endl;
+		while(sqlite3_step(m_database_read_range) == SQLITE_ROW)
+		{
+			v3s16 p = getIntegerAsBlock(
+					sqlite3_column_int64(m_database_read_range, 0));
+			const char * data = (const char *)sqlite3_column_blob(m_database_read_range, 1);
+			size_t len = sqlite3_column_bytes(m_database_read_range, 1);
+			dst.insert(p, std::string(data, len));
+		}
+		sqlite3_reset(m_database_read_range);
+	}
+}
+
+void MapDatabaseSQLite3::writeBlock(v3s16 p3d, const std::string &blob)
+{
+	verifyDatabase(true);
+
+	const char *bytes = blob.c_str();
+
+	if(sqlite3_bind_int64(m_database_write, 1, getBlockAsInteger(p3d)) != SQLITE_OK)
+		infostream<<"WARNING: Block position failed to bind: "<<sqlite3_errmsg(m_database)<<std::endl;
+	if(sqlite3_bind_blob(m_database_write, 2, (void *)bytes, blob.size(), NULL) != SQLITE_OK)
+		infostream<<"WARNING: Block data failed to bind: "<<sqlite3_errmsg(m_database)<<std::endl;
+	int written = sqlite3_step(m_database_write);
+	if(written != SQLITE_DONE)
+		infostream<<"WARNING: Block failed to save ("<<p3d.X<<", "<<p3d.Y<<", "<<p3d.Z<<") "
+		<<sqlite3_errmsg(m_database)<<std::endl;
+	// Make ready for later reuse
+	sqlite3_reset(m_database_write);
+}
+
+void MapDatabaseSQLite3::saveBlock(v3s16 blockpos, const std::string &blob)
+{
+	JMutexAutoLock lock(m_mutex);
+	writeBlock(blockpos, blob);
+}
+
+void MapDatabaseSQLite3::saveBlocks(core::map<v3s16, std::string> &blobs)
+{
+	JMutexAutoLock lock(m_mutex);
+
+	verifyDatabase(true);
+
+	// Nested transactions are not possible
+	bool transaction = !m_in_transaction;
+	if(transaction && sqlite3_exec(m_database, "BEGIN;",
+			NULL, NULL, NULL) != SQLITE_OK)
+		infostream<<"WARNING: saveBlocks(): BEGIN failed, saving"
+				<<" might be slow."<<std::endl;
+
+	for(core::map<v3s16, std::string>::Iterator
+			i = blobs.getIterator(); i.atEnd() == false; i++)
+		writeBlock(i.getNode()->getKey(), i.getNode()->getValue());
+
+	if(transaction && sqlite3_exec(m_database, "COMMIT;",
+			NULL, NULL, NULL) != SQLITE_OK)
+		infostream<<"WARNING: saveBlocks(): COMMIT failed, map might"
+				<<" not have saved."<<std::endl;
+}
+
+void MapDatabaseSQLite3::deleteBlock(v3s16 blockpos)
+{
+	JMutexAutoLock lock(m_mutex);
+
+	if(!verifyDatabase(false))
+		return;
+
+	if(sqlite3_bind_int64(m_database_delete, 1,
+			getBlockAsInteger(blockpos)) != SQLITE_OK)
+		infostream<<"WARNING: Could not bind block position for delete: "
+			<<sqlite3_errmsg(m_database)<<std::endl;
+	if(sqlite3_step(m_database_delete) != SQLITE_DONE)
+		infostream<<"WARNING: Block failed to delete ("<<blockpos.X<<", "
+			<<blockpos.Y<<", "<<blockpos.Z<<") "
+			<<sqlite3_errmsg(m_database)<<std::endl;
+	sqlite3_reset(m_database_delete);
+}
+
+void MapDatabaseSQLite3::beginSave()
+{
+	JMutexAutoLock lock(m_mutex);
+	verifyDatabase(true);
+	if(sqlite3_exec(m_database, "BEGIN;", NULL, NULL, NULL) != SQLITE_OK)
+		infostream<<"WARNING: beginSave() failed, saving might be slow.";
+	else
+		m_in_transaction = true;
+}
+
+void MapDatabaseSQLite3::endSave()
+{
+	JMutexAutoLock lock(m_mutex);
+	verifyDatabase(true);
+	m_in_transaction = false;
+	if(sqlite3_exec(m_database, "COMMIT;", NULL, NULL, NULL) != SQLITE_OK)
+		infostream<<"WARNING: endSave() failed, map might not have saved.";
+}
+
+void MapDatabaseSQLite3::listAllLoadableBlocks(core::list<v3s16> &dst)
+{
+	JMutexAutoLock lock(m_mutex);
+
+	if(!verifyDatabase(false))
+		return;
+	
+	while(sqlite3_step(m_database_list) == SQLITE_ROW)
+	{
+		sqlite3_int64 block_i = sqlite3_column_int64(m_database_list, 0);
+		v3s16 p = getIntegerAsBlock(block_i);
+		//dstream<<"block_i="<<block_i<<" p="<<PP(p)<<std::endl;
+		dst.push_back(p);
+	}
+	sqlite3_reset(m_database_list);
+}
+
+void MapDatabaseSQLite3::listAllLoadableBlocks(MapBlockPosSet &dst)
+{
+	JMutexAutoLock lock(m_mutex);
+
+	if(!verifyDatabase(false))
+		return;
+
+	while(sqlite3_step(m_database_list) == SQLITE_ROW)
+	{
+		sqlite3_int64 block_i = sqlite3_column_int64(m_database_list, 0);
+		dst.insert(getIntegerAsBlock(block_i));
+	}
+	sqlite3_reset(m_database_list);
+}
+
@@ -0,0 +1,81 @@
+/*
+Minetest-c55
+Copyright (C) 2010-2012 celeron55, Perttu Ahola <celeron55@gmail.com>
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation; either version 2.1 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#ifndef MAPDATABASE_SQLITE3_HEADER
+#define MAPDATABASE_SQLITE3_HEADER
+
+#include "mapdatabase.h"
+#include <jmutex.h>
+
+extern "C" {
+	#include "sqlite3.h"
+}
+
+/*
+	The blocks table in <world>/map.sqlite:
+	CREATE TABLE `blocks` (`pos` INT NOT NULL PRIMARY KEY, `data` BLOB);
+*/
+
+class MapDatabaseSQLite3 : public MapDatabase
+{
+public:
+	MapDatabaseSQLite3(const std::string &savedir);
+	~MapDatabaseSQLite3();
+
+	std::string getName() { return "sqlite3"; }
+
+	bool loadBlock(v3s16 blockpos, std::string *blob);
+	void loadBlocksInArea(v3s16 blockpos_min, v3s16 blockpos_max,
+			core::map<v3s16, std::string> &dst);
+	void saveBlock(v3s16 blockpos, const std::string &blob);
+	void saveBlocks(core::map<v3s16, std::string> &blobs);
+	void deleteBlock(v3s16 blockpos);
+	void beginSave();
+	void endSave();
+	void listAllLoadableBlocks(core::list<v3s16> &dst);
+	void listAllLoadableBlocks(MapBlockPosSet &dst);
+
+	// Get an integer suitable for a block
+	static sqlite3_int64 getBlockAsInteger(const v3s16 pos);
+	static v3s16 getIntegerAsBlock(sqlite3_int64 i);
+
+private:
+	// Opens the database if it is not open. If the file doesn't exist,
+	// creates it if create is true and otherwise returns false.
+	// m_mutex has to be locked.
+	bool verifyDatabase(bool create);
+	// Create the database structure
+	void createDatabase();
+	// m_mutex has to be locked
+	void writeBlock(v3s16 blockpos, const std::string &blob);
+
+	std::string m_savedir;
+	JMutex m_mutex;
+	bool m_in_transaction;
+
+	sqlite3 *m_database;
+	sqlite3_stmt *m_database_read;
+	sqlite3_stmt *m_database_read_range;
+	sqlite3_stmt *m_database_write;
+	sqlite3_stmt *m_database_delete;
+	sqlite3_stmt *m_database_list;
+};
+
+#endif
+
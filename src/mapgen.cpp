@@ -29,6 +29,7 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "voxelalgorithms.h"
 #include "profiler.h"
 #include "main.h" // For g_profiler
+#include <vector>
 
 namespace mapgen
 {
@@ -121,13 +122,14 @@ static s16 find_stone_level(VoxelManipulator &vmanip, v2s16 p2d,
 #endif
 
 void make_tree(ManualMapVoxelManipulator &vmanip, v3s16 p0,
-		bool is_apple_tree, INodeDefManager *ndef)
+		bool is_apple_tree, INodeDefManager *ndef, int seed)
 {
+	PseudoRandom pr(seed);
 	MapNode treenode(ndef->getId("mapgen_tree"));
 	MapNode leavesnode(ndef->getId("mapgen_leaves"));
 	MapNode applenode(ndef->getId("mapgen_apple"));
 	
-	s16 trunk_h = myrand_range(4, 5);
+	s16 trunk_h = pr.range(4, 5);
 	v3s16 p1 = p0;
 	for(s16 ii=0; ii<trunk_h; ii++)
 	{
@@ -162,9 +164,9 @@ void make_tree(ManualMapVoxelManipulator &vmanip, v3s16 p0,
 		s16 d = 1;
 
 		v3s16 p(
-			myrand_range(leaves_a.MinEdge.X, leaves_a.MaxEdge.X-d),
-			myrand_range(leaves_a.MinEdge.Y, leaves_a.MaxEdge.Y-d),
-			myrand_range(leaves_a.MinEdge.Z, leaves_a.MaxEdge.Z-d)
+			pr.range(leaves_a.MinEdge.X, leaves_a.MaxEdge.X-d),
+			pr.range(leaves_a.MinEdge.Y, leaves_a.MaxEdge.Y-d),
+			pr.range(leaves_a.MinEdge.Z, leaves_a.MaxEdge.Z-d)
 		);
 
 		for(s16 z=0; z<=d; z++)
@@ -190,7 +192,7 @@ void make_tree(ManualMapVoxelManipulator &vmanip, v3s16 p0,
 			continue;
 		u32 i = leaves_a.index(x,y,z);
 		if(leaves_d[i] == 1) {
-			bool is_apple = myrand_range(0,99) < 10;
+			bool is_apple = pr.range(0,99) < 10;
 			if(is_apple_tree && is_apple) {
 				vmanip.m_data[vi] = applenode;
 			} else {
@@ -1198,13 +1200,37 @@ bool block_is_underground(u64 seed, v3s16 blockpos)
 
 #define AVERAGE_MUD_AMOUNT 4
 
-double base_rock_level_2d(u64 seed, v2s16 p)
+/*
+	The noises that base_rock_level_2d() is made of. Positions are
+	divided by the scale and offset by 0.5.
+*/
+enum
+{
+	BRL_BASE, // The base ground level
+	BRL_HIGHER, // Higher ground level
+	BRL_STEEPNESS, // Steepness factor of cliffs
+	BRL_SELECTOR, // High/low selector
+	BRL_NOISE_COUNT
+};
+
+static const struct
+{
+	s32 seed_offset;
+	int octaves;
+	double persistence;
+	double scale;
+} base_rock_level_noises[BRL_NOISE_COUNT] = {
+	{82341, 5, 0.6, 250.},
+	{85039, 5, 0.6, 500.},
+	{-932, 5, 0.7, 125.},
+	{4213, 5, 0.69, 250.},
+};
+
+static double base_rock_level_from_noise(const double *n)
 {
 	// The base ground level
 	double base = (double)WATER_LEVEL - (double)AVERAGE_MUD_AMOUNT
-			+ 20. * noise2d_perlin(
-			0.5+(float)p.X/250., 0.5+(float)p.Y/250.,
-			seed+82341, 5, 0.6);
+			+ 20. * n[BRL_BASE];
 
 	/*// A bit hillier one
 	double base2 = WATER_LEVEL - 4.0 + 40. * noise2d_perlin(
@@ -1212,11 +1238,8 @@ double base_rock_level_2d(u64 seed, v2s16 p)
 			seed+93413, 6, 0.69);
 	if(base2 > base)
 		base = base2;*/
-#if 1
 	// Higher ground level
-	double higher = (double)WATER_LEVEL + 20. + 16. * noise2d_perlin(
-			0.5+(float)p.X/500., 0.5+(float)p.Y/500.,
-			seed+85039, 5, 0.6);
+	double higher = (double)WATER_LEVEL + 20. + 16. * n[BRL_HIGHER];
 	//higher = 30; // For debugging
 
 	// Limit higher to at least base
@@ -1224,9 +1247,7 @@ double base_rock_level_2d(u64 seed, v2s16 p)
 		higher = base;
 
 	// Steepness factor of cliffs
-	double b = 0.85 + 0.5 * noise2d_perlin(
-			0.5+(float)p.X/125., 0.5+(float)p.Y/125.,
-			seed-932, 5, 0.7);
+	double b = 0.85 + 0.5 * n[BRL_STEEPNESS];
 	b = rangelim(b, 0.0, 1000.0);
 	b = pow(b, 7);
 	b *= 5;
@@ -1245,24 +1266,65 @@ double base_rock_level_2d(u64 seed, v2s16 p)
 	// Offset to more low
 	double a_off = -0.20;
 	// High/low selector
-	/*double a = 0.5 + b * (a_off + noise2d_perlin(
-			0.5+(float)p.X/500., 0.5+(float)p.Y/500.,
-			seed+4213, 6, 0.7));*/
-	double a = (double)0.5 + b * (a_off + noise2d_perlin(
-			0.5+(float)p.X/250., 0.5+(float)p.Y/250.,
-			seed+4213, 5, 0.69));
+	double a = (double)0.5 + b * (a_off + n[BRL_SELECTOR]);
 	// Limit
 	a = rangelim(a, 0.0, 1.0);
 
 	//dstream<<"a="<<a<<std::endl;
 
 	double h = base*(1.0-a) + higher*a;
-#else
-	double h = base;
-#endif
 	return h;
 }
 
+double base_rock_level_2d(u64 seed, v2s16 p)
+{
+	double n[BRL_NOISE_COUNT];
+	for(u32 i=0; i<BRL_NOISE_COUNT; i++)
+	{
+		double scale = base_rock_level_noises[i].scale;
+		n[i] = noise2d_perlin(
+				0.5+(float)p.X/scale, 0.5+(float)p.Y/scale,
+				seed+base_rock_level_noises[i].seed_offset,
+				base_rock_level_noises[i].octaves,
+				base_rock_level_noises[i].persistence);
+	}
+	return base_rock_level_from_noise(n);
+}
+
+/*
+	base_rock_level_2d() of the columns p_min...p_min+size-1, in
+	result[(y-p_min.Y)*size.X + (x-p_min.X)]. The values are the same.
+*/
+void base_rock_level_2d_map(u64 seed, v2s16 p_min, v2s16 size,
+		double *result)
+{
+	std::vector<double> xs(size.X), ys(size.Y);
+	NoiseMap *maps[BRL_NOISE_COUNT];
+	for(u32 i=0; i<BRL_NOISE_COUNT; i++)
+	{
+		double scale = base_rock_level_noises[i].scale;
+		for(s16 x=0; x<size.X; x++)
+			xs[x] = 0.5+(float)(p_min.X+x)/scale;
+		for(s16 y=0; y<size.Y; y++)
+			ys[y] = 0.5+(float)(p_min.Y+y)/scale;
+		maps[i] = new NoiseMap(NoiseParams(NOISE_PERLIN,
+				seed+base_rock_level_noises[i].seed_offset,
+				base_rock_level_noises[i].octaves,
+				base_rock_level_noises[i].persistence, 1.0, 1.0),
+				size.X, size.Y);
+		maps[i]->noiseMap2D(&xs[0], &ys[0]);
+	}
+	for(s32 k=0; k<(s32)size.X*size.Y; k++)
+	{
+		double n[BRL_NOISE_COUNT];
+		for(u32 i=0; i<BRL_NOISE_COUNT; i++)
+			n[i] = maps[i]->result[k];
+		result[k] = base_rock_level_from_noise(n);
+	}
+	for(u32 i=0; i<BRL_NOISE_COUNT; i++)
+		delete maps[i];
+}
+
 s16 find_ground_level_from_noise(u64 seed, v2s16 p2d, s16 precision)
 {
 	return base_rock_level_2d(seed, p2d) + AVERAGE_MUD_AMOUNT;
@@ -1302,6 +1364,85 @@ BiomeType get_biome(u64 seed, v2s16 p2d)
 	return BT_NORMAL;
 };
 
+/*
+	noise2d_perlin(x_off+(float)x/scale, y_off+(float)y/scale, ...) of the
+	columns p_min...p_min+size-1, in the order of base_rock_level_2d_map()
+*/
+static void noise2d_perlin_columns(v2s16 p_min, v2s16 size,
+		double x_off, double y_off, float scale,
+		int seed, int octaves, double persistence, double *result)
+{
+	std::vector<double> xs(size.X), ys(size.Y);
+	for(s16 x=0; x<size.X; x++)
+		xs[x] = x_off+(float)(p_min.X+x)/scale;
+	for(s16 y=0; y<size.Y; y++)
+		ys[y] = y_off+(float)(p_min.Y+y)/scale;
+	NoiseMap map(NoiseParams(NOISE_PERLIN, seed, octaves, persistence,
+			1.0, 1.0), size.X, size.Y);
+	map.noiseMap2D(&xs[0], &ys[0]);
+	for(s32 k=0; k<(s32)size.X*size.Y; k++)
+		result[k] = map.result[k];
+}
+
+// get_biome() of an area of columns, like base_rock_level_2d_map()
+void get_biome_map(u64 seed, v2s16 p_min, v2s16 size, BiomeType *result)
+{
+	std::vector<double> n(size.X * size.Y);
+	noise2d_perlin_columns(p_min, size, 0.6, 0.2, 250, seed+9130, 3, 0.50,
+			&n[0]);
+	for(s32 k=0; k<(s32)size.X*size.Y; k++)
+		result[k] = n[k] > 0.35 ? BT_DESERT : BT_NORMAL;
+}
+
+/*
+	The 2D values of the columns of the central chunk, which the stages
+	of make_block() need. They are calculated once, with noise maps, and
+	are the same as what the functions of single columns give.
+*/
+struct ChunkColumns
+{
+	ChunkColumns(u64 seed, v2s16 p_min_, v2s16 size_);
+
+	u32 index(v2s16 p) const
+	{
+		return (p.Y - p_min.Y) * size.X + (p.X - p_min.X);
+	}
+
+	v2s16 p_min;
+	v2s16 size;
+	// base_rock_level_2d()
+	std::vector<double> rock_level;
+	// get_biome()
+	std::vector<BiomeType> biome;
+	// get_mud_add_amount()
+	std::vector<double> mud_add_amount;
+	// get_have_beach()
+	std::vector<bool> have_beach;
+};
+
+ChunkColumns::ChunkColumns(u64 seed, v2s16 p_min_, v2s16 size_):
+	p_min(p_min_),
+	size(size_),
+	rock_level(size.X * size.Y),
+	biome(size.X * size.Y),
+	mud_add_amount(size.X * size.Y),
+	have_beach(size.X * size.Y)
+{
+	base_rock_level_2d_map(seed, p_min, size, &rock_level[0]);
+	get_biome_map(seed, p_min, size, &biome[0]);
+
+	std::vector<double> n(size.X * size.Y);
+	noise2d_perlin_columns(p_min, size, 0.5, 0.5, 200, seed+91013, 3, 0.55,
+			&n[0]);
+	for(u32 k=0; k<n.size(); k++)
+		mud_add_amount[k] = (float)AVERAGE_MUD_AMOUNT + 2.0 * n[k];
+
+	noise2d_perlin_columns(p_min, size, 0.2, 0.7, 250, seed+59420, 3, 0.50,
+			&n[0]);
+	for(u32 k=0; k<n.size(); k++)
+		have_beach[k] = (n[k] > 0.15);
+}
+
 u32 get_blockseed(u64 seed, v3s16 p)
 {
 	s32 x=p.X, y=p.Y, z=p.Z;
@@ -1410,18 +1551,36 @@ void make_block(BlockMakeData *data)
 	// This is used to guide the cave generation
 	s16 stone_surface_max_y = 0;
 
+	/*
+		Calculate the 2D values of the columns for all stages
+	*/
+	TimeTaker columns_timer("column data");
+	const ChunkColumns columns(data->seed, v2s16(node_min.X, node_min.Z),
+			v2s16(central_area_size.X, central_area_size.Z));
+	g_profiler->avg("EmergeThread: mapgen column data",
+			columns_timer.stop(true) / 1000.0);
+
+	/*
+		The biome that some stages use for the whole chunk. Note that
+		this is at (node_min.X, node_min.Y), not at a column of the chunk.
+	*/
+	BiomeType chunk_biome = get_biome(data->seed,
+			v2s16(node_min.X, node_min.Y));
+
 	/*
 		Generate general ground level to full area
 	*/
 	{
 #if 1
-	TimeTaker timer1("Generating ground level");
+	ScopeProfiler sp(g_profiler, "EmergeThread: mapgen ground level",
+			SPT_AVG);
 	
 	for(s16 x=node_min.X; x<=node_max.X; x++)
 	for(s16 z=node_min.Z; z<=node_max.Z; z++)
 	{
 		// Node position
 		v2s16 p2d = v2s16(x,z);
+		u32 column_i = columns.index(p2d);
 		
 		/*
 			Skip of already generated
@@ -1436,7 +1595,7 @@ void make_block(BlockMakeData *data)
 		float surface_y_f = 0.0;
 
 		// Use perlin noise for ground height
-		surface_y_f = base_rock_level_2d(data->seed, p2d);
+		surface_y_f = columns.rock_level[column_i];
 		
 		/*// Experimental stuff
 		{
@@ -1452,7 +1611,7 @@ void make_block(BlockMakeData *data)
 		if(surface_y > stone_surface_max_y)
 			stone_surface_max_y = surface_y;
 
-		BiomeType bt = get_biome(data->seed, p2d);
+		BiomeType bt = columns.biome[column_i];
 		/*
 			Fill ground with stone
 		*/
@@ -1491,6 +1650,12 @@ void make_block(BlockMakeData *data)
 		Loop this part, it will make stuff look older and newer nicely
 	*/
 
+	// Time spent in the stages of the aging loop
+	u32 caves_ms = 0;
+	u32 add_mud_ms = 0;
+	u32 dirt_blobs_ms = 0;
+	u32 flow_mud_ms = 0;
+
 	const u32 age_loops = 2;
 	for(u32 i_age=0; i_age<age_loops; i_age++)
 	{ // Aging loop
@@ -1501,7 +1666,7 @@ void make_block(BlockMakeData *data)
 #if 1
 	{
 	// 24ms @cs=8
-	//TimeTaker timer1("caves");
+	TimeTaker timer1("caves", &caves_ms);
 
 	/*
 		Make caves (this code is relatively horrible)
@@ -1516,7 +1681,7 @@ void make_block(BlockMakeData *data)
 	PseudoRandom ps2(blockseed+1032);
 	if(ps.range(1, 6) == 1)
 		bruises_count = ps.range(0, ps.range(0, 2));
-	if(get_biome(data->seed, v2s16(node_min.X, node_min.Y)) == BT_DESERT){
+	if(chunk_biome == BT_DESERT){
 		caves_count /= 3;
 		bruises_count /= 3;
 	}
@@ -1786,7 +1951,7 @@ void make_block(BlockMakeData *data)
 #if 1
 	{
 	// 15ms @cs=8
-	TimeTaker timer1("add mud");
+	TimeTaker timer1("add mud", &add_mud_ms);
 
 	/*
 		Add mud to the central chunk
@@ -1797,9 +1962,10 @@ void make_block(BlockMakeData *data)
 	{
 		// Node position in 2d
 		v2s16 p2d = v2s16(x,z);
+		u32 column_i = columns.index(p2d);
 		
 		// Randomize mud amount
-		s16 mud_add_amount = get_mud_add_amount(data->seed, p2d) / 2.0 + 0.5;
+		s16 mud_add_amount = columns.mud_add_amount[column_i] / 2.0 + 0.5;
 
 		// Find ground level
 		s16 surface_y = find_stone_level(vmanip, p2d, ndef);
@@ -1808,7 +1974,7 @@ void make_block(BlockMakeData *data)
 			continue;
 
 		MapNode addnode(c_dirt);
-		BiomeType bt = get_biome(data->seed, p2d);
+		BiomeType bt = columns.biome[column_i];
 
 		if(bt == BT_DESERT)
 			addnode = MapNode(c_desert_sand);
@@ -1818,7 +1984,7 @@ void make_block(BlockMakeData *data)
 		} else if(mud_add_amount <= 0){
 			mud_add_amount = 1 - mud_add_amount;
 			addnode = MapNode(c_gravel);
-		} else if(bt == BT_NORMAL && get_have_beach(data->seed, p2d) &&
+		} else if(bt == BT_NORMAL && columns.have_beach[column_i] &&
 				surface_y + mud_add_amount <= WATER_LEVEL+2){
 			addnode = MapNode(c_sand);
 		}
@@ -1870,12 +2036,13 @@ void make_block(BlockMakeData *data)
 	/*
 		Add blobs of dirt and gravel underground
 	*/
-	if(get_biome(data->seed, v2s16(node_min.X, node_min.Y)) == BT_NORMAL)
+	if(chunk_biome == BT_NORMAL)
 	{
+	TimeTaker timer1("dirt blobs", &dirt_blobs_ms);
 	PseudoRandom pr(blockseed+983);
 	for(int i=0; i<volume_nodes/10/10/10; i++)
 	{
-		bool only_fill_cave = (myrand_range(0,1) != 0);
+		bool only_fill_cave = (pr.range(0,1) != 0);
 		v3s16 size(
 			pr.range(1, 8),
 			pr.range(1, 8),
@@ -1913,7 +2080,7 @@ void make_block(BlockMakeData *data)
 #if 1
 	{
 	// 340ms @cs=8
-	TimeTaker timer1("flow mud");
+	TimeTaker timer1("flow mud", &flow_mud_ms);
 
 	/*
 		Flow mud away from steep edges
@@ -2084,9 +2251,18 @@ void make_block(BlockMakeData *data)
 		END OF AGING LOOP
 	************************/
 
+	g_profiler->avg("EmergeThread: mapgen caves", caves_ms / 1000.0);
+	g_profiler->avg("EmergeThread: mapgen add mud", add_mud_ms / 1000.0);
+	g_profiler->avg("EmergeThread: mapgen dirt blobs",
+			dirt_blobs_ms / 1000.0);
+	g_profiler->avg("EmergeThread: mapgen flow mud", flow_mud_ms / 1000.0);
+
 	/*
 		Add top and bottom side of water to transforming_liquid queue
 	*/
+	{
+	ScopeProfiler sp(g_profiler, "EmergeThread: mapgen liquid queue",
+			SPT_AVG);
 
 	for(s16 x=full_node_min.X; x<=full_node_max.X; x++)
 	for(s16 z=full_node_min.Z; z<=full_node_max.Z; z++)
@@ -2134,9 +2310,13 @@ void make_block(BlockMakeData *data)
 		}
 	}
 
+	}//sp
+
 	/*
 		Grow grass
 	*/
+	{
+	ScopeProfiler sp(g_profiler, "EmergeThread: mapgen grass", SPT_AVG);
 
 	for(s16 x=full_node_min.X; x<=full_node_max.X; x++)
 	for(s16 z=full_node_min.Z; z<=full_node_max.Z; z++)
@@ -2180,11 +2360,17 @@ void make_block(BlockMakeData *data)
 		}
 	}
 
+	}//sp
+
 	/*
 		Generate some trees
 	*/
 	assert(central_area_size.X == central_area_size.Z);
 	{
+		ScopeProfiler sp(g_profiler, "EmergeThread: mapgen trees", SPT_AVG);
+
+		// Same trees every time the chunk is generated
+		PseudoRandom treerandom(blockseed+4211);
 		// Divide area into parts
 		s16 div = 8;
 		s16 sidelen = central_area_size.X / div;
@@ -2212,8 +2398,8 @@ void make_block(BlockMakeData *data)
 			// Put trees in random places on part of division
 			for(u32 i=0; i<tree_count; i++)
 			{
-				s16 x = myrand_range(p2d_min.X, p2d_max.X);
-				s16 z = myrand_range(p2d_min.Y, p2d_max.Y);
+				s16 x = treerandom.range(p2d_min.X, p2d_max.X);
+				s16 z = treerandom.range(p2d_min.Y, p2d_max.Y);
 				s16 y = find_ground_level(vmanip, v2s16(x,z), ndef);
 				// Don't make a tree under water level
 				if(y < WATER_LEVEL)
@@ -2234,7 +2420,7 @@ void make_block(BlockMakeData *data)
 				}
 				p.Y++;
 				// Make a tree
-				make_tree(vmanip, p, false, ndef);
+				make_tree(vmanip, p, false, ndef, treerandom.next());
 			}
 		}
 	}
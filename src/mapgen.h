@@ -42,9 +42,9 @@ namespace mapgen
 	// Main map generation routine
 	void make_block(BlockMakeData *data);
 	
-	// Add a tree
+	// Add a tree; the same seed makes the same tree
 	void make_tree(ManualMapVoxelManipulator &vmanip, v3s16 p0,
-			bool is_apple_tree, INodeDefManager *ndef);
+			bool is_apple_tree, INodeDefManager *ndef, int seed);
 	
 	/*
 		These are used by FarMesh
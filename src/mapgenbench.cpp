@@ -0,0 +1,176 @@
+/*
+Minetest-c55
+Copyright (C) 2010-2012 celeron55, Perttu Ahola <celeron55@gmail.com>
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation; either version 2.1 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+
+#include "mapgenbench.h"
+#include <vector>
+#include "server.h"
+#include "environment.h"
+#include "map.h" // getChunkOfBlock
+#include "mapblock.h"
+#include "mapgen.h"
+#include "nodedef.h"
+#include "subgame.h"
+#include "settings.h"
+#include "profiler.h"
+#include "main.h" // For g_settings and g_profiler
+#include "filesys.h"
+#include "porting.h"
+#include "util/numeric.h"
+#include "util/timetaker.h"
+#include "log.h"
+
+#define PP(x) "("<<(x).X<<","<<(x).Y<<","<<(x).Z<<")"
+
+// FNV-1a
+static u32 hashBytes(u32 h, const void *data, u32 size)
+{
+	const u8 *bytes = (const u8*)data;
+	for(u32 i=0; i<size; i++)
+		h = (h ^ bytes[i]) * 16777619;
+	return h;
+}
+
+/*
+	Hashes the nodes of the blocks as names and params, so that the hash
+	doesn't depend on content ids
+*/
+static u32 hashArea(ServerMap &map, INodeDefManager *ndef,
+		v3s16 blockpos_min, v3s16 blockpos_max)
+{
+	u32 h = 2166136261U;
+	// Hashes of node names by content id; 0 if not calculated yet
+	std::vector<u32> name_hashes(MAX_CONTENT + 1, 0);
+	for(s16 z=blockpos_min.Z; z<=blockpos_max.Z; z++)
+	for(s16 y=blockpos_min.Y; y<=blockpos_max.Y; y++)
+	for(s16 x=blockpos_min.X; x<=blockpos_max.X; x++)
+	{
+		MapBlock *block = map.getBlockNoCreateNoEx(v3s16(x,y,z));
+		u8 generated = (block && block->isGenerated()) ? 1 : 0;
+		h = hashBytes(h, &generated, 1);
+		if(!generated)
+			continue;
+		for(s16 z1=0; z1<MAP_BLOCKSIZE; z1++)
+		for(s16 y1=0; y1<MAP_BLOCKSIZE; y1++)
+		for(s16 x1=0; x1<MAP_BLOCKSIZE; x1++)
+		{
+			MapNode n = block->getNodeNoCheck(v3s16(x1,y1,z1));
+			content_t c = n.getContent();
+			if(name_hashes[c] == 0)
+			{
+				const std::string &name = ndef->get(c).name;
+				name_hashes[c] = hashBytes(2166136261U, name.c_str(),
+						name.size());
+			}
+			u8 params[2] = {n.param1, n.param2};
+			h = hashBytes(h, &name_hashes[c], 4);
+			h = hashBytes(h, params, 2);
+		}
+	}
+	return h;
+}
+
+bool benchmarkMapgen(const std::string &savedir,
+		const std::string &configpath, const SubgameSpec &gamespec,
+		v3s16 area_min, v3s16 area_max)
+{
+	if(g_settings->get("fixed_map_seed").empty())
+		g_settings->set("fixed_map_seed", "0");
+
+	v3s16 blockpos_min = getNodeBlockPos(area_min);
+	v3s16 blockpos_max = getNodeBlockPos(area_max);
+
+	bool success = false;
+	fs::RecursiveDelete(savedir);
+	do{ // enable break
+		Server server(savedir, configpath, gamespec, false);
+		ServerMap &map = server.getEnv().getServerMap();
+		INodeDefManager *ndef = server.getNodeDefManager();
+
+		actionstream<<"Mapgen benchmark: Generating blocks "
+				<<PP(blockpos_min)<<"-"<<PP(blockpos_max)
+				<<" with seed "<<map.getSeed()<<std::endl;
+
+		// Trees and some other things are placed with myrand()
+		mysrand(map.getSeed());
+		g_profiler->clear();
+
+		u32 chunks = 0;
+		u32 make_ms = 0;
+		u32 finish_ms = 0;
+		u32 start_ms = porting::getTimeMs();
+		// Chunks that have been generated, by their minimum block
+		core::map<v3s16, bool> done;
+		for(s16 z=blockpos_min.Z; z<=blockpos_max.Z; z++)
+		for(s16 y=blockpos_min.Y; y<=blockpos_max.Y; y++)
+		for(s16 x=blockpos_min.X; x<=blockpos_max.X; x++)
+		{
+			v3s16 chunk_min, chunk_max;
+			getChunkOfBlock(v3s16(x,y,z), chunk_min, chunk_max);
+			if(done.find(chunk_min) != NULL)
+				continue;
+			done.insert(chunk_min, true);
+
+			mapgen::BlockMakeData data;
+			map.initBlockMake(&data, chunk_min);
+			// Over the map limit
+			if(data.no_op)
+				continue;
+			{
+				TimeTaker timer("make_block", &make_ms);
+				mapgen::make_block(&data);
+			}
+			{
+				TimeTaker timer("finishBlockMake", &finish_ms);
+				core::map<v3s16, MapBlock*> modified_blocks;
+				map.finishBlockMake(&data, modified_blocks);
+			}
+			chunks++;
+		}
+		u32 total_ms = porting::getTimeMs() - start_ms;
+
+		if(chunks == 0)
+		{
+			errorstream<<"Mapgen benchmark: Nothing to generate"<<std::endl;
+			break;
+		}
+
+		actionstream<<"Mapgen benchmark: "<<chunks<<" chunks in "
+				<<total_ms<<"ms, "
+				<<(chunks * 1000.0 / MYMAX(total_ms, 1))<<" chunks/s"
+				<<std::endl;
+		actionstream<<"Mapgen benchmark: make_block "
+				<<((float)make_ms / chunks)<<"ms/chunk, finishBlockMake "
+				<<((float)finish_ms / chunks)<<"ms/chunk"<<std::endl;
+		actionstream<<"Mapgen benchmark: Stages (seconds per chunk):"
+				<<std::endl;
+		g_profiler->print(actionstream);
+		actionstream<<"Mapgen benchmark: Peak memory use "
+				<<porting::getPeakMemoryUsageKB()<<"kB"<<std::endl;
+
+		char hash[9];
+		snprintf(hash, sizeof(hash), "%08x",
+				hashArea(map, ndef, blockpos_min, blockpos_max));
+		actionstream<<"Mapgen benchmark: Node hash "<<hash<<std::endl;
+		success = true;
+	}while(false);
+	fs::RecursiveDelete(savedir);
+	return success;
+}
+
@@ -0,0 +1,51 @@
+/*
+Minetest-c55
+Copyright (C) 2010-2012 celeron55, Perttu Ahola <celeron55@gmail.com>
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation; either version 2.1 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+
+#ifndef MAPGENBENCH_HEADER
+#define MAPGENBENCH_HEADER
+
+#include "irrlichttypes_bloated.h"
+#include <string>
+
+struct SubgameSpec;
+
+/*
+	Generates the chunks of an area of the map like EmergeThread does, but
+	without clients or Lua on_generated callbacks, and reports to
+	actionstream:
+	- chunks per second and the time of make_block() and finishBlockMake()
+	- the time of the stages of make_block() (from g_profiler)
+	- peak memory use of the process
+	- a hash of the generated nodes of the area
+
+	The map is generated to a new world in savedir, which is deleted
+	before and after. The seed is fixed_map_seed, or 0 if it is not set.
+	The hash stays the same for the same game, seed and area as long as
+	the map generator makes the same terrain, so it can be used to check
+	that an optimization didn't change anything.
+
+	The area is in node coordinates. Returns false on failure.
+*/
+bool benchmarkMapgen(const std::string &savedir,
+		const std::string &configpath, const SubgameSpec &gamespec,
+		v3s16 area_min, v3s16 area_max);
+
+#endif
+
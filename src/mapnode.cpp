@@ -24,6 +24,7 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "nodedef.h"
 #include "content_mapnode.h" // For mapnode_translate_*_internal
 #include "serialization.h" // For ser_ver_supported
+#include "constants.h" // For MAP_BLOCKSIZE
 #include "util/serialize.h"
 #include <string>
 #include <sstream>
@@ -271,7 +272,8 @@ void MapNode::deSerialize(u8 *source, u8 version)
 }
 void MapNode::serializeBulk(std::ostream &os, int version,
 		const MapNode *nodes, u32 nodecount,
-		u8 content_width, u8 params_width, bool compressed)
+		u8 content_width, u8 params_width, bool compressed,
+		const CompressionParams &compression)
 {
 	if(!ser_ver_supported(version))
 		throw VersionMismatchException("ERROR: MapNode format not supported");
@@ -311,7 +313,7 @@ void MapNode::serializeBulk(std::ostream &os, int version,
 
 	if(compressed)
 	{
-		compressZlib(databuf, os);
+		compressWith(compression, &databuf[0], databuf.getSize(), os);
 	}
 	else
 	{
@@ -322,7 +324,8 @@ void MapNode::serializeBulk(std::ostream &os, int version,
 // Deserialize bulk node data
 void MapNode::deSerializeBulk(std::istream &is, int version,
 		MapNode *nodes, u32 nodecount,
-		u8 content_width, u8 params_width, bool compressed)
+		u8 content_width, u8 params_width, bool compressed,
+		u8 codec)
 {
 	if(!ser_ver_supported(version))
 		throw VersionMismatchException("ERROR: MapNode format not supported");
@@ -337,7 +340,7 @@ void MapNode::deSerializeBulk(std::istream &is, int version,
 	if(compressed)
 	{
 		std::ostringstream os(std::ios_base::binary);
-		decompressZlib(is, os);
+		decompressWith(codec, is, os);
 		std::string s = os.str();
 		if(s.size() != len)
 			throw SerializationError("deSerializeBulkNodes: "
@@ -352,11 +355,50 @@ void MapNode::deSerializeBulk(std::istream &is, int version,
 					"failed to read bulk node data");
 	}
 
+	deSerializeBulkData(&databuf[0], nodes, nodecount, content_width);
+}
+
+void MapNode::deSerializeBulk(BufReader &reader, int version,
+		MapNode *nodes, u32 nodecount,
+		u8 content_width, u8 params_width, bool compressed,
+		u8 codec)
+{
+	if(!ser_ver_supported(version))
+		throw VersionMismatchException("ERROR: MapNode format not supported");
+
+	assert(version >= 22);
+	assert(content_width == 1);
+	assert(params_width == 2);
+
+	u32 len = nodecount * (content_width + params_width);
+	if(!compressed)
+	{
+		deSerializeBulkData(reader.getRaw(len), nodes, nodecount,
+				content_width);
+		return;
+	}
+
+	// Decompress straight to a buffer of the right size; a block fits on
+	// the stack
+	const u32 stack_len = MAP_BLOCKSIZE*MAP_BLOCKSIZE*MAP_BLOCKSIZE*3;
+	u8 stack_buf[stack_len];
+	Buffer<u8> heap_buf(len > stack_len ? len : 0);
+	u8 *databuf = len > stack_len ? *heap_buf : stack_buf;
+	u32 consumed = decompressWith(codec, reader.getData(),
+			reader.getRemaining(), databuf, len);
+	reader.skip(consumed);
+
+	deSerializeBulkData(databuf, nodes, nodecount, content_width);
+}
+
+void MapNode::deSerializeBulkData(const u8 *databuf, MapNode *nodes,
+		u32 nodecount, u8 content_width)
+{
 	// Deserialize content
 	if(content_width == 1)
 	{
 		for(u32 i=0; i<nodecount; i++)
-			nodes[i].param0 = readU8(&databuf[i]);
+			nodes[i].param0 = databuf[i];
 	}
 	/* If param0 is extended to two bytes, use something like this: */
 	/*else if(content_width == 2)
@@ -366,14 +408,14 @@ void MapNode::deSerializeBulk(std::istream &is, int version,
 	}*/
 
 	// Deserialize param1
-	u32 start1 = content_width * nodecount;
+	const u8 *param1 = databuf + content_width * nodecount;
 	for(u32 i=0; i<nodecount; i++)
-		nodes[i].param1 = readU8(&databuf[start1 + i]);
+		nodes[i].param1 = param1[i];
 
 	// Deserialize param2
-	u32 start2 = (content_width + 1) * nodecount;
+	const u8 *param2 = databuf + (content_width + 1) * nodecount;
 	for(u32 i=0; i<nodecount; i++)
-		nodes[i].param2 = readU8(&databuf[start2 + i]);
+		nodes[i].param2 = param2[i];
 }
 
 /*
@@ -24,9 +24,11 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "irr_v3d.h"
 #include "irr_aabb3d.h"
 #include "light.h"
+#include "serialization.h" // CompressionParams
 #include <vector>
 
 class INodeDefManager;
+class BufReader;
 
 /*
 	Naming scheme:
@@ -223,15 +225,27 @@ struct MapNode
 	//   version = serialization version. Must be >= 22
 	//   content_width = the number of bytes of content per node
 	//   params_width = the number of bytes of params per node
-	//   compressed = true to zlib-compress output
+	//   compressed = true to compress output
+	//   compression, codec = the codec used if compressed
 	static void serializeBulk(std::ostream &os, int version,
 			const MapNode *nodes, u32 nodecount,
-			u8 content_width, u8 params_width, bool compressed);
+			u8 content_width, u8 params_width, bool compressed,
+			const CompressionParams &compression = CompressionParams());
 	static void deSerializeBulk(std::istream &is, int version,
 			MapNode *nodes, u32 nodecount,
-			u8 content_width, u8 params_width, bool compressed);
+			u8 content_width, u8 params_width, bool compressed,
+			u8 codec = COMPRESSION_ZLIB);
+	// Same as above, reading straight from a buffer
+	static void deSerializeBulk(BufReader &reader, int version,
+			MapNode *nodes, u32 nodecount,
+			u8 content_width, u8 params_width, bool compressed,
+			u8 codec = COMPRESSION_ZLIB);
 
 private:
+	// Fills nodes from uncompressed bulk data
+	static void deSerializeBulkData(const u8 *databuf, MapNode *nodes,
+			u32 nodecount, u8 content_width);
+
 	// Deprecated serialization methods
 	void serialize_pre22(u8 *dest, u8 version);
 	void deSerialize_pre22(u8 *source, u8 version);
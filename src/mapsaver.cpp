@@ -0,0 +1,272 @@
+/*
+Minetest-c55
+Copyright (C) 2010-2012 celeron55, Perttu Ahola <celeron55@gmail.com>
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation; either version 2.1 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include "mapsaver.h"
+#include <sstream>
+#include "map.h"
+#include "mapblock.h"
+#include "main.h" // For g_profiler
+#include "profiler.h"
+#include "log.h"
+#include "debug.h"
+
+// Maximum number of blocks written in one transaction
+#define MAPSAVER_BATCH_SIZE 256
+
+MapSaveThread::MapSaveThread(ServerMap *map, INodeDefManager *nodedef,
+		u32 max_queue_size):
+	SimpleThread(),
+	m_map(map),
+	m_nodedef(nodedef),
+	m_max_queue_size(max_queue_size)
+{
+	m_mutex.Init();
+	if(m_max_queue_size < 1)
+		m_max_queue_size = 1;
+}
+
+MapSaveThread::~MapSaveThread()
+{
+	stopAndFlush();
+
+	// Nothing should be left, but don't leak if something is
+	JMutexAutoLock lock(m_mutex);
+	for(core::map<v3s16, MapBlockSnapshot*>::Iterator
+			i = m_queued.getIterator(); i.atEnd() == false; i++)
+		delete i.getNode()->getValue();
+	m_queued.clear();
+	m_queue_order.clear();
+}
+
+void MapSaveThread::serializeSnapshot(const MapBlockSnapshot *snapshot,
+		INodeDefManager *nodedef, std::string *blob)
+{
+	/*
+		[0] u8 serialization version
+		[1] data
+	*/
+	std::ostringstream o(std::ios_base::binary);
+	o.write((char*)&snapshot->version, 1);
+	snapshot->serialize(o, nodedef);
+	*blob = o.str();
+}
+
+void MapSaveThread::enqueue(MapBlockSnapshot *snapshot)
+{
+	if(IsRunning() == false)
+	{
+		// Nobody would write it; do it here
+		core::map<v3s16, MapBlockSnapshot*> batch;
+		batch.insert(snapshot->pos, snapshot);
+		writeBatch(batch);
+		delete snapshot;
+		return;
+	}
+
+	bool stalled = false;
+	for(;;)
+	{
+		{
+			JMutexAutoLock lock(m_mutex);
+
+			core::map<v3s16, MapBlockSnapshot*>::Node *n =
+					m_queued.find(snapshot->pos);
+			if(n != NULL)
+			{
+				// Already queued; just replace the data
+				delete n->getValue();
+				n->setValue(snapshot);
+				return;
+			}
+			if(m_queued.size() < m_max_queue_size || IsRunning() == false)
+			{
+				m_queued.insert(snapshot->pos, snapshot);
+				m_queue_order.push_back(snapshot->pos);
+				break;
+			}
+		}
+		// Queue is full; wait for the thread to catch up
+		if(!stalled)
+		{
+			g_profiler->add("MapSaveThread: back-pressure stalls (num)", 1);
+			stalled = true;
+		}
+		ScopeProfiler sp(g_profiler, "MapSaveThread: back-pressure wait");
+		sleep_ms(5);
+	}
+}
+
+bool MapSaveThread::getPending(v3s16 p, std::string *blob)
+{
+	JMutexAutoLock lock(m_mutex);
+
+	// The queued one is newer than the one being written
+	core::map<v3s16, MapBlockSnapshot*>::Node *n = m_queued.find(p);
+	if(n == NULL)
+		n = m_writing.find(p);
+	if(n == NULL)
+		return false;
+
+	serializeSnapshot(n->getValue(), m_nodedef, blob);
+	return true;
+}
+
+void MapSaveThread::getPendingInArea(v3s16 blockpos_min,
+		v3s16 blockpos_max, core::map<v3s16, std::string> &dst)
+{
+	JMutexAutoLock lock(m_mutex);
+
+	// The queued ones are newer, so they are looked at last
+	core::map<v3s16, MapBlockSnapshot*> *sources[2] = {&m_writing, &m_queued};
+	for(u32 k=0; k<2; k++)
+	{
+		for(core::map<v3s16, MapBlockSnapshot*>::Iterator
+				i = sources[k]->getIterator(); i.atEnd() == false; i++)
+		{
+			v3s16 p = i.getNode()->getKey();
+			if(p.X < blockpos_min.X || p.Y < blockpos_min.Y ||
+					p.Z < blockpos_min.Z || p.X > blockpos_max.X ||
+					p.Y > blockpos_max.Y || p.Z > blockpos_max.Z)
+				continue;
+			std::string blob;
+			serializeSnapshot(i.getNode()->getValue(), m_nodedef, &blob);
+			dst.set(p, blob);
+		}
+	}
+}
+
+void MapSaveThread::flush()
+{
+	while(IsRunning())
+	{
+		{
+			JMutexAutoLock lock(m_mutex);
+			if(m_queued.size() == 0 && m_writing.size() == 0)
+				return;
+		}
+		sleep_ms(5);
+	}
+}
+
+void MapSaveThread::stopAndFlush()
+{
+	// The thread exits only after the queue is empty
+	stop();
+}
+
+u32 MapSaveThread::queueSize()
+{
+	JMutexAutoLock lock(m_mutex);
+	return m_queued.size();
+}
+
+void MapSaveThread::writeBatch(core::map<v3s16, MapBlockSnapshot*> &batch)
+{
+	ScopeProfiler sp(g_profiler, "MapSaveThread: write batch", SPT_AVG);
+
+	/*
+		Serialize and compress without holding any locks
+	*/
+	core::map<v3s16, std::string> blobs;
+	for(core::map<v3s16, MapBlockSnapshot*>::Iterator
+			i = batch.getIterator(); i.atEnd() == false; i++)
+	{
+		std::string blob;
+		serializeSnapshot(i.getNode()->getValue(), m_nodedef, &blob);
+		blobs.insert(i.getNode()->getKey(), blob);
+	}
+
+	/*
+		Write in one transaction
+	*/
+	m_map->writeBlockBatch(blobs);
+
+	g_profiler->add("MapSaveThread: blocks written (num)", blobs.size());
+}
+
+void * MapSaveThread::Thread()
+{
+	ThreadStarted();
+
+	log_register_thread("MapSaveThread");
+
+	DSTACK(__FUNCTION_NAME);
+
+	BEGIN_DEBUG_EXCEPTION_HANDLER
+
+	/*
+		When run is set to false, the queue is still written out
+		before exiting.
+	*/
+	for(;;)
+	{
+		core::map<v3s16, MapBlockSnapshot*> batch;
+		{
+			JMutexAutoLock lock(m_mutex);
+
+			g_profiler->avg("MapSaveThread: queue length", m_queued.size());
+
+			while(m_queue_order.size() != 0
+					&& batch.size() < MAPSAVER_BATCH_SIZE)
+			{
+				core::list<v3s16>::Iterator i = m_queue_order.begin();
+				v3s16 p = *i;
+				m_queue_order.erase(i);
+				core::map<v3s16, MapBlockSnapshot*>::Node *n =
+						m_queued.find(p);
+				assert(n);
+				batch.insert(p, n->getValue());
+				m_writing.insert(p, n->getValue());
+				m_queued.remove(p);
+			}
+		}
+
+		if(batch.size() == 0)
+		{
+			if(getRun() == false)
+				break;
+			sleep_ms(20);
+			continue;
+		}
+
+		try{
+			writeBatch(batch);
+		}
+		catch(std::exception &e)
+		{
+			errorstream<<"MapSaveThread: Failed to write "<<batch.size()
+					<<" blocks: "<<e.what()<<std::endl;
+		}
+
+		{
+			JMutexAutoLock lock(m_mutex);
+			m_writing.clear();
+		}
+		for(core::map<v3s16, MapBlockSnapshot*>::Iterator
+				i = batch.getIterator(); i.atEnd() == false; i++)
+			delete i.getNode()->getValue();
+	}
+
+	END_DEBUG_EXCEPTION_HANDLER(errorstream)
+
+	log_deregister_thread();
+
+	return NULL;
+}
+
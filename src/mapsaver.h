@@ -0,0 +1,98 @@
+/*
+Minetest-c55
+Copyright (C) 2010-2012 celeron55, Perttu Ahola <celeron55@gmail.com>
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation; either version 2.1 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#ifndef MAPSAVER_HEADER
+#define MAPSAVER_HEADER
+
+#include "irrlichttypes_bloated.h"
+#include "porting.h" // sleep_ms
+#include "util/container.h"
+#include "util/thread.h"
+#include <string>
+
+class ServerMap;
+class MapBlockSnapshot;
+class INodeDefManager;
+
+/*
+	Writes MapBlocks to the map database in the background.
+
+	The environment thread takes a MapBlockSnapshot of a block and queues
+	it with enqueue(). This thread serializes and compresses the snapshots
+	and writes them in batches, one transaction per batch.
+
+	A block that is queued again before it has been written only gets its
+	snapshot replaced, so it is written once.
+
+	The queue is bounded; enqueue() waits for the thread when the queue
+	is full, which slows down the producer instead of using up memory.
+*/
+
+class MapSaveThread : public SimpleThread
+{
+public:
+	MapSaveThread(ServerMap *map, INodeDefManager *nodedef,
+			u32 max_queue_size);
+	~MapSaveThread();
+
+	void * Thread();
+
+	// Takes ownership of snapshot.
+	// Writes synchronously if the thread is not running.
+	void enqueue(MapBlockSnapshot *snapshot);
+
+	// If the block is waiting to be written, puts the newest serialized
+	// data of it to blob (including the version byte) and returns true.
+	bool getPending(v3s16 p, std::string *blob);
+	// Does getPending() for every block in the area, replacing what is
+	// in dst
+	void getPendingInArea(v3s16 blockpos_min, v3s16 blockpos_max,
+			core::map<v3s16, std::string> &dst);
+
+	// Waits until everything queued so far has been written
+	void flush();
+
+	// Stops the thread after writing everything in the queue
+	void stopAndFlush();
+
+	u32 queueSize();
+
+	// Serializes a snapshot in the format stored in the database
+	static void serializeSnapshot(const MapBlockSnapshot *snapshot,
+			INodeDefManager *nodedef, std::string *blob);
+
+private:
+	// Writes the given snapshots
+	void writeBatch(core::map<v3s16, MapBlockSnapshot*> &batch);
+
+	ServerMap *m_map;
+	INodeDefManager *m_nodedef;
+	u32 m_max_queue_size;
+
+	JMutex m_mutex;
+	// Blocks waiting to be written
+	core::map<v3s16, MapBlockSnapshot*> m_queued;
+	// Write order of m_queued
+	core::list<v3s16> m_queue_order;
+	// Blocks currently being written by the thread
+	core::map<v3s16, MapBlockSnapshot*> m_writing;
+};
+
+#endif
+
@@ -0,0 +1,703 @@
+/*
+Minetest-c55
+Copyright (C) 2010-2012 celeron55, Perttu Ahola <celeron55@gmail.com>
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation; either version 2.1 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include "mapscanner.h"
+#include <cstdio>
+#include <sstream>
+#include <vector>
+#include "mapblock.h"
+#include "mapdatabase.h"
+#include "map.h" // registerWorldCompressionDictionary, getChunkOfBlock
+#include "nodedef.h"
+#include "itemdef.h"
+#include "gamedef.h"
+#include "settings.h"
+#include "main.h" // For g_settings
+#include "serialization.h"
+#include "exceptions.h"
+#include "gettime.h"
+#include "strfnd.h"
+#include "util/timetaker.h"
+#include "log.h"
+#include "debug.h"
+
+#define PP(x) "("<<(x).X<<","<<(x).Y<<","<<(x).Z<<")"
+
+// Blocks are read in boxes of MAPBLOCKPOSSET_REGION_SIZE^2 * this
+#define MAPSCANNER_BATCH_DEPTH 4
+#define MAPSCANNER_REPORT_INTERVAL_MS 2000
+
+void * MapScanThread::Thread()
+{
+	ThreadStarted();
+
+	log_register_thread("MapScanThread");
+
+	DSTACK(__FUNCTION_NAME);
+
+	BEGIN_DEBUG_EXCEPTION_HANDLER
+
+	for(;;)
+	{
+		// Nothing is queued after run has been set to false
+		bool run = getRun();
+		MapScanner::Batch *batch = m_scanner->popBatch();
+		if(batch == NULL)
+		{
+			if(run == false)
+				break;
+			sleep_ms(2);
+			continue;
+		}
+		m_scanner->processBatch(*batch, false);
+		delete batch;
+	}
+
+	END_DEBUG_EXCEPTION_HANDLER(errorstream)
+
+	log_deregister_thread();
+
+	return NULL;
+}
+
+MapScanner::MapScanner(const std::string &name, MapDatabase *database,
+		IGameDef *gamedef, u32 num_threads):
+	m_name(name),
+	m_database(database),
+	m_gamedef(gamedef),
+	m_num_threads(num_threads),
+	m_visitor(NULL),
+	m_start_time(0),
+	m_last_report_time(0)
+{
+	m_mutex.Init();
+	if(m_num_threads < 1)
+		m_num_threads = 1;
+}
+
+MapScanner::~MapScanner()
+{
+	for(u32 i=0; i<m_threads.size(); i++)
+	{
+		m_threads[i]->stop();
+		delete m_threads[i];
+	}
+	for(core::list<Batch*>::Iterator i = m_queue.begin();
+			i != m_queue.end(); i++)
+		delete *i;
+}
+
+MapScanStats MapScanner::run(MapBlockPosSet &positions,
+		MapBlockVisitor *visitor, MapBlockPosSet *skip)
+{
+	m_visitor = visitor;
+	m_stats = MapScanStats();
+	m_stats.blocks_total = positions.size();
+	m_start_time = getTimeMs();
+	m_last_report_time = m_start_time;
+	m_deferred.clear();
+
+	actionstream<<m_name<<": Going through "<<m_stats.blocks_total
+			<<" blocks with "<<m_num_threads<<" threads"<<std::endl;
+
+	for(u32 i=0; i<m_num_threads; i++)
+	{
+		MapScanThread *thread = new MapScanThread(this);
+		thread->Start();
+		m_threads.push_back(thread);
+	}
+
+	/*
+		Read the regions that have blocks in slices
+	*/
+	const s16 d = MAPBLOCKPOSSET_REGION_SIZE;
+	core::list<v3s16> regions;
+	positions.listRegions(regions);
+	for(core::list<v3s16>::Iterator i = regions.begin();
+			i != regions.end(); i++)
+	for(s16 z=0; z<d; z+=MAPSCANNER_BATCH_DEPTH)
+	{
+		v3s16 box_min = *i * d + v3s16(0, 0, z);
+		v3s16 box_max = box_min + v3s16(d-1, d-1, MAPSCANNER_BATCH_DEPTH-1);
+
+		Batch *batch = new Batch;
+		m_database->loadBlocksInArea(box_min, box_max, *batch);
+
+		if(skip != NULL)
+		{
+			core::list<v3s16> skipped;
+			for(Batch::Iterator j = batch->getIterator();
+					j.atEnd() == false; j++)
+			{
+				if(skip->contains(j.getNode()->getKey()))
+					skipped.push_back(j.getNode()->getKey());
+			}
+			for(core::list<v3s16>::Iterator j = skipped.begin();
+					j != skipped.end(); j++)
+				batch->remove(*j);
+			JMutexAutoLock lock(m_mutex);
+			m_stats.blocks_skipped += skipped.size();
+		}
+
+		if(batch->size() == 0)
+		{
+			delete batch;
+			continue;
+		}
+
+		// Wait if the workers have enough to do
+		for(;;)
+		{
+			{
+				JMutexAutoLock lock(m_mutex);
+				if(m_queue.size() < m_num_threads)
+				{
+					m_queue.push_back(batch);
+					break;
+				}
+			}
+			reportProgress(false);
+			sleep_ms(2);
+		}
+		reportProgress(false);
+	}
+
+	// The workers finish the queue before stopping
+	for(u32 i=0; i<m_threads.size(); i++)
+	{
+		m_threads[i]->stop();
+		delete m_threads[i];
+	}
+	m_threads.clear();
+
+	/*
+		Do the blocks that need new node ids here; this thread is allowed
+		to change the node definitions
+	*/
+	if(m_deferred.size() != 0)
+	{
+		infostream<<m_name<<": "<<m_deferred.size()<<" blocks have node"
+				<<" names without ids"<<std::endl;
+		processBatch(m_deferred, true);
+		m_deferred.clear();
+	}
+
+	m_stats.time_ms = getTimeMs() - m_start_time;
+	reportProgress(true);
+
+	m_visitor = NULL;
+	return m_stats;
+}
+
+MapScanner::Batch * MapScanner::popBatch()
+{
+	JMutexAutoLock lock(m_mutex);
+	if(m_queue.size() == 0)
+		return NULL;
+	core::list<Batch*>::Iterator i = m_queue.begin();
+	Batch *batch = *i;
+	m_queue.erase(i);
+	return batch;
+}
+
+void MapScanner::processBatch(Batch &batch, bool allocate_ids)
+{
+	Batch changed;
+	u32 visited = 0;
+	u32 failed = 0;
+	for(Batch::Iterator i = batch.getIterator(); i.atEnd() == false; i++)
+	{
+		v3s16 p = i.getNode()->getKey();
+		std::string changed_blob;
+		BlockResult r = processBlock(p, i.getNode()->getValue(),
+				allocate_ids, &changed_blob);
+		if(r == BLOCK_NEEDS_IDS)
+		{
+			JMutexAutoLock lock(m_mutex);
+			m_deferred.insert(p, i.getNode()->getValue());
+			continue;
+		}
+		if(r == BLOCK_FAILED)
+		{
+			failed++;
+			continue;
+		}
+		visited++;
+		if(r == BLOCK_CHANGED)
+			changed.insert(p, changed_blob);
+	}
+
+	if(changed.size() != 0)
+		m_database->saveBlocks(changed);
+
+	JMutexAutoLock lock(m_mutex);
+	m_stats.blocks_visited += visited;
+	m_stats.blocks_changed += changed.size();
+	m_stats.blocks_failed += failed;
+}
+
+MapScanner::BlockResult MapScanner::processBlock(v3s16 p,
+		const std::string &blob, bool allocate_ids,
+		std::string *changed_blob)
+{
+	MapBlock block(NULL, p, m_gamedef);
+	try{
+		BufReader reader((const u8*)blob.c_str(), blob.size());
+		u8 version = reader.getU8();
+
+		if(block.deSerialize(reader, version, true, allocate_ids) == false)
+			return BLOCK_NEEDS_IDS;
+	}
+	catch(SerializationError &e)
+	{
+		errorstream<<m_name<<": Failed to read block "<<PP(p)
+				<<": "<<e.what()<<std::endl;
+		return BLOCK_FAILED;
+	}
+	catch(VersionMismatchException &e)
+	{
+		errorstream<<m_name<<": Failed to read block "<<PP(p)
+				<<": "<<e.what()<<std::endl;
+		return BLOCK_FAILED;
+	}
+
+	if(m_visitor->visitBlock(&block) == false)
+		return BLOCK_UNCHANGED;
+
+	std::ostringstream os(std::ios_base::binary);
+	u8 version = SER_FMT_VER_HIGHEST;
+	os.write((char*)&version, 1);
+	block.serialize(os, version, true);
+	*changed_blob = os.str();
+	return BLOCK_CHANGED;
+}
+
+void MapScanner::reportProgress(bool force)
+{
+	u32 now = getTimeMs();
+	if(!force && now - m_last_report_time < MAPSCANNER_REPORT_INTERVAL_MS)
+		return;
+	m_last_report_time = now;
+
+	MapScanStats stats;
+	{
+		JMutexAutoLock lock(m_mutex);
+		stats = m_stats;
+	}
+	u32 done = stats.blocks_visited + stats.blocks_failed
+			+ stats.blocks_skipped;
+	float percent = stats.blocks_total == 0 ? 100.0 :
+			100.0 * done / stats.blocks_total;
+	float seconds = (float)(now - m_start_time) / 1000.0;
+	float speed = seconds > 0 ? (float)done / seconds : 0;
+	actionstream<<m_name<<": "<<done<<"/"<<stats.blocks_total
+			<<" blocks ("<<percent<<"%), "<<speed<<" blocks/s, "
+			<<stats.blocks_changed<<" changed, "
+			<<stats.blocks_failed<<" failed"<<std::endl;
+}
+
+/*
+	OfflineGameDef
+*/
+
+OfflineGameDef::OfflineGameDef():
+	m_itemdef(createItemDefManager()),
+	m_nodedef(createNodeDefManager())
+{
+}
+
+OfflineGameDef::~OfflineGameDef()
+{
+	delete m_nodedef;
+	delete m_itemdef;
+}
+
+IItemDefManager* OfflineGameDef::getItemDefManager()
+{
+	return m_itemdef;
+}
+
+INodeDefManager* OfflineGameDef::getNodeDefManager()
+{
+	return m_nodedef;
+}
+
+u16 OfflineGameDef::allocateUnknownNodeId(const std::string &name)
+{
+	return m_nodedef->allocateDummy(name);
+}
+
+bool scanWorldMap(const std::string &savedir, const std::string &name,
+		MapBlockVisitor *visitor, MapScanStats *stats)
+{
+	std::string backend = getWorldMapBackend(savedir);
+	MapDatabase *database = createMapDatabase(backend, savedir);
+	if(database == NULL)
+	{
+		errorstream<<name<<": Unknown map backend \""<<backend<<"\""
+				<<std::endl;
+		return false;
+	}
+	registerWorldCompressionDictionary(savedir);
+
+	MapBlockPosSet positions;
+	{
+		std::string timer_name = name + ": Listing stored blocks";
+		TimeTaker timer(timer_name.c_str());
+		database->listAllLoadableBlocks(positions);
+	}
+
+	OfflineGameDef gamedef;
+	MapScanner scanner(name, database, &gamedef,
+			g_settings->getS32("num_map_scan_threads"));
+	MapScanStats result = scanner.run(positions, visitor);
+	if(stats)
+		*stats = result;
+
+	delete database;
+	return true;
+}
+
+/*
+	Times compressing and decompressing all samples with params, going
+	through them until at least this long has passed
+*/
+#define COMPRESSION_BENCHMARK_MIN_TIME_MS 500
+
+static void benchmarkCompression(const CompressionParams &params,
+		const std::vector<std::string> &samples)
+{
+	u64 raw_bytes = 0;
+	u64 compressed_bytes = 0;
+	std::vector<std::string> compressed(samples.size());
+	for(u32 i=0; i<samples.size(); i++)
+	{
+		std::ostringstream os(std::ios_base::binary);
+		compressWith(params, (const u8*)samples[i].c_str(),
+				samples[i].size(), os);
+		compressed[i] = os.str();
+		raw_bytes += samples[i].size();
+		compressed_bytes += compressed[i].size();
+	}
+
+	u64 compress_bytes = 0;
+	u32 start = getTimeMs();
+	u32 compress_time = 0;
+	do{
+		for(u32 i=0; i<samples.size(); i++)
+		{
+			std::ostringstream os(std::ios_base::binary);
+			compressWith(params, (const u8*)samples[i].c_str(),
+					samples[i].size(), os);
+		}
+		compress_bytes += raw_bytes;
+		compress_time = getTimeMs() - start;
+	}while(compress_time < COMPRESSION_BENCHMARK_MIN_TIME_MS);
+
+	u64 decompress_bytes = 0;
+	start = getTimeMs();
+	u32 decompress_time = 0;
+	std::string dst;
+	do{
+		for(u32 i=0; i<compressed.size(); i++)
+		{
+			dst.clear();
+			decompressWith(params.codec, (const u8*)compressed[i].c_str(),
+					compressed[i].size(), &dst);
+			if(dst != samples[i])
+				throw SerializationError("Compression benchmark: "
+						"data changed in compression");
+		}
+		decompress_bytes += raw_bytes;
+		decompress_time = getTimeMs() - start;
+	}while(decompress_time < COMPRESSION_BENCHMARK_MIN_TIME_MS);
+
+	float mb = 1024.0 * 1024.0;
+	actionstream<<"Compression benchmark: "
+			<<getCompressionCodecName(params.codec);
+	if(params.codec == COMPRESSION_ZLIB)
+		actionstream<<" level "<<params.level;
+	if(params.codec == COMPRESSION_ZLIB && params.dictionary != 0)
+		actionstream<<" with a dictionary";
+	actionstream<<": ratio "
+			<<((float)raw_bytes / (compressed_bytes == 0 ? 1 : compressed_bytes))
+			<<", compress "<<(compress_bytes / mb / (compress_time / 1000.0))
+			<<" MB/s, decompress "
+			<<(decompress_bytes / mb / (decompress_time / 1000.0))
+			<<" MB/s"<<std::endl;
+}
+
+void sampleStoredBlockData(MapDatabase *database, u32 max_blocks,
+		std::vector<std::string> *samples)
+{
+	core::list<v3s16> positions;
+	database->listAllLoadableBlocks(positions);
+	u32 step = positions.size() / (max_blocks == 0 ? 1 : max_blocks);
+	if(step == 0)
+		step = 1;
+
+	u32 sampled = 0;
+	u32 i = 0;
+	for(core::list<v3s16>::Iterator j = positions.begin();
+			j != positions.end() && sampled < max_blocks; j++, i++)
+	{
+		if(i % step != 0)
+			continue;
+		std::string blob;
+		if(!database->loadBlock(*j, &blob))
+			continue;
+		std::string nodes;
+		std::string metadata;
+		try{
+			if(!getBlockUncompressedData(blob, &nodes, &metadata))
+				continue;
+		}
+		catch(SerializationError &e)
+		{
+			errorstream<<"Failed to read block "<<PP(*j)<<" for sampling: "
+					<<e.what()<<std::endl;
+			continue;
+		}
+		samples->push_back(nodes);
+		samples->push_back(metadata);
+		sampled++;
+	}
+}
+
+bool benchmarkWorldCompression(const std::string &savedir, u32 max_blocks)
+{
+	std::string backend = getWorldMapBackend(savedir);
+	MapDatabase *database = createMapDatabase(backend, savedir);
+	if(database == NULL)
+	{
+		errorstream<<"Compression benchmark: Unknown map backend \""
+				<<backend<<"\""<<std::endl;
+		return false;
+	}
+	registerWorldCompressionDictionary(savedir);
+	std::vector<std::string> samples;
+	sampleStoredBlockData(database, max_blocks, &samples);
+	delete database;
+
+	if(samples.empty())
+	{
+		errorstream<<"Compression benchmark: No blocks in the map"<<std::endl;
+		return false;
+	}
+	actionstream<<"Compression benchmark: "<<(samples.size() / 2)
+			<<" blocks"<<std::endl;
+
+	/*
+		The dictionary is trained with half of the blocks, like it would
+		be trained with the blocks that exist at the time
+	*/
+	std::vector<std::string> training_samples;
+	for(u32 i=0; i<samples.size(); i+=4)
+	{
+		training_samples.push_back(samples[i]);
+		training_samples.push_back(samples[i+1]);
+	}
+	u32 dictionary = registerCompressionDictionary(
+			trainCompressionDictionary(training_samples,
+			COMPRESSION_DICTIONARY_MAX_SIZE));
+
+	benchmarkCompression(CompressionParams(COMPRESSION_ZLIB, 1), samples);
+	benchmarkCompression(CompressionParams(COMPRESSION_ZLIB, -1), samples);
+	benchmarkCompression(CompressionParams(COMPRESSION_ZLIB, 9), samples);
+	benchmarkCompression(CompressionParams(COMPRESSION_ZLIB, -1, dictionary),
+			samples);
+	benchmarkCompression(CompressionParams(COMPRESSION_LZ), samples);
+	return true;
+}
+
+bool parseMapAreas(const std::string &s,
+		core::list<core::aabbox3d<s16> > &dst)
+{
+	Strfnd f(s);
+	while(f.atend() == false)
+	{
+		std::string area = trim(f.next(";"));
+		if(area == "")
+			continue;
+		int x1, y1, z1, x2, y2, z2;
+		char end;
+		if(sscanf(area.c_str(), "( %d , %d , %d ) , ( %d , %d , %d )%c",
+				&x1, &y1, &z1, &x2, &y2, &z2, &end) != 6)
+			return false;
+		core::aabbox3d<s16> box(x1, y1, z1, x1, y1, z1);
+		box.addInternalPoint(x2, y2, z2);
+		dst.push_back(box);
+	}
+	return true;
+}
+
+/*
+	Finds the chunks that have to be kept
+*/
+class PruneCheckVisitor : public MapBlockVisitor
+{
+public:
+	PruneCheckVisitor(MapBlockPosSet *keep_chunks):
+		m_keep_chunks(keep_chunks)
+	{
+		m_mutex.Init();
+	}
+
+	bool visitBlock(MapBlock *block)
+	{
+		if(block->isPlayerModified()
+				|| block->m_static_objects.m_stored.size() != 0
+				|| block->m_static_objects.m_active.size() != 0)
+		{
+			v3s16 chunk_min, chunk_max;
+			getChunkOfBlock(block->getPos(), chunk_min, chunk_max);
+			JMutexAutoLock lock(m_mutex);
+			m_keep_chunks->insert(chunk_min);
+		}
+		return false;
+	}
+
+private:
+	MapBlockPosSet *m_keep_chunks;
+	JMutex m_mutex;
+};
+
+/*
+	Generating a chunk writes into the one block border around it (caves,
+	mud flow and trees spread up to a block out of it), and generating
+	its neighbours wrote into it. A chunk next to a kept chunk would come
+	back without what the kept chunk put into it, and would write over
+	the kept chunk; so only chunks with no kept chunk around are pruned.
+*/
+static bool isChunkPrunable(MapBlockPosSet &keep_chunks, v3s16 chunk_min,
+		v3s16 chunk_max)
+{
+	v3s16 size = chunk_max - chunk_min + v3s16(1,1,1);
+	v3s16 d;
+	for(d.Z=-1; d.Z<=1; d.Z++)
+	for(d.Y=-1; d.Y<=1; d.Y++)
+	for(d.X=-1; d.X<=1; d.X++)
+	{
+		v3s16 p = chunk_min + v3s16(d.X*size.X, d.Y*size.Y, d.Z*size.Z);
+		if(keep_chunks.contains(p))
+			return false;
+	}
+	return true;
+}
+
+bool pruneWorldMap(const std::string &savedir,
+		const core::list<core::aabbox3d<s16> > &protected_areas,
+		u32 *blocks_deleted)
+{
+	std::string backend = getWorldMapBackend(savedir);
+	MapDatabase *database = createMapDatabase(backend, savedir);
+	if(database == NULL)
+	{
+		errorstream<<"prunemap: Unknown map backend \""<<backend<<"\""
+				<<std::endl;
+		return false;
+	}
+	registerWorldCompressionDictionary(savedir);
+
+	MapBlockPosSet positions;
+	{
+		TimeTaker timer("prunemap: Listing stored blocks");
+		database->listAllLoadableBlocks(positions);
+	}
+	u32 blocks_total = positions.size();
+
+	/*
+		Chunks in the protected areas are kept without reading them
+	*/
+	MapBlockPosSet keep_chunks;
+	for(core::list<core::aabbox3d<s16> >::ConstIterator
+			i = protected_areas.begin(); i != protected_areas.end(); i++)
+	{
+		v3s16 min = getNodeBlockPos(i->MinEdge);
+		v3s16 max = getNodeBlockPos(i->MaxEdge);
+		v3s16 p;
+		for(p.Z=min.Z; p.Z<=max.Z; p.Z++)
+		for(p.Y=min.Y; p.Y<=max.Y; p.Y++)
+		for(p.X=min.X; p.X<=max.X; p.X++)
+		{
+			v3s16 chunk_min, chunk_max;
+			getChunkOfBlock(p, chunk_min, chunk_max);
+			keep_chunks.insert(chunk_min);
+			// Continue from the next chunk
+			p.X = chunk_max.X;
+		}
+	}
+
+	/*
+		Look for modified blocks
+	*/
+	{
+		OfflineGameDef gamedef;
+		PruneCheckVisitor visitor(&keep_chunks);
+		MapScanner scanner("prunemap", database, &gamedef,
+				g_settings->getS32("num_map_scan_threads"));
+		MapScanStats stats = scanner.run(positions, &visitor);
+		if(stats.blocks_failed != 0)
+		{
+			// Unreadable blocks may be anything; leave the map alone
+			errorstream<<"prunemap: "<<stats.blocks_failed<<" blocks could"
+					<<" not be read, not pruning"<<std::endl;
+			delete database;
+			return false;
+		}
+	}
+
+	/*
+		Delete the blocks of the chunks that have no kept chunk around,
+		one region of the position set at a time
+	*/
+	u32 deleted = 0;
+	const s16 d = MAPBLOCKPOSSET_REGION_SIZE;
+	core::list<v3s16> regions;
+	positions.listRegions(regions);
+	for(core::list<v3s16>::Iterator i = regions.begin();
+			i != regions.end(); i++)
+	{
+		core::list<v3s16> to_delete;
+		v3s16 p;
+		for(p.Z=i->Z*d; p.Z<(i->Z+1)*d; p.Z++)
+		for(p.Y=i->Y*d; p.Y<(i->Y+1)*d; p.Y++)
+		for(p.X=i->X*d; p.X<(i->X+1)*d; p.X++)
+		{
+			if(positions.contains(p) == false)
+				continue;
+			v3s16 chunk_min, chunk_max;
+			getChunkOfBlock(p, chunk_min, chunk_max);
+			if(isChunkPrunable(keep_chunks, chunk_min, chunk_max))
+				to_delete.push_back(p);
+		}
+		if(to_delete.size() == 0)
+			continue;
+		database->deleteBlocks(to_delete);
+		deleted += to_delete.size();
+	}
+
+	actionstream<<"prunemap: Deleted "<<deleted<<" of "<<blocks_total
+			<<" blocks"<<std::endl;
+	if(blocks_deleted)
+		*blocks_deleted = deleted;
+
+	delete database;
+	return true;
+}
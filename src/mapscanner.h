@@ -0,0 +1,227 @@
+/*
+Minetest-c55
+Copyright (C) 2010-2012 celeron55, Perttu Ahola <celeron55@gmail.com>
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation; either version 2.1 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#ifndef MAPSCANNER_HEADER
+#define MAPSCANNER_HEADER
+
+#include "irrlichttypes_bloated.h"
+#include "porting.h" // sleep_ms
+#include "util/container.h"
+#include "util/thread.h"
+#include "gamedef.h"
+#include <string>
+#include <vector>
+
+class MapBlock;
+class MapDatabase;
+class MapBlockPosSet;
+class IWritableItemDefManager;
+class IWritableNodeDefManager;
+
+/*
+	Goes through all blocks stored in a map database without loading them
+	to a Map.
+
+	The blocks are read from the database in batches, one box of blocks
+	at a time, by the thread that calls run(). A pool of worker threads
+	deserializes them, gives them to a MapBlockVisitor and writes back the
+	ones that the visitor changed. Only one batch per worker is read ahead,
+	so memory use doesn't depend on the size of the map.
+
+	Blocks with node names that don't have ids yet are visited in the
+	thread calling run() after the others, because allocating ids changes
+	the node definitions. On a server, that thread is the one that may do
+	it.
+
+	Progress and speed are written to actionstream.
+*/
+
+class MapBlockVisitor
+{
+public:
+	virtual ~MapBlockVisitor() {}
+
+	// Called from several threads at once. Returns true if the block was
+	// changed and has to be written back.
+	virtual bool visitBlock(MapBlock *block) = 0;
+};
+
+struct MapScanStats
+{
+	u32 blocks_total;
+	u32 blocks_visited;
+	u32 blocks_changed;
+	u32 blocks_failed;
+	u32 blocks_skipped;
+	u32 time_ms;
+
+	MapScanStats():
+		blocks_total(0),
+		blocks_visited(0),
+		blocks_changed(0),
+		blocks_failed(0),
+		blocks_skipped(0),
+		time_ms(0)
+	{}
+};
+
+class MapScanner;
+
+class MapScanThread : public SimpleThread
+{
+public:
+	MapScanThread(MapScanner *scanner):
+		SimpleThread(),
+		m_scanner(scanner)
+	{}
+
+	void * Thread();
+
+private:
+	MapScanner *m_scanner;
+};
+
+class MapScanner
+{
+public:
+	// name is used in log messages
+	MapScanner(const std::string &name, MapDatabase *database,
+			IGameDef *gamedef, u32 num_threads);
+	~MapScanner();
+
+	/*
+		Visits the blocks in positions, which should be the stored ones
+		(MapDatabase::listAllLoadableBlocks()). Blocks in skip are left
+		alone. Returns when all have been visited.
+	*/
+	MapScanStats run(MapBlockPosSet &positions, MapBlockVisitor *visitor,
+			MapBlockPosSet *skip=NULL);
+
+private:
+	friend class MapScanThread;
+
+	typedef core::map<v3s16, std::string> Batch;
+
+	enum BlockResult
+	{
+		BLOCK_UNCHANGED,
+		BLOCK_CHANGED,
+		BLOCK_FAILED,
+		// Ids have to be allocated for its node names
+		BLOCK_NEEDS_IDS
+	};
+
+	// Called by the workers. Returns NULL if there is nothing to do now.
+	Batch * popBatch();
+	// Visits the blocks and writes the changed ones
+	void processBatch(Batch &batch, bool allocate_ids);
+	// Puts the new data to changed_blob if the visitor changed the block
+	BlockResult processBlock(v3s16 p, const std::string &blob,
+			bool allocate_ids, std::string *changed_blob);
+	void reportProgress(bool force);
+
+	std::string m_name;
+	MapDatabase *m_database;
+	IGameDef *m_gamedef;
+	u32 m_num_threads;
+	core::array<MapScanThread*> m_threads;
+
+	MapBlockVisitor *m_visitor;
+	u32 m_start_time;
+	u32 m_last_report_time;
+
+	JMutex m_mutex;
+	// Batches read but not taken by a worker
+	core::list<Batch*> m_queue;
+	// Blocks that need ids to be allocated
+	Batch m_deferred;
+	MapScanStats m_stats;
+};
+
+/*
+	Node and item definitions for reading a map without its mods; unknown
+	node names get dummy definitions.
+*/
+class OfflineGameDef : public IGameDef
+{
+public:
+	OfflineGameDef();
+	~OfflineGameDef();
+
+	IItemDefManager* getItemDefManager();
+	INodeDefManager* getNodeDefManager();
+	ICraftDefManager* getCraftDefManager() { return NULL; }
+	ITextureSource* getTextureSource() { return NULL; }
+	u16 allocateUnknownNodeId(const std::string &name);
+	ISoundManager* getSoundManager() { return NULL; }
+	MtEventManager* getEventManager() { return NULL; }
+
+private:
+	IWritableItemDefManager *m_itemdef;
+	IWritableNodeDefManager *m_nodedef;
+};
+
+/*
+	Runs visitor on all stored blocks of a world that is not being served,
+	for maintenance from the command line. Node names get ids as they are
+	found, so the mods of the world are not needed.
+	Returns false if the map could not be opened.
+*/
+bool scanWorldMap(const std::string &savedir, const std::string &name,
+		MapBlockVisitor *visitor, MapScanStats *stats=NULL);
+
+/*
+	Gets the uncompressed bulk node data and node metadata of up to
+	max_blocks stored blocks, spread over the whole map; two samples per
+	block. For training and testing compression.
+*/
+void sampleStoredBlockData(MapDatabase *database, u32 max_blocks,
+		std::vector<std::string> *samples);
+
+/*
+	Compares the compression codecs on up to max_blocks stored blocks of
+	a world, spread over the whole map, for choosing map_compression_disk
+	and map_compression_net. The compression ratio and speed of each are
+	written to actionstream. Returns false if the map could not be read.
+*/
+bool benchmarkWorldCompression(const std::string &savedir, u32 max_blocks);
+
+/*
+	Parses a list of areas in node coordinates, separated by ";":
+	"(x1,y1,z1),(x2,y2,z2); ...". Returns false on a syntax error.
+*/
+bool parseMapAreas(const std::string &s,
+		core::list<core::aabbox3d<s16> > &dst);
+
+/*
+	Deletes the stored blocks of a world that can be generated again as
+	they were. The map generator makes whole chunks at once, so a chunk is
+	kept if any of its stored blocks is player-modified
+	(MapBlock::isPlayerModified()), has objects or touches one of the
+	protected areas (node coordinates). Blocks saved by versions that
+	didn't track modification count as modified. Generating a chunk also
+	writes into the blocks around it, so the chunks next to a kept chunk
+	are kept too.
+	Returns false if the map could not be opened.
+*/
+bool pruneWorldMap(const std::string &savedir,
+		const core::list<core::aabbox3d<s16> > &protected_areas,
+		u32 *blocks_deleted=NULL);
+
+#endif
@@ -24,6 +24,7 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #endif
 #include "exceptions.h"
 #include "mapblock.h"
+#include "map.h"
 
 MapSector::MapSector(Map *parent, v2s16 pos, IGameDef *gamedef):
 		differs_from_disk(false),
@@ -48,7 +49,9 @@ void MapSector::deleteBlocks()
 	core::map<s16, MapBlock*>::Iterator i = m_blocks.getIterator();
 	for(; i.atEnd() == false; i++)
 	{
-		delete i.getNode()->getValue();
+		MapBlock *block = i.getNode()->getValue();
+		m_parent->getBlockIndex()->remove(block->getPos());
+		delete block;
 	}
 
 	// Clear container
@@ -102,6 +105,9 @@ MapBlock * MapSector::createBlankBlock(s16 y)
 	MapBlock *block = createBlankBlockNoInsert(y);
 	
 	m_blocks.insert(y, block);
+	m_parent->getBlockIndex()->insert(block->getPos(), block);
+	block->setModifiedList(m_parent->getModifiedBlocks());
+	block->setUsageList(m_parent->getBlockUsage());
 
 	return block;
 }
@@ -120,6 +126,9 @@ void MapSector::insertBlock(MapBlock *block)
 	
 	// Insert into container
 	m_blocks.insert(block_y, block);
+	m_parent->getBlockIndex()->insert(block->getPos(), block);
+	block->setModifiedList(m_parent->getModifiedBlocks());
+	block->setUsageList(m_parent->getBlockUsage());
 }
 
 void MapSector::deleteBlock(MapBlock *block)
@@ -131,6 +140,7 @@ void MapSector::deleteBlock(MapBlock *block)
 	
 	// Remove from container
 	m_blocks.remove(block_y);
+	m_parent->getBlockIndex()->remove(block->getPos());
 
 	// Delete
 	delete block;
@@ -61,8 +61,13 @@ class MapSector
 	void deleteBlock(MapBlock *block);
 	
 	void getBlocks(core::list<MapBlock*> &dest);
+	u32 getBlockCount()
+	{
+		return m_blocks.size();
+	}
 	
 	// Always false at the moment, because sector contains no metadata.
+	// Set with ServerMap::setSectorDiffersFromDisk().
 	bool differs_from_disk;
 
 protected:
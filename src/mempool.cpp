@@ -0,0 +1,231 @@
+/*
+Minetest-c55
+Copyright (C) 2010 celeron55, Perttu Ahola <celeron55@gmail.com>
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation; either version 2.1 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include "mempool.h"
+#include <stdlib.h>
+#include <new>
+#include <jmutexautolock.h>
+#include "debug.h"
+#include "profiler.h"
+
+/*
+	All pools, for reporting
+*/
+
+static JMutex * createPoolsMutex()
+{
+	JMutex *mutex = new JMutex();
+	mutex->Init();
+	return mutex;
+}
+
+static JMutex * getPoolsMutex()
+{
+	static JMutex *mutex = createPoolsMutex();
+	return mutex;
+}
+
+static core::list<MemoryPool*> * getPools()
+{
+	static core::list<MemoryPool*> *pools = new core::list<MemoryPool*>();
+	return pools;
+}
+
+MemoryPool::MemoryPool(const std::string &name, size_t object_size,
+		u32 objects_per_slab):
+	m_name(name),
+	m_object_size(object_size),
+	m_objects_per_slab(objects_per_slab),
+	m_slabs_with_space(NULL),
+	m_slab_count(0),
+	m_empty_slab_count(0),
+	m_objects_in_use(0)
+{
+	m_mutex.Init();
+	assert(m_objects_per_slab > 0);
+
+	// The object starts where next_free is; keep it aligned to 8 bytes
+	size_t header = offsetof(Chunk, next_free);
+	size_t size = object_size > sizeof(Chunk*) ? object_size : sizeof(Chunk*);
+	m_chunk_size = (header + size + 7) / 8 * 8;
+
+	JMutexAutoLock lock(*getPoolsMutex());
+	getPools()->push_back(this);
+}
+
+MemoryPool::~MemoryPool()
+{
+	{
+		JMutexAutoLock lock(*getPoolsMutex());
+		core::list<MemoryPool*> *pools = getPools();
+		for(core::list<MemoryPool*>::Iterator i = pools->begin();
+				i != pools->end(); i++)
+		{
+			if(*i == this)
+			{
+				pools->erase(i);
+				break;
+			}
+		}
+	}
+
+	// Objects that are still in use are in slabs that are not in the
+	// list; those are lost
+	while(m_slabs_with_space != NULL)
+	{
+		Slab *slab = m_slabs_with_space;
+		unlinkSlab(slab);
+		destroySlab(slab);
+	}
+}
+
+void * MemoryPool::allocate()
+{
+	JMutexAutoLock lock(m_mutex);
+
+	if(m_slabs_with_space == NULL)
+		linkSlab(createSlab());
+
+	Slab *slab = m_slabs_with_space;
+	if(slab->used == 0)
+		m_empty_slab_count--;
+
+	Chunk *chunk = slab->free_chunks;
+	slab->free_chunks = chunk->next_free;
+	slab->used++;
+	if(slab->free_chunks == NULL)
+		unlinkSlab(slab);
+
+	m_objects_in_use++;
+	return &chunk->next_free;
+}
+
+void MemoryPool::free(void *p)
+{
+	if(p == NULL)
+		return;
+
+	JMutexAutoLock lock(m_mutex);
+
+	Chunk *chunk = (Chunk*)((char*)p - offsetof(Chunk, next_free));
+	Slab *slab = chunk->slab;
+
+	if(slab->free_chunks == NULL)
+		linkSlab(slab);
+	chunk->next_free = slab->free_chunks;
+	slab->free_chunks = chunk;
+	slab->used--;
+	m_objects_in_use--;
+
+	if(slab->used == 0)
+	{
+		// Keep one empty slab for the next allocations
+		m_empty_slab_count++;
+		if(m_empty_slab_count > 1)
+		{
+			unlinkSlab(slab);
+			destroySlab(slab);
+		}
+	}
+}
+
+void MemoryPool::reportAll(Profiler *profiler)
+{
+	JMutexAutoLock lock(*getPoolsMutex());
+	core::list<MemoryPool*> *pools = getPools();
+	for(core::list<MemoryPool*>::Iterator i = pools->begin();
+			i != pools->end(); i++)
+		(*i)->report(profiler);
+}
+
+void MemoryPool::report(Profiler *profiler)
+{
+	u32 in_use;
+	u32 slab_count;
+	{
+		JMutexAutoLock lock(m_mutex);
+		in_use = m_objects_in_use;
+		slab_count = m_slab_count;
+	}
+	u32 capacity = slab_count * m_objects_per_slab;
+	profiler->avg("MemoryPool: "+m_name+" in use", in_use);
+	profiler->avg("MemoryPool: "+m_name+" KB",
+			(float)capacity * m_chunk_size / 1024);
+	if(capacity != 0)
+		profiler->avg("MemoryPool: "+m_name+" occupancy (%)",
+				100.0 * in_use / capacity);
+}
+
+MemoryPool::Slab * MemoryPool::createSlab()
+{
+	char *mem = (char*)malloc(sizeof(Slab)
+			+ m_chunk_size * m_objects_per_slab + 8);
+	if(mem == NULL)
+		throw std::bad_alloc();
+
+	Slab *slab = (Slab*)mem;
+	slab->prev = NULL;
+	slab->next = NULL;
+	slab->used = 0;
+	slab->free_chunks = NULL;
+
+	// Chunks start after the header, aligned to 8 bytes
+	size_t start = (sizeof(Slab) + 7) / 8 * 8;
+	for(u32 i=m_objects_per_slab; i>0; i--)
+	{
+		Chunk *chunk = (Chunk*)(mem + start + m_chunk_size * (i - 1));
+		chunk->slab = slab;
+		chunk->next_free = slab->free_chunks;
+		slab->free_chunks = chunk;
+	}
+
+	m_slab_count++;
+	m_empty_slab_count++;
+	return slab;
+}
+
+void MemoryPool::destroySlab(Slab *slab)
+{
+	if(slab->used == 0)
+		m_empty_slab_count--;
+	m_slab_count--;
+	::free(slab);
+}
+
+void MemoryPool::linkSlab(Slab *slab)
+{
+	slab->prev = NULL;
+	slab->next = m_slabs_with_space;
+	if(m_slabs_with_space != NULL)
+		m_slabs_with_space->prev = slab;
+	m_slabs_with_space = slab;
+}
+
+void MemoryPool::unlinkSlab(Slab *slab)
+{
+	if(slab->prev != NULL)
+		slab->prev->next = slab->next;
+	else
+		m_slabs_with_space = slab->next;
+	if(slab->next != NULL)
+		slab->next->prev = slab->prev;
+	slab->prev = NULL;
+	slab->next = NULL;
+}
+
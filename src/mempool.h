@@ -0,0 +1,121 @@
+/*
+Minetest-c55
+Copyright (C) 2010 celeron55, Perttu Ahola <celeron55@gmail.com>
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation; either version 2.1 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#ifndef MEMPOOL_HEADER
+#define MEMPOOL_HEADER
+
+#include "irrlichttypes.h"
+#include <jmutex.h>
+#include <string>
+#include <stddef.h>
+
+class Profiler;
+
+/*
+	Pool of memory for objects of one size, allocated in slabs of many
+	objects. Used for things that are allocated and freed a lot, so
+	that they don't fragment the heap.
+
+	A slab is freed when all of its objects are freed, except for one
+	that is kept for later use.
+
+	Pools live until the program exits, because objects can be freed by
+	destructors of other global objects. Create them with new and don't
+	delete them.
+
+	Thread-safe.
+*/
+
+class MemoryPool
+{
+public:
+	MemoryPool(const std::string &name, size_t object_size,
+			u32 objects_per_slab);
+	~MemoryPool();
+
+	void * allocate();
+	void free(void *p);
+
+	size_t getObjectSize()
+	{
+		return m_object_size;
+	}
+
+	// Adds the occupancy of all pools to the profiler
+	static void reportAll(Profiler *profiler);
+
+private:
+	struct Slab;
+	struct Chunk
+	{
+		Slab *slab;
+		// The object; when the chunk is free, the next free chunk
+		Chunk *next_free;
+	};
+	struct Slab
+	{
+		Slab *prev;
+		Slab *next;
+		u32 used;
+		Chunk *free_chunks;
+	};
+
+	void report(Profiler *profiler);
+	Slab * createSlab();
+	void destroySlab(Slab *slab);
+	void linkSlab(Slab *slab);
+	void unlinkSlab(Slab *slab);
+
+	std::string m_name;
+	size_t m_object_size;
+	// Bytes from the start of a chunk to the next
+	size_t m_chunk_size;
+	u32 m_objects_per_slab;
+
+	JMutex m_mutex;
+	// Slabs that have free chunks
+	Slab *m_slabs_with_space;
+	u32 m_slab_count;
+	u32 m_empty_slab_count;
+	u32 m_objects_in_use;
+};
+
+/*
+	Gives a class operators new and delete that use a pool. Derived
+	classes of another size use the normal heap.
+*/
+#define MEMORYPOOL_OPERATORS(pool)\
+	static void * operator new(size_t size)\
+	{\
+		if(size != (pool)->getObjectSize())\
+			return ::operator new(size);\
+		return (pool)->allocate();\
+	}\
+	static void operator delete(void *p, size_t size)\
+	{\
+		if(p == NULL)\
+			return;\
+		if(size != (pool)->getObjectSize())\
+			::operator delete(p);\
+		else\
+			(pool)->free(p);\
+	}
+
+#endif
+
@@ -48,3 +48,19 @@ void NameIdMapping::deSerialize(std::istream &is)
 	}
 }
 
+void NameIdMapping::deSerialize(BufReader &reader)
+{
+	int version = reader.getU8();
+	if(version != 0)
+		throw SerializationError("unsupported NameIdMapping version");
+	u32 count = reader.getU16();
+	m_id_to_name.clear();
+	m_name_to_id.clear();
+	for(u32 i=0; i<count; i++){
+		u16 id = reader.getU16();
+		std::string name = reader.getString();
+		m_id_to_name[id] = name;
+		m_name_to_id[name] = id;
+	}
+}
+
@@ -26,11 +26,14 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include <map>
 #include "irrlichttypes_bloated.h"
 
+class BufReader;
+
 class NameIdMapping
 {
 public:
 	void serialize(std::ostream &os) const;
 	void deSerialize(std::istream &is);
+	void deSerialize(BufReader &reader);
 	
 	void clear(){
 		m_id_to_name.clear();
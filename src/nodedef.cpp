@@ -28,6 +28,7 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "settings.h"
 #include "nameidmapping.h"
 #include "util/serialize.h"
+#include <jmutexautolock.h>
 
 /*
 	NodeBox
@@ -331,6 +332,8 @@ class CNodeDefManager: public IWritableNodeDefManager
 public:
 	void clear()
 	{
+		JMutexAutoLock lock(m_mapping_mutex);
+
 		m_name_id_mapping.clear();
 		m_name_id_mapping_with_aliases.clear();
 
@@ -376,7 +379,7 @@ class CNodeDefManager: public IWritableNodeDefManager
 			addNameIdMapping(c, f.name);
 		}
 	}
-	// CONTENT_IGNORE = not found
+	// CONTENT_IGNORE = not found. m_mapping_mutex has to be locked.
 	content_t getFreeId(bool require_full_param2)
 	{
 		// If allowed, first search in the large 4-bit-param2 pool
@@ -397,6 +400,7 @@ class CNodeDefManager: public IWritableNodeDefManager
 	}
 	CNodeDefManager()
 	{
+		m_mapping_mutex.Init();
 		clear();
 	}
 	virtual ~CNodeDefManager()
@@ -422,6 +426,7 @@ class CNodeDefManager: public IWritableNodeDefManager
 	}
 	virtual bool getId(const std::string &name, content_t &result) const
 	{
+		JMutexAutoLock lock(m_mapping_mutex);
 		std::map<std::string, content_t>::const_iterator
 			i = m_name_id_mapping_with_aliases.find(name);
 		if(i == m_name_id_mapping_with_aliases.end())
@@ -463,32 +468,16 @@ class CNodeDefManager: public IWritableNodeDefManager
 	// IWritableNodeDefManager
 	virtual void set(content_t c, const ContentFeatures &def)
 	{
-		verbosestream<<"registerNode: registering content id \""<<c
-				<<"\": name=\""<<def.name<<"\""<<std::endl;
-		assert(c <= MAX_CONTENT);
-		// Don't allow redefining CONTENT_IGNORE (but allow air)
-		if(def.name == "ignore" || c == CONTENT_IGNORE){
-			infostream<<"registerNode: WARNING: Ignoring "
-					<<"CONTENT_IGNORE redefinition"<<std::endl;
-			return;
-		}
-		// Check that the special contents are not redefined as different id
-		// because it would mess up everything
-		if((def.name == "ignore" && c != CONTENT_IGNORE) ||
-			(def.name == "air" && c != CONTENT_AIR)){
-			errorstream<<"registerNode: IGNORING ERROR: "
-					<<"trying to register built-in type \""
-					<<def.name<<"\" as different id"<<std::endl;
-			return;
-		}
-		m_content_features[c] = def;
-		if(def.name != "")
-			addNameIdMapping(c, def.name);
+		JMutexAutoLock lock(m_mapping_mutex);
+		setLocked(c, def);
 	}
 	virtual content_t set(const std::string &name,
 			const ContentFeatures &def)
 	{
 		assert(name == def.name);
+		// Finding a free id and taking it is done in one go, so that two
+		// threads allocating unknown nodes don't get the same id
+		JMutexAutoLock lock(m_mapping_mutex);
 		u16 id = CONTENT_IGNORE;
 		bool found = m_name_id_mapping.getId(name, id);  // ignore aliases
 		if(!found){
@@ -507,7 +496,7 @@ class CNodeDefManager: public IWritableNodeDefManager
 			if(name != "")
 				addNameIdMapping(id, name);
 		}
-		set(id, def);
+		setLocked(id, def);
 		return id;
 	}
 	virtual content_t allocateDummy(const std::string &name)
@@ -520,6 +509,7 @@ class CNodeDefManager: public IWritableNodeDefManager
 	virtual void updateAliases(IItemDefManager *idef)
 	{
 		std::set<std::string> all = idef->getAll();
+		JMutexAutoLock lock(m_mapping_mutex);
 		m_name_id_mapping_with_aliases.clear();
 		for(std::set<std::string>::iterator
 				i = all.begin(); i != all.end(); i++)
@@ -736,6 +726,7 @@ class CNodeDefManager: public IWritableNodeDefManager
 			throw SerializationError("unsupported NodeDefinitionManager version");
 		u16 count = readU16(is);
 		std::istringstream is2(deSerializeLongString(is), std::ios::binary);
+		JMutexAutoLock lock(m_mapping_mutex);
 		for(u16 n=0; n<count; n++){
 			u16 i = readU16(is2);
 			if(i > MAX_CONTENT){
@@ -757,6 +748,32 @@ class CNodeDefManager: public IWritableNodeDefManager
 		}
 	}
 private:
+	// m_mapping_mutex has to be locked
+	void setLocked(content_t c, const ContentFeatures &def)
+	{
+		verbosestream<<"registerNode: registering content id \""<<c
+				<<"\": name=\""<<def.name<<"\""<<std::endl;
+		assert(c <= MAX_CONTENT);
+		// Don't allow redefining CONTENT_IGNORE (but allow air)
+		if(def.name == "ignore" || c == CONTENT_IGNORE){
+			infostream<<"registerNode: WARNING: Ignoring "
+					<<"CONTENT_IGNORE redefinition"<<std::endl;
+			return;
+		}
+		// Check that the special contents are not redefined as different id
+		// because it would mess up everything
+		if((def.name == "ignore" && c != CONTENT_IGNORE) ||
+			(def.name == "air" && c != CONTENT_AIR)){
+			errorstream<<"registerNode: IGNORING ERROR: "
+					<<"trying to register built-in type \""
+					<<def.name<<"\" as different id"<<std::endl;
+			return;
+		}
+		m_content_features[c] = def;
+		if(def.name != "")
+			addNameIdMapping(c, def.name);
+	}
+	// m_mapping_mutex has to be locked
 	void addNameIdMapping(content_t i, std::string name)
 	{
 		m_name_id_mapping.set(i, name);
@@ -771,6 +788,14 @@ class CNodeDefManager: public IWritableNodeDefManager
 	// item aliases too. Updated by updateAliases()
 	// Note: Not serialized.
 	std::map<std::string, content_t> m_name_id_mapping_with_aliases;
+	/*
+		Protects the two mappings above and the allocation of ids.
+		Blocks are deserialized outside the environment lock, and their
+		unknown nodes are given ids there, while other threads look up
+		ids by name. The features of an id are only written before the
+		id can be found by name, so they are read without locking.
+	*/
+	mutable JMutex m_mapping_mutex;
 };
 
 IWritableNodeDefManager* createNodeDefManager()
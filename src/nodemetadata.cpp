@@ -67,12 +67,49 @@ void NodeMetadata::deSerialize(std::istream &is)
 	m_inventory->deSerialize(is);
 }
 
+void NodeMetadata::deSerialize(BufReader &reader)
+{
+	m_stringvars.clear();
+	int num_vars = reader.getU32();
+	for(int i=0; i<num_vars; i++){
+		std::string name = reader.getString();
+		std::string var = reader.getLongString();
+		m_stringvars[name] = var;
+	}
+
+	// The inventory is text; read it in place with a stream
+	MemoryStreamBuf buf(reader.getData(), reader.getRemaining());
+	std::istream is(&buf);
+	m_inventory->deSerialize(is);
+	reader.skip(buf.getPosition());
+}
+
 void NodeMetadata::clear()
 {
 	m_stringvars.clear();
 	m_inventory->clear();
 }
 
+u32 NodeMetadata::getMemoryUsage() const
+{
+	u32 usage = sizeof(NodeMetadata) + sizeof(Inventory);
+	for(std::map<std::string, std::string>::const_iterator
+			i = m_stringvars.begin();
+			i != m_stringvars.end(); i++)
+	{
+		// The tree node has about four pointers
+		usage += 4 * sizeof(void*) + 2 * sizeof(std::string)
+				+ i->first.size() + i->second.size();
+	}
+	std::vector<const InventoryList*> lists = m_inventory->getLists();
+	for(u32 i=0; i<lists.size(); i++)
+	{
+		usage += sizeof(InventoryList)
+				+ lists[i]->getSize() * sizeof(ItemStack);
+	}
+	return usage;
+}
+
 /*
 	NodeMetadataList
 */
@@ -152,6 +189,52 @@ void NodeMetadataList::deSerialize(std::istream &is, IGameDef *gamedef)
 	}
 }
 
+void NodeMetadataList::deSerialize(BufReader &reader, IGameDef *gamedef)
+{
+	m_data.clear();
+
+	u8 version = reader.getU8();
+	
+	if(version == 0){
+		// Nothing
+		return;
+	}
+
+	if(version != 1){
+		infostream<<__FUNCTION_NAME<<": version "<<version<<" not supported"
+				<<std::endl;
+		throw SerializationError("NodeMetadataList::deSerialize");
+	}
+
+	u16 count = reader.getU16();
+
+	for(u16 i=0; i<count; i++)
+	{
+		u16 p16 = reader.getU16();
+
+		v3s16 p(0,0,0);
+		p.Z += p16 / MAP_BLOCKSIZE / MAP_BLOCKSIZE;
+		p16 -= p.Z * MAP_BLOCKSIZE * MAP_BLOCKSIZE;
+		p.Y += p16 / MAP_BLOCKSIZE;
+		p16 -= p.Y * MAP_BLOCKSIZE;
+		p.X += p16;
+
+		// The data has to be read even if it is not used
+		NodeMetadata *data = new NodeMetadata(gamedef);
+		data->deSerialize(reader);
+		if(m_data.find(p) != m_data.end())
+		{
+			infostream<<"WARNING: NodeMetadataList::deSerialize(): "
+					<<"already set data at position"
+					<<"("<<p.X<<","<<p.Y<<","<<p.Z<<"): Ignoring."
+					<<std::endl;
+			delete data;
+			continue;
+		}
+		m_data[p] = data;
+	}
+}
+
 NodeMetadataList::~NodeMetadataList()
 {
 	clear();
@@ -181,6 +264,29 @@ void NodeMetadataList::set(v3s16 p, NodeMetadata *d)
 	m_data.insert(std::make_pair(p, d));
 }
 
+void NodeMetadataList::getPositions(std::vector<v3s16> &dst) const
+{
+	for(std::map<v3s16, NodeMetadata*>::const_iterator
+			i = m_data.begin();
+			i != m_data.end(); i++)
+	{
+		dst.push_back(i->first);
+	}
+}
+
+u32 NodeMetadataList::getMemoryUsage() const
+{
+	u32 usage = 0;
+	for(std::map<v3s16, NodeMetadata*>::const_iterator
+			i = m_data.begin();
+			i != m_data.end(); i++)
+	{
+		usage += 4 * sizeof(void*) + sizeof(v3s16)
+				+ i->second->getMemoryUsage();
+	}
+	return usage;
+}
+
 void NodeMetadataList::clear()
 {
 	for(std::map<v3s16, NodeMetadata*>::iterator
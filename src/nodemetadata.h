@@ -24,6 +24,7 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include <string>
 #include <iostream>
 #include <map>
+#include <vector>
 
 /*
 	NodeMetadata stores arbitary amounts of data for special blocks.
@@ -36,6 +37,7 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 
 class Inventory;
 class IGameDef;
+class BufReader;
 
 class NodeMetadata
 {
@@ -45,8 +47,11 @@ class NodeMetadata
 	
 	void serialize(std::ostream &os) const;
 	void deSerialize(std::istream &is);
+	void deSerialize(BufReader &reader);
 	
 	void clear();
+	// Rough bytes of memory used
+	u32 getMemoryUsage() const;
 
 	// Generic key/value store
 	std::string getString(const std::string &name) const
@@ -92,6 +97,7 @@ class NodeMetadataList
 
 	void serialize(std::ostream &os) const;
 	void deSerialize(std::istream &is, IGameDef *gamedef);
+	void deSerialize(BufReader &reader, IGameDef *gamedef);
 	
 	// Get pointer to data
 	NodeMetadata* get(v3s16 p);
@@ -101,6 +107,10 @@ class NodeMetadataList
 	void set(v3s16 p, NodeMetadata *d);
 	// Deletes all
 	void clear();
+	// Positions of the nodes that have metadata
+	void getPositions(std::vector<v3s16> &dst) const;
+	// Rough bytes of memory used by the metadata
+	u32 getMemoryUsage() const;
 	
 private:
 	std::map<v3s16, NodeMetadata*> m_data;
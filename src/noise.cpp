@@ -20,6 +20,7 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include <math.h>
 #include "noise.h"
 #include <iostream>
+#include <vector>
 #include "debug.h"
 
 #define NOISE_MAGIC_X 1619
@@ -423,3 +424,301 @@ double NoiseBuffer::get(double x, double y, double z)
 	if(x <= 0.0 || x >= m_size_x)
 }*/
 
+/*
+	NoiseMapT
+*/
+
+// If a grid covers more lattice cells than this per point, the points
+// are done one at a time
+#define NOISEMAP_MAX_CELLS_PER_POINT 4
+
+/*
+	The lattice coordinate and interpolation factor of each coordinate of
+	an axis, as in noise2d_gradient() and noise3d_gradient(). The range
+	of the lattice coordinates is returned in min and max.
+*/
+template <typename T>
+static void noiseMapAxis(const double *coords, int count, double f,
+		bool ease, int *c0, T *t, int &min, int &max)
+{
+	// An empty range if there are no coordinates
+	min = 0;
+	max = -1;
+	for(int i=0; i<count; i++)
+	{
+		double x = coords[i] * f;
+		int x0 = (x > 0.0 ? (int)x : (int)x - 1);
+		double xl = x - (double)x0;
+		c0[i] = x0;
+		t[i] = ease ? easeCurve(xl) : xl;
+		if(i == 0 || x0 < min)
+			min = x0;
+		if(i == 0 || x0 > max)
+			max = x0;
+	}
+}
+
+template <typename T>
+NoiseMapT<T>::NoiseMapT(const NoiseParams &param_, int sx_, int sy_,
+		int sz_):
+	param(param_),
+	sx(sx_),
+	sy(sy_),
+	sz(sz_)
+{
+	assert(sx > 0 && sy > 0 && sz > 0);
+	result = new T[sx*sy*sz];
+}
+
+template <typename T>
+NoiseMapT<T>::~NoiseMapT()
+{
+	delete[] result;
+}
+
+template <typename T>
+T * NoiseMapT<T>::noiseMap2D(const double *x, const double *y)
+{
+	if(param.type == NOISE_CONSTANT_ONE)
+	{
+		for(int i=0; i<sx*sy; i++)
+			result[i] = 1.0;
+		return result;
+	}
+
+	std::vector<double> xs(sx), ys(sy);
+	for(int i=0; i<sx; i++)
+		xs[i] = x[i] / param.pos_scale;
+	for(int i=0; i<sy; i++)
+		ys[i] = y[i] / param.pos_scale;
+
+	perlin2D(&xs[0], sx, &ys[0], sy, param.type == NOISE_PERLIN_ABS);
+	finish(sx*sy);
+	return result;
+}
+
+template <typename T>
+T * NoiseMapT<T>::noiseMap3D(const double *x, const double *y,
+		const double *z)
+{
+	if(param.type == NOISE_CONSTANT_ONE)
+	{
+		for(int i=0; i<sx*sy*sz; i++)
+			result[i] = 1.0;
+		return result;
+	}
+
+	std::vector<double> xs(sx), ys(sy), zs(sz);
+	for(int i=0; i<sx; i++)
+		xs[i] = x[i] / param.pos_scale;
+	for(int i=0; i<sy; i++)
+		ys[i] = y[i] / param.pos_scale;
+	for(int i=0; i<sz; i++)
+		zs[i] = z[i] / param.pos_scale;
+
+	if(param.type == NOISE_PERLIN_CONTOUR_FLIP_YZ)
+		perlin3D(&xs[0], sx, &zs[0], sz, sx*sy, &ys[0], sy, sx, false);
+	else
+		perlin3D(&xs[0], sx, &ys[0], sy, sx, &zs[0], sz, sx*sy,
+				param.type == NOISE_PERLIN_ABS);
+	finish(sx*sy*sz);
+	return result;
+}
+
+template <typename T>
+void NoiseMapT<T>::perlin2D(const double *c1, int s1,
+		const double *c2, int s2, bool abs)
+{
+	std::vector<int> l1(s1), l2(s2);
+	std::vector<T> t1(s1), t2(s2);
+	std::vector<T> lattice;
+	// Lattice rows interpolated along the first axis at each point
+	std::vector<T> rows;
+
+	for(int i=0; i<s1*s2; i++)
+		result[i] = 0;
+
+	double f = 1.0;
+	double g = 1.0;
+	for(int octave=0; octave<param.octaves; octave++)
+	{
+		int seed = param.seed + octave;
+		int min1, max1, min2, max2;
+		noiseMapAxis(c1, s1, f, true, &l1[0], &t1[0], min1, max1);
+		noiseMapAxis(c2, s2, f, true, &l2[0], &t2[0], min2, max2);
+		int n1 = max1 - min1 + 2;
+		int n2 = max2 - min2 + 2;
+
+		if((double)n1 * n2 > (double)NOISEMAP_MAX_CELLS_PER_POINT
+				* (s1 + 1) * (s2 + 1))
+		{
+			for(int j=0; j<s2; j++)
+			for(int i=0; i<s1; i++)
+			{
+				T v = noise2d_gradient(c1[i]*f, c2[j]*f, seed);
+				result[j*s1 + i] += g * (abs ? fabs(v) : v);
+			}
+		}
+		else
+		{
+			lattice.resize(n1 * n2);
+			for(int y=0; y<n2; y++)
+			for(int x=0; x<n1; x++)
+				lattice[y*n1 + x] = noise2d(min1 + x, min2 + y, seed);
+
+			rows.resize(n2 * s1);
+			for(int y=0; y<n2; y++)
+			{
+				const T *lrow = &lattice[y*n1];
+				T *row = &rows[y*s1];
+				for(int i=0; i<s1; i++)
+				{
+					int x = l1[i] - min1;
+					row[i] = lrow[x] + (lrow[x+1] - lrow[x]) * t1[i];
+				}
+			}
+
+			T gt = g;
+			for(int j=0; j<s2; j++)
+			{
+				const T *u = &rows[(l2[j] - min2) * s1];
+				const T *v = u + s1;
+				T ty = t2[j];
+				T *dst = &result[j*s1];
+				if(abs)
+				{
+					for(int i=0; i<s1; i++)
+						dst[i] += gt * fabs(u[i] + (v[i] - u[i]) * ty);
+				}
+				else
+				{
+					for(int i=0; i<s1; i++)
+						dst[i] += gt * (u[i] + (v[i] - u[i]) * ty);
+				}
+			}
+		}
+
+		f *= 2.0;
+		g *= param.persistence;
+	}
+}
+
+template <typename T>
+void NoiseMapT<T>::perlin3D(const double *c1, int s1,
+		const double *c2, int s2, int stride2,
+		const double *c3, int s3, int stride3, bool abs)
+{
+	std::vector<int> l1(s1), l2(s2), l3(s3);
+	std::vector<T> t1(s1), t2(s2), t3(s3);
+	std::vector<T> lattice;
+	// Lattice values multiplied by the factors of the first axis at each
+	// point: p0 for the lower and p1 for the upper corner
+	std::vector<T> p0, p1;
+
+	for(int k=0; k<s3; k++)
+	for(int j=0; j<s2; j++)
+	for(int i=0; i<s1; i++)
+		result[i + j*stride2 + k*stride3] = 0;
+
+	double f = 1.0;
+	double g = 1.0;
+	for(int octave=0; octave<param.octaves; octave++)
+	{
+		int seed = param.seed + octave;
+		int min1, max1, min2, max2, min3, max3;
+		noiseMapAxis(c1, s1, f, false, &l1[0], &t1[0], min1, max1);
+		noiseMapAxis(c2, s2, f, false, &l2[0], &t2[0], min2, max2);
+		noiseMapAxis(c3, s3, f, false, &l3[0], &t3[0], min3, max3);
+		int n1 = max1 - min1 + 2;
+		int n2 = max2 - min2 + 2;
+		int n3 = max3 - min3 + 2;
+
+		if((double)n1 * n2 * n3 > (double)NOISEMAP_MAX_CELLS_PER_POINT
+				* (s1 + 1) * (s2 + 1) * (s3 + 1))
+		{
+			for(int k=0; k<s3; k++)
+			for(int j=0; j<s2; j++)
+			for(int i=0; i<s1; i++)
+			{
+				T v = noise3d_gradient(c1[i]*f, c2[j]*f, c3[k]*f, seed);
+				result[i + j*stride2 + k*stride3] += g * (abs ? fabs(v) : v);
+			}
+		}
+		else
+		{
+			lattice.resize(n1 * n2 * n3);
+			for(int z=0; z<n3; z++)
+			for(int y=0; y<n2; y++)
+			for(int x=0; x<n1; x++)
+				lattice[(z*n2 + y)*n1 + x] = noise3d(min1 + x, min2 + y,
+						min3 + z, seed);
+
+			p0.resize(n2 * n3 * s1);
+			p1.resize(n2 * n3 * s1);
+			for(int yz=0; yz<n2*n3; yz++)
+			{
+				const T *lrow = &lattice[yz*n1];
+				T *row0 = &p0[yz*s1];
+				T *row1 = &p1[yz*s1];
+				for(int i=0; i<s1; i++)
+				{
+					int x = l1[i] - min1;
+					row0[i] = lrow[x] * (1 - t1[i]);
+					row1[i] = lrow[x+1] * t1[i];
+				}
+			}
+
+			/*
+				The terms are added in the same order and grouping as in
+				triLinearInterpolation(), so that the result is the same
+			*/
+			T gt = g;
+			for(int k=0; k<s3; k++)
+			for(int j=0; j<s2; j++)
+			{
+				int r00 = ((l3[k] - min3)*n2 + (l2[j] - min2)) * s1;
+				int r10 = r00 + s1;
+				int r01 = r00 + n2*s1;
+				int r11 = r01 + s1;
+				const T *a = &p0[r00], *b = &p1[r00];
+				const T *c = &p0[r10], *d = &p1[r10];
+				const T *e = &p0[r01], *h = &p1[r01];
+				const T *m = &p0[r11], *n = &p1[r11];
+				T ty = t2[j];
+				T tz = t3[k];
+				T my = 1 - ty;
+				T mz = 1 - tz;
+				T *dst = &result[j*stride2 + k*stride3];
+				for(int i=0; i<s1; i++)
+				{
+					T v = a[i]*my*mz + b[i]*my*mz + c[i]*ty*mz
+							+ d[i]*ty*mz + e[i]*my*tz + h[i]*my*tz
+							+ m[i]*ty*tz + n[i]*ty*tz;
+					dst[i] += gt * (abs ? fabs(v) : v);
+				}
+			}
+		}
+
+		f *= 2.0;
+		g *= param.persistence;
+	}
+}
+
+template <typename T>
+void NoiseMapT<T>::finish(int count)
+{
+	if(param.type == NOISE_PERLIN_CONTOUR
+			|| param.type == NOISE_PERLIN_CONTOUR_FLIP_YZ)
+	{
+		for(int i=0; i<count; i++)
+			result[i] = contour(param.noise_scale * result[i]);
+	}
+	else
+	{
+		for(int i=0; i<count; i++)
+			result[i] = param.noise_scale * result[i];
+	}
+}
+
+template class NoiseMapT<double>;
+template class NoiseMapT<float>;
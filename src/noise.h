@@ -113,6 +113,57 @@ struct NoiseParams
 
 double noise3d_param(const NoiseParams &param, double x, double y, double z);
 
+/*
+	Noise of a whole 2D or 3D grid of points at once, for map generation.
+
+	Each axis has its own list of coordinates: point (i,j,k) is at
+	(x[i], y[j], z[k]) and its value goes to result[k*sx*sy + j*sx + i].
+	The lattice values of each octave are calculated once for the cells
+	that the grid covers. The points are interpolated a row at a time,
+	with the factors of the row, so the inner loops only go through
+	plain arrays.
+
+	NoiseParams work as in noise3d_param(); a 2D map is the same without
+	the z coordinate.
+
+	NoiseMap (double) does the same arithmetic in the same order as
+	noise3d_param() and noise2d_perlin() and noise2d_perlin_abs() (with
+	pos_scale and noise_scale 1), so that terrain of existing worlds
+	doesn't change; only -ffast-math can make the last bits differ.
+	NoiseMapFloat is faster but its values differ slightly; don't use it
+	where the map generator has used the functions before.
+*/
+template <typename T>
+class NoiseMapT
+{
+public:
+	NoiseMapT(const NoiseParams &param_, int sx_, int sy_, int sz_=1);
+	~NoiseMapT();
+
+	// Fill result and return it
+	T * noiseMap2D(const double *x, const double *y);
+	T * noiseMap3D(const double *x, const double *y, const double *z);
+
+	NoiseParams param;
+	int sx;
+	int sy;
+	int sz;
+	T *result;
+
+private:
+	// The perlin sum of a grid of s1*s2(*s3) points; the value of point
+	// (i,j,k) goes to result[i + j*stride2 + k*stride3]
+	void perlin2D(const double *c1, int s1, const double *c2, int s2,
+			bool abs);
+	void perlin3D(const double *c1, int s1, const double *c2, int s2,
+			int stride2, const double *c3, int s3, int stride3, bool abs);
+	// Applies noise_scale and contour
+	void finish(int count);
+};
+
+typedef NoiseMapT<double> NoiseMap;
+typedef NoiseMapT<float> NoiseMapFloat;
+
 class NoiseBuffer
 {
 public:
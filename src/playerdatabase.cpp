@@ -0,0 +1,345 @@
+/*
+Minetest-c55
+Copyright (C) 2010-2012 celeron55, Perttu Ahola <celeron55@gmail.com>
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation; either version 2.1 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#include "playerdatabase.h"
+#include <fstream>
+#include <sstream>
+#include "player.h"
+#include "filesys.h"
+#include "exceptions.h"
+#include "util/string.h"
+#include "log.h"
+#include "debug.h"
+
+PlayerDatabase::PlayerDatabase(const std::string &savedir,
+		IGameDef *gamedef):
+	m_in_transaction(false),
+	m_database(NULL),
+	m_database_read(NULL),
+	m_database_write(NULL),
+	m_database_list(NULL),
+	m_database_auth_read(NULL),
+	m_database_auth_write(NULL)
+{
+	std::string dbp = savedir + DIR_DELIM + "players.sqlite";
+
+	fs::CreateAllDirs(savedir);
+
+	int d = sqlite3_open_v2(dbp.c_str(), &m_database,
+			SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE, NULL);
+	if(d != SQLITE_OK) {
+		infostream<<"WARNING: Player database failed to open: "
+				<<sqlite3_errmsg(m_database)<<std::endl;
+		sqlite3_close(m_database);
+		m_database = NULL;
+		throw FileNotGoodException("Cannot open player database file");
+	}
+
+	/*
+		Create missing tables and import the old files to them in one
+		transaction, so that an interrupted import is done again
+	*/
+	bool create_players = !tableExists("players");
+	bool create_auth = !tableExists("auth");
+	if(create_players || create_auth)
+		beginSave();
+	if(create_players)
+	{
+		if(sqlite3_exec(m_database,
+				"CREATE TABLE `players` ("
+					"`name` TEXT NOT NULL PRIMARY KEY,"
+					"`data` BLOB"
+				");", NULL, NULL, NULL) != SQLITE_OK)
+			throw FileNotGoodException("Could not create player database structure");
+		infostream<<"PlayerDatabase: Created table players"<<std::endl;
+	}
+	if(create_auth)
+	{
+		if(sqlite3_exec(m_database,
+				"CREATE TABLE `auth` ("
+					"`name` TEXT NOT NULL PRIMARY KEY,"
+					"`password` TEXT NOT NULL,"
+					"`privileges` TEXT NOT NULL"
+				");", NULL, NULL, NULL) != SQLITE_OK)
+			throw FileNotGoodException("Could not create player database structure");
+		infostream<<"PlayerDatabase: Created table auth"<<std::endl;
+	}
+
+	m_database_read = prepare(
+			"SELECT `data` FROM `players` WHERE `name`=? LIMIT 1");
+	m_database_write = prepare(
+			"REPLACE INTO `players` VALUES(?, ?)");
+	m_database_list = prepare(
+			"SELECT `name` FROM `players`");
+	m_database_auth_read = prepare(
+			"SELECT `password`, `privileges` FROM `auth` WHERE `name`=? LIMIT 1");
+	m_database_auth_write = prepare(
+			"REPLACE INTO `auth` VALUES(?, ?, ?)");
+
+	if(create_players)
+		importPlayerFiles(savedir + DIR_DELIM + "players", gamedef);
+	if(create_auth)
+		importAuthFile(savedir + DIR_DELIM + "auth.txt");
+	endSave();
+
+	infostream<<"PlayerDatabase: Database opened"<<std::endl;
+}
+
+PlayerDatabase::~PlayerDatabase()
+{
+	endSave();
+
+	if(m_database_read)
+		sqlite3_finalize(m_database_read);
+	if(m_database_write)
+		sqlite3_finalize(m_database_write);
+	if(m_database_list)
+		sqlite3_finalize(m_database_list);
+	if(m_database_auth_read)
+		sqlite3_finalize(m_database_auth_read);
+	if(m_database_auth_write)
+		sqlite3_finalize(m_database_auth_write);
+	if(m_database)
+		sqlite3_close(m_database);
+}
+
+bool PlayerDatabase::tableExists(const char *name)
+{
+	sqlite3_stmt *stmt = prepare("SELECT `name` FROM `sqlite_master`"
+			" WHERE `type`='table' AND `name`=?");
+	sqlite3_bind_text(stmt, 1, name, -1, NULL);
+	bool exists = (sqlite3_step(stmt) == SQLITE_ROW);
+	sqlite3_finalize(stmt);
+	return exists;
+}
+
+sqlite3_stmt * PlayerDatabase::prepare(const char *sql)
+{
+	sqlite3_stmt *stmt = NULL;
+	int d = sqlite3_prepare(m_database, sql, -1, &stmt, NULL);
+	if(d != SQLITE_OK) {
+		infostream<<"WARNING: Player database statement failed to prepare: "
+				<<sqlite3_errmsg(m_database)<<std::endl;
+		throw FileNotGoodException("Cannot prepare player database statement");
+	}
+	return stmt;
+}
+
+void PlayerDatabase::importPlayerFiles(const std::string &players_path,
+		IGameDef *gamedef)
+{
+	u32 imported = 0;
+
+	std::vector<fs::DirListNode> player_files = fs::GetDirListing(players_path);
+	for(u32 i=0; i<player_files.size(); i++)
+	{
+		if(player_files[i].dir)
+			continue;
+		
+		// Full path to this file
+		std::string path = players_path + DIR_DELIM + player_files[i].name;
+
+		std::string data;
+		{
+			std::ifstream is(path.c_str(), std::ios_base::binary);
+			if(is.good() == false)
+			{
+				infostream<<"Failed to read "<<path<<std::endl;
+				continue;
+			}
+			std::ostringstream os(std::ios_base::binary);
+			os<<is.rdbuf();
+			data = os.str();
+		}
+
+		// Load player to see what is its name
+		RemotePlayer testplayer(gamedef);
+		try{
+			std::istringstream is(data, std::ios_base::binary);
+			testplayer.deSerialize(is);
+		}
+		catch(SerializationError &e)
+		{
+			errorstream<<"Not importing player file "<<path<<": "
+					<<e.what()<<std::endl;
+			continue;
+		}
+
+		std::string playername = testplayer.getName();
+		if(!string_allowed(playername, PLAYERNAME_ALLOWED_CHARS))
+		{
+			infostream<<"Not importing player with invalid name: "
+					<<playername<<std::endl;
+			continue;
+		}
+		std::string existing;
+		if(loadPlayer(playername, &existing))
+		{
+			infostream<<"Not importing "<<path<<": player "<<playername
+					<<" was already imported"<<std::endl;
+			continue;
+		}
+
+		savePlayer(playername, data);
+		imported++;
+	}
+
+	if(imported != 0)
+		actionstream<<"Imported "<<imported<<" players from "
+				<<players_path<<std::endl;
+}
+
+void PlayerDatabase::importAuthFile(const std::string &path)
+{
+	std::ifstream is(path.c_str(), std::ios_base::binary);
+	if(is.good() == false)
+		return;
+
+	u32 imported = 0;
+	std::string line;
+	while(std::getline(is, line))
+	{
+		// <name>:<password hash>:<privilege1,...>
+		line = trim(line);
+		if(line == "")
+			continue;
+		size_t c1 = line.find(':');
+		size_t c2 = c1 == std::string::npos ? c1 : line.find(':', c1 + 1);
+		if(c1 == 0 || c2 == std::string::npos)
+		{
+			errorstream<<"Not importing invalid line in "<<path<<": \""
+					<<line<<"\""<<std::endl;
+			continue;
+		}
+		std::string name = line.substr(0, c1);
+		std::string password = line.substr(c1 + 1, c2 - c1 - 1);
+		std::string privileges = line.substr(c2 + 1);
+		saveAuth(name, password, privileges);
+		imported++;
+	}
+
+	if(imported != 0)
+		actionstream<<"Imported "<<imported<<" authentication entries from "
+				<<path<<std::endl;
+}
+
+bool PlayerDatabase::loadPlayer(const std::string &name, std::string *data)
+{
+	if(sqlite3_bind_text(m_database_read, 1, name.c_str(), name.size(),
+			NULL) != SQLITE_OK)
+		infostream<<"WARNING: Could not bind player name for load: "
+			<<sqlite3_errmsg(m_database)<<std::endl;
+	bool found = false;
+	if(sqlite3_step(m_database_read) == SQLITE_ROW) {
+		const char *bytes = (const char *)sqlite3_column_blob(m_database_read, 0);
+		size_t len = sqlite3_column_bytes(m_database_read, 0);
+		*data = std::string(bytes, len);
+		found = true;
+	}
+	sqlite3_reset(m_database_read);
+	return found;
+}
+
+void PlayerDatabase::savePlayer(const std::string &name,
+		const std::string &data)
+{
+	if(sqlite3_bind_text(m_database_write, 1, name.c_str(), name.size(),
+			NULL) != SQLITE_OK)
+		infostream<<"WARNING: Player name failed to bind: "
+				<<sqlite3_errmsg(m_database)<<std::endl;
+	if(sqlite3_bind_blob(m_database_write, 2, data.c_str(), data.size(),
+			NULL) != SQLITE_OK)
+		infostream<<"WARNING: Player data failed to bind: "
+				<<sqlite3_errmsg(m_database)<<std::endl;
+	if(sqlite3_step(m_database_write) != SQLITE_DONE)
+		errorstream<<"PlayerDatabase: Player \""<<name
+				<<"\" failed to save: "<<sqlite3_errmsg(m_database)
+				<<std::endl;
+	sqlite3_reset(m_database_write);
+}
+
+void PlayerDatabase::listPlayers(core::list<std::string> &dst)
+{
+	while(sqlite3_step(m_database_list) == SQLITE_ROW)
+	{
+		const char *bytes = (const char *)sqlite3_column_text(m_database_list, 0);
+		size_t len = sqlite3_column_bytes(m_database_list, 0);
+		dst.push_back(std::string(bytes, len));
+	}
+	sqlite3_reset(m_database_list);
+}
+
+bool PlayerDatabase::loadAuth(const std::string &name, std::string *password,
+		std::string *privileges)
+{
+	if(sqlite3_bind_text(m_database_auth_read, 1, name.c_str(), name.size(),
+			NULL) != SQLITE_OK)
+		infostream<<"WARNING: Could not bind player name for auth load: "
+			<<sqlite3_errmsg(m_database)<<std::endl;
+	bool found = false;
+	if(sqlite3_step(m_database_auth_read) == SQLITE_ROW) {
+		*password = (const char *)sqlite3_column_text(m_database_auth_read, 0);
+		*privileges = (const char *)sqlite3_column_text(m_database_auth_read, 1);
+		found = true;
+	}
+	sqlite3_reset(m_database_auth_read);
+	return found;
+}
+
+void PlayerDatabase::saveAuth(const std::string &name,
+		const std::string &password, const std::string &privileges)
+{
+	if(sqlite3_bind_text(m_database_auth_write, 1, name.c_str(), name.size(),
+			NULL) != SQLITE_OK ||
+			sqlite3_bind_text(m_database_auth_write, 2, password.c_str(),
+			password.size(), NULL) != SQLITE_OK ||
+			sqlite3_bind_text(m_database_auth_write, 3, privileges.c_str(),
+			privileges.size(), NULL) != SQLITE_OK)
+		infostream<<"WARNING: Auth entry failed to bind: "
+				<<sqlite3_errmsg(m_database)<<std::endl;
+	if(sqlite3_step(m_database_auth_write) != SQLITE_DONE)
+		errorstream<<"PlayerDatabase: Auth entry of \""<<name
+				<<"\" failed to save: "<<sqlite3_errmsg(m_database)
+				<<std::endl;
+	sqlite3_reset(m_database_auth_write);
+}
+
+void PlayerDatabase::beginSave()
+{
+	if(m_in_transaction)
+		return;
+	if(sqlite3_exec(m_database, "BEGIN;", NULL, NULL, NULL) != SQLITE_OK)
+	{
+		infostream<<"WARNING: PlayerDatabase: BEGIN failed, saving"
+				<<" might be slow."<<std::endl;
+		return;
+	}
+	m_in_transaction = true;
+}
+
+void PlayerDatabase::endSave()
+{
+	if(!m_in_transaction)
+		return;
+	m_in_transaction = false;
+	if(sqlite3_exec(m_database, "COMMIT;", NULL, NULL, NULL) != SQLITE_OK)
+		errorstream<<"PlayerDatabase: COMMIT failed: "
+				<<sqlite3_errmsg(m_database)<<std::endl;
+}
+
@@ -0,0 +1,90 @@
+/*
+Minetest-c55
+Copyright (C) 2010-2012 celeron55, Perttu Ahola <celeron55@gmail.com>
+
+This program is free software; you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation; either version 2.1 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License along
+with this program; if not, write to the Free Software Foundation, Inc.,
+51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+*/
+
+#ifndef PLAYERDATABASE_HEADER
+#define PLAYERDATABASE_HEADER
+
+#include "irrlichttypes_bloated.h"
+#include <string>
+
+extern "C" {
+	#include "sqlite3.h"
+}
+
+class IGameDef;
+
+/*
+	Players and authentication data of a world in <world>/players.sqlite,
+	indexed by name:
+	CREATE TABLE `players` (`name` TEXT NOT NULL PRIMARY KEY, `data` BLOB);
+	CREATE TABLE `auth` (`name` TEXT NOT NULL PRIMARY KEY,
+			`password` TEXT NOT NULL, `privileges` TEXT NOT NULL);
+
+	The player data is what Player::serialize() writes; the same as the
+	old files in <world>/players/. The privileges are separated by commas.
+
+	When a table is created, the old files (players/ and auth.txt) are
+	imported to it in the same transaction.
+
+	Not thread-safe; the environment is locked when it is used.
+*/
+
+class PlayerDatabase
+{
+public:
+	// Opens or creates the database; throws FileNotGoodException
+	PlayerDatabase(const std::string &savedir, IGameDef *gamedef);
+	~PlayerDatabase();
+
+	// Returns false if the player has not been saved
+	bool loadPlayer(const std::string &name, std::string *data);
+	void savePlayer(const std::string &name, const std::string &data);
+	void listPlayers(core::list<std::string> &dst);
+
+	// Returns false if there is no such entry
+	bool loadAuth(const std::string &name, std::string *password,
+			std::string *privileges);
+	void saveAuth(const std::string &name, const std::string &password,
+			const std::string &privileges);
+
+	// Call these before and after saving of many entries
+	void beginSave();
+	void endSave();
+
+private:
+	bool tableExists(const char *name);
+	sqlite3_stmt * prepare(const char *sql);
+
+	// Import the files of old worlds
+	void importPlayerFiles(const std::string &players_path,
+			IGameDef *gamedef);
+	void importAuthFile(const std::string &path);
+
+	bool m_in_transaction;
+
+	sqlite3 *m_database;
+	sqlite3_stmt *m_database_read;
+	sqlite3_stmt *m_database_write;
+	sqlite3_stmt *m_database_list;
+	sqlite3_stmt *m_database_auth_read;
+	sqlite3_stmt *m_database_auth_write;
+};
+
+#endif
+
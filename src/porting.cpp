@@ -305,5 +305,26 @@ void initializePaths()
 #endif // RUN_IN_PLACE
 }
 
+#if !defined(_WIN32)
+	#include <sys/resource.h>
+#endif
+
+u32 getPeakMemoryUsageKB()
+{
+#if defined(_WIN32)
+	return 0;
+#else
+	struct rusage usage;
+	if(getrusage(RUSAGE_SELF, &usage) != 0)
+		return 0;
+	#if defined(__APPLE__)
+	// In bytes on OS X
+	return usage.ru_maxrss / 1024;
+	#else
+	return usage.ru_maxrss;
+	#endif
+#endif
+}
+
 } //namespace porting
 
@@ -35,6 +35,14 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 	#define SWPRINTF_CHARSTRING L"%s"
 #endif
 
+// Storage class of variables that each thread has its own copy of;
+// only for plain data
+#ifdef _MSC_VER
+	#define THREAD_LOCAL __declspec(thread)
+#else
+	#define THREAD_LOCAL __thread
+#endif
+
 #ifdef _WIN32
 	#include <windows.h>
 	#define sleep_ms(x) Sleep(x)
@@ -107,6 +115,12 @@ void initializePaths();
 	}*/
 #endif
 
+/*
+	Peak resident memory use of the process in kilobytes, or 0 if it is
+	not known on the platform
+*/
+u32 getPeakMemoryUsageKB();
+
 } // namespace porting
 
 #endif // PORTING_HEADER
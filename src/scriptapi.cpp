@@ -47,6 +47,7 @@ extern "C" {
 #include "daynightratio.h"
 #include "noise.h" // PseudoRandom for LuaPseudoRandom
 #include "util/pointedthing.h"
+#include "auth.h"
 
 static void stackDump(lua_State *L, std::ostream &o)
 {
@@ -2112,9 +2113,11 @@ class NodeMetaRef
 		ref->m_env->getMap().dispatchEvent(&event);
 		// Set the block to be saved
 		MapBlock *block = ref->m_env->getMap().getBlockNoCreateNoEx(blockpos);
-		if(block)
+		if(block){
 			block->raiseModified(MOD_STATE_WRITE_NEEDED,
 					"NodeMetaRef::reportMetadataChange");
+			ref->m_env->getMap().setBlockPlayerModified(block);
+		}
 	}
 	
 	// Exported functions
@@ -3088,6 +3091,238 @@ const luaL_reg LuaPerlinNoise::methods[] = {
 	{0,0}
 };
 
+/*
+	LuaVoxelManip
+*/
+
+// Most blocks that read_from_map() reads at once; 4M nodes, so that the
+// tables of get_data() stay reasonable
+#define VOXELMANIP_MAX_BLOCKS 1024
+
+class LuaVoxelManip
+{
+private:
+	ServerMap *m_map;
+	INodeDefManager *m_ndef;
+	ManualMapVoxelManipulator m_vmanip;
+
+	static const char className[];
+	static const luaL_reg methods[];
+
+	// Exported functions
+
+	// garbage collector
+	static int gc_object(lua_State *L)
+	{
+		LuaVoxelManip *o = *(LuaVoxelManip **)(lua_touserdata(L, 1));
+		delete o;
+		return 0;
+	}
+
+	// read_from_map(p1, p2) -> minp, maxp
+	// Reads all blocks that contain nodes of the area p1...p2. Returns the
+	// area that was read.
+	static int l_read_from_map(lua_State *L)
+	{
+		LuaVoxelManip *o = checkobject(L, 1);
+		v3s16 p1 = read_v3s16(L, 2);
+		v3s16 p2 = read_v3s16(L, 3);
+		v3s16 bp1 = getNodeBlockPos(v3s16(MYMIN(p1.X, p2.X),
+				MYMIN(p1.Y, p2.Y), MYMIN(p1.Z, p2.Z)));
+		v3s16 bp2 = getNodeBlockPos(v3s16(MYMAX(p1.X, p2.X),
+				MYMAX(p1.Y, p2.Y), MYMAX(p1.Z, p2.Z)));
+		v3s16 size = bp2 - bp1 + v3s16(1,1,1);
+		if((u64)size.X * size.Y * size.Z > VOXELMANIP_MAX_BLOCKS)
+			return luaL_error(L, "area too large; at most %d blocks",
+					VOXELMANIP_MAX_BLOCKS);
+		// Load the blocks from disk if they are not in memory
+		for(s16 z=bp1.Z; z<=bp2.Z; z++)
+		for(s16 y=bp1.Y; y<=bp2.Y; y++)
+		for(s16 x=bp1.X; x<=bp2.X; x++)
+			o->m_map->emergeBlock(v3s16(x,y,z), false);
+		o->m_vmanip.clear();
+		o->m_vmanip.clearChanges();
+		o->m_vmanip.initialEmerge(bp1, bp2);
+		push_v3s16(L, o->m_vmanip.m_area.MinEdge);
+		push_v3s16(L, o->m_vmanip.m_area.MaxEdge);
+		return 2;
+	}
+
+	// get_emerged_area() -> minp, maxp
+	static int l_get_emerged_area(lua_State *L)
+	{
+		LuaVoxelManip *o = checkobject(L, 1);
+		push_v3s16(L, o->m_vmanip.m_area.MinEdge);
+		push_v3s16(L, o->m_vmanip.m_area.MaxEdge);
+		return 2;
+	}
+
+	// get_data() -> list of content ids
+	static int l_get_data(lua_State *L)
+	{
+		LuaVoxelManip *o = checkobject(L, 1);
+		ManualMapVoxelManipulator &vm = o->m_vmanip;
+		u32 volume = vm.m_area.getVolume();
+		lua_createtable(L, volume, 0);
+		for(u32 i=0; i<volume; i++)
+		{
+			content_t c = CONTENT_IGNORE;
+			if(!(vm.m_flags[i] & VOXELFLAG_INEXISTENT))
+				c = vm.m_data[i].getContent();
+			lua_pushinteger(L, c);
+			lua_rawseti(L, -2, i + 1);
+		}
+		return 1;
+	}
+
+	// set_data(data)
+	// data = list of content ids like get_data() returns; nodes that are
+	// nil in it are left as they are
+	static int l_set_data(lua_State *L)
+	{
+		LuaVoxelManip *o = checkobject(L, 1);
+		luaL_checktype(L, 2, LUA_TTABLE);
+		ManualMapVoxelManipulator &vm = o->m_vmanip;
+		INodeDefManager *ndef = o->m_ndef;
+		u32 volume = vm.m_area.getVolume();
+		for(u32 i=0; i<volume; i++)
+		{
+			lua_rawgeti(L, 2, i + 1);
+			if(lua_isnil(L, -1)){
+				lua_pop(L, 1);
+				continue;
+			}
+			lua_Integer c = lua_tointeger(L, -1);
+			lua_pop(L, 1);
+			if(c < 0 || c > MAX_CONTENT || !vm.setNodeContent(i, c, ndef))
+				return luaL_error(L, "invalid content id %d at index %d",
+						(int)c, (int)(i + 1));
+		}
+		return 0;
+	}
+
+	// get_param2_data() -> list of param2 values
+	static int l_get_param2_data(lua_State *L)
+	{
+		LuaVoxelManip *o = checkobject(L, 1);
+		ManualMapVoxelManipulator &vm = o->m_vmanip;
+		u32 volume = vm.m_area.getVolume();
+		lua_createtable(L, volume, 0);
+		for(u32 i=0; i<volume; i++)
+		{
+			u8 param2 = 0;
+			if(!(vm.m_flags[i] & VOXELFLAG_INEXISTENT))
+				param2 = vm.m_data[i].getParam2();
+			lua_pushinteger(L, param2);
+			lua_rawseti(L, -2, i + 1);
+		}
+		return 1;
+	}
+
+	// set_param2_data(data)
+	// data = list of param2 values; nil leaves a node as it is
+	static int l_set_param2_data(lua_State *L)
+	{
+		LuaVoxelManip *o = checkobject(L, 1);
+		luaL_checktype(L, 2, LUA_TTABLE);
+		ManualMapVoxelManipulator &vm = o->m_vmanip;
+		u32 volume = vm.m_area.getVolume();
+		for(u32 i=0; i<volume; i++)
+		{
+			lua_rawgeti(L, 2, i + 1);
+			if(lua_isnil(L, -1)){
+				lua_pop(L, 1);
+				continue;
+			}
+			lua_Integer param2 = lua_tointeger(L, -1);
+			lua_pop(L, 1);
+			if(param2 < 0 || param2 > 255)
+				return luaL_error(L, "invalid param2 %d at index %d",
+						(int)param2, (int)(i + 1));
+			vm.setNodeParam2(i, param2);
+		}
+		return 0;
+	}
+
+	// write_to_map()
+	// Writes the changed blocks back to the map and updates lighting
+	static int l_write_to_map(lua_State *L)
+	{
+		LuaVoxelManip *o = checkobject(L, 1);
+		o->m_map->writeVoxelManipulator(o->m_vmanip);
+		return 0;
+	}
+
+public:
+	LuaVoxelManip(ServerMap *map, INodeDefManager *ndef):
+		m_map(map),
+		m_ndef(ndef),
+		m_vmanip(map)
+	{
+	}
+
+	~LuaVoxelManip()
+	{
+	}
+
+	// Creates a LuaVoxelManip and leaves it on top of stack
+	// Not callable from Lua; it is gotten from EnvRef:get_voxel_manip().
+	static void create(lua_State *L, ServerMap *map, INodeDefManager *ndef)
+	{
+		LuaVoxelManip *o = new LuaVoxelManip(map, ndef);
+		*(void **)(lua_newuserdata(L, sizeof(void *))) = o;
+		luaL_getmetatable(L, className);
+		lua_setmetatable(L, -2);
+	}
+
+	static LuaVoxelManip* checkobject(lua_State *L, int narg)
+	{
+		luaL_checktype(L, narg, LUA_TUSERDATA);
+		void *ud = luaL_checkudata(L, narg, className);
+		if(!ud) luaL_typerror(L, narg, className);
+		return *(LuaVoxelManip**)ud;  // unbox pointer
+	}
+
+	static void Register(lua_State *L)
+	{
+		lua_newtable(L);
+		int methodtable = lua_gettop(L);
+		luaL_newmetatable(L, className);
+		int metatable = lua_gettop(L);
+
+		lua_pushliteral(L, "__metatable");
+		lua_pushvalue(L, methodtable);
+		lua_settable(L, metatable);  // hide metatable from Lua getmetatable()
+
+		lua_pushliteral(L, "__index");
+		lua_pushvalue(L, methodtable);
+		lua_settable(L, metatable);
+
+		lua_pushliteral(L, "__gc");
+		lua_pushcfunction(L, gc_object);
+		lua_settable(L, metatable);
+
+		lua_pop(L, 1);  // drop metatable
+
+		luaL_openlib(L, 0, methods, 0);  // fill methodtable
+		lua_pop(L, 1);  // drop methodtable
+
+		// Cannot be created from Lua
+		//lua_register(L, className, create_object);
+	}
+};
+const char LuaVoxelManip::className[] = "VoxelManip";
+const luaL_reg LuaVoxelManip::methods[] = {
+	method(LuaVoxelManip, read_from_map),
+	method(LuaVoxelManip, get_emerged_area),
+	method(LuaVoxelManip, get_data),
+	method(LuaVoxelManip, set_data),
+	method(LuaVoxelManip, get_param2_data),
+	method(LuaVoxelManip, set_param2_data),
+	method(LuaVoxelManip, write_to_map),
+	{0,0}
+};
+
 /*
 	EnvRef
 */
@@ -3610,6 +3845,19 @@ class EnvRef
 		return 1;
 	}
 
+	// EnvRef:get_voxel_manip()
+	// returns a VoxelManip for changing many nodes at once
+	static int l_get_voxel_manip(lua_State *L)
+	{
+		EnvRef *o = checkobject(L, 1);
+		ServerEnvironment *env = o->m_env;
+		if(env == NULL) return 0;
+
+		LuaVoxelManip::create(L, &env->getServerMap(),
+				env->getGameDef()->ndef());
+		return 1;
+	}
+
 public:
 	EnvRef(ServerEnvironment *env):
 		m_env(env)
@@ -3690,6 +3938,7 @@ const luaL_reg EnvRef::methods[] = {
 	method(EnvRef, find_node_near),
 	method(EnvRef, find_nodes_in_area),
 	method(EnvRef, get_perlin),
+	method(EnvRef, get_voxel_manip),
 	{0,0}
 };
 
@@ -4487,6 +4736,49 @@ static int l_notify_authentication_modified(lua_State *L)
 	return 0;
 }
 
+// get_auth_entry(name) -> {password=, privileges={priv1=true,...}} or nil
+static int l_get_auth_entry(lua_State *L)
+{
+	std::string name = luaL_checkstring(L, 1);
+	std::string password;
+	std::set<std::string> privs;
+	if(!get_server(L)->getAuthManager()->get(name, &password, &privs)){
+		lua_pushnil(L);
+		return 1;
+	}
+	lua_newtable(L);
+	int table = lua_gettop(L);
+	lua_pushstring(L, password.c_str());
+	lua_setfield(L, table, "password");
+	lua_newtable(L);
+	for(std::set<std::string>::const_iterator
+			i = privs.begin(); i != privs.end(); i++){
+		lua_pushboolean(L, true);
+		lua_setfield(L, -2, i->c_str());
+	}
+	lua_setfield(L, table, "privileges");
+	return 1;
+}
+
+// set_auth_entry(name, password, {priv1=true,...})
+static int l_set_auth_entry(lua_State *L)
+{
+	std::string name = luaL_checkstring(L, 1);
+	std::string password = luaL_checkstring(L, 2);
+	luaL_checktype(L, 3, LUA_TTABLE);
+	std::set<std::string> privs;
+	read_privileges(L, 3, privs);
+	get_server(L)->getAuthManager()->set(name, password, privs);
+	return 0;
+}
+
+// reload_auth_entries()
+static int l_reload_auth_entries(lua_State *L)
+{
+	get_server(L)->getAuthManager()->reload();
+	return 0;
+}
+
 // get_craft_result(input)
 static int l_get_craft_result(lua_State *L)
 {
@@ -4530,6 +4822,31 @@ static int l_get_craft_result(lua_State *L)
 	return 2;
 }
 
+// get_content_id(name) -> content id or nil
+static int l_get_content_id(lua_State *L)
+{
+	std::string name = luaL_checkstring(L, 1);
+	INodeDefManager *ndef = get_server(L)->getNodeDefManager();
+	content_t c;
+	if(!ndef->getId(name, c)){
+		lua_pushnil(L);
+		return 1;
+	}
+	lua_pushinteger(L, c);
+	return 1;
+}
+
+// get_name_from_content_id(id) -> name
+static int l_get_name_from_content_id(lua_State *L)
+{
+	int c = luaL_checkint(L, 1);
+	if(c < 0 || c > MAX_CONTENT)
+		return luaL_error(L, "invalid content id %d", c);
+	INodeDefManager *ndef = get_server(L)->getNodeDefManager();
+	lua_pushstring(L, ndef->get(c).name.c_str());
+	return 1;
+}
+
 static const struct luaL_Reg minetest_f [] = {
 	{"debug", l_debug},
 	{"log", l_log},
@@ -4553,7 +4870,12 @@ static const struct luaL_Reg minetest_f [] = {
 	{"is_singleplayer", l_is_singleplayer},
 	{"get_password_hash", l_get_password_hash},
 	{"notify_authentication_modified", l_notify_authentication_modified},
+	{"get_auth_entry", l_get_auth_entry},
+	{"set_auth_entry", l_set_auth_entry},
+	{"reload_auth_entries", l_reload_auth_entries},
 	{"get_craft_result", l_get_craft_result},
+	{"get_content_id", l_get_content_id},
+	{"get_name_from_content_id", l_get_name_from_content_id},
 	{NULL, NULL}
 };
 
@@ -4594,6 +4916,7 @@ void scriptapi_export(lua_State *L, Server *server)
 	EnvRef::Register(L);
 	LuaPseudoRandom::Register(L);
 	LuaPerlinNoise::Register(L);
+	LuaVoxelManip::Register(L);
 }
 
 bool scriptapi_loadmod(lua_State *L, const std::string &scriptpath,
@@ -20,6 +20,11 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "serialization.h"
 
 #include "util/serialize.h"
+#include "log.h"
+#include <string.h> // memcpy
+#include <algorithm> // std::sort
+#include <jmutex.h>
+#include <jmutexautolock.h>
 #ifdef _WIN32
 	#define ZLIB_WINAPI
 #endif
@@ -53,7 +58,201 @@ void zerr(int ret)
     }
 }
 
-void compressZlib(SharedBuffer<u8> data, std::ostream &os)
+const char* getCompressionCodecName(u8 codec)
+{
+	switch(codec)
+	{
+	case COMPRESSION_ZLIB:
+		return "zlib";
+	case COMPRESSION_LZ:
+		return "lz";
+	}
+	return "unknown";
+}
+
+CompressionParams parseCompressionParams(const std::string &codec,
+		s32 level)
+{
+	for(u8 i=0; i<COMPRESSION_CODEC_COUNT; i++)
+	{
+		if(codec == getCompressionCodecName(i))
+			return CompressionParams(i, level);
+	}
+	errorstream<<"Unknown compression codec \""<<codec
+			<<"\", using zlib"<<std::endl;
+	return CompressionParams(COMPRESSION_ZLIB, level);
+}
+
+/*
+	Compression dictionaries
+*/
+
+class CompressionDictionaries
+{
+public:
+	CompressionDictionaries()
+	{
+		m_mutex.Init();
+	}
+
+	~CompressionDictionaries()
+	{
+		for(core::map<u32, std::string*>::Iterator
+				i = m_dictionaries.getIterator(); i.atEnd() == false; i++)
+			delete i.getNode()->getValue();
+	}
+
+	u32 add(const std::string &dictionary)
+	{
+		u32 id = adler32(adler32(0, Z_NULL, 0),
+				(const Bytef*)dictionary.c_str(), dictionary.size());
+		JMutexAutoLock lock(m_mutex);
+		if(m_dictionaries.find(id) == NULL)
+			m_dictionaries.insert(id, new std::string(dictionary));
+		return id;
+	}
+
+	// The dictionaries are never removed, so the pointer stays valid
+	const std::string * get(u32 id)
+	{
+		JMutexAutoLock lock(m_mutex);
+		core::map<u32, std::string*>::Node *n = m_dictionaries.find(id);
+		if(n == NULL)
+			return NULL;
+		return n->getValue();
+	}
+
+private:
+	JMutex m_mutex;
+	core::map<u32, std::string*> m_dictionaries;
+};
+
+static CompressionDictionaries g_compression_dictionaries;
+
+u32 registerCompressionDictionary(const std::string &dictionary)
+{
+	return g_compression_dictionaries.add(dictionary);
+}
+
+/*
+	Pieces of this size, starting at every step bytes, are counted
+*/
+#define DICTIONARY_PIECE_SIZE 32
+#define DICTIONARY_PIECE_STEP 8
+
+struct DictionaryPiece
+{
+	// Number of samples where the piece is
+	u32 count;
+	// Where it was found first
+	u32 sample;
+	u32 offset;
+	// The last sample that was counted
+	u32 last_sample;
+};
+
+// FNV-1a; adler32 is poor for short data
+static u32 hashPiece(const u8 *data)
+{
+	u32 hash = 2166136261U;
+	for(u32 i=0; i<DICTIONARY_PIECE_SIZE; i++)
+		hash = (hash ^ data[i]) * 16777619U;
+	return hash;
+}
+
+static bool comparePieceCounts(const DictionaryPiece *a,
+		const DictionaryPiece *b)
+{
+	return a->count > b->count;
+}
+
+std::string trainCompressionDictionary(
+		const std::vector<std::string> &samples, u32 max_size)
+{
+	core::map<u32, DictionaryPiece> pieces;
+	for(u32 i=0; i<samples.size(); i++)
+	{
+		const std::string &sample = samples[i];
+		for(u32 j=0; j + DICTIONARY_PIECE_SIZE <= sample.size();
+				j += DICTIONARY_PIECE_STEP)
+		{
+			// zlib compresses runs of a byte well without a dictionary
+			if(sample.compare(j + 1, DICTIONARY_PIECE_SIZE - 1,
+					sample, j, DICTIONARY_PIECE_SIZE - 1) == 0)
+				continue;
+			u32 hash = hashPiece((const u8*)&sample[j]);
+			core::map<u32, DictionaryPiece>::Node *n = pieces.find(hash);
+			if(n == NULL)
+			{
+				DictionaryPiece piece;
+				piece.count = 1;
+				piece.sample = i;
+				piece.offset = j;
+				piece.last_sample = i;
+				pieces.insert(hash, piece);
+				continue;
+			}
+			DictionaryPiece &piece = n->getValue();
+			if(piece.last_sample == i)
+				continue;
+			piece.count++;
+			piece.last_sample = i;
+		}
+	}
+
+	// Pieces found in more than one sample, the most common first
+	std::vector<const DictionaryPiece*> common;
+	for(core::map<u32, DictionaryPiece>::Iterator
+			i = pieces.getIterator(); i.atEnd() == false; i++)
+	{
+		if(i.getNode()->getValue().count >= 2)
+			common.push_back(&i.getNode()->getValue());
+	}
+	std::sort(common.begin(), common.end(), comparePieceCounts);
+
+	u32 count = max_size / DICTIONARY_PIECE_SIZE;
+	if(count > common.size())
+		count = common.size();
+
+	// zlib can refer to the end of the dictionary for the longest, so
+	// the most common pieces go there
+	std::string dictionary;
+	dictionary.reserve(count * DICTIONARY_PIECE_SIZE);
+	for(s32 i=count-1; i>=0; i--)
+	{
+		const DictionaryPiece *piece = common[i];
+		dictionary.append(samples[piece->sample], piece->offset,
+				DICTIONARY_PIECE_SIZE);
+	}
+	return dictionary;
+}
+
+/*
+	inflate() that sets the registered dictionary that the stream asks
+	for
+*/
+static int inflateWithDictionary(z_stream *z, int flush)
+{
+	int status = inflate(z, flush);
+	if(status != Z_NEED_DICT)
+		return status;
+	const std::string *dictionary = g_compression_dictionaries.get(z->adler);
+	if(dictionary == NULL)
+	{
+		errorstream<<"decompressZlib: Unknown dictionary "<<z->adler
+				<<std::endl;
+		return Z_NEED_DICT;
+	}
+	if(inflateSetDictionary(z, (const Bytef*)dictionary->c_str(),
+			dictionary->size()) != Z_OK)
+		return Z_DATA_ERROR;
+	return inflate(z, flush);
+}
+
+#define ZLIB_DICTIONARY_MIN_DATA_SIZE 64
+
+static void compressZlib(const u8 *data, u32 size, std::ostream &os,
+		s32 level, u32 dictionary)
 {
 	z_stream z;
 	const s32 bufsize = 16384;
@@ -67,9 +266,23 @@ void compressZlib(SharedBuffer<u8> data, std::ostream &os)
 	z.zfree = Z_NULL;
 	z.opaque = Z_NULL;
 
-	ret = deflateInit(&z, -1);
+	if(level < -1 || level > 9)
+		level = -1;
+	ret = deflateInit(&z, level);
 	if(ret != Z_OK)
 		throw SerializationError("compressZlib: deflateInit failed");
+
+	// Small data doesn't gain enough to pay for the id of the dictionary
+	if(dictionary != 0 && size >= ZLIB_DICTIONARY_MIN_DATA_SIZE)
+	{
+		const std::string *dict = g_compression_dictionaries.get(dictionary);
+		if(dict == NULL)
+		{
+			deflateEnd(&z);
+			throw SerializationError("compressZlib: unknown dictionary");
+		}
+		deflateSetDictionary(&z, (const Bytef*)dict->c_str(), dict->size());
+	}
 	
 	z.avail_in = 0;
 	
@@ -83,9 +296,9 @@ void compressZlib(SharedBuffer<u8> data, std::ostream &os)
 		{
 			//z.next_in = (char*)&data[input_i];
 			z.next_in = (Bytef*)&data[input_i];
-			z.avail_in = data.getSize() - input_i;
+			z.avail_in = size - input_i;
 			input_i += z.avail_in;
-			if(input_i == (int)data.getSize())
+			if(input_i == (int)size)
 				flush = Z_FINISH;
 		}
 		if(z.avail_in == 0)
@@ -106,10 +319,17 @@ void compressZlib(SharedBuffer<u8> data, std::ostream &os)
 
 }
 
-void compressZlib(const std::string &data, std::ostream &os)
+void compressZlib(SharedBuffer<u8> data, std::ostream &os, s32 level,
+		u32 dictionary)
+{
+	compressZlib(*data, data.getSize(), os, level, dictionary);
+}
+
+void compressZlib(const std::string &data, std::ostream &os, s32 level,
+		u32 dictionary)
 {
-	SharedBuffer<u8> databuf((u8*)data.c_str(), data.size());
-	compressZlib(databuf, os);
+	compressZlib((const u8*)data.c_str(), data.size(), os, level,
+			dictionary);
 }
 
 void decompressZlib(std::istream &is, std::ostream &os)
@@ -154,7 +374,7 @@ void decompressZlib(std::istream &is, std::ostream &os)
 		}
 			
 		//dstream<<"1 z.avail_in="<<z.avail_in<<std::endl;
-		status = inflate(&z, Z_NO_FLUSH);
+		status = inflateWithDictionary(&z, Z_NO_FLUSH);
 		//dstream<<"2 z.avail_in="<<z.avail_in<<std::endl;
 		bytes_read += is.gcount() - z.avail_in;
 		//dstream<<"bytes_read="<<bytes_read<<std::endl;
@@ -194,6 +414,392 @@ void decompressZlib(std::istream &is, std::ostream &os)
 	inflateEnd(&z);
 }
 
+u32 decompressZlib(const u8 *data, u32 size, u8 *dst, u32 dst_size)
+{
+	z_stream z;
+	z.zalloc = Z_NULL;
+	z.zfree = Z_NULL;
+	z.opaque = Z_NULL;
+	z.next_in = (Bytef*)data;
+	z.avail_in = size;
+	if(inflateInit(&z) != Z_OK)
+		throw SerializationError("decompressZlib: inflateInit failed");
+
+	z.next_out = (Bytef*)dst;
+	z.avail_out = dst_size;
+	int status = inflateWithDictionary(&z, Z_FINISH);
+	u32 consumed = size - z.avail_in;
+	u32 avail_out = z.avail_out;
+	inflateEnd(&z);
+
+	if(status == Z_BUF_ERROR && avail_out == 0)
+		throw SerializationError("decompressZlib: too much data");
+	if(status != Z_STREAM_END)
+		throw SerializationError("decompressZlib: inflate failed");
+	if(avail_out != 0)
+		throw SerializationError("decompressZlib: not enough data");
+	return consumed;
+}
+
+u32 decompressZlib(const u8 *data, u32 size, std::string *dst)
+{
+	z_stream z;
+	const u32 bufsize = 16384;
+	char output_buffer[bufsize];
+	z.zalloc = Z_NULL;
+	z.zfree = Z_NULL;
+	z.opaque = Z_NULL;
+	z.next_in = (Bytef*)data;
+	z.avail_in = size;
+	if(inflateInit(&z) != Z_OK)
+		throw SerializationError("decompressZlib: inflateInit failed");
+
+	int status;
+	do
+	{
+		z.next_out = (Bytef*)output_buffer;
+		z.avail_out = bufsize;
+		status = inflateWithDictionary(&z, Z_NO_FLUSH);
+		if(status != Z_OK && status != Z_STREAM_END)
+		{
+			inflateEnd(&z);
+			throw SerializationError("decompressZlib: inflate failed");
+		}
+		dst->append(output_buffer, bufsize - z.avail_out);
+	}
+	while(status != Z_STREAM_END);
+
+	u32 consumed = size - z.avail_in;
+	inflateEnd(&z);
+	return consumed;
+}
+
+/*
+	The LZ codec. The format is like that of LZ4 blocks:
+
+	u32 uncompressed size
+	u32 compressed size (of the sequences below)
+	sequences:
+		u8 token: literal count in the high 4 bits, match length - 4
+		          in the low 4 bits; 15 means that more follows as
+		          bytes of 255 ended by a byte of less than 255
+		[more literal count]
+		literals
+		u16 match offset (back from the current position)
+		[more match length]
+	The last sequence only has literals; it ends at the compressed size.
+*/
+
+#define LZ_HASH_BITS 12
+#define LZ_MIN_MATCH 4
+#define LZ_MAX_OFFSET 65535
+
+static inline u32 lzRead32(const u8 *p)
+{
+	return (u32)p[0] | ((u32)p[1] << 8) | ((u32)p[2] << 16) | ((u32)p[3] << 24);
+}
+
+static inline u32 lzHash(u32 v)
+{
+	return (v * 2654435761U) >> (32 - LZ_HASH_BITS);
+}
+
+static inline u8* lzWriteLength(u8 *op, u32 len)
+{
+	while(len >= 255)
+	{
+		*op++ = 255;
+		len -= 255;
+	}
+	*op++ = len;
+	return op;
+}
+
+static inline u8* lzWriteSequence(u8 *op, const u8 *literals,
+		u32 literal_count, u32 offset, u32 match_length)
+{
+	u8 *token = op++;
+	u32 ml = match_length >= LZ_MIN_MATCH ? match_length - LZ_MIN_MATCH : 0;
+	*token = ((literal_count < 15 ? literal_count : 15) << 4)
+			| (ml < 15 ? ml : 15);
+	if(literal_count >= 15)
+		op = lzWriteLength(op, literal_count - 15);
+	memcpy(op, literals, literal_count);
+	op += literal_count;
+	if(match_length == 0)
+		return op;
+	*op++ = offset & 0xff;
+	*op++ = offset >> 8;
+	if(ml >= 15)
+		op = lzWriteLength(op, ml - 15);
+	return op;
+}
+
+/*
+	Whether compressed_size bytes can be what compressLZ() makes of size
+	bytes. Anything else is broken data; checked before allocating.
+	At best a byte of match length stands for 255 bytes; at worst all is
+	literals with a length byte per 255 of them.
+*/
+static bool lzCompressedSizeValid(u32 size, u32 compressed_size)
+{
+	if(size / 255 > compressed_size + 1)
+		return false;
+	if(compressed_size > size && compressed_size - size > size / 255 + 16)
+		return false;
+	return true;
+}
+
+void compressLZ(const u8 *data, u32 size, std::ostream &os)
+{
+	// Enough for any data; see lzCompressedSizeValid()
+	Buffer<u8> outbuf(8 + size + size / 255 + 16);
+	u8 *op = *outbuf + 8;
+
+	// Positions + 1 of the last places of hashes; 0 is none
+	u32 table[1 << LZ_HASH_BITS];
+	memset(table, 0, sizeof(table));
+
+	u32 anchor = 0;
+	u32 i = 0;
+	// The last bytes are always literals, so a match can be read
+	// without checking the end
+	u32 limit = size > 12 ? size - 12 : 0;
+	while(i < limit)
+	{
+		u32 v = lzRead32(&data[i]);
+		u32 h = lzHash(v);
+		u32 candidate = table[h];
+		table[h] = i + 1;
+		if(candidate == 0 || i - (candidate - 1) > LZ_MAX_OFFSET
+				|| lzRead32(&data[candidate - 1]) != v)
+		{
+			// Skip faster through data that doesn't compress
+			i += 1 + ((i - anchor) >> 6);
+			continue;
+		}
+		u32 m = candidate - 1;
+		u32 len = LZ_MIN_MATCH;
+		while(i + len < size && data[m + len] == data[i + len])
+			len++;
+		op = lzWriteSequence(op, &data[anchor], i - anchor, i - m, len);
+		i += len;
+		anchor = i;
+		if(i < limit)
+			table[lzHash(lzRead32(&data[i - 2]))] = i - 2 + 1;
+	}
+	op = lzWriteSequence(op, &data[anchor], size - anchor, 0, 0);
+
+	u32 compressed_size = op - *outbuf - 8;
+	writeU32(*outbuf, size);
+	writeU32(*outbuf + 4, compressed_size);
+	os.write((const char*)*outbuf, 8 + compressed_size);
+}
+
+/*
+	Decodes the sequences of src to dst, which has to be filled exactly
+*/
+static void lzDecode(const u8 *src, u32 src_size, u8 *dst, u32 dst_size)
+{
+	// A byte of input gives at most 255 bytes of output; this keeps
+	// broken sizes from allocating much
+	if(dst_size / 255 > src_size + 1)
+		throw SerializationError("decompressLZ: invalid size");
+	const u8 *ip = src;
+	const u8 *iend = src + src_size;
+	u8 *op = dst;
+	u8 *oend = dst + dst_size;
+	for(;;)
+	{
+		if(ip >= iend)
+			throw SerializationError("decompressLZ: truncated data");
+		u8 token = *ip++;
+
+		// Literals
+		u32 literal_count = token >> 4;
+		if(literal_count == 15)
+		{
+			u8 b;
+			do{
+				if(ip >= iend)
+					throw SerializationError("decompressLZ: truncated data");
+				b = *ip++;
+				literal_count += b;
+			}while(b == 255);
+		}
+		if(literal_count > (u32)(iend - ip) || literal_count > (u32)(oend - op))
+			throw SerializationError("decompressLZ: invalid literal count");
+		memcpy(op, ip, literal_count);
+		ip += literal_count;
+		op += literal_count;
+		if(ip == iend)
+			break;
+
+		// Match
+		if(iend - ip < 2)
+			throw SerializationError("decompressLZ: truncated data");
+		u32 offset = ip[0] | (ip[1] << 8);
+		ip += 2;
+		u32 match_length = (token & 0x0f);
+		if(match_length == 15)
+		{
+			u8 b;
+			do{
+				if(ip >= iend)
+					throw SerializationError("decompressLZ: truncated data");
+				b = *ip++;
+				match_length += b;
+			}while(b == 255);
+		}
+		match_length += LZ_MIN_MATCH;
+		if(offset == 0 || offset > (u32)(op - dst)
+				|| match_length > (u32)(oend - op))
+			throw SerializationError("decompressLZ: invalid match");
+		const u8 *match = op - offset;
+		if(offset >= match_length)
+		{
+			memcpy(op, match, match_length);
+			op += match_length;
+		}
+		else
+		{
+			// Overlapping; repeats the last offset bytes. What has been
+			// copied can be copied again, so the pieces double in size.
+			while(match_length > 0)
+			{
+				u32 n = op - match;
+				if(n > match_length)
+					n = match_length;
+				memcpy(op, match, n);
+				op += n;
+				match_length -= n;
+			}
+		}
+	}
+	if(op != oend)
+		throw SerializationError("decompressLZ: invalid size");
+}
+
+void decompressLZ(std::istream &is, std::ostream &os)
+{
+	u32 size = readU32(is);
+	u32 compressed_size = readU32(is);
+	if(is.good() == false || !lzCompressedSizeValid(size, compressed_size))
+		throw SerializationError("decompressLZ: invalid header");
+	// Read in pieces, so that a broken size can't make a huge buffer
+	// for a short stream
+	std::string compressed;
+	while(compressed.size() < compressed_size)
+	{
+		char buf[65536];
+		u32 n = compressed_size - compressed.size();
+		if(n > sizeof(buf))
+			n = sizeof(buf);
+		is.read(buf, n);
+		if(is.gcount() != (std::streamsize)n)
+			throw SerializationError("decompressLZ: truncated data");
+		compressed.append(buf, n);
+	}
+	Buffer<u8> buf(size);
+	lzDecode((const u8*)compressed.c_str(), compressed_size, *buf, size);
+	os.write((const char*)*buf, size);
+}
+
+u32 decompressLZ(const u8 *data, u32 size, u8 *dst, u32 dst_size)
+{
+	if(size < 8)
+		throw SerializationError("decompressLZ: truncated data");
+	u32 uncompressed_size = readU32((u8*)data);
+	u32 compressed_size = readU32((u8*)data + 4);
+	if(uncompressed_size != dst_size
+			|| !lzCompressedSizeValid(uncompressed_size, compressed_size))
+		throw SerializationError("decompressLZ: invalid size");
+	if(compressed_size > size - 8)
+		throw SerializationError("decompressLZ: truncated data");
+	lzDecode(data + 8, compressed_size, dst, dst_size);
+	return 8 + compressed_size;
+}
+
+u32 decompressLZ(const u8 *data, u32 size, std::string *dst)
+{
+	if(size < 8)
+		throw SerializationError("decompressLZ: truncated data");
+	u32 uncompressed_size = readU32((u8*)data);
+	u32 compressed_size = readU32((u8*)data + 4);
+	if(compressed_size > size - 8)
+		throw SerializationError("decompressLZ: truncated data");
+	if(!lzCompressedSizeValid(uncompressed_size, compressed_size))
+		throw SerializationError("decompressLZ: invalid size");
+	if(uncompressed_size == 0)
+		return 8 + compressed_size;
+	size_t start = dst->size();
+	dst->resize(start + uncompressed_size);
+	try{
+		lzDecode(data + 8, compressed_size, (u8*)&(*dst)[start],
+				uncompressed_size);
+	}
+	catch(SerializationError &e)
+	{
+		dst->resize(start);
+		throw;
+	}
+	return 8 + compressed_size;
+}
+
+void compressWith(const CompressionParams &params, const u8 *data, u32 size,
+		std::ostream &os)
+{
+	switch(params.codec)
+	{
+	case COMPRESSION_ZLIB:
+		compressZlib(data, size, os, params.level, params.dictionary);
+		return;
+	case COMPRESSION_LZ:
+		compressLZ(data, size, os);
+		return;
+	}
+	throw SerializationError("compressWith: unknown codec");
+}
+
+void decompressWith(u8 codec, std::istream &is, std::ostream &os)
+{
+	switch(codec)
+	{
+	case COMPRESSION_ZLIB:
+		decompressZlib(is, os);
+		return;
+	case COMPRESSION_LZ:
+		decompressLZ(is, os);
+		return;
+	}
+	throw SerializationError("decompressWith: unknown codec");
+}
+
+u32 decompressWith(u8 codec, const u8 *data, u32 size,
+		u8 *dst, u32 dst_size)
+{
+	switch(codec)
+	{
+	case COMPRESSION_ZLIB:
+		return decompressZlib(data, size, dst, dst_size);
+	case COMPRESSION_LZ:
+		return decompressLZ(data, size, dst, dst_size);
+	}
+	throw SerializationError("decompressWith: unknown codec");
+}
+
+u32 decompressWith(u8 codec, const u8 *data, u32 size, std::string *dst)
+{
+	switch(codec)
+	{
+	case COMPRESSION_ZLIB:
+		return decompressZlib(data, size, dst);
+	case COMPRESSION_LZ:
+		return decompressLZ(data, size, dst);
+	}
+	throw SerializationError("decompressWith: unknown codec");
+}
+
 void compress(SharedBuffer<u8> data, std::ostream &os, u8 version)
 {
 	if(version >= 11)
@@ -23,6 +23,8 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "irrlichttypes.h"
 #include "exceptions.h"
 #include <iostream>
+#include <string>
+#include <vector>
 #include "util/pointer.h"
 
 /*
@@ -59,24 +61,113 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 	21: dynamic content type allocation
 	22: minerals removed, facedir & wallmounted changed
 	23: NodeTimers, new node metadata format
+	24: compression codec id in MapBlocks
+	25: player-modified flag in MapBlocks
 */
 // This represents an uninitialized or invalid format
 #define SER_FMT_VER_INVALID 255
 // Highest supported serialization version
-#define SER_FMT_VER_HIGHEST 23
+#define SER_FMT_VER_HIGHEST 25
 // Lowest supported serialization version
 #define SER_FMT_VER_LOWEST 0
 
 #define ser_ver_supported(v) (v >= SER_FMT_VER_LOWEST && v <= SER_FMT_VER_HIGHEST)
 
+/*
+	Compression codecs of MapBlock data. From version 24 on, the id of
+	the codec is written in the block; older versions always use zlib.
+	Don't change the ids, they are saved on disk.
+*/
+enum CompressionCodec
+{
+	COMPRESSION_ZLIB = 0,
+	// Self-made LZ77 compressor; faster than zlib, but compresses less
+	COMPRESSION_LZ = 1,
+};
+#define COMPRESSION_CODEC_COUNT 2
+
+struct CompressionParams
+{
+	u8 codec;
+	// Only used by zlib; 0-9 or -1 for the zlib default
+	s32 level;
+	// Only used by zlib; id of a registered dictionary or 0 for none
+	u32 dictionary;
+
+	CompressionParams(u8 codec_=COMPRESSION_ZLIB, s32 level_=-1,
+			u32 dictionary_=0):
+		codec(codec_),
+		level(level_),
+		dictionary(dictionary_)
+	{}
+};
+
+// "zlib" or "lz"
+const char* getCompressionCodecName(u8 codec);
+// Falls back to zlib with a warning if the codec name is unknown
+CompressionParams parseCompressionParams(const std::string &codec,
+		s32 level);
+
+/*
+	Preset dictionaries for zlib. The data of small blocks compresses
+	much better when it can refer to typical data in the dictionary.
+
+	Data compressed with a dictionary can only be decompressed when the
+	same dictionary is registered; zlib finds it by its id, which is the
+	adler32 checksum of the dictionary. Registered dictionaries are kept
+	until the process exits. Thread-safe.
+*/
+#define COMPRESSION_DICTIONARY_MAX_SIZE 32768
+// Returns the id of the dictionary
+u32 registerCompressionDictionary(const std::string &dictionary);
+/*
+	Makes a dictionary of at most max_size bytes out of pieces of data
+	that are common in samples; the samples should be like the data it
+	is going to be used for. Returns "" if nothing is common enough.
+*/
+std::string trainCompressionDictionary(
+		const std::vector<std::string> &samples, u32 max_size);
+
 /*
 	Misc. serialization functions
 */
 
-void compressZlib(SharedBuffer<u8> data, std::ostream &os);
-void compressZlib(const std::string &data, std::ostream &os);
+void compressZlib(SharedBuffer<u8> data, std::ostream &os, s32 level=-1,
+		u32 dictionary=0);
+void compressZlib(const std::string &data, std::ostream &os, s32 level=-1,
+		u32 dictionary=0);
 void decompressZlib(std::istream &is, std::ostream &os);
 
+/*
+	Decompress a zlib stream that starts at data, without streams. They
+	return the number of compressed bytes, so that reading can go on
+	after them. Throw SerializationError on failure.
+	All decompressZlib()s use registered dictionaries when the stream
+	asks for them.
+*/
+// The data has to decompress to exactly dst_size bytes
+u32 decompressZlib(const u8 *data, u32 size, u8 *dst, u32 dst_size);
+// Appends to dst
+u32 decompressZlib(const u8 *data, u32 size, std::string *dst);
+
+/*
+	The LZ codec. The data is preceded by its uncompressed and compressed
+	sizes, so it can be read from the middle of a stream like zlib.
+*/
+void compressLZ(const u8 *data, u32 size, std::ostream &os);
+void decompressLZ(std::istream &is, std::ostream &os);
+u32 decompressLZ(const u8 *data, u32 size, u8 *dst, u32 dst_size);
+u32 decompressLZ(const u8 *data, u32 size, std::string *dst);
+
+// These choose the function of the codec; unknown codecs throw
+// SerializationError
+void compressWith(const CompressionParams &params, const u8 *data, u32 size,
+		std::ostream &os);
+void decompressWith(u8 codec, std::istream &is, std::ostream &os);
+u32 decompressWith(u8 codec, const u8 *data, u32 size,
+		u8 *dst, u32 dst_size);
+u32 decompressWith(u8 codec, const u8 *data, u32 size, std::string *dst);
+
 // These choose between zlib and a self-made one according to version
 void compress(SharedBuffer<u8> data, std::ostream &os, u8 version);
 //void compress(const std::string &data, std::ostream &os, u8 version);
@@ -45,6 +45,8 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "content_abm.h"
 #include "content_sao.h"
 #include "mods.h"
+#include "auth.h"
+#include "playerdatabase.h"
 #include "sha1.h"
 #include "base64.h"
 #include "tool.h"
@@ -53,6 +55,9 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "hex.h"
 #include "util/string.h"
 #include "util/pointedthing.h"
+#include <algorithm>
+#include <deque>
+#include <math.h>
 
 #define PP(x) "("<<(x).X<<","<<(x).Y<<","<<(x).Z<<")"
 
@@ -108,6 +113,258 @@ class MapEditEventAreaIgnorer
 	VoxelArea *m_ignorevariable;
 };
 
+/*
+	BlockEmergeQueue
+*/
+
+MemoryPool * getQueuedBlockEmergePool()
+{
+	static MemoryPool *pool = new MemoryPool("QueuedBlockEmerge",
+			sizeof(QueuedBlockEmerge), 256);
+	return pool;
+}
+
+BlockEmergeQueue::BlockEmergeQueue():
+	m_next_seq(0)
+{
+	m_mutex.Init();
+}
+
+BlockEmergeQueue::~BlockEmergeQueue()
+{
+	JMutexAutoLock lock(m_mutex);
+
+	for(core::map<v3s16, QueueEntry>::Iterator
+			i = m_blocks.getIterator(); i.atEnd() == false; i++)
+		delete i.getNode()->getValue().q;
+}
+
+BlockEmergeQueue::PeerState & BlockEmergeQueue::getPeer(u16 peer_id)
+{
+	core::map<u16, PeerState>::Node *n = m_peers.find(peer_id);
+	if(n == NULL)
+	{
+		PeerState ps;
+		ps.pos_known = false;
+		ps.range = 0;
+		m_peers.insert(peer_id, ps);
+		n = m_peers.find(peer_id);
+	}
+	return n->getValue();
+}
+
+s32 BlockEmergeQueue::getPriority(QueuedBlockEmerge *q)
+{
+	// Distance to the nearest peer, in blocks; 0 if no peer has a
+	// position
+	s32 priority = -1;
+	for(core::map<u16, u8>::Iterator
+			i = q->peer_ids.getIterator(); i.atEnd() == false; i++)
+	{
+		core::map<u16, PeerState>::Node *n =
+				m_peers.find(i.getNode()->getKey());
+		if(n == NULL || n->getValue().pos_known == false)
+			continue;
+		v3s16 d = q->pos - n->getValue().pos;
+		s32 dist = MYMAX(MYMAX(abs(d.X), abs(d.Y)), abs(d.Z));
+		if(priority == -1 || dist < priority)
+			priority = dist;
+	}
+	if(priority == -1)
+		priority = 0;
+	return priority;
+}
+
+void BlockEmergeQueue::updatePriority(QueueEntry &e)
+{
+	s32 priority = getPriority(e.q);
+	if(priority == e.priority)
+		return;
+	m_order.erase(std::make_pair(e.priority, e.seq));
+	e.priority = priority;
+	m_order[std::make_pair(e.priority, e.seq)] = e.q->pos;
+}
+
+bool BlockEmergeQueue::removePeerFromBlock(v3s16 pos, u16 peer_id)
+{
+	core::map<v3s16, QueueEntry>::Node *n = m_blocks.find(pos);
+	if(n == NULL)
+		return false;
+	QueueEntry &e = n->getValue();
+	if(e.q->peer_ids.find(peer_id) == NULL)
+		return false;
+	e.q->peer_ids.remove(peer_id);
+	getPeer(peer_id).blocks.remove(pos);
+
+	if(e.q->peer_ids.size() != 0)
+	{
+		updatePriority(e);
+		return false;
+	}
+
+	m_order.erase(std::make_pair(e.priority, e.seq));
+	delete e.q;
+	m_blocks.remove(pos);
+	return true;
+}
+
+void BlockEmergeQueue::addBlock(u16 peer_id, v3s16 pos, u8 flags)
+{
+	DSTACK(__FUNCTION_NAME);
+
+	JMutexAutoLock lock(m_mutex);
+
+	/*
+		If the block is already in queue, update the peer to it
+	*/
+	core::map<v3s16, QueueEntry>::Node *n = m_blocks.find(pos);
+	if(n != NULL)
+	{
+		QueueEntry &e = n->getValue();
+		if(e.q->peer_ids.find(peer_id) == NULL)
+			getPeer(peer_id).blocks.insert(pos, true);
+		e.q->peer_ids[peer_id] = flags;
+		updatePriority(e);
+		return;
+	}
+
+	/*
+		Add the block
+	*/
+	QueueEntry e;
+	e.q = new QueuedBlockEmerge;
+	e.q->pos = pos;
+	e.q->peer_ids[peer_id] = flags;
+	getPeer(peer_id).blocks.insert(pos, true);
+	e.priority = getPriority(e.q);
+	e.seq = m_next_seq++;
+	m_blocks.insert(pos, e);
+	m_order[std::make_pair(e.priority, e.seq)] = pos;
+}
+
+void BlockEmergeQueue::push(QueuedBlockEmerge &q)
+{
+	for(core::map<u16, u8>::Iterator
+			i = q.peer_ids.getIterator(); i.atEnd() == false; i++)
+	{
+		u16 peer_id = i.getNode()->getKey();
+		// Don't bring back peers that have left meanwhile
+		{
+			JMutexAutoLock lock(m_mutex);
+			if(peer_id != 0 && m_peers.find(peer_id) == NULL)
+				continue;
+		}
+		addBlock(peer_id, q.pos, i.getNode()->getValue());
+	}
+}
+
+QueuedBlockEmerge * BlockEmergeQueue::pop()
+{
+	JMutexAutoLock lock(m_mutex);
+
+	std::map<std::pair<s32, u32>, v3s16>::iterator i = m_order.begin();
+	if(i == m_order.end())
+		return NULL;
+	v3s16 pos = i->second;
+	m_order.erase(i);
+
+	core::map<v3s16, QueueEntry>::Node *n = m_blocks.find(pos);
+	assert(n);
+	QueuedBlockEmerge *q = n->getValue().q;
+	m_blocks.remove(pos);
+
+	for(core::map<u16, u8>::Iterator
+			j = q->peer_ids.getIterator(); j.atEnd() == false; j++)
+		getPeer(j.getNode()->getKey()).blocks.remove(pos);
+
+	return q;
+}
+
+u32 BlockEmergeQueue::size()
+{
+	JMutexAutoLock lock(m_mutex);
+	return m_blocks.size();
+}
+
+u32 BlockEmergeQueue::peerItemCount(u16 peer_id)
+{
+	JMutexAutoLock lock(m_mutex);
+
+	core::map<u16, PeerState>::Node *n = m_peers.find(peer_id);
+	if(n == NULL)
+		return 0;
+	return n->getValue().blocks.size();
+}
+
+void BlockEmergeQueue::setPeerPosition(u16 peer_id, v3s16 blockpos,
+		s16 range)
+{
+	JMutexAutoLock lock(m_mutex);
+
+	PeerState &ps = getPeer(peer_id);
+	if(ps.pos_known && ps.pos == blockpos && ps.range == range)
+		return;
+	ps.pos_known = true;
+	ps.pos = blockpos;
+	ps.range = range;
+	if(ps.blocks.size() == 0)
+		return;
+
+	/*
+		Re-score the blocks of the peer and give up those that are out
+		of range
+	*/
+	core::list<v3s16> out_of_range;
+	for(core::map<v3s16, bool>::Iterator
+			i = ps.blocks.getIterator(); i.atEnd() == false; i++)
+	{
+		core::map<v3s16, QueueEntry>::Node *n =
+				m_blocks.find(i.getNode()->getKey());
+		assert(n);
+		QueueEntry &e = n->getValue();
+		v3s16 d = e.q->pos - blockpos;
+		if(abs(d.X) > range || abs(d.Y) > range || abs(d.Z) > range)
+			out_of_range.push_back(e.q->pos);
+		else
+			updatePriority(e);
+	}
+
+	u32 dropped_count = 0;
+	for(core::list<v3s16>::Iterator i = out_of_range.begin();
+			i != out_of_range.end(); i++)
+	{
+		if(removePeerFromBlock(*i, peer_id))
+			dropped_count++;
+	}
+	if(dropped_count != 0)
+		g_profiler->add("BlockEmergeQueue: dropped (num)", dropped_count);
+}
+
+void BlockEmergeQueue::removePeer(u16 peer_id)
+{
+	JMutexAutoLock lock(m_mutex);
+
+	core::map<u16, PeerState>::Node *n = m_peers.find(peer_id);
+	if(n == NULL)
+		return;
+	core::list<v3s16> blocks;
+	for(core::map<v3s16, bool>::Iterator
+			i = n->getValue().blocks.getIterator(); i.atEnd() == false; i++)
+		blocks.push_back(i.getNode()->getKey());
+
+	u32 dropped_count = 0;
+	for(core::list<v3s16>::Iterator i = blocks.begin();
+			i != blocks.end(); i++)
+	{
+		if(removePeerFromBlock(*i, peer_id))
+			dropped_count++;
+	}
+	if(dropped_count != 0)
+		g_profiler->add("BlockEmergeQueue: dropped (num)", dropped_count);
+
+	m_peers.remove(peer_id);
+}
+
 void * ServerThread::Thread()
 {
 	ThreadStarted();
@@ -166,7 +423,7 @@ void * EmergeThread::Thread()
 	bool enable_mapgen_debug_info = g_settings->getBool("enable_mapgen_debug_info");
 
 	v3s16 last_tried_pos(-32768,-32768,-32768); // For error output
-	
+
 	/*
 		Get block info from queue, emerge them and send them
 		to clients.
@@ -181,6 +438,8 @@ void * EmergeThread::Thread()
 		
 		SharedPtr<QueuedBlockEmerge> q(qptr);
 
+		u32 busy_start_ms = porting::getTimeMs();
+
 		v3s16 &p = q->pos;
 		v2s16 p2d(p.X,p.Z);
 		
@@ -243,7 +502,31 @@ void * EmergeThread::Thread()
 		*/
 		
 		bool started_generate = false;
+		bool deferred = false;
+		u32 deferred_release_count = 0;
 		mapgen::BlockMakeData data;
+		v3s16 reserved_min;
+		v3s16 reserved_max;
+
+		/*
+			Read and deserialize the block from disk without holding the
+			environment lock; only attaching it to the map needs it.
+		*/
+		MapBlock *loaded_block = NULL;
+		u32 rewrite_count = 0;
+		{
+			bool in_memory = false;
+			{
+				JMutexAutoLock envlock(m_server->m_env_mutex);
+				rewrite_count = map.getRewriteCount();
+				block = map.getBlockNoCreateNoEx(p);
+				if(block && !block->isDummy() && block->isGenerated())
+					in_memory = true;
+			}
+			std::string blob;
+			if(!in_memory && map.fetchBlock(p, &blob))
+				loaded_block = map.deSerializeBlock(p, blob);
+		}
 
 		{
 			JMutexAutoLock envlock(m_server->m_env_mutex);
@@ -252,29 +535,76 @@ void * EmergeThread::Thread()
 			if(map.getSectorNoGenerateNoEx(p2d) == NULL)
 				map.loadSectorMeta(p2d);
 			
+			// The stored data may have been rewritten since it was read
+			if(loaded_block && map.getRewriteCount() != rewrite_count)
+			{
+				delete loaded_block;
+				loaded_block = NULL;
+			}
+
 			// Attempt to load block
 			block = map.getBlockNoCreateNoEx(p);
 			if(!block || block->isDummy() || !block->isGenerated())
 			{
-				if(enable_mapgen_debug_info)
-					infostream<<"EmergeThread: not in memory, "
-							<<"attempting to load from disk"<<std::endl;
+				if(loaded_block && map.attachBlock(loaded_block))
+				{
+					block = loaded_block;
+					loaded_block = NULL;
+				}
+				else
+				{
+					if(enable_mapgen_debug_info)
+						infostream<<"EmergeThread: not in memory, "
+								<<"attempting to load from disk"<<std::endl;
 
-				block = map.loadBlock(p);
+					block = map.loadBlock(p);
+				}
 			}
 			
 			// If could not load and allowed to generate, start generation
 			// inside this same envlock
 			if(only_from_disk == false &&
 					(block == NULL || block->isGenerated() == false)){
-				if(enable_mapgen_debug_info)
-					infostream<<"EmergeThread: generating"<<std::endl;
-				started_generate = true;
+				/*
+					Another thread can be generating an overlapping
+					chunk; the block is tried again later then.
+				*/
+				map.getBlockMakeArea(p, reserved_min, reserved_max);
+				if(m_server->m_emerge_reservations.reserve(
+						reserved_min, reserved_max))
+				{
+					if(enable_mapgen_debug_info)
+						infostream<<"EmergeThread: generating"<<std::endl;
+					started_generate = true;
 
-				map.initBlockMake(&data, p);
+					map.initBlockMake(&data, p);
+				}
+				else
+				{
+					deferred = true;
+					deferred_release_count = m_server->
+							m_emerge_reservations.getReleaseCount();
+				}
 			}
 		}
 
+		// Not used if the map had got the block in the meantime
+		delete loaded_block;
+
+		if(deferred)
+		{
+			g_profiler->add("EmergeThread: deferred for reservation (num)", 1);
+			m_server->m_emerge_queue.push(*q);
+			/*
+				Trying again before the chunk in the way is done would
+				only take the environment lock over and over again, so
+				wait for it (or for a while, in case it takes long)
+			*/
+			m_server->m_emerge_reservations.waitForRelease(
+					deferred_release_count, 100);
+			continue;
+		}
+
 		/*
 			If generator was initialized, generate now when envlock is free.
 		*/
@@ -302,6 +632,14 @@ void * EmergeThread::Thread()
 				// whatever this does
 				map.finishBlockMake(&data, modified_blocks);
 
+				// Other threads can generate in the area again once this
+				// is unlocked
+				m_server->m_emerge_reservations.release(reserved_min);
+				{
+					JMutexAutoLock lock(m_server->m_emerge_stats_mutex);
+					m_server->m_emerge_chunks_generated++;
+				}
+
 				// Get central block
 				block = map.getBlockNoCreateNoEx(p);
 				
@@ -327,6 +665,9 @@ void * EmergeThread::Thread()
 				MapEditEventAreaIgnorer ign(
 						&m_server->m_ignore_map_edit_events_area,
 						VoxelArea(minp, maxp));
+				// What the mods change is still generated, not edited
+				MapGeneratingGuard generating(&map,
+						data.blockpos_min, data.blockpos_max);
 				{
 					TimeTaker timer("on_generated");
 					scriptapi_environment_on_generated(m_server->m_lua,
@@ -346,6 +687,12 @@ void * EmergeThread::Thread()
 
 		if(block == NULL)
 			got_block = false;
+
+		{
+			JMutexAutoLock lock(m_server->m_emerge_stats_mutex);
+			m_server->m_emerge_busy_ms +=
+					porting::getTimeMs() - busy_start_ms;
+		}
 			
 		/*
 			Set sent status of modified blocks on clients
@@ -771,6 +1118,9 @@ void RemoteClient::GetNextBlocks(Server *server, float dtime,
 				// Make it more responsive when needing to generate stuff
 				if(surely_not_found_on_disk)
 					max_emerge = 1;
+				// Keep all emerge threads busy
+				max_emerge = MYMAX(max_emerge,
+						server->m_emergethreads.size());
 				if(server->m_emerge_queue.peerItemCount(peer_id) < max_emerge)
 				{
 					//infostream<<"Adding block to emerge queue"<<std::endl;
@@ -782,7 +1132,7 @@ void RemoteClient::GetNextBlocks(Server *server, float dtime,
 						flags |= BLOCK_EMERGE_FLAG_FROMDISK;
 					
 					server->m_emerge_queue.addBlock(peer_id, p, flags);
-					server->m_emergethread.trigger();
+					server->triggerEmergeThreads();
 
 					if(nearest_emerged_d == -1)
 						nearest_emerged_d = d;
@@ -933,13 +1283,14 @@ Server::Server(
 	m_env(NULL),
 	m_con(PROTOCOL_ID, 512, CONNECTION_TIMEOUT, this),
 	m_banmanager(path_world+DIR_DELIM+"ipban.txt"),
+	m_player_database(NULL),
+	m_authmanager(NULL),
 	m_lua(NULL),
 	m_itemdef(createItemDefManager()),
 	m_nodedef(createNodeDefManager()),
 	m_craftdef(createCraftDefManager()),
 	m_event(new EventManager()),
 	m_thread(this),
-	m_emergethread(this),
 	m_time_of_day_send_timer(0),
 	m_uptime(0),
 	m_shutdown_requested(false),
@@ -957,6 +1308,10 @@ Server::Server(
 	m_step_dtime_mutex.Init();
 	m_step_dtime = 0.0;
 
+	m_emerge_stats_mutex.Init();
+	m_emerge_busy_ms = 0;
+	m_emerge_chunks_generated = 0;
+
 	if(path_world == "")
 		throw ServerError("Supplied empty world path");
 	
@@ -997,6 +1352,11 @@ Server::Server(
 	JMutexAutoLock envlock(m_env_mutex);
 	JMutexAutoLock conlock(m_con_mutex);
 
+	// Open player database; the authentication handler uses it
+	infostream<<"Server: Opening player database"<<std::endl;
+	m_player_database = new PlayerDatabase(m_path_world, this);
+	m_authmanager = new AuthManager(m_player_database);
+
 	// Initialize scripting
 	
 	infostream<<"Server: Initializing Lua"<<std::endl;
@@ -1062,14 +1422,31 @@ Server::Server(
 		m_env->loadMeta(m_path_world);
 	}
 
-	// Load players
-	infostream<<"Server: Loading players"<<std::endl;
-	m_env->deSerializePlayers(m_path_world);
+	// Players are loaded when they join
+	m_env->setPlayerDatabase(m_player_database);
 
 	/*
 		Add some test ActiveBlockModifiers to environment
 	*/
 	add_legacy_abms(m_env, m_nodedef);
+
+	/*
+		Create emerge threads; they are started when something is queued
+	*/
+	s32 num_emerge_threads = g_settings->getS32("num_emerge_threads");
+	if(num_emerge_threads < 1)
+		num_emerge_threads = 1;
+	infostream<<"Server: Using "<<num_emerge_threads<<" emerge threads"
+			<<std::endl;
+	for(s32 i=0; i<num_emerge_threads; i++)
+		m_emergethreads.push_back(new EmergeThread(this));
+
+	m_net_compression = parseCompressionParams(
+			g_settings->get("map_compression_net"),
+			g_settings->getS32("map_compression_level_net"));
+	if(g_settings->getBool("map_compression_dictionary"))
+		m_net_compression.dictionary =
+				m_env->getServerMap().getCompressionDictionaryId();
 }
 
 Server::~Server()
@@ -1112,7 +1489,7 @@ Server::~Server()
 			Save players
 		*/
 		infostream<<"Server: Saving players"<<std::endl;
-		m_env->serializePlayers(m_path_world);
+		m_env->serializePlayers();
 
 		/*
 			Save environment metadata
@@ -1150,6 +1527,9 @@ Server::~Server()
 	}
 	
 	// Delete things in the reverse order of creation
+	for(u32 i=0; i<m_emergethreads.size(); i++)
+		delete m_emergethreads[i];
+	m_emergethreads.clear();
 	delete m_env;
 	delete m_event;
 	delete m_itemdef;
@@ -1159,6 +1539,9 @@ Server::~Server()
 	// Deinitialize scripting
 	infostream<<"Server: Deinitializing scripting"<<std::endl;
 	script_deinit(m_lua);
+
+	delete m_authmanager;
+	delete m_player_database;
 }
 
 void Server::start(unsigned short port)
@@ -1196,11 +1579,13 @@ void Server::stop()
 	
 	infostream<<"Server: Stopping and waiting threads"<<std::endl;
 
-	// Stop threads (set run=false first so both start stopping)
+	// Stop threads (set run=false first so all start stopping)
 	m_thread.setRun(false);
-	m_emergethread.setRun(false);
+	for(u32 i=0; i<m_emergethreads.size(); i++)
+		m_emergethreads[i]->setRun(false);
 	m_thread.stop();
-	m_emergethread.stop();
+	for(u32 i=0; i<m_emergethreads.size(); i++)
+		m_emergethreads[i]->stop();
 	
 	infostream<<"Server: Threads stopped"<<std::endl;
 }
@@ -1319,8 +1704,19 @@ void Server::AsyncRunStep()
 		JMutexAutoLock lock(m_env_mutex);
 		// Run Map's timers and unload unused data
 		ScopeProfiler sp(g_profiler, "Server: map timer and unload");
+		s32 budget_mb = g_settings->getS32("server_map_memory_budget");
+		u64 memory_budget = 0;
+		if(budget_mb > 0)
+			memory_budget = (u64)budget_mb * 1024 * 1024;
 		m_env->getMap().timerUpdate(map_timer_and_unload_dtime,
-				g_settings->getFloat("server_unload_unused_data_timeout"));
+				g_settings->getFloat("server_unload_unused_data_timeout"),
+				NULL, memory_budget);
+		g_profiler->avg("Server: loaded blocks",
+				m_env->getMap().getBlockUsage()->size());
+		g_profiler->avg("Server: loaded blocks memory (MB)",
+				m_env->getMap().getBlockUsage()->getMemoryUsage()
+				/ 1024 / 1024);
+		MemoryPool::reportAll(g_profiler);
 	}
 	
 	/*
@@ -1852,9 +2248,28 @@ void Server::AsyncRunStep()
 		counter += dtime;
 		if(counter >= 2.0)
 		{
+			/*
+				Statistics for sizing num_emerge_threads
+			*/
+			u32 busy_ms;
+			u32 chunks;
+			{
+				JMutexAutoLock lock(m_emerge_stats_mutex);
+				busy_ms = m_emerge_busy_ms;
+				chunks = m_emerge_chunks_generated;
+				m_emerge_busy_ms = 0;
+				m_emerge_chunks_generated = 0;
+			}
+			g_profiler->avg("EmergeThread: queue length",
+					m_emerge_queue.size());
+			g_profiler->avg("EmergeThread: utilisation (%)", 100.0 * busy_ms
+					/ (counter * 1000.0 * m_emergethreads.size()));
+			g_profiler->avg("EmergeThread: chunks per second",
+					chunks / counter);
+
 			counter = 0.0;
 			
-			m_emergethread.trigger();
+			triggerEmergeThreads();
 		}
 	}
 
@@ -1877,7 +2292,7 @@ void Server::AsyncRunStep()
 			m_env->getMap().save(MOD_STATE_WRITE_NEEDED);
 
 			// Save players
-			m_env->serializePlayers(m_path_world);
+			m_env->serializePlayers();
 			
 			// Save environment metadata
 			m_env->saveMeta(m_path_world);
@@ -2133,6 +2548,7 @@ void Server::ProcessData(u8 *data, u32 datasize, u16 peer_id)
 				initial_password = given_password;
 
 			scriptapi_create_auth(m_lua, playername, initial_password);
+			m_privs_cache.erase(playername);
 		}
 		
 		has_auth = scriptapi_get_auth(m_lua, playername, &checkpwd, NULL);
@@ -2237,6 +2653,13 @@ void Server::ProcessData(u8 *data, u32 datasize, u16 peer_id)
 		// Send node definitions
 		SendNodeDef(m_con, peer_id, m_nodedef);
 		
+		// Send the dictionary that blocks are compressed with
+		if(m_net_compression.codec == COMPRESSION_ZLIB
+				&& m_net_compression.dictionary != 0
+				&& getClient(peer_id)->serialization_version >= 24)
+			SendCompressionDictionary(m_con, peer_id,
+					m_env->getServerMap().getCompressionDictionary());
+
 		// Send media announcement
 		sendMediaAnnouncement(peer_id);
 		
@@ -3269,8 +3692,10 @@ void Server::setInventoryModified(const InventoryLocation &loc)
 		v3s16 blockpos = getNodeBlockPos(loc.p);
 
 		MapBlock *block = m_env->getMap().getBlockNoCreateNoEx(blockpos);
-		if(block)
+		if(block){
 			block->raiseModified(MOD_STATE_WRITE_NEEDED);
+			m_env->getMap().setBlockPlayerModified(block);
+		}
 		
 		setBlockNotSent(blockpos);
 	}
@@ -3427,6 +3852,32 @@ void Server::SendItemDef(con::Connection &con, u16 peer_id,
 	con.Send(peer_id, 0, data, true);
 }
 
+void Server::SendCompressionDictionary(con::Connection &con, u16 peer_id,
+		const std::string &dictionary)
+{
+	DSTACK(__FUNCTION_NAME);
+	std::ostringstream os(std::ios_base::binary);
+
+	/*
+		u16 command
+		u32 length of the next item
+		zlib-compressed dictionary
+	*/
+	writeU16(os, TOCLIENT_COMPRESSION_DICTIONARY);
+	std::ostringstream tmp_os(std::ios::binary);
+	compressZlib(dictionary, tmp_os);
+	os<<serializeLongString(tmp_os.str());
+
+	// Make data buffer
+	std::string s = os.str();
+	verbosestream<<"Server: Sending compression dictionary to id("<<peer_id
+			<<"): size="<<s.size()<<std::endl;
+	SharedBuffer<u8> data((u8*)s.c_str(), s.size());
+	// Send as reliable on the channel of the blocks, so that it gets
+	// there before them
+	con.Send(peer_id, 1, data, true);
+}
+
 void Server::SendNodeDef(con::Connection &con, u16 peer_id,
 		INodeDefManager *nodedef)
 {
@@ -3573,8 +4024,7 @@ void Server::SendPlayerPrivileges(u16 peer_id)
 {
 	Player *player = m_env->getPlayer(peer_id);
 	assert(player);
-	std::set<std::string> privs;
-	scriptapi_get_auth(m_lua, player->getName(), NULL, &privs);
+	std::set<std::string> privs = getPlayerEffectivePrivs(player->getName());
 	
 	std::ostringstream os(std::ios_base::binary);
 	writeU16(os, TOCLIENT_PRIVILEGES);
@@ -3834,7 +4284,7 @@ void Server::SendBlockNoLock(u16 peer_id, MapBlock *block, u8 ver)
 	*/
 	
 	std::ostringstream os(std::ios_base::binary);
-	block->serialize(os, ver, false);
+	block->serialize(os, ver, false, m_net_compression);
 	std::string s = os.str();
 	SharedBuffer<u8> blockdata((u8*)s.c_str(), s.size());
 
@@ -3871,6 +4321,12 @@ void Server::SendBlocks(float dtime)
 	{
 		ScopeProfiler sp(g_profiler, "Server: selecting blocks for sending");
 
+		// Blocks farther than this are not emerged for a player. The
+		// sending position is predicted one block ahead.
+		s16 emerge_range = MYMAX(
+				g_settings->getS16("max_block_send_distance"),
+				g_settings->getS16("max_block_generate_distance")) + 1;
+
 		for(core::map<u16, RemoteClient*>::Iterator
 			i = m_clients.getIterator();
 			i.atEnd() == false; i++)
@@ -3887,6 +4343,19 @@ void Server::SendBlocks(float dtime)
 			
 			if(client->serialization_version == SER_FMT_VER_INVALID)
 				continue;
+
+			/*
+				Let the emerge queue prioritize by where the player is
+				and drop what it has left behind
+			*/
+			Player *player = m_env->getPlayer(client->peer_id);
+			if(player)
+			{
+				v3s16 blockpos = getNodeBlockPos(
+						floatToInt(player->getPosition(), BS));
+				m_emerge_queue.setPeerPosition(client->peer_id, blockpos,
+						emerge_range);
+			}
 			
 			client->GetNextBlocks(this, dtime, queue);
 		}
@@ -4322,13 +4791,24 @@ std::wstring Server::getStatusString()
 
 std::set<std::string> Server::getPlayerEffectivePrivs(const std::string &name)
 {
-	std::set<std::string> privs;
+	std::map<std::string, std::set<std::string> >::iterator i =
+			m_privs_cache.find(name);
+	if(i != m_privs_cache.end())
+		return i->second;
+
+	g_profiler->add("Server: privilege cache misses (num)", 1);
+	std::set<std::string> &privs = m_privs_cache[name];
 	scriptapi_get_auth(m_lua, name, NULL, &privs);
 	return privs;
 }
 
 bool Server::checkPriv(const std::string &name, const std::string &priv)
 {
+	std::map<std::string, std::set<std::string> >::iterator i =
+			m_privs_cache.find(name);
+	if(i != m_privs_cache.end())
+		return (i->second.count(priv) != 0);
+
 	std::set<std::string> privs = getPlayerEffectivePrivs(name);
 	return (privs.count(priv) != 0);
 }
@@ -4336,6 +4816,7 @@ bool Server::checkPriv(const std::string &name, const std::string &priv)
 void Server::reportPrivsModified(const std::string &name)
 {
 	if(name == ""){
+		m_privs_cache.clear();
 		for(core::map<u16, RemoteClient*>::Iterator
 				i = m_clients.getIterator();
 				i.atEnd() == false; i++){
@@ -4344,6 +4825,7 @@ void Server::reportPrivsModified(const std::string &name)
 			reportPrivsModified(player->getName());
 		}
 	} else {
+		m_privs_cache.erase(name);
 		Player *player = m_env->getPlayer(name.c_str());
 		if(!player)
 			return;
@@ -4377,6 +4859,12 @@ void Server::notifyPlayers(const std::wstring msg)
 	BroadcastChatMessage(msg);
 }
 
+void Server::triggerEmergeThreads()
+{
+	for(u32 i=0; i<m_emergethreads.size(); i++)
+		m_emergethreads[i]->trigger();
+}
+
 void Server::queueBlockEmerge(v3s16 blockpos, bool allow_generate)
 {
 	u8 flags = 0;
@@ -4385,6 +4873,234 @@ void Server::queueBlockEmerge(v3s16 blockpos, bool allow_generate)
 	m_emerge_queue.addBlock(PEER_ID_INEXISTENT, blockpos, flags);
 }
 
+#define PREGENERATE_POLL_INTERVAL_MS 100
+#define PREGENERATE_REPORT_INTERVAL_MS 5000
+#define PREGENERATE_SAVE_INTERVAL_MS 30000
+// Number of chunks queued at once per emerge thread
+#define PREGENERATE_CHUNKS_PER_THREAD 4
+
+/*
+	A chunk of listPregenerateChunks(), with its place in the spiral order
+*/
+struct PregenerateChunk
+{
+	// The minimum block of the chunk
+	v3s16 pos;
+	// Distance from the origin in chunks, along X or Z
+	s32 ring;
+	// Direction from the origin
+	float angle;
+	// Vertical distance from the origin in blocks
+	s32 height;
+
+	bool operator<(const PregenerateChunk &other) const
+	{
+		if(ring != other.ring)
+			return ring < other.ring;
+		if(angle != other.angle)
+			return angle < other.angle;
+		return height < other.height;
+	}
+};
+
+void listPregenerateChunks(v3s16 blockpos_min, v3s16 blockpos_max,
+		bool spiral, std::vector<v3s16> &dst)
+{
+	std::vector<PregenerateChunk> chunks;
+	v3s16 first_min, first_max, last_min, last_max;
+	getChunkOfBlock(blockpos_min, first_min, first_max);
+	getChunkOfBlock(blockpos_max, last_min, last_max);
+	v3s16 chunksize = first_max - first_min + v3s16(1,1,1);
+	for(s16 z=first_min.Z; z<=last_min.Z; z+=chunksize.Z)
+	for(s16 y=first_min.Y; y<=last_min.Y; y+=chunksize.Y)
+	for(s16 x=first_min.X; x<=last_min.X; x+=chunksize.X)
+	{
+		v3s16 min(x,y,z);
+		v3s16 max = min + chunksize - v3s16(1,1,1);
+		// Same limits as in ServerMap::initBlockMake()
+		if(blockpos_over_limit(min - v3s16(1,1,1)) ||
+				blockpos_over_limit(max + v3s16(1,1,1)))
+			continue;
+		v3s16 center = min + chunksize / 2;
+		PregenerateChunk chunk;
+		chunk.pos = min;
+		chunk.ring = MYMAX(abs(center.X / chunksize.X),
+				abs(center.Z / chunksize.Z));
+		chunk.angle = atan2((float)center.Z, (float)center.X);
+		chunk.height = abs(center.Y);
+		chunks.push_back(chunk);
+	}
+	if(spiral)
+		std::sort(chunks.begin(), chunks.end());
+	for(u32 i=0; i<chunks.size(); i++)
+		dst.push_back(chunks[i].pos);
+}
+
+u32 readPregenerateProgress(const std::string &path,
+		const std::string &area, bool spiral, u32 chunk_count)
+{
+	Settings progress;
+	if(!progress.readConfigFile(path.c_str())
+			|| !progress.exists("area") || !progress.exists("spiral")
+			|| !progress.exists("chunks_done")
+			|| progress.get("area") != area
+			|| progress.getBool("spiral") != spiral)
+		return 0;
+	return MYMIN((u32)MYMAX(progress.getS32("chunks_done"), 0),
+			chunk_count);
+}
+
+void writePregenerateProgress(const std::string &path,
+		const std::string &area, bool spiral, u32 chunks_done)
+{
+	Settings progress;
+	progress.set("area", area);
+	progress.setBool("spiral", spiral);
+	progress.set("chunks_done", itos(chunks_done));
+	progress.updateConfigFile(path.c_str());
+}
+
+bool Server::pregenerateMap(v3s16 blockpos_min, v3s16 blockpos_max,
+		bool spiral, bool &kill)
+{
+	DSTACK(__FUNCTION_NAME);
+
+	ServerMap &map = m_env->getServerMap();
+
+	std::vector<v3s16> chunks;
+	listPregenerateChunks(blockpos_min, blockpos_max, spiral, chunks);
+
+	/*
+		Continue an interrupted run of the same area and order
+	*/
+	std::string progress_path = m_path_world + DIR_DELIM + "pregenerate.txt";
+	std::ostringstream area_os;
+	area_os<<PP(blockpos_min)<<","<<PP(blockpos_max);
+	u32 done = readPregenerateProgress(progress_path, area_os.str(),
+			spiral, chunks.size());
+	actionstream<<"Pregenerating "<<chunks.size()<<" chunks of blocks "
+			<<area_os.str()<<" with "<<m_emergethreads.size()
+			<<" threads"<<std::endl;
+	if(done != 0)
+		actionstream<<"Continuing after "<<done<<" chunks"<<std::endl;
+
+	// Chunks that have been queued, in order; queued[i] tells if chunk
+	// done+i has been generated
+	std::deque<bool> queued;
+	u32 next = done;
+	u32 max_queued = m_emergethreads.size() * PREGENERATE_CHUNKS_PER_THREAD;
+	u32 start_done = done;
+	u32 start_ms = porting::getTimeMs();
+	u32 last_ms = start_ms;
+	u32 report_ms = start_ms;
+	u32 save_ms = start_ms;
+	s32 budget_mb = g_settings->getS32("server_map_memory_budget");
+	u64 memory_budget = 0;
+	if(budget_mb > 0)
+		memory_budget = (u64)budget_mb * 1024 * 1024;
+	bool success = true;
+
+	for(;;)
+	{
+		if(kill)
+		{
+			actionstream<<"Pregenerating interrupted"<<std::endl;
+			success = false;
+		}
+		std::string async_err = m_async_fatal_error.get();
+		if(async_err != "")
+		{
+			errorstream<<"Pregenerating failed: "<<async_err<<std::endl;
+			success = false;
+		}
+
+		// Queue more chunks
+		if(success)
+		{
+			bool added = false;
+			while(next < chunks.size() && queued.size() < max_queued)
+			{
+				m_emerge_queue.addBlock(PEER_ID_INEXISTENT,
+						chunks[next], 0);
+				queued.push_back(false);
+				next++;
+				added = true;
+			}
+			if(added)
+				triggerEmergeThreads();
+			sleep_ms(PREGENERATE_POLL_INTERVAL_MS);
+		}
+
+		u32 now_ms = porting::getTimeMs();
+		bool finished = !success || done == chunks.size();
+		{
+			JMutexAutoLock envlock(m_env_mutex);
+
+			// Find out which of the queued chunks have been generated
+			for(u32 i=0; i<queued.size(); i++)
+			{
+				if(queued[i])
+					continue;
+				MapBlock *block = map.getBlockNoCreateNoEx(
+						chunks[done + i]);
+				if(block && block->isGenerated())
+					queued[i] = true;
+			}
+			while(!queued.empty() && queued.front())
+			{
+				queued.pop_front();
+				done++;
+			}
+			finished = finished || done == chunks.size();
+
+			// Save and unload the blocks that are not used anymore. The
+			// blocks of the chunks being checked are kept because they
+			// have been used within the unload timeout.
+			map.timerUpdate((float)(now_ms - last_ms) / 1000.0,
+					g_settings->getFloat("server_unload_unused_data_timeout"),
+					NULL, memory_budget);
+
+			// Save everything and the progress
+			if(finished || now_ms - save_ms >= PREGENERATE_SAVE_INTERVAL_MS)
+			{
+				save_ms = now_ms;
+				map.save(MOD_STATE_WRITE_NEEDED);
+				m_env->saveMeta(m_path_world);
+				map.flushSavedBlocks();
+				writePregenerateProgress(progress_path, area_os.str(),
+						spiral, done);
+			}
+		}
+		last_ms = now_ms;
+
+		if(finished || now_ms - report_ms >= PREGENERATE_REPORT_INTERVAL_MS)
+		{
+			report_ms = now_ms;
+			float seconds = (float)(now_ms - start_ms) / 1000.0;
+			float rate = seconds > 0 ? (done - start_done) / seconds : 0;
+			actionstream<<"Pregenerated "<<done<<"/"<<chunks.size()
+					<<" chunks ("<<(chunks.size() == 0 ? 100 :
+					done * 100 / chunks.size())<<"%), "<<rate
+					<<" chunks/s";
+			if(rate > 0 && done != chunks.size())
+				actionstream<<", "<<(u32)((chunks.size() - done) / rate)
+						<<"s left";
+			actionstream<<std::endl;
+		}
+
+		if(finished)
+			break;
+	}
+
+	// Stop generating what is still queued
+	for(u32 i=0; i<m_emergethreads.size(); i++)
+		m_emergethreads[i]->setRun(false);
+	for(u32 i=0; i<m_emergethreads.size(); i++)
+		m_emergethreads[i]->stop();
+
+	return success;
+}
+
 // IGameDef interface
 // Under envlock
 IItemDefManager* Server::getItemDefManager()
@@ -4516,6 +5232,9 @@ PlayerSAO* Server::emergePlayer(const char *name, u16 peer_id)
 		Try to get an existing player
 	*/
 	player = static_cast<RemotePlayer*>(m_env->getPlayer(name));
+	// Load it if it has been saved
+	if(player == NULL)
+		player = static_cast<RemotePlayer*>(m_env->loadPlayer(name));
 
 	// If player is already connected, cancel
 	if(player != NULL && player->peer_id != 0)
@@ -4610,6 +5329,9 @@ void Server::handlePeerChange(PeerChange &c)
 		n = m_clients.find(c.peer_id);
 		// The client should exist
 		assert(n != NULL);
+
+		// Blocks wanted only by it are not emerged anymore
+		m_emerge_queue.removePeer(c.peer_id);
 		
 		/*
 			Mark objects to be not known by the client
@@ -4645,6 +5367,10 @@ void Server::handlePeerChange(PeerChange &c)
 
 		Player *player = m_env->getPlayer(c.peer_id);
 
+		// The privileges are asked again if the player comes back
+		if(player != NULL)
+			m_privs_cache.erase(player->getName());
+
 		// Collect information about leaving in chat
 		std::wstring message;
 		{
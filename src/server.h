@@ -24,6 +24,8 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "environment.h"
 #include "irrlichttypes_bloated.h"
 #include <string>
+#include <map>
+#include <vector>
 #include "porting.h"
 #include "map.h"
 #include "inventory.h"
@@ -44,6 +46,8 @@ class IWritableNodeDefManager;
 class IWritableCraftDefManager;
 class EventManager;
 class PlayerSAO;
+class PlayerDatabase;
+class AuthManager;
 
 class ServerError : public std::exception
 {
@@ -67,117 +71,192 @@ class ServerError : public std::exception
 */
 v3f findSpawnPos(ServerMap &map);
 
+/*
+	Parts of Server::pregenerateMap()
+*/
+// The minimum blocks of the chunks that have blocks in the area, inside
+// the map limits, in z,y,x order or in a spiral around the origin
+void listPregenerateChunks(v3s16 blockpos_min, v3s16 blockpos_max,
+		bool spiral, std::vector<v3s16> &dst);
+// The number of chunks done by an earlier run of the same area and
+// order, as saved in the file at path; 0 if there is none
+u32 readPregenerateProgress(const std::string &path,
+		const std::string &area, bool spiral, u32 chunk_count);
+void writePregenerateProgress(const std::string &path,
+		const std::string &area, bool spiral, u32 chunks_done);
+
 /*
 	A structure containing the data needed for queueing the fetching
 	of blocks.
 */
+MemoryPool * getQueuedBlockEmergePool();
+
 struct QueuedBlockEmerge
 {
 	v3s16 pos;
 	// key = peer_id, value = flags
 	core::map<u16, u8> peer_ids;
+
+	MEMORYPOOL_OPERATORS(getQueuedBlockEmergePool())
 };
 
 /*
+	Blocks waiting to be emerged, most important first.
+
+	The priority of a block is its distance to the nearest player that
+	wants it; it is updated when players move with setPeerPosition().
+	A peer gives up its blocks that are out of its range, and all of them
+	when it leaves. Blocks that no peer wants anymore are dropped.
+
+	Blocks queued with peer_id=0 (by the server itself) are never dropped.
+
 	This is a thread-safe class.
 */
 class BlockEmergeQueue
 {
 public:
-	BlockEmergeQueue()
+	BlockEmergeQueue();
+	~BlockEmergeQueue();
+	
+	/*
+		peer_id=0 adds with nobody to send to
+	*/
+	void addBlock(u16 peer_id, v3s16 pos, u8 flags);
+
+	/*
+		Puts a popped block back to the queue, with the peers of it
+	*/
+	void push(QueuedBlockEmerge &q);
+
+	// Returned pointer must be deleted
+	// Returns NULL if queue is empty
+	QueuedBlockEmerge * pop();
+
+	u32 size();
+	
+	u32 peerItemCount(u16 peer_id);
+
+	/*
+		Tells where the player of a peer is. Blocks farther than range
+		(in blocks) from it are not wanted by the peer anymore.
+	*/
+	void setPeerPosition(u16 peer_id, v3s16 blockpos, s16 range);
+
+	// Drops the peer from all blocks
+	void removePeer(u16 peer_id);
+
+private:
+	struct QueueEntry
 	{
-		m_mutex.Init();
-	}
+		QueuedBlockEmerge *q;
+		s32 priority;
+		// Order of adding, for blocks of the same priority
+		u32 seq;
+	};
 
-	~BlockEmergeQueue()
+	struct PeerState
 	{
-		JMutexAutoLock lock(m_mutex);
+		bool pos_known;
+		v3s16 pos;
+		s16 range;
+		// Positions of the queued blocks wanted by the peer
+		core::map<v3s16, bool> blocks;
+	};
 
-		core::list<QueuedBlockEmerge*>::Iterator i;
-		for(i=m_queue.begin(); i!=m_queue.end(); i++)
-		{
-			QueuedBlockEmerge *q = *i;
-			delete q;
-		}
+	// These need m_mutex to be locked
+	PeerState & getPeer(u16 peer_id);
+	s32 getPriority(QueuedBlockEmerge *q);
+	void updatePriority(QueueEntry &e);
+	// Removes the peer from the block; drops the block if nobody
+	// wants it anymore. Returns true if it was dropped.
+	bool removePeerFromBlock(v3s16 pos, u16 peer_id);
+
+	// Blocks by position
+	core::map<v3s16, QueueEntry> m_blocks;
+	// (priority, seq) -> position
+	std::map<std::pair<s32, u32>, v3s16> m_order;
+	core::map<u16, PeerState> m_peers;
+	u32 m_next_seq;
+	JMutex m_mutex;
+};
+
+/*
+	Areas of the chunks that the emerge threads are generating.
+
+	mapgen::make_block() works on a copy of a chunk and its borders, and
+	finishBlockMake() writes all of the copy back to the map. Two chunks
+	whose areas with the borders overlap thus can not be generated at
+	the same time.
+
+	Used with the environment locked, except for waitForRelease().
+*/
+class EmergeReservations
+{
+public:
+	EmergeReservations():
+		m_release_count(0)
+	{
+		m_release_mutex.Init();
 	}
-	
+
 	/*
-		peer_id=0 adds with nobody to send to
+		The area is from ServerMap::getBlockMakeArea().
+		Returns false if an overlapping area is reserved.
 	*/
-	void addBlock(u16 peer_id, v3s16 pos, u8 flags)
+	bool reserve(v3s16 area_min, v3s16 area_max)
 	{
-		DSTACK(__FUNCTION_NAME);
-	
-		JMutexAutoLock lock(m_mutex);
-
-		if(peer_id != 0)
+		for(core::map<v3s16, v3s16>::Iterator
+				i = m_areas.getIterator(); i.atEnd() == false; i++)
 		{
-			/*
-				Find if block is already in queue.
-				If it is, update the peer to it and quit.
-			*/
-			core::list<QueuedBlockEmerge*>::Iterator i;
-			for(i=m_queue.begin(); i!=m_queue.end(); i++)
-			{
-				QueuedBlockEmerge *q = *i;
-				if(q->pos == pos)
-				{
-					q->peer_ids[peer_id] = flags;
-					return;
-				}
-			}
+			v3s16 min = i.getNode()->getKey();
+			v3s16 max = i.getNode()->getValue();
+			if(area_min.X <= max.X && area_max.X >= min.X &&
+					area_min.Y <= max.Y && area_max.Y >= min.Y &&
+					area_min.Z <= max.Z && area_max.Z >= min.Z)
+				return false;
 		}
-		
-		/*
-			Add the block
-		*/
-		QueuedBlockEmerge *q = new QueuedBlockEmerge;
-		q->pos = pos;
-		if(peer_id != 0)
-			q->peer_ids[peer_id] = flags;
-		m_queue.push_back(q);
+		m_areas.insert(area_min, area_max);
+		return true;
 	}
 
-	// Returned pointer must be deleted
-	// Returns NULL if queue is empty
-	QueuedBlockEmerge * pop()
+	void release(v3s16 area_min)
 	{
-		JMutexAutoLock lock(m_mutex);
-
-		core::list<QueuedBlockEmerge*>::Iterator i = m_queue.begin();
-		if(i == m_queue.end())
-			return NULL;
-		QueuedBlockEmerge *q = *i;
-		m_queue.erase(i);
-		return q;
+		m_areas.remove(area_min);
+		JMutexAutoLock lock(m_release_mutex);
+		m_release_count++;
 	}
 
-	u32 size()
+	// Changes every time an area is released
+	u32 getReleaseCount()
 	{
-		JMutexAutoLock lock(m_mutex);
-		return m_queue.size();
+		JMutexAutoLock lock(m_release_mutex);
+		return m_release_count;
 	}
-	
-	u32 peerItemCount(u16 peer_id)
-	{
-		JMutexAutoLock lock(m_mutex);
 
-		u32 count = 0;
-
-		core::list<QueuedBlockEmerge*>::Iterator i;
-		for(i=m_queue.begin(); i!=m_queue.end(); i++)
+	/*
+		Waits until an area is released after getReleaseCount() returned
+		count, or at most max_ms. Called without the environment lock.
+	*/
+	void waitForRelease(u32 count, u32 max_ms)
+	{
+		for(u32 waited_ms = 0; waited_ms < max_ms; waited_ms += 2)
 		{
-			QueuedBlockEmerge *q = *i;
-			if(q->peer_ids.find(peer_id) != NULL)
-				count++;
+			if(getReleaseCount() != count)
+				return;
+			sleep_ms(2);
 		}
+	}
 
-		return count;
+	u32 size()
+	{
+		return m_areas.size();
 	}
 
 private:
-	core::list<QueuedBlockEmerge*> m_queue;
-	JMutex m_mutex;
+	// Minimum corner -> maximum corner
+	core::map<v3s16, v3s16> m_areas;
+	u32 m_release_count;
+	JMutex m_release_mutex;
 };
 
 class Server;
@@ -453,6 +532,22 @@ class Server : public con::PeerHandler, public MapEventReceiver,
 	~Server();
 	void start(unsigned short port);
 	void stop();
+
+	/*
+		Generates all chunks that have blocks in an area, with the emerge
+		threads (num_emerge_threads), and saves them. Called instead of
+		start(); there is no network.
+
+		The chunks are done in z,y,x order, or in a spiral around the
+		origin if spiral is true. The number of chunks done in that
+		order is saved in <world>/pregenerate.txt at every save, and an
+		interrupted run with the same area and order continues from
+		there. Chunks that are already generated are only loaded.
+
+		Returns false if stopped by kill or an error.
+	*/
+	bool pregenerateMap(v3s16 blockpos_min, v3s16 blockpos_max,
+			bool spiral, bool &kill);
 	// This is mainly a way to pass the time to the server.
 	// Actual processing is done in an another thread.
 	void step(float dtime);
@@ -502,10 +597,15 @@ class Server : public con::PeerHandler, public MapEventReceiver,
 	void stopSound(s32 handle);
 	
 	// Envlock + conlock
+	// The privileges are cached until reportPrivsModified() is called
 	std::set<std::string> getPlayerEffectivePrivs(const std::string &name);
 	bool checkPriv(const std::string &name, const std::string &priv);
 	void reportPrivsModified(const std::string &name=""); // ""=all
 
+	// Used by the built-in authentication handler; envlock
+	AuthManager* getAuthManager()
+		{ return m_authmanager; }
+
 	// Saves g_settings to configpath given at initialization
 	void saveConfig();
 
@@ -539,6 +639,8 @@ class Server : public con::PeerHandler, public MapEventReceiver,
 	
 	// Envlock and conlock should be locked when using Lua
 	lua_State *getLua(){ return m_lua; }
+	// Envlock should be locked when using the environment
+	ServerEnvironment & getEnv(){ return *m_env; }
 	
 	// IGameDef interface
 	// Under envlock
@@ -587,6 +689,8 @@ class Server : public con::PeerHandler, public MapEventReceiver,
 			IItemDefManager *itemdef);
 	static void SendNodeDef(con::Connection &con, u16 peer_id,
 			INodeDefManager *nodedef);
+	static void SendCompressionDictionary(con::Connection &con, u16 peer_id,
+			const std::string &dictionary);
 	
 	/*
 		Non-static send methods.
@@ -669,6 +773,9 @@ class Server : public con::PeerHandler, public MapEventReceiver,
 	void handlePeerChange(PeerChange &c);
 	void handlePeerChanges();
 
+	// Starts the emerge threads that are not running
+	void triggerEmergeThreads();
+
 	/*
 		Variables
 	*/
@@ -710,6 +817,13 @@ class Server : public con::PeerHandler, public MapEventReceiver,
 	// Bann checking
 	BanManager m_banmanager;
 
+	// Players and authentication data (behind the env mutex)
+	PlayerDatabase *m_player_database;
+	AuthManager *m_authmanager;
+	// Effective privileges of players, as the authentication handler
+	// gave them (behind the env mutex)
+	std::map<std::string, std::set<std::string> > m_privs_cache;
+
 	// Scripting
 	// Envlock and conlock should be locked when using Lua
 	lua_State *m_lua;
@@ -728,6 +842,10 @@ class Server : public con::PeerHandler, public MapEventReceiver,
 	
 	// Mods
 	core::list<ModSpec> m_mods;
+
+	// Codec of blocks sent to clients; clients of block format 24 and
+	// later get the dictionary when they join
+	CompressionParams m_net_compression;
 	
 	/*
 		Threads
@@ -740,10 +858,16 @@ class Server : public con::PeerHandler, public MapEventReceiver,
 
 	// The server mainly operates in this thread
 	ServerThread m_thread;
-	// This thread fetches and generates map
-	EmergeThread m_emergethread;
-	// Queue of block coordinates to be processed by the emerge thread
+	// These threads fetch and generate map (num_emerge_threads)
+	core::array<EmergeThread*> m_emergethreads;
+	// Queue of block coordinates to be processed by the emerge threads
 	BlockEmergeQueue m_emerge_queue;
+	// Chunks being generated; under envlock
+	EmergeReservations m_emerge_reservations;
+	// Statistics of the emerge threads, for the profiler
+	JMutex m_emerge_stats_mutex;
+	u32 m_emerge_busy_ms;
+	u32 m_emerge_chunks_generated;
 	
 	/*
 		Time related stuff
@@ -70,6 +70,15 @@ struct StaticObject
 		// data
 		data = deSerializeString(is);
 	}
+	void deSerialize(BufReader &reader, u8 version)
+	{
+		type = reader.getU8();
+		v3s32 intp = reader.getV3S32();
+		pos.X = (f32)intp.X/1000;
+		pos.Y = (f32)intp.Y/1000;
+		pos.Z = (f32)intp.Z/1000;
+		data = reader.getString();
+	}
 };
 
 class StaticObjectList
@@ -151,6 +160,33 @@ class StaticObjectList
 			m_stored.push_back(s_obj);
 		}
 	}
+	void deSerialize(BufReader &reader)
+	{
+		u8 version = reader.getU8();
+		u16 count = reader.getU16();
+		for(u16 i=0; i<count; i++)
+		{
+			StaticObject s_obj;
+			s_obj.deSerialize(reader, version);
+			m_stored.push_back(s_obj);
+		}
+	}
+
+	// Rough bytes of memory used by the objects
+	u32 getMemoryUsage()
+	{
+		u32 usage = 0;
+		for(core::list<StaticObject>::Iterator
+				i = m_stored.begin();
+				i != m_stored.end(); i++)
+			usage += 2 * sizeof(void*) + sizeof(StaticObject) + i->data.size();
+		for(core::map<u16, StaticObject>::Iterator
+				i = m_active.getIterator();
+				i.atEnd()==false; i++)
+			usage += 4 * sizeof(void*) + sizeof(StaticObject)
+					+ i.getNode()->getValue().data.size();
+		return usage;
+	}
 	
 	/*
 		NOTE: When an object is transformed to active, it is removed
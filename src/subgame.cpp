@@ -21,6 +21,7 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "porting.h"
 #include "filesys.h"
 #include "settings.h"
+#include "main.h" // g_settings
 #include "log.h"
 #include "util/string.h"
 
@@ -220,6 +221,11 @@ bool initializeWorld(const std::string &path, const std::string &gameid)
 		fs::CreateAllDirs(path);
 		std::ofstream of(worldmt_path.c_str(), std::ios::binary);
 		of<<"gameid = "<<gameid<<"\n";
+		// The world keeps the codec it is made with
+		of<<"map_compression_disk = "
+				<<g_settings->get("map_compression_disk")<<"\n";
+		of<<"map_compression_level_disk = "
+				<<g_settings->get("map_compression_level_disk")<<"\n";
 	}
 	return true;
 }
@@ -33,13 +33,28 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 #include "content_mapnode.h"
 #include "nodedef.h"
 #include "mapsector.h"
+#include "mapblock.h"
+#include "mapblockindex.h"
+#include "mempool.h"
+#include "mapscanner.h" // OfflineGameDef
+#include "nodemetadata.h"
 #include "settings.h"
 #include "log.h"
 #include "util/string.h"
 #include "voxelalgorithms.h"
 #include "inventory.h"
+#include "server.h"
+#include "auth.h"
+#include "playerdatabase.h"
 #include "util/numeric.h"
 #include "util/serialize.h"
+#include "noise.h"
+#include "mapdatabase.h"
+#include "mapdatabase_log.h"
+#include "filesys.h"
+#include "util/thread.h"
+#include <fstream>
+#include <algorithm>
 
 /*
 	Asserts that the exception occurs
@@ -52,6 +67,17 @@ with this program; if not, write to the Free Software Foundation, Inc.,
 	assert(exception_thrown);\
 }
 
+/*
+	An empty directory for the tests that need files
+*/
+std::string getTestTempDirectory()
+{
+	std::string path = porting::path_user + DIR_DELIM + "unittest_tmp";
+	fs::RecursiveDelete(path);
+	fs::CreateAllDirs(path);
+	return path;
+}
+
 /*
 	A few item and node definitions for those tests that need them
 */
@@ -410,6 +436,108 @@ struct TestCompress
 		}
 
 		}
+
+		{ // All codecs, with data that compresses and data that doesn't
+
+		std::string fromdata;
+		for(u32 i=0; i<5000; i++)
+			fromdata += (char)(i < 3000 ? i % 7 : myrand() % 256);
+		for(u32 i=0; i<300; i++)
+			fromdata += 'x';
+
+		for(u8 codec=0; codec<COMPRESSION_CODEC_COUNT; codec++)
+		{
+			std::ostringstream os(std::ios_base::binary);
+			compressWith(CompressionParams(codec), (const u8*)fromdata.c_str(),
+					fromdata.size(), os);
+			// Something after the data has to be left alone
+			os<<"end";
+			std::string str_out = os.str();
+			assert(str_out.size() < fromdata.size());
+
+			std::istringstream is(str_out, std::ios_base::binary);
+			std::ostringstream os2(std::ios_base::binary);
+			decompressWith(codec, is, os2);
+			assert(os2.str() == fromdata);
+
+			std::string str_out2;
+			u32 consumed = decompressWith(codec, (const u8*)str_out.c_str(),
+					str_out.size(), &str_out2);
+			assert(str_out2 == fromdata);
+			assert(consumed == str_out.size() - 3);
+
+			// Cut data is an error
+			bool threw = false;
+			try{
+				Buffer<u8> buf(fromdata.size());
+				decompressWith(codec, (const u8*)str_out.c_str(),
+						str_out.size() / 2, *buf, fromdata.size());
+			}
+			catch(SerializationError &e)
+			{
+				threw = true;
+			}
+			assert(threw);
+		}
+
+		// Sizes that compressLZ() can't have made are an error before
+		// anything is allocated for them
+		for(u32 i=0; i<2; i++)
+		{
+			std::ostringstream os(std::ios_base::binary);
+			writeU32(os, i == 0 ? 100 : 0xffffffff);
+			writeU32(os, i == 0 ? 0xffffffff : 10);
+			os<<"short";
+			std::string str_out = os.str();
+			std::istringstream is(str_out, std::ios_base::binary);
+			std::ostringstream os2(std::ios_base::binary);
+			EXCEPTION_CHECK(SerializationError, decompressLZ(is, os2));
+			std::string str_out2;
+			EXCEPTION_CHECK(SerializationError, decompressLZ(
+					(const u8*)str_out.c_str(), str_out.size(), &str_out2));
+		}
+
+		}
+
+		{ // A dictionary made of similar data
+
+		std::vector<std::string> samples;
+		for(u32 i=0; i<20; i++)
+		{
+			std::ostringstream os(std::ios_base::binary);
+			for(u32 j=0; j<50; j++)
+				os<<"Field "<<(j * 7919 % 101)<<" = "<<(j % 5 == 0 ? i : j)<<"\n";
+			samples.push_back(os.str());
+		}
+		std::string dictionary = trainCompressionDictionary(samples, 1024);
+		assert(dictionary.size() > 0 && dictionary.size() <= 1024);
+		u32 id = registerCompressionDictionary(dictionary);
+		assert(id != 0);
+		assert(registerCompressionDictionary(dictionary) == id);
+
+		const std::string &fromdata = samples[5];
+		std::ostringstream os_plain(std::ios_base::binary);
+		compressZlib(fromdata, os_plain);
+		std::ostringstream os(std::ios_base::binary);
+		compressZlib(fromdata, os, -1, id);
+		std::string str_out = os.str();
+		assert(str_out.size() < os_plain.str().size());
+
+		std::istringstream is(str_out, std::ios_base::binary);
+		std::ostringstream os2(std::ios_base::binary);
+		decompressZlib(is, os2);
+		assert(os2.str() == fromdata);
+
+		std::string str_out2;
+		decompressZlib((const u8*)str_out.c_str(), str_out.size(), &str_out2);
+		assert(str_out2 == fromdata);
+
+		Buffer<u8> buf(fromdata.size());
+		decompressZlib((const u8*)str_out.c_str(), str_out.size(),
+				*buf, fromdata.size());
+		assert(memcmp(*buf, fromdata.c_str(), fromdata.size()) == 0);
+
+		}
 	}
 };
 
@@ -1076,6 +1204,61 @@ struct TestMapSector
 };
 #endif
 
+struct TestNoiseMap
+{
+	void Run()
+	{
+		// Points spaced like map columns, and far apart
+		double xs[20], ys[7], zs[5];
+		for(int i=0; i<20; i++)
+			xs[i] = 0.5 + (float)(i - 10) / 25.;
+		for(int i=0; i<7; i++)
+			ys[i] = 0.5 + (float)(i * 13 - 40) / 25.;
+		for(int i=0; i<5; i++)
+			zs[i] = -3.3 + i * 100.7;
+
+		/*
+			The maps do the same arithmetic as the point functions, but
+			-ffast-math may reorder it differently; allow for rounding
+		*/
+
+		// 2D is like noise2d_perlin() and noise2d_perlin_abs()
+		for(int abs=0; abs<2; abs++)
+		{
+			NoiseParams np(abs ? NOISE_PERLIN_ABS : NOISE_PERLIN,
+					1234, 4, 0.66, 1.0, 1.0);
+			NoiseMap map(np, 20, 7);
+			NoiseMapFloat mapf(np, 20, 7);
+			map.noiseMap2D(xs, ys);
+			mapf.noiseMap2D(xs, ys);
+			for(int j=0; j<7; j++)
+			for(int i=0; i<20; i++)
+			{
+				double d = abs ?
+						noise2d_perlin_abs(xs[i], ys[j], 1234, 4, 0.66) :
+						noise2d_perlin(xs[i], ys[j], 1234, 4, 0.66);
+				assert(fabs(map.result[j*20 + i] - d) < 1e-9);
+				assert(fabs(mapf.result[j*20 + i] - d) < 0.001);
+			}
+		}
+
+		// 3D is like noise3d_param()
+		NoiseType types[] = {NOISE_PERLIN, NOISE_PERLIN_ABS,
+				NOISE_PERLIN_CONTOUR, NOISE_PERLIN_CONTOUR_FLIP_YZ};
+		for(int t=0; t<4; t++)
+		{
+			NoiseParams np(types[t], 52534, 4, 0.5, 50, 5.0);
+			NoiseMap map(np, 20, 7, 5);
+			map.noiseMap3D(xs, ys, zs);
+			for(int k=0; k<5; k++)
+			for(int j=0; j<7; j++)
+			for(int i=0; i<20; i++)
+				assert(fabs(map.result[(k*7 + j)*20 + i]
+						- noise3d_param(np, xs[i], ys[j], zs[k])) < 1e-9);
+		}
+	}
+};
+
 struct TestCollision
 {
 	void Run()
@@ -1223,6 +1406,1256 @@ struct TestCollision
 	}
 };
 
+struct TestMapBlockPosSet
+{
+	void Run()
+	{
+		MapBlockPosSet set;
+		assert(set.contains(v3s16(0,0,0)) == false);
+		set.insert(v3s16(0,0,0));
+		set.insert(v3s16(-1,-1,-1));
+		set.insert(v3s16(15,-16,31000/16));
+		set.insert(v3s16(15,-16,31000/16));
+		assert(set.size() == 3);
+		assert(set.contains(v3s16(0,0,0)));
+		assert(set.contains(v3s16(-1,-1,-1)));
+		assert(set.contains(v3s16(15,-16,31000/16)));
+		assert(set.contains(v3s16(16,-16,31000/16)) == false);
+		assert(set.contains(v3s16(1,0,0)) == false);
+		set.remove(v3s16(0,0,0));
+		set.remove(v3s16(1,0,0));
+		assert(set.size() == 2);
+		assert(set.contains(v3s16(0,0,0)) == false);
+		assert(set.contains(v3s16(-1,-1,-1)));
+		set.clear();
+		assert(set.size() == 0);
+		assert(set.contains(v3s16(-1,-1,-1)) == false);
+	}
+};
+
+struct TestModifiedBlockList
+{
+	void Run()
+	{
+		ModifiedBlockList list;
+		MapBlock *b1 = new MapBlock(NULL, v3s16(0,0,0), NULL, true);
+		MapBlock *b2 = new MapBlock(NULL, v3s16(1,0,0), NULL, true);
+		MapBlock *b3 = new MapBlock(NULL, v3s16(2,0,0), NULL, true);
+		// New blocks are modified
+		b1->setModifiedList(&list);
+		b2->setModifiedList(&list);
+		assert(list.size() == 2);
+		b3->resetModified();
+		b3->setModifiedList(&list);
+		assert(list.size() == 2);
+		b1->resetModified();
+		assert(list.size() == 1);
+		b3->raiseModified(MOD_STATE_WRITE_AT_UNLOAD);
+		b3->raiseModified(MOD_STATE_WRITE_NEEDED);
+		assert(list.size() == 2);
+		core::list<MapBlock*> blocks;
+		list.getBlocks(blocks);
+		assert(blocks.size() == 2);
+		delete b2;
+		assert(list.size() == 1);
+		blocks.clear();
+		list.getBlocks(blocks);
+		assert(blocks.size() == 1 && *blocks.begin() == b3);
+		delete b3;
+		delete b1;
+		assert(list.size() == 0);
+	}
+};
+
+struct TestBlockUsageList
+{
+	void Run()
+	{
+		BlockUsageList list;
+		MapBlock *b1 = new MapBlock(NULL, v3s16(0,0,0), NULL, true);
+		MapBlock *b2 = new MapBlock(NULL, v3s16(1,0,0), NULL, true);
+		MapBlock *b3 = new MapBlock(NULL, v3s16(2,0,0), NULL, true);
+		b1->setUsageList(&list);
+		list.step(1.0);
+		b2->setUsageList(&list);
+		list.step(1.0);
+		b3->setUsageList(&list);
+		assert(list.size() == 3);
+		assert(list.getLeastRecentlyUsed() == b1);
+		assert(b1->getUsageTimer() == 2);
+		core::list<MapBlock*> unused;
+		list.getBlocksUnusedFor(0.5, 1.5, unused);
+		assert(unused.size() == 1 && *unused.begin() == b2);
+		unused.clear();
+		list.getBlocksUnusedFor(0.5, 2.5, unused);
+		assert(unused.size() == 2 && *unused.begin() == b1);
+		list.step(1.0);
+		b1->resetUsageTimer();
+		assert(b1->getUsageTimer() == 0);
+		assert(list.getLeastRecentlyUsed() == b2);
+		delete b2;
+		assert(list.getLeastRecentlyUsed() == b3);
+		b3->resetUsageTimer();
+		assert(list.getLeastRecentlyUsed() == b1);
+		delete b1;
+		delete b3;
+		assert(list.size() == 0);
+		assert(list.getLeastRecentlyUsed() == NULL);
+		assert(list.getMemoryUsage() == 0);
+
+		// The memory usage follows the storage of the nodes
+		MapBlock *b4 = new MapBlock(NULL, v3s16(3,0,0), NULL);
+		b4->setUsageList(&list);
+		u64 compact_usage = list.getMemoryUsage();
+		assert(compact_usage == b4->getMemoryUsage());
+		assert(compact_usage >= sizeof(MapBlock));
+		b4->expandNodes();
+		assert(list.getMemoryUsage() == compact_usage
+				+ MAP_BLOCKSIZE*MAP_BLOCKSIZE*MAP_BLOCKSIZE*sizeof(MapNode));
+		b4->compactNodes();
+		assert(list.getMemoryUsage() == compact_usage);
+		b4->setUsageList(NULL);
+		assert(list.getMemoryUsage() == 0);
+		delete b4;
+	}
+};
+
+// Finds blocks from an index that is not changed meanwhile
+class TestMapBlockIndexThread : public SimpleThread
+{
+public:
+	TestMapBlockIndexThread(MapBlockIndex *index, MapBlock *b1, MapBlock *b2):
+		m_index(index),
+		m_b1(b1),
+		m_b2(b2),
+		failed(false)
+	{
+	}
+
+	void * Thread()
+	{
+		ThreadStarted();
+		for(u32 i=0; i<100000; i++)
+		{
+			MapBlock *expected = (i % 2 == 0) ? m_b1 : m_b2;
+			if(m_index->find(v3s16(i % 2, 0, 0)) != expected)
+				failed = true;
+		}
+		return NULL;
+	}
+
+private:
+	MapBlockIndex *m_index;
+	MapBlock *m_b1;
+	MapBlock *m_b2;
+public:
+	bool failed;
+};
+
+struct TestMapBlockIndex
+{
+	void Run()
+	{
+		MapBlockIndex index;
+		MapBlock *b1 = new MapBlock(NULL, v3s16(0,0,0), NULL, true);
+		MapBlock *b2 = new MapBlock(NULL, v3s16(0,0,0), NULL, true);
+		assert(index.find(v3s16(0,0,0)) == NULL);
+		// Enough blocks to grow the table and to have collisions
+		for(s16 i=0; i<3000; i++)
+			index.insert(v3s16(i%20-10, i/400-3, (i/20)%20-10), b1);
+		assert(index.size() == 3000);
+		assert(index.find(v3s16(-10,-3,-10)) == b1);
+		assert(index.find(v3s16(9,4,-1)) == b1);
+		assert(index.find(v3s16(9,4,0)) == NULL);
+		index.insert(v3s16(9,4,-1), b2);
+		assert(index.size() == 3000);
+		assert(index.find(v3s16(9,4,-1)) == b2);
+		// Remove every other one; the rest have to be found still
+		for(s16 i=0; i<3000; i+=2)
+			index.remove(v3s16(i%20-10, i/400-3, (i/20)%20-10));
+		assert(index.size() == 1500);
+		for(s16 i=0; i<3000; i++)
+		{
+			MapBlock *b = index.find(v3s16(i%20-10, i/400-3, (i/20)%20-10));
+			assert((b != NULL) == (i % 2 == 1));
+		}
+		index.remove(v3s16(100,100,100));
+		assert(index.size() == 1500);
+
+		// Threads finding blocks at the same time don't disturb each other
+		MapBlockIndex index2;
+		index2.insert(v3s16(0,0,0), b1);
+		index2.insert(v3s16(1,0,0), b2);
+		TestMapBlockIndexThread t1(&index2, b1, b2);
+		TestMapBlockIndexThread t2(&index2, b1, b2);
+		t1.Start();
+		t2.Start();
+		while(t1.IsRunning() || t2.IsRunning())
+			sleep_ms(1);
+		assert(!t1.failed);
+		assert(!t2.failed);
+
+		delete b1;
+		delete b2;
+	}
+};
+
+struct TestMapBlockStorage
+{
+	void Run()
+	{
+		u32 nodecount = MAP_BLOCKSIZE*MAP_BLOCKSIZE*MAP_BLOCKSIZE;
+		MapBlock b(NULL, v3s16(0,0,0), NULL);
+		assert(b.isCompact());
+		assert(b.getNodesMemoryUsage() == 0);
+		assert(b.getNode(v3s16(1,2,3)).getContent() == CONTENT_IGNORE);
+		// Writing the same node keeps it compact
+		MapNode n_ignore(CONTENT_IGNORE);
+		b.setNode(v3s16(1,2,3), n_ignore);
+		assert(b.isCompact());
+		MapNode n_air(CONTENT_AIR, 0x0f);
+		b.setNode(v3s16(1,2,3), n_air);
+		assert(b.isCompact() == false);
+		assert(b.getNode(v3s16(1,2,3)) == n_air);
+
+		// A few kinds of nodes
+		for(u32 i=0; i<nodecount; i++)
+		{
+			MapNode n(i % 5, i % 3 == 0 ? 0x0f : 0);
+			b.setNodeNoCheck(i % 16, (i / 16) % 16, i / 256, n);
+		}
+		MapNode *nodes = new MapNode[nodecount];
+		b.getNodes(nodes);
+		assert(b.compactNodes());
+		assert(b.getNodesMemoryUsage() == nodecount / 2);
+		MapNode *nodes2 = new MapNode[nodecount];
+		b.getNodes(nodes2);
+		for(u32 i=0; i<nodecount; i++)
+		{
+			assert(nodes[i] == nodes2[i]);
+			assert(b.getNodeNoCheck(i % 16, (i / 16) % 16, i / 256)
+					== nodes[i]);
+		}
+		delete[] nodes;
+		delete[] nodes2;
+
+		// Too many kinds
+		b.expandNodes();
+		for(u32 i=0; i<MAPBLOCK_PALETTE_SIZE + 1; i++)
+		{
+			MapNode n(i);
+			b.setNodeNoCheck(i, 0, 0, n);
+		}
+		assert(b.compactNodes() == false);
+		assert(b.getNodesMemoryUsage() == nodecount * sizeof(MapNode));
+
+		// One kind
+		for(u32 i=0; i<MAPBLOCK_PALETTE_SIZE + 1; i++)
+			b.setNodeNoCheck(i, 0, 0, n_air);
+		for(u32 i=0; i<nodecount; i++)
+			b.setNodeNoCheck(i % 16, (i / 16) % 16, i / 256, n_air);
+		assert(b.compactNodes());
+		assert(b.getNodesMemoryUsage() == 0);
+		assert(b.getNode(v3s16(15,15,15)) == n_air);
+	}
+};
+
+struct TestMapNodeAccess
+{
+	class TestMap : public Map
+	{
+	public:
+		TestMap(IGameDef *gamedef=NULL):
+			Map(dstream, gamedef)
+		{
+		}
+
+		MapSector * createSector(v2s16 p)
+		{
+			MapSector *sector = new ServerMapSector(this, p, NULL);
+			m_sectors.insert(p, sector);
+			return sector;
+		}
+	};
+
+	void Run()
+	{
+		TestMap map;
+		MapSector *sector = map.createSector(v2s16(0,0));
+		MapBlock *block = sector->createBlankBlock(0);
+		MapNode n(CONTENT_AIR, 0x0f);
+		block->setNode(v3s16(1,2,3), n);
+		// A dummy block below
+		sector->insertBlock(new MapBlock(&map, v3s16(0,-1,0), NULL, true));
+
+		bool valid = false;
+		assert(map.getNodeNoEx(v3s16(1,2,3), &valid) == n);
+		assert(valid);
+		map.getNodeNoEx(v3s16(1,-1,3), &valid);
+		assert(!valid);
+		map.getNodeNoEx(v3s16(1,17,3), &valid);
+		assert(!valid);
+		assert(block->getNodeParentNoEx(v3s16(1,2,3), &valid) == n);
+		assert(valid);
+		block->getNodeParentNoEx(v3s16(1,-1,3), &valid);
+		assert(!valid);
+
+		VoxelArea area(v3s16(-2,-2,-2), v3s16(17,3,3));
+		MapNode *nodes = new MapNode[area.getVolume()];
+		bool *nodes_valid = new bool[area.getVolume()];
+		assert(map.getNodesInArea(area, nodes, nodes_valid) == 16*4*4);
+		assert(nodes[area.index(1,2,3)] == n);
+		assert(nodes_valid[area.index(1,2,3)]);
+		assert(nodes[area.index(0,0,0)].getContent() == CONTENT_IGNORE);
+		assert(nodes_valid[area.index(0,0,0)]);
+		assert(nodes[area.index(16,0,0)].getContent() == CONTENT_IGNORE);
+		assert(!nodes_valid[area.index(16,0,0)]);
+		assert(!nodes_valid[area.index(0,-1,0)]);
+		delete[] nodes;
+		delete[] nodes_valid;
+	}
+};
+
+struct TestMapGeneratingGuard
+{
+	void Run()
+	{
+		OfflineGameDef gamedef;
+		TestMapNodeAccess::TestMap map;
+		MapSector *sector = map.createSector(v2s16(0,0));
+		MapBlock *block = sector->createBlankBlock(0);
+		MapBlock *block2 = sector->createBlankBlock(1);
+
+		/*
+			Edits of on_generated leave the blocks prunable, but only
+			those in the generated area
+		*/
+		{
+			MapGeneratingGuard generating(&map,
+					v3s16(0,-1,0), v3s16(0,0,0));
+			NodeMetadata *meta = new NodeMetadata(&gamedef);
+			meta->setString("infotext", "generated");
+			map.setNodeMetadata(v3s16(1,2,3), meta);
+			map.removeNodeMetadata(v3s16(1,2,3));
+			map.setBlockPlayerModified(block2);
+		}
+		assert(block->isPlayerModified() == false);
+		assert(block2->isPlayerModified() == true);
+
+		// Later edits are kept
+		map.removeNodeMetadata(v3s16(1,2,3));
+		assert(block->isPlayerModified() == true);
+	}
+};
+
+struct TestVoxelManipChanges
+{
+	void Run()
+	{
+		OfflineGameDef gamedef;
+		INodeDefManager *ndef = gamedef.ndef();
+		content_t stone = gamedef.allocateUnknownNodeId("test:stone");
+		content_t dirt = gamedef.allocateUnknownNodeId("test:dirt");
+
+		TestMapNodeAccess::TestMap map(&gamedef);
+		MapSector *sector = map.createSector(v2s16(0,0));
+		MapBlock *block0 = sector->createBlankBlock(0);
+		MapBlock *block1 = sector->createBlankBlock(1);
+		MapNode n_stone(stone);
+		block0->setNode(v3s16(0,0,0), n_stone);
+		MapNode n_air(CONTENT_AIR);
+		block1->setNode(v3s16(15,15,15), n_air);
+		// Block (0,2,0) is not in the map
+
+		ManualMapVoxelManipulator vm(&map);
+		vm.initialEmerge(v3s16(0,0,0), v3s16(0,2,0));
+		VoxelArea &a = vm.m_area;
+
+		// Same as before, or not in the map: no change
+		MapNode n_inexistent = vm.m_data[a.index(1,33,0)];
+		vm.setNodeContent(a.index(0,0,0), stone, ndef);
+		vm.setNodeParam2(a.index(1,0,0), 0);
+		vm.setNodeContent(a.index(1,33,0), stone, ndef);
+		vm.setNodeParam2(a.index(1,33,0), 7);
+		assert(vm.m_changed_blocks.size() == 0);
+		assert(vm.m_data[a.index(1,33,0)] == n_inexistent);
+
+		// Ignore and undefined nodes are refused
+		assert(!vm.setNodeContent(a.index(5,5,5), CONTENT_IGNORE, ndef));
+		assert(!vm.setNodeContent(a.index(5,5,5), 3000, ndef));
+		assert(vm.m_changed_blocks.size() == 0);
+
+		// Nodes that don't change light: no relighting
+		vm.setNodeContent(a.index(0,0,0), dirt, ndef);
+		vm.setNodeParam2(a.index(2,17,0), 7);
+		assert(vm.m_changed_blocks.size() == 2);
+		assert(vm.m_changed_blocks.find(v3s16(0,0,0)) != NULL);
+		assert(vm.m_changed_blocks.find(v3s16(0,1,0)) != NULL);
+		assert(vm.m_relight_blocks.size() == 0);
+
+		// Air to stone does
+		vm.setNodeContent(a.index(15,31,15), stone, ndef);
+		assert(vm.m_changed_blocks.size() == 2);
+		assert(vm.m_relight_blocks.size() == 1);
+		assert(vm.m_relight_blocks.find(v3s16(0,1,0)) != NULL);
+
+		// Only the changed blocks are written, and the changes are
+		// forgotten
+		vm.clearChanges();
+		vm.setNodeParam2(a.index(3,3,3), 5);
+		vm.setNodeParam2(a.index(4,20,4), 6);
+		// Not written back
+		block1->setNode(v3s16(1,1,1), n_stone);
+		vm.m_changed_blocks.remove(v3s16(0,1,0));
+		// The metadata of the node that becomes dirt is removed
+		block0->m_node_metadata.set(v3s16(0,0,0), new NodeMetadata(&gamedef));
+		block0->m_node_metadata.set(v3s16(3,3,3), new NodeMetadata(&gamedef));
+		map.writeVoxelManipulator(vm);
+		assert(vm.m_changed_blocks.size() == 0);
+		assert(block0->getNode(v3s16(0,0,0)).getContent() == dirt);
+		assert(block0->getNode(v3s16(3,3,3)).getParam2() == 5);
+		assert(block0->m_node_metadata.get(v3s16(0,0,0)) == NULL);
+		assert(block0->m_node_metadata.get(v3s16(3,3,3)) != NULL);
+		assert(block0->isPlayerModified());
+		assert(block1->getNode(v3s16(1,1,1)).getContent() == stone);
+		assert(block1->getNode(v3s16(4,4,4)).getParam2() == 0);
+		assert(!block1->isPlayerModified());
+	}
+};
+
+struct TestMapBlockSerialization
+{
+	void Run()
+	{
+		OfflineGameDef gamedef;
+		content_t stone = gamedef.allocateUnknownNodeId("test:stone");
+		content_t dirt = gamedef.allocateUnknownNodeId("test:dirt");
+		u32 nodecount = MAP_BLOCKSIZE*MAP_BLOCKSIZE*MAP_BLOCKSIZE;
+
+		MapBlock b(NULL, v3s16(1,2,3), &gamedef);
+		for(u32 i=0; i<nodecount; i++)
+		{
+			MapNode n(i % 7 == 0 ? dirt : (i < 2000 ? stone : CONTENT_AIR),
+					i % 16, i % 3);
+			b.setNodeNoCheck(i % 16, (i / 16) % 16, i / 256, n);
+		}
+		NodeMetadata *meta = new NodeMetadata(&gamedef);
+		meta->setString("infotext", "Test");
+		meta->getInventory()->addList("main", 4);
+		b.m_node_metadata.set(v3s16(1,2,3), meta);
+		b.m_static_objects.insert(0, StaticObject(7, v3f(1,2,3), "data"));
+		b.setTimestamp(12345);
+
+		std::string blobs[COMPRESSION_CODEC_COUNT];
+		for(u8 codec=0; codec<COMPRESSION_CODEC_COUNT; codec++)
+		{
+			std::ostringstream os(std::ios_base::binary);
+			writeU8(os, SER_FMT_VER_HIGHEST);
+			b.serialize(os, SER_FMT_VER_HIGHEST, true,
+					CompressionParams(codec));
+			blobs[codec] = os.str();
+		}
+
+		// The stream and buffer versions give the same block, with
+		// all codecs
+		for(u32 k=0; k<2*COMPRESSION_CODEC_COUNT; k++)
+		{
+			const std::string &blob = blobs[k / 2];
+			MapBlock b2(NULL, v3s16(1,2,3), &gamedef);
+			if(k % 2 == 0)
+			{
+				// The stream is left at the end of the block
+				std::istringstream is(blob + "rest", std::ios_base::binary);
+				u8 version = readU8(is);
+				assert(b2.deSerialize(is, version, true));
+				std::string rest;
+				is>>rest;
+				assert(rest == "rest");
+			}
+			else
+			{
+				BufReader reader((const u8*)blob.c_str(), blob.size());
+				u8 version = reader.getU8();
+				assert(b2.deSerialize(reader, version, true));
+				assert(reader.getRemaining() == 0);
+			}
+			for(u32 i=0; i<nodecount; i++)
+			{
+				v3s16 p(i % 16, (i / 16) % 16, i / 256);
+				assert(b2.getNodeNoCheck(p) == b.getNodeNoCheck(p));
+			}
+			NodeMetadata *meta2 = b2.m_node_metadata.get(v3s16(1,2,3));
+			assert(meta2 != NULL);
+			assert(meta2->getString("infotext") == "Test");
+			assert(meta2->getInventory()->getList("main") != NULL);
+			assert(b2.m_static_objects.m_stored.size() == 1);
+			assert(b2.m_static_objects.m_stored.begin()->data == "data");
+			assert(b2.getTimestamp() == 12345);
+			assert(b2.isPlayerModified() == false);
+		}
+
+		// The player-modified flag is kept; older blocks may have been
+		// modified
+		{
+			for(u8 version=24; version<=25; version++)
+			{
+				std::ostringstream os(std::ios_base::binary);
+				b.serialize(os, version, true);
+				std::istringstream is(os.str(), std::ios_base::binary);
+				MapBlock b5(NULL, v3s16(1,2,3), &gamedef);
+				assert(b5.deSerialize(is, version, true));
+				assert(b5.isPlayerModified() == (version < 25));
+			}
+			b.setPlayerModified();
+			std::ostringstream os(std::ios_base::binary);
+			b.serialize(os, SER_FMT_VER_HIGHEST, true);
+			std::istringstream is(os.str(), std::ios_base::binary);
+			MapBlock b5(NULL, v3s16(1,2,3), &gamedef);
+			assert(b5.deSerialize(is, SER_FMT_VER_HIGHEST, true));
+			assert(b5.isPlayerModified());
+		}
+
+		// The old formats are read from buffers too
+		{
+			std::ostringstream os(std::ios_base::binary);
+			b.serialize(os, 21, true);
+			std::string blob = os.str() + "rest";
+			BufReader reader((const u8*)blob.c_str(), blob.size());
+			MapBlock b6(NULL, v3s16(1,2,3), &gamedef);
+			assert(b6.deSerialize(reader, 21, true));
+			assert(reader.getRemaining() == 4);
+			assert(b6.isPlayerModified());
+		}
+
+		// Cut data is an error
+		std::string blob = blobs[COMPRESSION_ZLIB];
+		MapBlock b3(NULL, v3s16(1,2,3), &gamedef);
+		BufReader reader((const u8*)blob.c_str(), blob.size() - 10);
+		u8 version = reader.getU8();
+		bool thrown = false;
+		try{
+			b3.deSerialize(reader, version, true);
+		}
+		catch(SerializationError &e)
+		{
+			thrown = true;
+		}
+		assert(thrown);
+	}
+};
+
+/*
+	Blocks in memory; records what MapScanner does with them
+*/
+class TestScanDatabase : public MapDatabase
+{
+public:
+	TestScanDatabase()
+	{
+		m_mutex.Init();
+	}
+	std::string getName() { return "test"; }
+	bool loadBlock(v3s16 blockpos, std::string *blob)
+	{
+		JMutexAutoLock lock(m_mutex);
+		core::map<v3s16, std::string>::Node *n = blocks.find(blockpos);
+		if(n == NULL)
+			return false;
+		*blob = n->getValue();
+		return true;
+	}
+	void loadBlocksInArea(v3s16 blockpos_min, v3s16 blockpos_max,
+			core::map<v3s16, std::string> &dst)
+	{
+		JMutexAutoLock lock(m_mutex);
+		area_mins.push_back(blockpos_min);
+		area_maxs.push_back(blockpos_max);
+		for(core::map<v3s16, std::string>::Iterator
+				i = blocks.getIterator(); i.atEnd() == false; i++)
+		{
+			v3s16 p = i.getNode()->getKey();
+			if(VoxelArea(blockpos_min, blockpos_max).contains(p))
+				dst.insert(p, i.getNode()->getValue());
+		}
+	}
+	void saveBlock(v3s16 blockpos, const std::string &blob)
+	{
+		JMutexAutoLock lock(m_mutex);
+		blocks[blockpos] = blob;
+		saved.push_back(blockpos);
+	}
+	void deleteBlock(v3s16 blockpos)
+	{
+		JMutexAutoLock lock(m_mutex);
+		blocks.remove(blockpos);
+	}
+	void listAllLoadableBlocks(core::list<v3s16> &dst)
+	{
+		JMutexAutoLock lock(m_mutex);
+		for(core::map<v3s16, std::string>::Iterator
+				i = blocks.getIterator(); i.atEnd() == false; i++)
+			dst.push_back(i.getNode()->getKey());
+	}
+
+	core::map<v3s16, std::string> blocks;
+	core::list<v3s16> saved;
+	core::array<v3s16> area_mins;
+	core::array<v3s16> area_maxs;
+	JMutex m_mutex;
+};
+
+/*
+	Turns dirt into stone
+*/
+class TestScanVisitor : public MapBlockVisitor
+{
+public:
+	TestScanVisitor(content_t dirt, content_t stone):
+		m_dirt(dirt),
+		m_stone(stone),
+		visited(0)
+	{
+		m_mutex.Init();
+	}
+	bool visitBlock(MapBlock *block)
+	{
+		{
+			JMutexAutoLock lock(m_mutex);
+			visited++;
+		}
+		bool changed = false;
+		v3s16 p;
+		for(p.Z=0; p.Z<MAP_BLOCKSIZE; p.Z++)
+		for(p.Y=0; p.Y<MAP_BLOCKSIZE; p.Y++)
+		for(p.X=0; p.X<MAP_BLOCKSIZE; p.X++)
+		{
+			if(block->getNodeNoCheck(p).getContent() != m_dirt)
+				continue;
+			MapNode n(m_stone);
+			block->setNodeNoCheck(p, n);
+			changed = true;
+		}
+		return changed;
+	}
+
+	content_t m_dirt;
+	content_t m_stone;
+	u32 visited;
+	JMutex m_mutex;
+};
+
+struct TestMapScanner
+{
+	std::string makeBlob(IGameDef *gamedef, v3s16 p, content_t c)
+	{
+		MapBlock b(NULL, p, gamedef);
+		MapNode n(c);
+		for(s16 i=0; i<MAP_BLOCKSIZE; i++)
+			b.setNodeNoCheck(i, 0, 0, n);
+		std::ostringstream os(std::ios_base::binary);
+		writeU8(os, SER_FMT_VER_HIGHEST);
+		b.serialize(os, SER_FMT_VER_HIGHEST, true);
+		return os.str();
+	}
+
+	void Run()
+	{
+		OfflineGameDef gamedef;
+		content_t stone = gamedef.allocateUnknownNodeId("test:stone");
+		content_t dirt = gamedef.allocateUnknownNodeId("test:dirt");
+		// Knows a node that the scanner has to allocate an id for
+		OfflineGameDef gamedef2;
+		content_t gravel = gamedef2.allocateUnknownNodeId("test:gravel");
+		content_t dirt2 = gamedef2.allocateUnknownNodeId("test:dirt");
+
+		/*
+			Blocks in two regions and in several slices of them
+		*/
+		TestScanDatabase db;
+		core::list<v3s16> dirt_blocks;
+		for(s16 i=0; i<40; i++)
+		{
+			v3s16 p(i % 5, -(i % 3), i - 20);
+			if(i % 4 == 0)
+			{
+				db.blocks.insert(p, makeBlob(&gamedef, p, dirt));
+				dirt_blocks.push_back(p);
+			}
+			else
+			{
+				db.blocks.insert(p, makeBlob(&gamedef, p, stone));
+			}
+		}
+		v3s16 p_new(100, 0, 0);
+		db.blocks.insert(p_new, makeBlob(&gamedef2, p_new, gravel));
+		v3s16 p_new_dirt(101, 0, 0);
+		db.blocks.insert(p_new_dirt, makeBlob(&gamedef2, p_new_dirt, dirt2));
+		dirt_blocks.push_back(p_new_dirt);
+		v3s16 p_broken(0, 5, 0);
+		db.blocks.insert(p_broken, "broken");
+		v3s16 p_skipped(1, 5, 0);
+		db.blocks.insert(p_skipped, makeBlob(&gamedef, p_skipped, dirt));
+
+		MapBlockPosSet positions;
+		for(core::map<v3s16, std::string>::Iterator
+				i = db.blocks.getIterator(); i.atEnd() == false; i++)
+			positions.insert(i.getNode()->getKey());
+		MapBlockPosSet skip;
+		skip.insert(p_skipped);
+
+		MapScanner scanner("TestMapScanner", &db, &gamedef, 3);
+		TestScanVisitor visitor(dirt, stone);
+		MapScanStats stats = scanner.run(positions, &visitor, &skip);
+
+		assert(stats.blocks_total == 44);
+		assert(stats.blocks_visited == 42);
+		assert(stats.blocks_changed == dirt_blocks.size());
+		assert(stats.blocks_failed == 1);
+		assert(stats.blocks_skipped == 1);
+		assert(visitor.visited == 42);
+
+		// Read a box that is a slice of a region at a time, and each
+		// block once
+		u32 loaded = 0;
+		for(u32 i=0; i<db.area_mins.size(); i++)
+		{
+			v3s16 min = db.area_mins[i];
+			v3s16 max = db.area_maxs[i];
+			const s16 d = MAPBLOCKPOSSET_REGION_SIZE;
+			assert(max.X - min.X == d - 1 && max.Y - min.Y == d - 1);
+			assert(max.Z - min.Z < d - 1);
+			assert(getContainerPos(min, d) == getContainerPos(max, d));
+			for(core::map<v3s16, std::string>::Iterator
+					j = db.blocks.getIterator(); j.atEnd() == false; j++)
+			{
+				if(VoxelArea(min, max).contains(j.getNode()->getKey()))
+					loaded++;
+			}
+		}
+		assert(loaded == db.blocks.size());
+
+		// Only the changed blocks were written back
+		assert(db.saved.size() == dirt_blocks.size());
+		for(core::list<v3s16>::Iterator i = dirt_blocks.begin();
+				i != dirt_blocks.end(); i++)
+		{
+			std::string blob;
+			assert(db.loadBlock(*i, &blob));
+			MapBlock b(NULL, *i, &gamedef);
+			std::istringstream is(blob, std::ios_base::binary);
+			u8 version = readU8(is);
+			assert(b.deSerialize(is, version, true));
+			assert(b.getNodeNoCheck(0,0,0).getContent() == stone);
+		}
+		std::string blob;
+		assert(db.loadBlock(p_skipped, &blob)
+				&& blob == makeBlob(&gamedef, p_skipped, dirt));
+		assert(db.loadBlock(p_broken, &blob) && blob == "broken");
+	}
+};
+
+struct TestPruneWorldMap
+{
+	void saveBlock(MapDatabase *db, IGameDef *gamedef, v3s16 p,
+			bool player_modified)
+	{
+		MapBlock b(NULL, p, gamedef);
+		MapNode n(CONTENT_AIR);
+		for(s16 i=0; i<MAP_BLOCKSIZE; i++)
+			b.setNodeNoCheck(i, 0, 0, n);
+		if(player_modified)
+			b.setPlayerModified();
+		std::ostringstream os(std::ios_base::binary);
+		writeU8(os, SER_FMT_VER_HIGHEST);
+		b.serialize(os, SER_FMT_VER_HIGHEST, true);
+		db->saveBlock(p, os.str());
+	}
+
+	void Run()
+	{
+		std::string savedir = getTestTempDirectory();
+		OfflineGameDef gamedef;
+		// Chunks are 5 blocks from -2
+		v3s16 modified(0,0,0), next(5,0,0), diagonal(-3,-3,-3),
+				far(10,0,0), protected_block(0,30,0), next_protected(0,34,0),
+				far_protected(0,40,0), modified_chunk(2,2,2);
+		{
+			MapDatabase *db = createMapDatabase("sqlite3", savedir);
+			assert(db);
+			saveBlock(db, &gamedef, modified, true);
+			saveBlock(db, &gamedef, modified_chunk, false);
+			saveBlock(db, &gamedef, next, false);
+			saveBlock(db, &gamedef, diagonal, false);
+			saveBlock(db, &gamedef, far, false);
+			saveBlock(db, &gamedef, protected_block, false);
+			saveBlock(db, &gamedef, next_protected, false);
+			saveBlock(db, &gamedef, far_protected, false);
+			delete db;
+		}
+
+		core::list<core::aabbox3d<s16> > areas;
+		assert(parseMapAreas("(0,480,0),(15,495,15)", areas));
+		u32 deleted = 0;
+		assert(pruneWorldMap(savedir, areas, &deleted));
+		assert(deleted == 2);
+
+		/*
+			The chunks around a kept chunk are kept, because generating
+			them again would write into it
+		*/
+		MapDatabase *db = createMapDatabase("sqlite3", savedir);
+		std::string blob;
+		assert(db->loadBlock(modified, &blob));
+		assert(db->loadBlock(modified_chunk, &blob));
+		assert(db->loadBlock(next, &blob));
+		assert(db->loadBlock(diagonal, &blob));
+		assert(db->loadBlock(far, &blob) == false);
+		assert(db->loadBlock(protected_block, &blob));
+		assert(db->loadBlock(next_protected, &blob));
+		assert(db->loadBlock(far_protected, &blob) == false);
+		delete db;
+
+		fs::RecursiveDelete(savedir);
+	}
+};
+
+struct TestMapDatabaseLog
+{
+	std::string getBlob(MapDatabase *db, v3s16 p)
+	{
+		std::string blob;
+		if(!db->loadBlock(p, &blob))
+			return "(none)";
+		return blob;
+	}
+
+	void Run()
+	{
+		std::string savedir = getTestTempDirectory();
+		std::string dir = savedir + DIR_DELIM + "maplog";
+		v3s16 a(0,0,0), b(1,-2,3), c(-100,5,7), x(4,4,4);
+
+		// Saved, index written on close
+		{
+			MapDatabaseLog db(savedir);
+			db.saveBlock(a, "aaa");
+			db.saveBlock(b, "bbb");
+			db.saveBlock(c, std::string(5000, 'c'));
+			db.saveBlock(a, "aaa2");
+			assert(db.getBlockCount() == 3);
+		}
+		assert(fs::PathExists(dir + DIR_DELIM + "index"));
+		{
+			MapDatabaseLog db(savedir);
+			assert(getBlob(&db, a) == "aaa2");
+			assert(getBlob(&db, b) == "bbb");
+			assert(getBlob(&db, c) == std::string(5000, 'c'));
+			assert(getBlob(&db, x) == "(none)");
+			assert(db.getBlockCount() == 3);
+			// Each run writes to a new segment
+			db.deleteBlock(b);
+			db.saveBlock(x, "xxx");
+			assert(getBlob(&db, b) == "(none)");
+			assert(db.getSegmentCount() == 2);
+		}
+
+		/*
+			Crash: no index and a half-written record at the end of the
+			last segment. The index is rebuilt from the segments.
+		*/
+		fs::DeleteSingleFileOrEmptyDirectory(dir + DIR_DELIM + "index");
+		{
+			std::ofstream os((dir + DIR_DELIM + "00000002.seg").c_str(),
+					std::ios_base::binary | std::ios_base::app);
+			os.write("\x01\x00\x07", 3);
+		}
+		{
+			MapDatabaseLog db(savedir);
+			assert(getBlob(&db, a) == "aaa2");
+			assert(getBlob(&db, b) == "(none)");
+			assert(getBlob(&db, x) == "xxx");
+			assert(db.getBlockCount() == 3);
+
+			core::list<v3s16> list;
+			db.listAllLoadableBlocks(list);
+			assert(list.size() == 3);
+
+			/*
+				Compacting the segment with the deletion has to carry the
+				deletion over while the older segment still has a copy
+			*/
+			db.compactSegment(2);
+			assert(!fs::PathExists(dir + DIR_DELIM + "00000002.seg"));
+			assert(getBlob(&db, b) == "(none)");
+			assert(getBlob(&db, x) == "xxx");
+			assert(db.getDeletedCount() == 1);
+		}
+		fs::DeleteSingleFileOrEmptyDirectory(dir + DIR_DELIM + "index");
+		{
+			MapDatabaseLog db(savedir);
+			assert(getBlob(&db, b) == "(none)");
+			assert(getBlob(&db, x) == "xxx");
+			assert(db.getBlockCount() == 3);
+			assert(db.getDeletedCount() == 1);
+			/*
+				The older segment can go too; then nothing is left of b
+				and the deletion is forgotten
+			*/
+			db.compactSegment(1);
+			assert(!fs::PathExists(dir + DIR_DELIM + "00000001.seg"));
+			assert(getBlob(&db, a) == "aaa2");
+			assert(getBlob(&db, c) == std::string(5000, 'c'));
+			assert(db.getDeletedCount() == 0);
+		}
+		{
+			MapDatabaseLog db(savedir);
+			assert(getBlob(&db, b) == "(none)");
+			assert(getBlob(&db, x) == "xxx");
+			assert(db.getBlockCount() == 3);
+			assert(db.getDeletedCount() == 0);
+			db.saveBlock(b, "bbb2");
+		}
+		{
+			/*
+				The deletion only has to outlive the segment that had
+				the copy, not the older segments
+			*/
+			MapDatabaseLog db(savedir);
+			assert(getBlob(&db, b) == "bbb2");
+			db.deleteBlock(b);
+			assert(db.getDeletedCount() == 1);
+			db.compactSegment(5);
+			assert(!fs::PathExists(dir + DIR_DELIM + "00000005.seg"));
+			assert(fs::PathExists(dir + DIR_DELIM + "00000004.seg"));
+			assert(getBlob(&db, b) == "(none)");
+			assert(db.getDeletedCount() == 0);
+		}
+		{
+			MapDatabaseLog db(savedir);
+			assert(getBlob(&db, b) == "(none)");
+			assert(getBlob(&db, a) == "aaa2");
+			assert(db.getBlockCount() == 3);
+			assert(db.getDeletedCount() == 0);
+		}
+
+		fs::RecursiveDelete(savedir);
+	}
+};
+
+struct TestCopyMapDatabase
+{
+	void Run()
+	{
+		std::string savedir = getTestTempDirectory();
+		v3s16 a(0,0,0), b(1,-2,3), c(-2048,2047,0);
+		{
+			MapDatabase *db = createMapDatabase("sqlite3", savedir);
+			assert(db);
+			db->saveBlock(a, "aaa");
+			db->saveBlock(b, std::string("b\0b", 3));
+			db->saveBlock(c, "ccc");
+			delete db;
+		}
+		assert(getWorldMapBackend(savedir) == "sqlite3");
+		assert(migrateWorldMapBackend(savedir, "log"));
+		assert(getWorldMapBackend(savedir) == "log");
+		{
+			MapDatabase *db = createMapDatabase("log", savedir);
+			std::string blob;
+			assert(db->loadBlock(a, &blob) && blob == "aaa");
+			assert(db->loadBlock(b, &blob) && blob == std::string("b\0b", 3));
+			assert(db->loadBlock(c, &blob) && blob == "ccc");
+			core::list<v3s16> list;
+			db->listAllLoadableBlocks(list);
+			assert(list.size() == 3);
+
+			// Back again with copyMapDatabase() directly
+			std::string dstdir = savedir + DIR_DELIM + "copy";
+			fs::CreateDir(dstdir);
+			MapDatabase *dst = createMapDatabase("sqlite3", dstdir);
+			assert(copyMapDatabase(db, dst) == 3);
+			assert(dst->loadBlock(b, &blob) && blob == std::string("b\0b", 3));
+			delete dst;
+			delete db;
+		}
+		// The old data is left in place
+		{
+			MapDatabase *db = createMapDatabase("sqlite3", savedir);
+			std::string blob;
+			assert(db->loadBlock(c, &blob) && blob == "ccc");
+			delete db;
+		}
+
+		// The codec comes from world.mt, or from the settings
+		{
+			CompressionParams params = getWorldMapCompression(savedir);
+			assert(params.codec == parseCompressionParams(
+					g_settings->get("map_compression_disk"), -1).codec);
+			std::string conf_path = savedir + DIR_DELIM + "world.mt";
+			Settings conf;
+			conf.readConfigFile(conf_path.c_str());
+			conf.set("map_compression_disk", "lz");
+			conf.set("map_compression_level_disk", "5");
+			assert(conf.updateConfigFile(conf_path.c_str()));
+			params = getWorldMapCompression(savedir);
+			assert(params.codec == COMPRESSION_LZ);
+			assert(params.level == 5);
+		}
+
+		fs::RecursiveDelete(savedir);
+	}
+};
+
+struct TestMemoryPool
+{
+	void Run()
+	{
+		MemoryPool pool("test", 20, 4);
+		core::list<u32*> objects;
+		for(u32 i=0; i<10; i++)
+		{
+			u32 *p = (u32*)pool.allocate();
+			assert(p != NULL);
+			assert(((size_t)p & 7) == 0);
+			for(u32 j=0; j<5; j++)
+				p[j] = i;
+			objects.push_back(p);
+		}
+		u32 i = 0;
+		for(core::list<u32*>::Iterator j = objects.begin();
+				j != objects.end(); j++, i++)
+		{
+			for(u32 k=0; k<5; k++)
+				assert((*j)[k] == i);
+		}
+		// Free every other and allocate them again
+		i = 0;
+		for(core::list<u32*>::Iterator j = objects.begin();
+				j != objects.end(); j++, i++)
+		{
+			if(i % 2 == 0)
+				continue;
+			pool.free(*j);
+			*j = (u32*)pool.allocate();
+			(*j)[0] = i;
+		}
+		i = 0;
+		for(core::list<u32*>::Iterator j = objects.begin();
+				j != objects.end(); j++, i++)
+		{
+			assert((*j)[0] == i);
+			pool.free(*j);
+		}
+		pool.free(NULL);
+	}
+};
+
+struct TestBlockEmergeQueue
+{
+	void Run()
+	{
+		BlockEmergeQueue q;
+		q.setPeerPosition(1, v3s16(0,0,0), 10);
+		q.addBlock(1, v3s16(5,0,0), 0);
+		q.addBlock(1, v3s16(1,0,0), 0);
+		q.addBlock(1, v3s16(5,0,0), 0);
+		q.addBlock(2, v3s16(9,0,0), 0);
+		assert(q.size() == 3);
+		assert(q.peerItemCount(1) == 2);
+		assert(q.peerItemCount(2) == 1);
+
+		// The nearer block goes first; the peer moves toward the other
+		q.setPeerPosition(1, v3s16(6,0,0), 10);
+		q.setPeerPosition(2, v3s16(-10,0,0), 10);
+		QueuedBlockEmerge *e = q.pop();
+		assert(e && e->pos == v3s16(5,0,0));
+		delete e;
+		assert(q.peerItemCount(1) == 1);
+
+		// Out of range of peer 2, and peer 1 leaves; only the block of
+		// the server is left
+		q.addBlock(0, v3s16(20,0,0), 0);
+		assert(q.size() == 2);
+		q.removePeer(1);
+		assert(q.size() == 1);
+		e = q.pop();
+		assert(e && e->pos == v3s16(20,0,0));
+		delete e;
+		assert(q.pop() == NULL);
+	}
+};
+
+struct TestPregenerate
+{
+	void Run()
+	{
+		v3s16 chunk_min, chunk_max;
+		getChunkOfBlock(v3s16(0,0,0), chunk_min, chunk_max);
+		v3s16 chunksize = chunk_max - chunk_min + v3s16(1,1,1);
+
+		v3s16 area_min(-20,-1,-20);
+		v3s16 area_max(19,0,19);
+		std::vector<v3s16> in_order, spiral;
+		listPregenerateChunks(area_min, area_max, false, in_order);
+		listPregenerateChunks(area_min, area_max, true, spiral);
+
+		// Every chunk once, in z,y,x order
+		assert(in_order.size() > 8);
+		for(u32 i=0; i<in_order.size(); i++)
+		{
+			v3s16 min, max;
+			getChunkOfBlock(in_order[i], min, max);
+			assert(min == in_order[i]);
+			if(i == 0)
+				continue;
+			v3s16 a = in_order[i-1];
+			v3s16 b = in_order[i];
+			assert(a.Z < b.Z || (a.Z == b.Z && (a.Y < b.Y
+					|| (a.Y == b.Y && a.X < b.X))));
+		}
+		assert(hasChunkOf(in_order, area_min));
+		assert(hasChunkOf(in_order, area_max));
+
+		// The same chunks outwards from the origin
+		assert(spiral.size() == in_order.size());
+		s32 last_ring = 0;
+		for(u32 i=0; i<spiral.size(); i++)
+		{
+			assert(std::find(in_order.begin(), in_order.end(), spiral[i])
+					!= in_order.end());
+			v3s16 center = spiral[i] + chunksize / 2;
+			s32 ring = MYMAX(abs(center.X / chunksize.X),
+					abs(center.Z / chunksize.Z));
+			assert(ring >= last_ring);
+			last_ring = ring;
+		}
+		v3s16 min, max;
+		getChunkOfBlock(v3s16(0,0,0), min, max);
+		assert(spiral[0].X == min.X && spiral[0].Z == min.Z);
+
+		/*
+			Progress is only used by a run of the same area and order
+		*/
+		std::string dir = getTestTempDirectory();
+		std::string path = dir + DIR_DELIM + "pregenerate.txt";
+		assert(readPregenerateProgress(path, "area", true, 100) == 0);
+		writePregenerateProgress(path, "area", true, 42);
+		assert(readPregenerateProgress(path, "area", true, 100) == 42);
+		assert(readPregenerateProgress(path, "area", false, 100) == 0);
+		assert(readPregenerateProgress(path, "other", true, 100) == 0);
+		assert(readPregenerateProgress(path, "area", true, 10) == 10);
+		writePregenerateProgress(path, "area", true, 50);
+		assert(readPregenerateProgress(path, "area", true, 100) == 50);
+		fs::RecursiveDelete(dir);
+	}
+
+	bool hasChunkOf(const std::vector<v3s16> &chunks,
+			v3s16 blockpos)
+	{
+		v3s16 min, max;
+		getChunkOfBlock(blockpos, min, max);
+		return std::find(chunks.begin(), chunks.end(), min) != chunks.end();
+	}
+};
+
+struct TestPlayerDatabase
+{
+	void writeFile(const std::string &path, const std::string &data)
+	{
+		std::ofstream os(path.c_str(), std::ios_base::binary);
+		os<<data;
+	}
+
+	std::string serializePlayer(IGameDef *gamedef, const char *name,
+			v3f pos)
+	{
+		RemotePlayer player(gamedef);
+		player.updateName(name);
+		player.setPosition(pos);
+		std::ostringstream os(std::ios_base::binary);
+		player.serialize(os);
+		return os.str();
+	}
+
+	void Run()
+	{
+		std::string savedir = getTestTempDirectory();
+		OfflineGameDef gamedef;
+
+		/*
+			An old world; the files are not named after the players
+		*/
+		std::string players_path = savedir + DIR_DELIM + "players";
+		fs::CreateDir(players_path);
+		std::string celeron = serializePlayer(&gamedef, "celeron55",
+				v3f(1,2,3));
+		std::string other = serializePlayer(&gamedef, "other",
+				v3f(4,5,6));
+		writeFile(players_path + DIR_DELIM + "celeron551", celeron);
+		writeFile(players_path + DIR_DELIM + "player2", other);
+		writeFile(players_path + DIR_DELIM + "broken", "garbage");
+		writeFile(savedir + DIR_DELIM + "auth.txt",
+				"celeron55:hash:interact,shout\n"
+				"invalid line\n"
+				"other::\n");
+
+		{
+			PlayerDatabase db(savedir, &gamedef);
+			std::string data;
+			assert(db.loadPlayer("celeron55", &data) && data == celeron);
+			assert(db.loadPlayer("other", &data) && data == other);
+			assert(db.loadPlayer("player2", &data) == false);
+			core::list<std::string> names;
+			db.listPlayers(names);
+			assert(names.size() == 2);
+
+			std::string password, privileges;
+			assert(db.loadAuth("celeron55", &password, &privileges));
+			assert(password == "hash" && privileges == "interact,shout");
+			assert(db.loadAuth("other", &password, &privileges));
+			assert(password == "" && privileges == "");
+			assert(db.loadAuth("invalid line", &password, &privileges)
+					== false);
+
+			db.beginSave();
+			db.savePlayer("other", "changed");
+			db.savePlayer("new", "data");
+			db.endSave();
+		}
+
+		// The old files are imported only once
+		writeFile(players_path + DIR_DELIM + "player3",
+				serializePlayer(&gamedef, "third", v3f(0,0,0)));
+		{
+			PlayerDatabase db(savedir, &gamedef);
+			std::string data;
+			assert(db.loadPlayer("other", &data) && data == "changed");
+			assert(db.loadPlayer("new", &data) && data == "data");
+			assert(db.loadPlayer("third", &data) == false);
+			core::list<std::string> names;
+			db.listPlayers(names);
+			assert(names.size() == 3);
+		}
+
+		fs::RecursiveDelete(savedir);
+	}
+};
+
+struct TestAuthPrivs
+{
+	void Run()
+	{
+		std::set<std::string> privs =
+				AuthManager::stringToPrivs("shout, interact,,fly ");
+		assert(privs.size() == 3);
+		assert(privs.count("interact") == 1);
+		assert(privs.count("fly") == 1);
+		assert(AuthManager::privsToString(privs) == "fly,interact,shout");
+		assert(AuthManager::stringToPrivs("").size() == 0);
+		assert(AuthManager::privsToString(std::set<std::string>()) == "");
+	}
+};
+
 struct TestSocket
 {
 	void Run()
@@ -1693,6 +3126,25 @@ void run_tests()
 	//TEST(TestMapBlock);
 	//TEST(TestMapSector);
 	TEST(TestCollision);
+	TEST(TestNoiseMap);
+	TEST(TestMapBlockPosSet);
+	TEST(TestModifiedBlockList);
+	TEST(TestBlockUsageList);
+	TEST(TestMapBlockIndex);
+	TEST(TestMapBlockStorage);
+	TEST(TestMapBlockSerialization);
+	TEST(TestMapDatabaseLog);
+	TEST(TestCopyMapDatabase);
+	TEST(TestMapScanner);
+	TEST(TestPruneWorldMap);
+	TEST(TestMemoryPool);
+	TEST(TestMapNodeAccess);
+	TEST(TestMapGeneratingGuard);
+	TEST(TestVoxelManipChanges);
+	TEST(TestBlockEmergeQueue);
+	TEST(TestPregenerate);
+	TEST(TestPlayerDatabase);
+	TEST(TestAuthPrivs);
 	if(INTERNET_SIMULATOR == false){
 		TEST(TestSocket);
 		dout_con<<"=== BEGIN RUNNING UNIT TESTS FOR CONNECTION ==="<<std::endl;
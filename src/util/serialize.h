@@ -448,6 +448,99 @@ inline std::string deSerializeLongString(std::istream &is)
 	return s;
 }
 
+/*
+	Reads values from a buffer in place, without copying it to a stream.
+	Throws SerializationError when reading past the end.
+*/
+class BufReader
+{
+public:
+	BufReader(const u8 *data, u32 size):
+		m_data(data),
+		m_size(size),
+		m_pos(0)
+	{
+	}
+
+	// Returns a pointer to the next len bytes and skips them
+	const u8 * getRaw(u32 len)
+	{
+		if(len > m_size - m_pos)
+			throw SerializationError("BufReader: unexpected end of data");
+		const u8 *p = m_data + m_pos;
+		m_pos += len;
+		return p;
+	}
+	void skip(u32 len)
+	{
+		getRaw(len);
+	}
+
+	u8 getU8()
+	{
+		return readU8((u8*)getRaw(1));
+	}
+	u16 getU16()
+	{
+		return readU16((u8*)getRaw(2));
+	}
+	u32 getU32()
+	{
+		return readU32((u8*)getRaw(4));
+	}
+	v3s32 getV3S32()
+	{
+		return readV3S32((u8*)getRaw(12));
+	}
+	// A string with the length as the first two bytes
+	std::string getString()
+	{
+		u16 len = getU16();
+		return std::string((const char*)getRaw(len), len);
+	}
+	// A string with the length as the first four bytes
+	std::string getLongString()
+	{
+		u32 len = getU32();
+		return std::string((const char*)getRaw(len), len);
+	}
+
+	// The data that has not been read yet
+	const u8 * getData() const
+	{
+		return m_data + m_pos;
+	}
+	u32 getRemaining() const
+	{
+		return m_size - m_pos;
+	}
+
+private:
+	const u8 *m_data;
+	u32 m_size;
+	u32 m_pos;
+};
+
+/*
+	A read-only stream buffer over memory that belongs to someone else.
+	For using the stream-based deserializers on a part of a buffer
+	without copying it; getPosition() tells how much was read.
+*/
+class MemoryStreamBuf : public std::streambuf
+{
+public:
+	MemoryStreamBuf(const u8 *data, u32 size)
+	{
+		char *p = (char*)data;
+		setg(p, p, p + size);
+	}
+
+	u32 getPosition() const
+	{
+		return gptr() - eback();
+	}
+};
+
 // Creates a string encoded in JSON format (almost equivalent to a C string literal)
 std::string serializeJsonString(const std::string &plain);
 
@@ -378,23 +378,40 @@ class VoxelManipulator /*: public NodeContainer*/
 
 		return m_data[m_area.index(p)];
 	}
-	MapNode getNodeNoEx(v3s16 p)
+	/*
+		These return a CONTENT_IGNORE node instead of throwing. If
+		is_valid_position is not NULL, it is set to whether the node
+		exists.
+	*/
+	MapNode getNodeNoEx(v3s16 p, bool *is_valid_position = NULL)
 	{
 		emerge(p);
 
 		if(m_flags[m_area.index(p)] & VOXELFLAG_INEXISTENT)
 		{
+			if(is_valid_position)
+				*is_valid_position = false;
 			return MapNode(CONTENT_IGNORE);
 		}
 
+		if(is_valid_position)
+			*is_valid_position = true;
 		return m_data[m_area.index(p)];
 	}
-	MapNode getNodeNoExNoEmerge(v3s16 p)
+	// Doesn't emerge; nodes that have not been loaded don't exist.
+	// Use this when the area has been filled beforehand.
+	MapNode getNodeNoExNoEmerge(v3s16 p, bool *is_valid_position = NULL)
 	{
-		if(m_area.contains(p) == false)
-			return MapNode(CONTENT_IGNORE);
-		if(m_flags[m_area.index(p)] & VOXELFLAG_INEXISTENT)
+		if(m_area.contains(p) == false
+				|| (m_flags[m_area.index(p)]
+				& (VOXELFLAG_INEXISTENT | VOXELFLAG_NOT_LOADED)))
+		{
+			if(is_valid_position)
+				*is_valid_position = false;
 			return MapNode(CONTENT_IGNORE);
+		}
+		if(is_valid_position)
+			*is_valid_position = true;
 		return m_data[m_area.index(p)];
 	}
 	// Stuff explodes if non-emerged area is touched with this.